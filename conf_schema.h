@@ -382,6 +382,8 @@ END_ARRAY(10)
 
 STRUCT(rhizome_direct)
 SUB_STRUCT(peerlist,        peer,)
+ATOM(uint16_t,              connections,    4, uint16_nonzero,, "Most HTTP connections open at once to each Rhizome Direct peer")
+ATOM(uint16_t,              queue_limit,    256, uint16_nonzero,, "Most bundle pushes and pulls queued for each Rhizome Direct peer before its next enquiry is held back")
 END_STRUCT
 
 STRUCT(rhizome_api_addfile)
@@ -398,10 +400,15 @@ END_STRUCT
 
 STRUCT(rhizome_http)
 ATOM(bool_t,                enable,     1, boolean,, "If true, Rhizome HTTP server is started")
+ATOM(uint32_t,              keepalive_timeout, 5, uint32_time_interval,, "Time a connection is kept open waiting for its next request, zero to close after every response")
+ATOM(uint32_t,              keepalive_max, 100, uint32_nonzero,, "Most requests served on one connection before it is closed")
 END_STRUCT
 
 STRUCT(rhizome_mdp)
 ATOM(bool_t,                enable,     1, boolean,, "If true, Rhizome MDP server is started")
+ATOM(uint32_t,              max_open_reads, 32, uint32_nonzero,, "Maximum number of payloads held open to serve MDP block requests")
+ATOM(bool_t,                share_blocks, 1, boolean,, "If true, a broadcast block wanted by several neighbours at once is sent once for all of them")
+ATOM(bool_t,                compress_blocks, 1, boolean,, "If true, payload blocks are sent LZ4 compressed to requesters that can decompress them, and requested so from peers")
 END_STRUCT
 
 STRUCT(rhizome_advertise)
@@ -413,15 +420,31 @@ STRUCT(rhizome)
 ATOM(bool_t,                enable,         1, boolean,, "If true, server opens Rhizome database when starting")
 ATOM(bool_t,                fetch,          1, boolean,, "If false, no new bundles will be fetched from peers")
 ATOM(bool_t,                clean_on_open,  0, boolean,, "If true, Rhizome database is cleaned at start of every command")
+ATOM(uint32_t,              cleanup_slice_ms, 50, uint32_nonzero,, "Longest time the server's background cleanup or verification runs before yielding to other work, in milliseconds")
+ATOM(bool_t,                wal,            1, boolean,, "If true, Rhizome database uses a write-ahead log, so that reading and writing do not block each other")
+ATOM(uint32_t,              checkpoint_interval_ms, 5000, uint32_nonzero,, "Interval between the server's write-ahead log checkpoints, in milliseconds")
 STRING(256,                 datastore_path, "", str_nonempty,, "Path of rhizome storage directory, absolute or relative to instance directory")
 ATOM(uint64_t,              database_size,  UINT64_MAX, uint64_scaled,, "Maximum size of database in bytes")
 ATOM(uint64_t,              min_free_space, 100*1024*1024, uint64_scaled,, "Minimum free space to preserve on the disk")
 ATOM(uint32_t,              max_blob_size,  128 * 1024, uint32_scaled,, "Store payloads larger than this in files not SQLite blobs")
+ATOM(uint64_t,              max_mapped_bytes, 64 * 1024 * 1024, uint64_scaled,, "Maximum total size of payload files memory-mapped for reading, zero to disable")
+ATOM(bool_t,                block_hashes,   0, boolean,, "If true, new bundles carry a hash of each payload block so that blocks can be verified individually")
+ATOM(bool_t,                chunked_store,  0, boolean,, "If true, large payloads are stored as content-defined chunks shared between payloads, and fetches reuse chunks already held")
+ATOM(bool_t,                compress_chunks, 0, boolean,, "If true, chunks added to the chunk store are kept LZ4 compressed wherever that makes them smaller")
+ATOM(uint32_t,              signature_cache_size, 1024, uint32_nonzero,, "Number of manifest signature verification results remembered in memory")
+ATOM(bool_t,                signature_cache_persist, 1, boolean,, "If true, the store remembers the verified signature of each manifest it holds, so it is not verified again after a restart")
 
 ATOM(uint64_t,              rhizome_mdp_block_size, 512, uint64_scaled,, "Rhizome MDP block size.")
 ATOM(uint64_t,              idle_timeout,           RHIZOME_IDLE_TIMEOUT, uint64_scaled,, "Rhizome transfer timeout if no data received.")
 ATOM(uint64_t,              mdp_stall_timeout,      1000, uint64_scaled,, "Timeout to request more data via mdp.")
+ATOM(uint32_t,              mdp_fetch_sources,      4, uint32_nonzero,, "Most neighbours to fetch blocks of one payload from at once via mdp.")
 ATOM(uint32_t,              fetch_delay_ms,         50, uint32_nonzero,, "Delay from receiving first bundle advert to initiating fetch")
+ATOM(uint32_t,              fetch_slots,            6, uint32_nonzero,, "Most bundles to fetch at once")
+ATOM(uint32_t,              fetch_queue_size,       128, uint32_nonzero,, "Most bundles waiting to be fetched")
+ATOM(bool_t,                resume_fetches,         1, boolean,, "If true, a payload that is partly fetched is kept, so that a later fetch from any peer carries on where it left off")
+ATOM(bool_t,                delta_fetch,            1, boolean,, "If true, a new version of a bundle fetched via HTTP is sent as a delta against the version already held")
+ATOM(uint32_t,              partial_max_age_ms,     24 * 60 * 60 * 1000, uint32_nonzero,, "How long a partly fetched payload is kept for a later fetch to resume, in milliseconds")
+ATOM(bool_t,                sync_reconcile,         1, boolean,, "If true, start syncing with each peer by exchanging set reconciliation sketches instead of walking every BAR")
 SUB_STRUCT(rhizome_direct,  direct,)
 SUB_STRUCT(rhizome_api,     api,)
 SUB_STRUCT(rhizome_http,    http,)
@@ -483,7 +506,7 @@ END_ARRAY(10)
 STRUCT(api_restful)
 SUB_STRUCT(userlist,        users,)
 ATOM(uint32_t,              newsince_timeout,       60, uint32_time_interval,, "Time to block while reporting new bundles")
-ATOM(uint32_t,              newsince_poll_ms,       2000, uint32_nonzero,, "Database poll interval while blocked reporting new bundles")
+ATOM(uint32_t,              newsince_poll_ms,       2000, uint32_nonzero,, "Interval at which to look for bundles stored by other processes while blocked reporting new bundles")
 END_STRUCT
 
 STRUCT(api)
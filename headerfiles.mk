@@ -25,6 +25,7 @@ HDRS=	fifo.h \
 	strbuf.h \
 	strbuf_helpers.h \
 	sha2.h \
+	lz4.h \
 	conf.h \
 	conf_schema.h \
 	crypto.h \
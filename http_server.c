@@ -99,7 +99,9 @@ static int http_request_parse_header(struct http_request *r);
 static int http_request_start_body(struct http_request *r);
 static int http_request_reject_content(struct http_request *r);
 static int http_request_parse_body_form_data(struct http_request *r);
+static void http_request_parse(struct http_request *r);
 static void http_request_start_response(struct http_request *r);
+static void http_request_restart(struct http_request *r);
 
 void http_request_init(struct http_request *r, int sockfd)
 {
@@ -149,6 +151,10 @@ int http_request_set_response_bufsize(struct http_request *r, size_t bufsiz)
 {
   // Don't allocate a new buffer if the existing one contains content.
   assert(r->response_buffer_sent == r->response_buffer_length);
+  // Keep a buffer already allocated from the heap if it is big enough, eg, one left from an earlier
+  // response on a persistent connection.
+  if (r->response_free_buffer && bufsiz <= r->response_buffer_size)
+    return 0;
   const char *const bufe = r->buffer + sizeof r->buffer;
   assert(r->reserved < bufe);
   size_t rbufsiz = bufe - r->reserved;
@@ -1021,6 +1027,31 @@ static int http_request_parse_header(struct http_request *r)
     goto malformed;
   }
   _rewind(r);
+  if (_skip_literal_nocase(r, "Connection:")) {
+    // A comma-separated list of connection options, of which only "close" and "keep-alive" mean
+    // anything here.
+    struct substring option;
+    do {
+      _skip_optional_space(r);
+      if (!_skip_token(r, &option))
+	goto malformed;
+      size_t len = option.end - option.start;
+      if (len == 5 && strncasecmp(option.start, "close", len) == 0)
+	r->request_header.connection_close = 1;
+      else if (len == 10 && strncasecmp(option.start, "keep-alive", len) == 0)
+	r->request_header.connection_keep_alive = 1;
+      _skip_optional_space(r);
+    } while (_skip_literal(r, ","));
+    if (r->cursor == eol) {
+      r->cursor = nextline;
+      _commit(r);
+      if (r->debug_flag && *r->debug_flag)
+	DEBUGF("Parsed HTTP request header: %s", alloca_toprint(-1, sol, eol - sol));
+      return 0;
+    }
+    goto malformed;
+  }
+  _rewind(r);
   if (r->debug_flag && *r->debug_flag)
     DEBUGF("Skipped HTTP request header: %s", alloca_toprint(-1, sol, eol - sol));
   r->cursor = nextline;
@@ -1551,16 +1582,34 @@ static void http_request_receive(struct http_request *r)
   assert((size_t) bytes <= room);
   // If no data was read, then just return to polling.  Don't drop the connection on an empty read,
   // because that drops connections when they shouldn't, including during testing.  The inactivity
-  // timeout will drop inactive connections.
-  if (bytes == 0)
+  // timeout will drop inactive connections.  The exception is a persistent connection waiting for
+  // its next request, which clients close whenever they are done with it; the empty read is the
+  // end of stream, and polling would only report it again and again until the timeout.
+  if (bytes == 0) {
+    if (r->request_count && r->end == r->received) {
+      if (r->debug_flag && *r->debug_flag)
+	DEBUG("Persistent connection closed by client");
+      http_request_finalise(r);
+    }
     RETURNVOID;
+  }
   r->end += (size_t) bytes;
   if (r->request_content_remaining != CONTENT_LENGTH_UNKNOWN)
     r->request_content_remaining -= (size_t) bytes;
   // We got some data, so reset the inactivity timer and invoke the parsing state machine to process
   // it.  The state machine invokes the caller-supplied callback functions.
   http_request_set_idle_timeout(r);
-  // Parse the unparsed and received data.
+  http_request_parse(r);
+  OUT();
+}
+
+/* Parse the unparsed and received data, invoking the caller-supplied callback functions as parsing
+ * reaches different stages, until more data is needed or a response is started.
+ */
+static void http_request_parse(struct http_request *r)
+{
+  IN();
+  assert(r->phase == RECEIVE);
   while (r->phase == RECEIVE) {
     int result;
     _rewind(r);
@@ -1754,12 +1803,76 @@ static void http_request_send_response(struct http_request *r)
     if ((size_t) written < (size_t) unsent)
       RETURNVOID;
   }
+  if (r->keep_alive && r->phase == TRANSMIT) {
+    http_request_restart(r);
+    RETURNVOID;
+  }
   if (r->debug_flag && *r->debug_flag)
     DEBUG("Done, closing connection");
   http_request_finalise(r);
   OUT();
 }
 
+/* Prepare a persistent connection for its next request once the response to the last one has been
+ * sent.  The parser and response state are reset but the buffers are kept, and any part of the next
+ * request that arrived along with the last one is parsed straight away, so that pipelined requests
+ * are answered in order.
+ */
+static void http_request_restart(struct http_request *r)
+{
+  IN();
+  assert(r->phase == TRANSMIT);
+  assert(r->keep_alive);
+  if (r->reset)
+    r->reset(r);
+  // http_request_start_response() left the pipelined bytes at the start of buffer[].
+  size_t pipelined = r->reserved - r->buffer;
+  r->verb = NULL;
+  r->path = NULL;
+  r->version_major = 0;
+  r->version_minor = 0;
+  bzero(&r->request_header, sizeof r->request_header);
+  r->request_header.content_length = CONTENT_LENGTH_UNKNOWN;
+  r->request_content_remaining = CONTENT_LENGTH_UNKNOWN;
+  r->form_data_state = START;
+  bzero(&r->form_data, sizeof r->form_data);
+  bzero(&r->part_header, sizeof r->part_header);
+  r->part_body_length = 0;
+  bzero(&r->response, sizeof r->response);
+  r->response.header.content_length = CONTENT_LENGTH_UNKNOWN;
+  r->response.header.resource_length = CONTENT_LENGTH_UNKNOWN;
+  r->render_extra_headers = NULL;
+  r->response_length = 0;
+  r->response_sent = 0;
+  r->response_buffer_need = 0;
+  r->response_buffer_length = 0;
+  r->response_buffer_sent = 0;
+  // A static response buffer lies in the part of buffer[] that is about to receive the next
+  // request, but a buffer allocated from the heap is kept for the next response.
+  if (!r->response_free_buffer) {
+    r->response_buffer = NULL;
+    r->response_buffer_size = 0;
+  }
+  r->keep_alive = 0;
+  r->reserved = r->buffer;
+  r->received = r->parsed = r->cursor = r->buffer + 32;
+  memmove(r->received, r->buffer, pipelined);
+  r->end = r->received + pipelined;
+  r->parser = http_request_parse_verb;
+  r->phase = RECEIVE;
+  r->alarm.poll.events = POLLIN;
+  watch(&r->alarm);
+  r->alarm.alarm = gettime_ms() + r->keepalive_timeout;
+  r->alarm.deadline = r->alarm.alarm + 500;
+  unschedule(&r->alarm);
+  schedule(&r->alarm);
+  if (r->debug_flag && *r->debug_flag)
+    DEBUGF("Keeping connection open for request %u, %zu bytes already received", r->request_count + 1, pipelined);
+  if (pipelined)
+    http_request_parse(r);
+  OUT();
+}
+
 static void http_server_poll(struct sched_ent *alarm)
 {
   struct http_request *r = (struct http_request *) alarm;
@@ -2028,6 +2141,9 @@ static int _render_response(struct http_request *r)
     strbuf_append_quoted_string(sb, hr.header.www_authenticate.realm);
     strbuf_puts(sb, "\r\n");
   }
+  if (r->keep_alive)
+    strbuf_sprintf(sb, "Connection: keep-alive\r\nKeep-Alive: timeout=%u, max=%u\r\n",
+	  (unsigned)(r->keepalive_timeout / 1000), r->keepalive_max - r->request_count);
   if (r->render_extra_headers)
     r->render_extra_headers(r, sb);
   assert(strcmp(strbuf_substr(sb, -2), "\r\n") == 0);
@@ -2079,6 +2195,34 @@ static void http_request_render_response(struct http_request *r)
   }
 }
 
+/* Return true if the connection can be kept open for another request once the response to this one
+ * has been sent.  That needs a client that wants it, all of this request to have been received, and
+ * a response whose end the client can find without the connection closing.
+ */
+static int http_request_is_persistent(const struct http_request *r)
+{
+  if (r->keepalive_timeout == 0 || r->request_count >= r->keepalive_max)
+    return 0;
+  // HTTP/1.1 connections persist unless the client says otherwise, HTTP/1.0 ones only if it asks.
+  if (r->request_header.connection_close)
+    return 0;
+  if (r->version_minor == 0 && !r->request_header.connection_keep_alive)
+    return 0;
+  // An error may have been provoked by part of a request, whose remainder could not then be told
+  // apart from the next request.
+  if (r->response.result_code >= 400)
+    return 0;
+  if (   r->request_header.content_length != CONTENT_LENGTH_UNKNOWN
+      && r->request_header.content_length != 0
+      && (r->request_content_remaining != 0 || r->parsed != r->end)
+  )
+    return 0;
+  // Generated content of unknown length is ended by closing the connection.
+  if (r->response.content_generator && r->response.header.content_length == CONTENT_LENGTH_UNKNOWN)
+    return 0;
+  return 1;
+}
+
 static size_t http_request_drain(struct http_request *r)
 {
   assert(r->phase == RECEIVE);
@@ -2106,12 +2250,6 @@ static void http_request_start_response(struct http_request *r)
     http_request_finalise(r);
     RETURNVOID;
   }
-  // Drain the rest of the request that has not been received yet (eg, if sending an error response
-  // provoked while parsing the early part of a partially-received request).  If a read error
-  // occurs, the connection is closed so the phase changes to DONE.
-  http_request_drain(r);
-  if (r->phase != RECEIVE)
-    RETURNVOID;
   // Ensure conformance to HTTP standards.
   if (r->response.result_code == 401 && r->response.header.www_authenticate.scheme == NOAUTH) {
     WHY("HTTP 401 response missing WWW-Authenticate header, sending 500 Server Error instead");
@@ -2119,6 +2257,22 @@ static void http_request_start_response(struct http_request *r)
     r->response.content = NULL;
     r->response.content_generator = NULL;
   }
+  ++r->request_count;
+  r->keep_alive = http_request_is_persistent(r);
+  if (r->keep_alive) {
+    // Whatever follows this request in the buffer is the start of the next one.  Move it to the
+    // start of the buffer, out of the way of the response, until the response has been sent.
+    size_t pipelined = r->end - r->parsed;
+    memmove(r->buffer, r->parsed, pipelined);
+    r->reserved = r->buffer + pipelined;
+  } else {
+    // Drain the rest of the request that has not been received yet (eg, if sending an error
+    // response provoked while parsing the early part of a partially-received request).  If a read
+    // error occurs, the connection is closed so the phase changes to DONE.
+    http_request_drain(r);
+    if (r->phase != RECEIVE)
+      RETURNVOID;
+  }
   // If the response cannot be rendered, then render a 500 Server Error instead.  If that fails,
   // then just close the connection.
   http_request_render_response(r);
@@ -2127,6 +2281,7 @@ static void http_request_start_response(struct http_request *r)
     r->response.result_code = 500;
     r->response.content = NULL;
     r->response.content_generator = NULL;
+    r->keep_alive = 0;
     http_request_render_response(r);
     if (r->response_buffer == NULL) {
       WHY("Cannot render HTTP 500 Server Error response, closing connection");
@@ -2157,6 +2312,23 @@ void http_request_pause_response(struct http_request *r, time_ms_t until)
   schedule(&r->alarm);
 }
 
+/* Resume a paused response immediately, instead of waiting for its pause to elapse, eg, when the
+ * content generator has been told that it has something new to send.  Does nothing if the response
+ * is not paused.
+ */
+void http_request_resume_response(struct http_request *r)
+{
+  if (r->phase != PAUSE)
+    return;
+  if (r->debug_flag && *r->debug_flag)
+    DEBUGF("Resuming paused response");
+  time_ms_t now = gettime_ms();
+  unschedule(&r->alarm);
+  r->alarm.alarm = now;
+  r->alarm.deadline = now + r->idle_timeout;
+  schedule(&r->alarm);
+}
+
 /* Start sending a static (pre-computed) response back to the client.  The response's Content-Type
  * is set by the 'mime_type' parameter (in the standard format "type/subtype").  The response's
  * content is set from the 'body' and 'bytes' parameters, which need not point to persistent data,
@@ -93,6 +93,8 @@ struct http_request_headers {
   const char *origin; // points into buffer; nul terminated
   struct http_range content_ranges[5];
   struct http_client_authorization authorization;
+  bool_t connection_close; // "Connection: close"
+  bool_t connection_keep_alive; // "Connection: keep-alive"
 };
 
 struct http_response_headers {
@@ -163,6 +165,7 @@ void http_request_free_response_buffer(struct http_request *r);
 int http_request_set_response_bufsize(struct http_request *r, size_t bufsiz);
 void http_request_finalise(struct http_request *r);
 void http_request_pause_response(struct http_request *r, time_ms_t until);
+void http_request_resume_response(struct http_request *r);
 void http_request_response_static(struct http_request *r, int result, const char *mime_type, const char *body, uint64_t bytes);
 void http_request_response_generated(struct http_request *r, int result, const char *mime_type, HTTP_CONTENT_GENERATOR *);
 void http_request_simple_response(struct http_request *r, uint16_t result, const char *body);
@@ -187,6 +190,14 @@ struct http_request {
   // The following are used for parsing the HTTP request.
   time_ms_t initiate_time; // time connection was initiated
   time_ms_t idle_timeout; // disconnect if no bytes received for this long
+  // The caller may set these up to keep the connection open for further requests once a response
+  // has been sent (HTTP keep-alive).  A zero keepalive_timeout closes the connection after every
+  // response.
+  time_ms_t keepalive_timeout; // disconnect if no further request starts within this long
+  unsigned keepalive_max; // most requests to serve on one connection
+  void (*reset)(struct http_request *); // release caller's per-request state before the next request
+  unsigned request_count; // number of requests responded to on this connection
+  bool_t keep_alive; // keep the connection open after the current response
   struct sockaddr_in client_sockaddr_in; // caller may supply this
   // The parsed HTTP request is accumulated into the following fields.
   const char *verb; // points to nul terminated static string, "GET", "PUT", etc.
@@ -18,6 +18,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
 #include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include "serval.h"
 #include "httpd.h"
 #include "conf.h"
@@ -44,10 +46,12 @@ HTTP_HANDLER restful_keyring_;
 
 HTTP_HANDLER rhizome_status_page;
 HTTP_HANDLER rhizome_file_page;
+HTTP_HANDLER rhizome_delta_page;
 HTTP_HANDLER manifest_by_prefix_page;
 
 HTTP_HANDLER rhizome_direct_import;
 HTTP_HANDLER rhizome_direct_enquiry;
+HTTP_HANDLER rhizome_direct_range_enquiry;
 HTTP_HANDLER rhizome_direct_dispatch;
 
 struct http_handler {
@@ -64,8 +68,10 @@ struct http_handler paths[]={
   {"/restful/keyring/", restful_keyring_},
   {"/rhizome/status", rhizome_status_page},
   {"/rhizome/file/", rhizome_file_page},
+  {"/rhizome/delta/", rhizome_delta_page},
   {"/rhizome/import", rhizome_direct_import},
   {"/rhizome/enquiry", rhizome_direct_enquiry},
+  {"/rhizome/rangeenquiry", rhizome_direct_range_enquiry},
   {"/rhizome/manifestbyprefix/", manifest_by_prefix_page},
   {"/rhizome/", rhizome_direct_dispatch},
   {"/static/", static_page},
@@ -230,24 +236,44 @@ success:
   return 0;
 }
 
-static void httpd_server_finalise_http_request(struct http_request *hr)
+static unsigned int http_request_uuid_counter = 0;
+
+static void httpd_server_release_request(httpd_request *r)
 {
-  httpd_request *r = (httpd_request *) hr;
   if (r->manifest) {
     rhizome_manifest_free(r->manifest);
     r->manifest = NULL;
   }
+  rhizome_bundle_unlisten(&r->newsince);
   if (r->finalise_union) {
     r->finalise_union(r);
     r->finalise_union = NULL;
   }
+}
+
+static void httpd_server_finalise_http_request(struct http_request *hr)
+{
+  httpd_request *r = (httpd_request *) hr;
+  httpd_server_release_request(r);
   if (httpd_request_count)
     --httpd_request_count;
 }
 
-static int httpd_dispatch(struct http_request *);
+/* Called between requests on a persistent connection, to start the next request with the same
+ * state as a newly accepted one.
+ */
+static void httpd_server_reset_http_request(struct http_request *hr)
+{
+  httpd_request *r = (httpd_request *) hr;
+  httpd_server_release_request(r);
+  bzero((char *) r + sizeof r->http, sizeof *r - sizeof r->http);
+  r->uuid = http_request_uuid_counter++;
+  r->payload_status = INVALID_RHIZOME_PAYLOAD_STATUS;
+  r->bundle_status = INVALID_RHIZOME_BUNDLE_STATUS;
+  r->http.handle_content_end = NULL;
+}
 
-static unsigned int http_request_uuid_counter = 0;
+static int httpd_dispatch(struct http_request *);
 
 void httpd_server_poll(struct sched_ent *alarm)
 {
@@ -274,6 +300,11 @@ void httpd_server_poll(struct sched_ent *alarm)
 	    addr_len, addr.sa_family, alloca_tohex((unsigned char *)addr.sa_data, sizeof addr.sa_data)
 	  );
       }
+      // Responses to pipelined requests go out in consecutive small writes, which Nagle's algorithm
+      // would hold back until the client's delayed acknowledgement of the first.
+      int on = 1;
+      if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof on) == -1)
+	WARN_perror("setsockopt(TCP_NODELAY)");
       httpd_request *request = emalloc_zero(sizeof(httpd_request));
       if (request == NULL) {
 	WHY("Cannot respond to HTTP request, out of memory");
@@ -289,8 +320,11 @@ void httpd_server_poll(struct sched_ent *alarm)
 	request->http.debug_flag = &config.debug.httpd;
 	request->http.disable_tx_flag = &config.debug.nohttptx;
 	request->http.finalise = httpd_server_finalise_http_request;
+	request->http.reset = httpd_server_reset_http_request;
 	request->http.free = free;
 	request->http.idle_timeout = RHIZOME_IDLE_TIMEOUT;
+	request->http.keepalive_timeout = config.rhizome.http.keepalive_timeout * 1000;
+	request->http.keepalive_max = config.rhizome.http.keepalive_max;
 	http_request_init(&request->http, sock);
       }
     }
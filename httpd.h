@@ -77,6 +77,10 @@ typedef struct httpd_request
    */
   uint64_t ui64;
 
+  /* For "newsince" responses that are paused until a new bundle is stored.
+   */
+  struct rhizome_bundle_listener newsince;
+
   /* Finaliser for union contents (below).
    */
   void (*finalise_union)(struct httpd_request *);
@@ -101,6 +105,15 @@ typedef struct httpd_request
     }
       direct_import;
 
+    /* For receiving a Rhizome Direct range enquiry
+     */
+    struct {
+      const char *current_part;
+      bool_t received_ranges;
+      struct form_buf_malloc ranges;
+    }
+      direct_range;
+
     /* For receiving RESTful Rhizome insert request
      */
     struct {
@@ -148,8 +161,11 @@ typedef struct httpd_request
     struct {
       enum list_phase phase;
       uint64_t rowid_highest;
+      uint64_t rowid_lowest;
       size_t rowcount;
+      size_t limit; // zero means no limit
       time_ms_t end_time;
+      char service[64]; // cursor.service points here
       struct rhizome_list_cursor cursor;
     }
       rhlist;
@@ -194,6 +210,19 @@ typedef struct httpd_request
       struct form_buf_malloc message;
     }
       sendmsg;
+
+    /* For receiving the block signatures of a payload already held, and sending a newer payload as
+     * a delta against them.
+    */
+    struct {
+      const char *current_part;
+      bool_t received_signatures;
+      struct form_buf_malloc signatures;
+      rhizome_filehash_t filehash;
+      struct rhizome_delta delta;
+      struct rhizome_read read_state;
+    }
+      delta;
       
     
     struct {
@@ -226,6 +255,7 @@ struct http_response_parts {
   char *reason;
   uint64_t range_start;
   uint64_t content_length;
+  bool_t keep_alive;
   char *content_start;
 };
 
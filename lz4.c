@@ -0,0 +1,184 @@
+/*
+ Serval DNA - LZ4 block compression
+ Copyright (C) 2014 Serval Project Inc.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "lz4.h"
+
+/* A small, self-contained implementation of the LZ4 block format, as described in
+ * lz4_Block_format.md of the reference LZ4 distribution, so that blocks compressed here can be
+ * decompressed by any LZ4 implementation and vice versa.
+ *
+ * A block is a series of sequences.  Each sequence starts with a token byte: its high four bits give
+ * the number of literal bytes that follow, and its low four bits the length of the match that comes
+ * after them, less four.  Either value of fifteen is continued in following bytes, each adding up to
+ * 255.  The literals are followed by the two byte little-endian distance back to the match.  The
+ * last sequence holds only literals.  The last five bytes of a block are always literals, and the
+ * last match starts at least twelve bytes before the end.
+ *
+ * The compressor finds matches through a single hash table of four byte sequences, and makes no
+ * attempt to find the longest match, which is what makes LZ4 fast enough for slow devices.
+ */
+
+#define LZ4_MIN_MATCH     4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MFLIMIT       12
+#define LZ4_MAX_DISTANCE  65535
+#define LZ4_HASH_LOG      12
+
+static uint32_t lz4_read32(const unsigned char *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof v);
+  return v;
+}
+
+static unsigned lz4_hash(uint32_t sequence)
+{
+  return (sequence * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+// append the continuation bytes of a length that did not fit in its half of the token
+static unsigned char *lz4_put_length(unsigned char *op, const unsigned char *oend, size_t length)
+{
+  for (; length >= 255; length -= 255) {
+    if (op >= oend)
+      return NULL;
+    *op++ = 255;
+  }
+  if (op >= oend)
+    return NULL;
+  *op++ = (unsigned char) length;
+  return op;
+}
+
+static unsigned char *lz4_put_literals(unsigned char *op, const unsigned char *oend, const unsigned char *literals, size_t count, unsigned match)
+{
+  if (op >= oend)
+    return NULL;
+  unsigned char *token = op++;
+  *token = (unsigned char)(((count < 15 ? count : 15) << 4) | match);
+  if (count >= 15 && (op = lz4_put_length(op, oend, count - 15)) == NULL)
+    return NULL;
+  if ((size_t)(oend - op) < count)
+    return NULL;
+  memcpy(op, literals, count);
+  return op + count;
+}
+
+size_t lz4_compress_block(const unsigned char *src, size_t srclen, unsigned char *dst, size_t dstsize)
+{
+  const unsigned char *ip = src;
+  const unsigned char *anchor = src;
+  const unsigned char *iend = src + srclen;
+  unsigned char *op = dst;
+  const unsigned char *oend = dst + dstsize;
+
+  if (srclen > LZ4_MFLIMIT) {
+    int32_t table[1 << LZ4_HASH_LOG];
+    memset(table, 0xFF, sizeof table);
+    const unsigned char *mflimit = iend - LZ4_MFLIMIT;
+    const unsigned char *matchlimit = iend - LZ4_LAST_LITERALS;
+    while (ip <= mflimit) {
+      uint32_t sequence = lz4_read32(ip);
+      unsigned h = lz4_hash(sequence);
+      int32_t candidate = table[h];
+      table[h] = (int32_t)(ip - src);
+      if (candidate < 0 || ip - (src + candidate) > LZ4_MAX_DISTANCE || lz4_read32(src + candidate) != sequence) {
+	++ip;
+	continue;
+      }
+      const unsigned char *match = src + candidate;
+      // extend the match backwards over any literals, and then forwards as far as it goes
+      while (ip > anchor && match > src && ip[-1] == match[-1]) {
+	--ip;
+	--match;
+      }
+      size_t length = LZ4_MIN_MATCH;
+      while (ip + length < matchlimit && ip[length] == match[length])
+	++length;
+      size_t matchcode = length - LZ4_MIN_MATCH;
+      if ((op = lz4_put_literals(op, oend, anchor, (size_t)(ip - anchor), matchcode < 15 ? matchcode : 15)) == NULL)
+	return 0;
+      if (oend - op < 2)
+	return 0;
+      uint16_t distance = (uint16_t)(ip - match);
+      *op++ = (unsigned char) distance;
+      *op++ = (unsigned char)(distance >> 8);
+      if (matchcode >= 15 && (op = lz4_put_length(op, oend, matchcode - 15)) == NULL)
+	return 0;
+      ip += length;
+      anchor = ip;
+    }
+  }
+  if ((op = lz4_put_literals(op, oend, anchor, (size_t)(iend - anchor), 0)) == NULL)
+    return 0;
+  return (size_t)(op - dst);
+}
+
+ssize_t lz4_decompress_block(const unsigned char *src, size_t srclen, unsigned char *dst, size_t dstsize)
+{
+  const unsigned char *ip = src;
+  const unsigned char *iend = src + srclen;
+  unsigned char *op = dst;
+  unsigned char *oend = dst + dstsize;
+  while (ip < iend) {
+    unsigned token = *ip++;
+    size_t length = token >> 4;
+    if (length == 15) {
+      unsigned char b;
+      do {
+	if (ip >= iend)
+	  return -1;
+	length += b = *ip++;
+      } while (b == 255);
+    }
+    if (length > (size_t)(iend - ip) || length > (size_t)(oend - op))
+      return -1;
+    memcpy(op, ip, length);
+    op += length;
+    ip += length;
+    // the last sequence has no match
+    if (ip == iend)
+      break;
+    if (iend - ip < 2)
+      return -1;
+    size_t distance = ip[0] | ((size_t)ip[1] << 8);
+    ip += 2;
+    if (distance == 0 || distance > (size_t)(op - dst))
+      return -1;
+    length = token & 15;
+    if (length == 15) {
+      unsigned char b;
+      do {
+	if (ip >= iend)
+	  return -1;
+	length += b = *ip++;
+      } while (b == 255);
+    }
+    length += LZ4_MIN_MATCH;
+    if (length > (size_t)(oend - op))
+      return -1;
+    // the match may overlap the bytes it produces, so copy one byte at a time
+    const unsigned char *match = op - distance;
+    while (length--)
+      *op++ = *match++;
+  }
+  return (ssize_t)(op - dst);
+}
@@ -0,0 +1,35 @@
+/*
+ Serval DNA - LZ4 block compression
+ Copyright (C) 2014 Serval Project Inc.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __SERVAL_DNA__LZ4_H
+#define __SERVAL_DNA__LZ4_H
+
+#include <sys/types.h>
+
+/* Compress a block of data in the LZ4 block format.  Returns the length of the compressed block, or 0
+ * if it would not fit in dstsize bytes.
+ */
+size_t lz4_compress_block(const unsigned char *src, size_t srclen, unsigned char *dst, size_t dstsize);
+
+/* Decompress a block in the LZ4 block format.  Returns the length of the decompressed data, or -1 if
+ * the block is malformed or would not fit in dstsize bytes.
+ */
+ssize_t lz4_decompress_block(const unsigned char *src, size_t srclen, unsigned char *dst, size_t dstsize);
+
+#endif // __SERVAL_DNA__LZ4_H
@@ -359,6 +359,18 @@ static int restful_meshms_messagelist_json_content(struct http_request *hr, unsi
 
 static int _messagelist_json_ack(struct httpd_request *r, strbuf b, struct newsince_position pos);
 
+static void restful_meshms_newsince_notify(struct rhizome_bundle_listener *l, const rhizome_manifest *m)
+{
+  httpd_request *r = (httpd_request *) l->context;
+  if (m && !(   m->service && strcasecmp(m->service, RHIZOME_SERVICE_MESHMS2) == 0
+	     && m->has_sender && m->has_recipient
+	     && (   (cmp_sid_t(&m->sender, &r->sid1) == 0 && cmp_sid_t(&m->recipient, &r->sid2) == 0)
+		 || (cmp_sid_t(&m->sender, &r->sid2) == 0 && cmp_sid_t(&m->recipient, &r->sid1) == 0))))
+    return;
+  rhizome_bundle_unlisten(l);
+  http_request_resume_response(&r->http);
+}
+
 static int restful_meshms_messagelist_json_content_chunk(struct http_request *hr, strbuf b)
 {
   httpd_request *r = (httpd_request *) hr;
@@ -411,9 +423,14 @@ static int restful_meshms_messagelist_json_content_chunk(struct http_request *hr
 	      ++r->u.msglist.rowcount;
 	    r->u.msglist.token = r->u.msglist.latest;
 	    meshms_message_iterator_close(&r->u.msglist.iter);
-	    time_ms_t wake_at = now + config.api.restful.newsince_poll_ms;
-	    if (wake_at > r->u.msglist.end_time)
-	      wake_at = r->u.msglist.end_time;
+	    // Sleep until either ply of this conversation is stored again.  If that cannot be
+	    // arranged, fall back to polling.
+	    time_ms_t wake_at = r->u.msglist.end_time;
+	    r->newsince.rowid = 0;
+	    r->newsince.notify = restful_meshms_newsince_notify;
+	    r->newsince.context = r;
+	    if (rhizome_bundle_listen(&r->newsince) == -1 && wake_at > now + config.api.restful.newsince_poll_ms)
+	      wake_at = now + config.api.restful.newsince_poll_ms;
 	    http_request_pause_response(&r->http, wake_at);
 	    return 0;
 	  }
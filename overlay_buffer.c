@@ -618,7 +618,7 @@ uint64_t ob_get_packed_ui64(struct overlay_buffer *b)
     byte = ob_get(b);
     if (byte<0)
       return WHY("Failed to unpack integer");
-    ret |= (byte&0x7f)<<shift;
+    ret |= (uint64_t)(byte&0x7f)<<shift;
     shift+=7;
   }while(byte & 0x80);
   return ret;
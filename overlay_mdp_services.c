@@ -24,6 +24,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "strbuf.h"
 #include "overlay_buffer.h"
 #include "overlay_address.h"
+#include "overlay_interface.h"
 #include "overlay_packet.h"
 #include "mdp_client.h"
 #include "rhizome.h"
@@ -31,24 +32,160 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "log.h"
 #include "keyring.h"
 #include "dataformats.h"
+#include "lz4.h"
 
-int rhizome_mdp_send_block(struct subscriber *dest, const rhizome_bid_t *bid, uint64_t version, uint64_t fileOffset, uint32_t bitmap, uint16_t blockLength)
+/* Bytes of payload blocks sent to requesters that can decompress them, and the bytes they were sent
+ * as, by the service of their bundle.
+ */
+struct rhizome_mdp_compression {
+  char service[40];
+  uint64_t block_bytes;
+  uint64_t sent_bytes;
+};
+
+/* A window of payload blocks being sent in answer to one request.  The blocks are read from the
+ * store a run at a time, and sent as fast as the overlay queue will take them, so a request may
+ * name many more blocks than fit in the queue at once.
+ */
+struct rhizome_mdp_stream {
+  struct subscriber *dest; // NULL once finished
+  char broadcast;
+  char compress; // every requester of the stream can decompress blocks
+  struct rhizome_mdp_compression *compression;
+  rhizome_bid_t bid;
+  uint64_t version;
+  uint64_t offset;
+  uint16_t block_length;
+  unsigned blocks;
+  unsigned next;
+  uint8_t bitmap[RHIZOME_MDP_MAX_WINDOW / 8]; // blocks the requester already holds
+  char shared; // other requesters have joined the stream, so it is no longer dest's alone
+  char popular; // other neighbours asked for the same payload lately, so may be listening too
+  struct subscriber *requester; // who last asked for the stream, kept once it is finished
+  time_ms_t requested;
+  time_ms_t start; // when to send the first blocks
+  time_ms_t expires;
+};
+
+#define RHIZOME_MDP_STREAMS 8
+// how long an unfinished stream waits for room in the overlay queue before it is abandoned
+#define RHIZOME_MDP_STREAM_TIMEOUT 5000
+// how often a stream waiting for room in the overlay queue looks again
+#define RHIZOME_MDP_STREAM_INTERVAL 10
+// how many frames to leave free in the overlay queue; blocks queued much deeper than this wait so
+// long that they are too late to be retransmitted when the link loses them
+#define RHIZOME_MDP_STREAM_QUEUE_SPARE 60
+// how long to hold back a window of a payload that another neighbour has asked for lately, so that
+// requests from both that arrive close together can be joined and sent once, and how lately
+#define RHIZOME_MDP_SHARE_DELAY 20
+#define RHIZOME_MDP_SHARE_HORIZON 1000
+// services whose compression is counted separately
+#define RHIZOME_MDP_COMPRESSION_SERVICES 8
+
+static struct rhizome_mdp_stream rhizome_mdp_streams[RHIZOME_MDP_STREAMS];
+// one run of blocks read from the store
+static unsigned char rhizome_mdp_stream_buffer[RHIZOME_MDP_MAX_WINDOW * 1024];
+// blocks sent, those of them broadcast on a link, and blocks that other requesters were spared by
+// hearing them broadcast
+static unsigned rhizome_mdp_blocks_sent = 0;
+static unsigned rhizome_mdp_blocks_broadcast = 0;
+static unsigned rhizome_mdp_blocks_shared = 0;
+static struct rhizome_mdp_compression rhizome_mdp_compression[RHIZOME_MDP_COMPRESSION_SERVICES];
+
+DEFINE_ALARM(rhizome_mdp_stream_blocks);
+
+static int stream_block_wanted(const struct rhizome_mdp_stream *stream, unsigned i)
 {
-  IN();
-  if (!is_rhizome_mdp_server_running())
-    RETURN(-1);
-  if (blockLength<=0 || blockLength>1024)
-    RETURN(WHYF("Invalid block length %d", blockLength));
+  return !(stream->bitmap[i >> 3] & (0x80 >> (i & 7)));
+}
 
-  if (config.debug.rhizome_tx)
-    DEBUGF("Requested blocks for bid=%s, ver=%"PRIu64" @%"PRIx64" bitmap %x", alloca_tohex_rhizome_bid_t(*bid), version, fileOffset, bitmap);
-    
+/* Return the broadcast destination of the interface that we reach a neighbour over directly, if
+ * that interface carries our broadcasts, so that the neighbour would hear blocks sent to it.
+ */
+static struct network_destination *peer_broadcast_destination(const struct subscriber *peer)
+{
+  if (!peer || !(peer->reachable & REACHABLE_DIRECT) || !peer->destination)
+    return NULL;
+  struct network_destination *link = peer->destination->interface->destination;
+  return link && link->ifconfig.send ? link : NULL;
+}
+
+/* Count the other streams of the same payload whose next blocks are all within the block about to be
+ * sent, to requesters that would hear it if it were broadcast on the given link, and could decompress
+ * it if it is compressed.  If mark is set, the block is being broadcast, so those streams can skip them.  Streams may use a different block length, as long as
+ * their next block starts where this one does.  Only the next blocks of each stream are shared, so
+ * that every requester still sees its window arrive in order, and can tell from the last block of a
+ * window that the rest were lost.
+ */
+static unsigned rhizome_mdp_stream_share(const struct rhizome_mdp_stream *stream, const struct network_destination *link,
+					 uint64_t offset, size_t bytes, int compressed, int mark)
+{
+  // the last block of the payload covers the rest of every other stream
+  uint64_t end = bytes < stream->block_length ? UINT64_MAX : offset + bytes;
+  unsigned shared = 0, i;
+  for (i = 0; i < RHIZOME_MDP_STREAMS; i++){
+    struct rhizome_mdp_stream *s = &rhizome_mdp_streams[i];
+    if (s == stream || !s->dest
+	|| s->version != stream->version
+	|| cmp_rhizome_bid_t(&s->bid, &stream->bid) != 0
+	|| peer_broadcast_destination(s->dest) != link
+	|| (compressed && !s->compress))
+      continue;
+    unsigned next = s->next;
+    while (next < s->blocks && !stream_block_wanted(s, next))
+      next++;
+    if (next >= s->blocks || s->offset + next * (uint64_t)s->block_length != offset)
+      continue;
+    unsigned covered = next;
+    while (covered < s->blocks && s->offset + (covered + 1) * (uint64_t)s->block_length <= end)
+      covered++;
+    if (covered == next)
+      continue;
+    if (mark){
+      for (; next < covered; next++)
+	s->bitmap[next >> 3] |= 0x80 >> (next & 7);
+      s->next = covered;
+    }
+    shared++;
+  }
+  return shared;
+}
+
+/* Broadcast one block on a link, as a single frame that every neighbour on the link hears.  Frames
+ * without a destination would otherwise be sent separately to each neighbour that we reach by
+ * unicast.
+ */
+static int rhizome_mdp_send_link(struct network_destination *link, struct overlay_buffer *payload)
+{
+  struct overlay_frame *frame = emalloc_zero(sizeof(struct overlay_frame));
+  if (!frame)
+    return -1;
+  frame->type = OF_TYPE_DATA;
+  frame->source = my_subscriber;
+  frame->ttl = 1;
+  frame->queue = OQ_OPPORTUNISTIC;
+  frame_add_destination(frame, NULL, link);
+  if ((frame->payload = ob_new()) == NULL){
+    op_free(frame);
+    return -1;
+  }
+  overlay_mdp_encode_ports(frame->payload, MDP_PORT_RHIZOME_RESPONSE, MDP_PORT_RHIZOME_RESPONSE);
+  ob_append_bytes(frame->payload, ob_current_ptr(payload), ob_remaining(payload));
+  if (overlay_payload_enqueue(frame)){
+    op_free(frame);
+    return -1;
+  }
+  return 0;
+}
+
+/* Send as many more blocks of the stream as the overlay queue has room for.  Returns 1 if there are
+ * more blocks to send, 0 if the stream is finished.
+ */
+static int rhizome_mdp_stream_send(struct rhizome_mdp_stream *stream)
+{
   struct internal_mdp_header header;
   bzero(&header, sizeof header);
   
-  uint8_t buff[MDP_MTU];
-  struct overlay_buffer *payload = ob_static(buff, sizeof(buff));
-  
   // Reply is broadcast, so we cannot authcrypt, and signing is too time consuming
   // for low devices.  The result is that an attacker can prevent rhizome transfers
   // if they want to by injecting fake blocks.  The alternative is to not broadcast
@@ -62,54 +199,319 @@ int rhizome_mdp_send_block(struct subscriber *dest, const rhizome_bid_t *bid, ui
   header.crypt_flags = MDP_FLAG_NO_CRYPT | MDP_FLAG_NO_SIGN;
   header.source = my_subscriber;
   header.source_port = MDP_PORT_RHIZOME_RESPONSE;
+  header.destination_port = MDP_PORT_RHIZOME_RESPONSE;
+  header.qos = OQ_OPPORTUNISTIC;
   
-  if (dest && (dest->reachable==REACHABLE_UNICAST || dest->reachable==REACHABLE_INDIRECT)){
-    // if we get a request from a peer that we can only talk to via unicast, send data via unicast too.
-    header.destination = dest;
-  }else{
-    // send replies to broadcast so that others can hear blocks and record them
-    // (not that preemptive listening is implemented yet).
-    header.ttl = 1;
+  if (gettime_ms() < stream->start)
+    return 1;
+  struct network_destination *link = config.rhizome.mdp.share_blocks ? peer_broadcast_destination(stream->dest) : NULL;
+  
+  // pick the blocks that will fit in the queue, and read them from the store in one go
+  int room = overlay_queue_remaining(header.qos) - RHIZOME_MDP_STREAM_QUEUE_SPARE;
+  unsigned first = stream->blocks, last = stream->next, count = 0, i;
+  for (i = stream->next; i < stream->blocks && (int)count < room; i++){
+    if (!stream_block_wanted(stream, i))
+      continue;
+    if (first == stream->blocks)
+      first = i;
+    last = i;
+    count++;
+  }
+  if (!count){
+    // nothing left that the requester lacks
+    if (i >= stream->blocks)
+      stream->next = stream->blocks;
+    return stream->next < stream->blocks;
   }
   
-  header.destination_port = MDP_PORT_RHIZOME_RESPONSE;
-  header.qos = OQ_OPPORTUNISTIC;
+  uint64_t run_offset = stream->offset + first * (uint64_t)stream->block_length;
+  size_t run_length = (last + 1 - first) * (size_t)stream->block_length;
+  size_t run_read = 0;
+  while (run_read < run_length){
+    ssize_t r = rhizome_read_cached(&stream->bid, stream->version, gettime_ms()+5000, run_offset + run_read,
+				    rhizome_mdp_stream_buffer + run_read, run_length - run_read);
+    if (r <= 0)
+      break;
+    run_read += r;
+  }
   
-  int i;
-  for(i=0;i<32;i++){
-    if (bitmap&(1<<(31-i)))
+  uint8_t buff[MDP_MTU];
+  struct overlay_buffer *payload = ob_static(buff, sizeof(buff));
+  unsigned char packed[1024];
+  
+  for (i = first; i <= last; i++){
+    if (!stream_block_wanted(stream, i))
       continue;
-    
-    if (overlay_queue_remaining(header.qos) < 10)
+    size_t block_start = (i - first) * (size_t)stream->block_length;
+    if (block_start >= run_read){
+      // past the end of the payload, or the store could not be read
+      stream->next = stream->blocks;
       break;
+    }
+    size_t bytes = run_read - block_start;
+    if (bytes > stream->block_length)
+      bytes = stream->block_length;
     
     // calculate and set offset of block
-    uint64_t offset = fileOffset+i*blockLength;
+    uint64_t offset = stream->offset + i * (uint64_t)stream->block_length;
+    // compress the block if the requesters can decompress it, and it saves more than the length
+    // that has to be sent with it
+    size_t packed_bytes = 0;
+    if (stream->compress && bytes > 3)
+      packed_bytes = lz4_compress_block(rhizome_mdp_stream_buffer + block_start, bytes, packed, bytes - 3);
     ob_clear(payload);
-    ob_append_byte(payload, 'B'); // contains blocks
+    ob_append_byte(payload, packed_bytes ? 'Z' : 'B'); // contains blocks
     // include 16 bytes of BID prefix for identification
-    ob_append_bytes(payload, bid->binary, 16);
+    ob_append_bytes(payload, stream->bid.binary, 16);
     // and version of manifest (in the correct byte order)
-    ob_append_ui64_rv(payload, version);
+    ob_append_ui64_rv(payload, stream->version);
     
     ob_append_ui64_rv(payload, offset);
+    if (packed_bytes){
+      ob_append_ui16_rv(payload, bytes);
+      ob_append_bytes(payload, packed, packed_bytes);
+    }else{
+      ob_append_bytes(payload, rhizome_mdp_stream_buffer + block_start, bytes);
+      // Mark the last block of the file, if required
+      if (bytes < stream->block_length)
+	ob_set(payload, 0, 'T');
+    }
     
-    ssize_t bytes_read = rhizome_read_cached(bid, version, gettime_ms()+5000, offset, ob_current_ptr(payload), blockLength);
-    if (bytes_read<=0)
-      break;
-    
-    ob_append_space(payload, bytes_read);
-    
-    // Mark the last block of the file, if required
-    if ((size_t)bytes_read < blockLength)
-      ob_set(payload, 0, 'T');
-    
-    // send packet
+    unsigned sharers = link ? rhizome_mdp_stream_share(stream, link, offset, bytes, packed_bytes != 0, 0) : 0;
+    int ret;
     ob_flip(payload);
-    if (overlay_send_frame(&header, payload))
+    if (link && (stream->shared || stream->popular || sharers)){
+      // other requesters of the same block hear it too, and need not be sent it again
+      if ((ret = rhizome_mdp_send_link(link, payload)) == 0)
+        rhizome_mdp_blocks_broadcast++;
+    }else{
+      if (!stream->broadcast){
+        // if we get a request from a peer that we can only talk to via unicast, send data via unicast too.
+        header.destination = stream->dest;
+        header.ttl = 0;
+      }else{
+        // send replies to broadcast so that others can hear blocks and record them
+        header.destination = NULL;
+        header.ttl = 1;
+      }
+      ret = overlay_send_frame(&header, payload);
+    }
+    
+    // try again later if the queue would not take it
+    if (ret)
       break;
+    stream->next = bytes < stream->block_length ? stream->blocks : i + 1;
+    rhizome_mdp_blocks_sent++;
+    if (stream->compression){
+      stream->compression->block_bytes += bytes;
+      stream->compression->sent_bytes += packed_bytes ? packed_bytes + 2 : bytes;
+    }
+    if (sharers)
+      rhizome_mdp_blocks_shared += rhizome_mdp_stream_share(stream, link, offset, bytes, packed_bytes != 0, 1);
   }
   ob_free(payload);
+  return stream->next < stream->blocks;
+}
+
+static void rhizome_mdp_stream_finish(struct rhizome_mdp_stream *stream)
+{
+  stream->dest = NULL;
+  if (config.debug.rhizome_tx){
+    DEBUGF("Sent %u blocks in all, %u broadcast on a link, sparing %u more that other requesters heard",
+	   rhizome_mdp_blocks_sent, rhizome_mdp_blocks_broadcast, rhizome_mdp_blocks_shared);
+    const struct rhizome_mdp_compression *c = stream->compression;
+    if (c && c->sent_bytes)
+      DEBUGF("Blocks of %s bundles compressed from %"PRIu64" to %"PRIu64" bytes, ratio %.2f",
+	     alloca_str_toprint(c->service), c->block_bytes, c->sent_bytes, (double)c->block_bytes / (double)c->sent_bytes);
+  }
+}
+
+/* Find the compression counters of the service of a bundle, starting them if need be.  Returns NULL
+ * if the bundle is not stored, or there are too many services to count separately.
+ */
+static struct rhizome_mdp_compression *rhizome_mdp_compression_counters(const rhizome_bid_t *bid, uint64_t version)
+{
+  char service[sizeof rhizome_mdp_compression[0].service];
+  strbuf sb = strbuf_local(service, sizeof service);
+  if (sqlite_exec_strbuf(sb, "SELECT service FROM MANIFESTS WHERE id = ? AND version = ?;",
+			 RHIZOME_BID_T, bid, INT64, version, END) != 1)
+    return NULL;
+  unsigned i;
+  for (i = 0; i < RHIZOME_MDP_COMPRESSION_SERVICES; i++){
+    struct rhizome_mdp_compression *c = &rhizome_mdp_compression[i];
+    if (!c->service[0])
+      strbuf_ncat(strbuf_local(c->service, sizeof c->service), service, sizeof service);
+    if (strcmp(c->service, service) == 0)
+      return c;
+  }
+  return NULL;
+}
+
+void rhizome_mdp_stream_blocks(struct sched_ent *alarm)
+{
+  time_ms_t now = gettime_ms();
+  int pending = 0;
+  unsigned i;
+  for (i = 0; i < RHIZOME_MDP_STREAMS; i++){
+    struct rhizome_mdp_stream *stream = &rhizome_mdp_streams[i];
+    if (!stream->dest)
+      continue;
+    if (stream->expires < now || !rhizome_mdp_stream_send(stream))
+      rhizome_mdp_stream_finish(stream);
+    else
+      pending = 1;
+  }
+  if (pending)
+    RESCHEDULE(alarm, now + RHIZOME_MDP_STREAM_INTERVAL, now + RHIZOME_MDP_STREAM_INTERVAL, TIME_MS_NEVER_WILL);
+}
+
+/* Fold a request into a broadcast stream of the same payload that is already under way, if the
+ * requested blocks line up with the stream's and none of them come before the stream's next block,
+ * so that every requester of the stream still hears its window in order.  The stream then sends
+ * the blocks that any of its requesters lack, once.  Returns 1 if the request was joined to a stream.
+ */
+static int rhizome_mdp_stream_join(struct subscriber *dest, const struct network_destination *link, const rhizome_bid_t *bid, uint64_t version, uint64_t fileOffset, const uint8_t *bitmap, unsigned blocks, uint16_t blockLength, char compress)
+{
+  unsigned first;
+  for (first = 0; first < blocks && (bitmap[first >> 3] & (0x80 >> (first & 7))); first++)
+    ;
+  if (first == blocks)
+    return 0;
+  uint64_t start = fileOffset + first * (uint64_t)blockLength;
+  uint64_t end = fileOffset + blocks * (uint64_t)blockLength;
+  unsigned i;
+  for (i = 0; i < RHIZOME_MDP_STREAMS; i++){
+    struct rhizome_mdp_stream *s = &rhizome_mdp_streams[i];
+    if (!s->dest
+	|| (s->dest == dest && !s->shared)
+	|| s->version != version
+	|| s->block_length != blockLength
+	|| start < s->offset
+	|| (start - s->offset) % blockLength
+	|| (start - s->offset) / blockLength < s->next
+	|| (end - s->offset) / blockLength > RHIZOME_MDP_MAX_WINDOW
+	|| cmp_rhizome_bid_t(&s->bid, bid) != 0
+	|| peer_broadcast_destination(s->dest) != link)
+      continue;
+    unsigned base = (start - s->offset) / blockLength;
+    unsigned count = (end - s->offset) / blockLength, j;
+    // blocks added to the end of the stream are only sent if the new requester lacks them
+    for (j = s->blocks; j < count; j++)
+      s->bitmap[j >> 3] |= 0x80 >> (j & 7);
+    for (j = first; j < blocks; j++){
+      unsigned k = base + j - first;
+      if (bitmap[j >> 3] & (0x80 >> (j & 7)))
+	continue;
+      if (k < s->blocks && stream_block_wanted(s, k))
+	rhizome_mdp_blocks_shared++;
+      else
+	s->bitmap[k >> 3] &= ~(0x80 >> (k & 7));
+    }
+    if (count > s->blocks)
+      s->blocks = count;
+    // blocks are only compressed while every requester can decompress them
+    if (!compress)
+      s->compress = 0;
+    s->shared = 1;
+    s->requester = dest;
+    s->requested = gettime_ms();
+    s->expires = s->requested + RHIZOME_MDP_STREAM_TIMEOUT;
+    if (config.debug.rhizome_tx)
+      DEBUGF("Joined request from %s to blocks being sent to %s", alloca_tohex_sid_t(dest->sid), alloca_tohex_sid_t(s->dest->sid));
+    // the new request replaces any window still being sent to the requester alone
+    for (j = 0; j < RHIZOME_MDP_STREAMS; j++){
+      struct rhizome_mdp_stream *o = &rhizome_mdp_streams[j];
+      if (o != s && o->dest == dest && !o->shared && o->version == version && cmp_rhizome_bid_t(&o->bid, bid) == 0)
+	o->dest = NULL;
+    }
+    return 1;
+  }
+  return 0;
+}
+
+/* Send the blocks of a window that the requester does not already hold, compressed if the requester
+ * can decompress them.  A new request from the same peer for the same payload replaces any window
+ * still being sent to it alone.
+ */
+int rhizome_mdp_send_block(struct subscriber *dest, const rhizome_bid_t *bid, uint64_t version, uint64_t fileOffset, const uint8_t *bitmap, unsigned blocks, uint16_t blockLength, char compress)
+{
+  IN();
+  if (!is_rhizome_mdp_server_running())
+    RETURN(-1);
+  if (blockLength<=0 || blockLength>1024)
+    RETURN(WHYF("Invalid block length %d", blockLength));
+  if (blocks<=0 || blocks>RHIZOME_MDP_MAX_WINDOW)
+    RETURN(WHYF("Invalid block count %u", blocks));
+
+  if (config.debug.rhizome_tx)
+    DEBUGF("Requested %u blocks by %s for bid=%s, ver=%"PRIu64" @%"PRIx64" bitmap %s", blocks,
+	   dest ? alloca_tohex_sid_t_trunc(dest->sid, 14) : "broadcast", alloca_tohex_rhizome_bid_t(*bid), version, fileOffset,
+	   alloca_tohex(bitmap, (blocks + 7) / 8));
+  
+  char broadcast = !(dest && (dest->reachable==REACHABLE_UNICAST || dest->reachable==REACHABLE_INDIRECT));
+  struct network_destination *link = config.rhizome.mdp.share_blocks ? peer_broadcast_destination(dest) : NULL;
+  compress = compress && config.rhizome.mdp.compress_blocks;
+  if (link && rhizome_mdp_stream_join(dest, link, bid, version, fileOffset, bitmap, blocks, blockLength, compress))
+    RETURN(0);
+  
+  struct rhizome_mdp_stream *stream = NULL;
+  unsigned i;
+  for (i = 0; i < RHIZOME_MDP_STREAMS; i++){
+    struct rhizome_mdp_stream *s = &rhizome_mdp_streams[i];
+    if (s->dest == dest && !s->shared && cmp_rhizome_bid_t(&s->bid, bid) == 0 && s->version == version){
+      stream = s;
+      break;
+    }
+    if (!stream || (stream->dest && (!s->dest || s->expires < stream->expires)))
+      stream = s;
+  }
+  if (stream->dest && stream->dest != dest && config.debug.rhizome_tx)
+    DEBUGF("Abandoning blocks for %s, too many requests at once", alloca_tohex_sid_t(stream->dest->sid));
+  // keep counting compression against the service of the payload the stream was already sending
+  if (!compress)
+    stream->compression = NULL;
+  else if (!stream->compression || stream->version != version || cmp_rhizome_bid_t(&stream->bid, bid) != 0)
+    stream->compression = rhizome_mdp_compression_counters(bid, version);
+  
+  // if other neighbours are fetching the same payload, broadcast its blocks on the link so that they
+  // all hear them, and hold the window back briefly so that requests arriving close together can be
+  // joined
+  time_ms_t now = gettime_ms();
+  char popular = 0;
+  if (link)
+    for (i = 0; i < RHIZOME_MDP_STREAMS; i++){
+      struct rhizome_mdp_stream *s = &rhizome_mdp_streams[i];
+      if (s->requester && s->requester != dest && s->requested + RHIZOME_MDP_SHARE_HORIZON > now
+	  && s->version == version && cmp_rhizome_bid_t(&s->bid, bid) == 0){
+	popular = 1;
+	break;
+      }
+    }
+  stream->dest = dest;
+  stream->requester = dest;
+  stream->requested = now;
+  stream->start = popular ? now + RHIZOME_MDP_SHARE_DELAY : now;
+  stream->broadcast = broadcast;
+  stream->compress = compress;
+  stream->shared = 0;
+  stream->popular = popular;
+  stream->bid = *bid;
+  stream->version = version;
+  stream->offset = fileOffset;
+  stream->block_length = blockLength;
+  stream->blocks = blocks;
+  stream->next = 0;
+  bzero(stream->bitmap, sizeof stream->bitmap);
+  memcpy(stream->bitmap, bitmap, (blocks + 7) / 8);
+  stream->expires = now + RHIZOME_MDP_STREAM_TIMEOUT;
+  
+  if (rhizome_mdp_stream_send(stream)){
+    struct sched_ent *alarm = &ALARM_STRUCT(rhizome_mdp_stream_blocks);
+    if (!is_scheduled(alarm)){
+      RESCHEDULE(alarm, now + RHIZOME_MDP_STREAM_INTERVAL, now + RHIZOME_MDP_STREAM_INTERVAL, TIME_MS_NEVER_WILL);
+    }
+  }else
+    rhizome_mdp_stream_finish(stream);
   
   RETURN(0);
   OUT();
@@ -121,14 +523,137 @@ int overlay_mdp_service_rhizomerequest(struct internal_mdp_header *header, struc
   // Note, was originally built using read_uint64 which has reverse byte order of ob_get_ui64
   uint64_t version = ob_get_ui64_rv(payload);
   uint64_t fileOffset = ob_get_ui64_rv(payload);
-  uint32_t bitmap = ob_get_ui32_rv(payload);
+  uint32_t legacy_bitmap = ob_get_ui32_rv(payload);
   uint16_t blockLength = ob_get_ui16_rv(payload);
   if (ob_overrun(payload))
     return -1;
-  return rhizome_mdp_send_block(header->source, bidp, version, fileOffset, bitmap, blockLength);
+  uint8_t bitmap[RHIZOME_MDP_MAX_WINDOW / 8];
+  unsigned blocks = RHIZOME_MDP_LEGACY_WINDOW;
+  bitmap[0] = legacy_bitmap >> 24;
+  bitmap[1] = legacy_bitmap >> 16;
+  bitmap[2] = legacy_bitmap >> 8;
+  bitmap[3] = legacy_bitmap;
+  // newer peers may ask for a bigger window, with a bitmap to match
+  if (ob_remaining(payload)){
+    blocks = ob_get_ui16_rv(payload);
+    if (blocks == 0 || blocks > RHIZOME_MDP_MAX_WINDOW)
+      return WHYF("Invalid block count %u", blocks);
+    const uint8_t *p = ob_get_bytes_ptr(payload, (blocks + 7) / 8);
+    if (!p)
+      return -1;
+    memcpy(bitmap, p, (blocks + 7) / 8);
+  }
+  // and then say which optional features they support
+  uint8_t flags = ob_remaining(payload) ? ob_get(payload) : 0;
+  return rhizome_mdp_send_block(header->source, bidp, version, fileOffset, bitmap, blocks, blockLength,
+				(flags & RHIZOME_MDP_REQUEST_COMPRESS) ? 1 : 0);
+}
+
+/* Send one packet of a payload's block hashes, starting at block number first, so that the peer can
+ * verify each block as it arrives.  If we don't have block hashes for the payload, send an empty
+ * packet, so that the peer doesn't wait for them.
+ */
+int overlay_mdp_service_rhizome_blockhash_request(struct internal_mdp_header *header, struct overlay_buffer *payload)
+{
+  IN();
+  const rhizome_bid_t *bidp = (const rhizome_bid_t *) ob_get_bytes_ptr(payload, sizeof bidp->binary);
+  uint64_t version = ob_get_ui64_rv(payload);
+  uint32_t first = ob_get_ui32_rv(payload);
+  if (ob_overrun(payload))
+    RETURN(-1);
+  if (!is_rhizome_mdp_server_running())
+    RETURN(-1);
+  
+  rhizome_filehash_t filehash;
+  if (rhizome_database_filehash_from_id(bidp, version, &filehash) != 0)
+    RETURN(0);
+  
+  unsigned char hashes[RHIZOME_BLOCK_HASHES_PER_PACKET * RHIZOME_BLOCK_HASH_BYTES];
+  int count = rhizome_read_block_hashes(&filehash, first, RHIZOME_BLOCK_HASHES_PER_PACKET, hashes);
+  if (count == -1)
+    RETURN(-1);
+  if (config.debug.rhizome_tx)
+    DEBUGF("Sending %d block hashes from %"PRIu32" for bid=%s, ver=%"PRIu64, count, first, alloca_tohex_rhizome_bid_t(*bidp), version);
+  
+  struct internal_mdp_header reply;
+  bzero(&reply, sizeof reply);
+  reply.crypt_flags = MDP_FLAG_NO_CRYPT | MDP_FLAG_NO_SIGN;
+  reply.source = my_subscriber;
+  reply.source_port = MDP_PORT_RHIZOME_RESPONSE;
+  reply.destination = header->source;
+  reply.destination_port = MDP_PORT_RHIZOME_RESPONSE;
+  reply.qos = OQ_OPPORTUNISTIC;
+  
+  struct overlay_buffer *response = ob_new();
+  ob_append_byte(response, 'H'); // contains block hashes
+  ob_append_bytes(response, bidp->binary, 16);
+  ob_append_ui64_rv(response, version);
+  ob_append_ui32_rv(response, first);
+  if (count)
+    ob_append_bytes(response, hashes, (size_t)count * RHIZOME_BLOCK_HASH_BYTES);
+  ob_flip(response);
+  int ret = overlay_send_frame(&reply, response);
+  ob_free(response);
+  RETURN(ret);
+  OUT();
+}
+
+/* Send one packet of a payload's chunk list, starting at chunk number first, so that the peer can
+ * copy the chunks it already holds instead of fetching them.  If the payload isn't stored as
+ * chunks, send a list with no chunks in it.
+ */
+int overlay_mdp_service_rhizome_chunk_request(struct internal_mdp_header *header, struct overlay_buffer *payload)
+{
+  IN();
+  const rhizome_bid_t *bidp = (const rhizome_bid_t *) ob_get_bytes_ptr(payload, sizeof bidp->binary);
+  uint64_t version = ob_get_ui64_rv(payload);
+  uint32_t first = ob_get_ui32_rv(payload);
+  if (ob_overrun(payload))
+    RETURN(-1);
+  if (!is_rhizome_mdp_server_running())
+    RETURN(-1);
+  
+  rhizome_filehash_t filehash;
+  if (rhizome_database_filehash_from_id(bidp, version, &filehash) != 0)
+    RETURN(0);
+  
+  struct rhizome_chunk_ref refs[RHIZOME_CHUNKS_PER_PACKET];
+  uint32_t total = 0;
+  int count = rhizome_read_chunk_list(&filehash, first, RHIZOME_CHUNKS_PER_PACKET, refs, &total);
+  if (count == -1)
+    RETURN(-1);
+  if (config.debug.rhizome_tx)
+    DEBUGF("Sending %d of %"PRIu32" chunks from %"PRIu32" for bid=%s, ver=%"PRIu64,
+	   count, total, first, alloca_tohex_rhizome_bid_t(*bidp), version);
+  
+  struct internal_mdp_header reply;
+  bzero(&reply, sizeof reply);
+  reply.crypt_flags = MDP_FLAG_NO_CRYPT | MDP_FLAG_NO_SIGN;
+  reply.source = my_subscriber;
+  reply.source_port = MDP_PORT_RHIZOME_RESPONSE;
+  reply.destination = header->source;
+  reply.destination_port = MDP_PORT_RHIZOME_RESPONSE;
+  reply.qos = OQ_OPPORTUNISTIC;
+  
+  struct overlay_buffer *response = ob_new();
+  ob_append_byte(response, 'C'); // contains a chunk list
+  ob_append_bytes(response, bidp->binary, 16);
+  ob_append_ui64_rv(response, version);
+  ob_append_ui32_rv(response, first);
+  ob_append_ui32_rv(response, total);
+  int i;
+  for (i = 0; i < count; ++i) {
+    ob_append_ui32_rv(response, refs[i].length);
+    ob_append_bytes(response, refs[i].hash, sizeof refs[i].hash);
+  }
+  ob_flip(response);
+  int ret = overlay_send_frame(&reply, response);
+  ob_free(response);
+  RETURN(ret);
+  OUT();
 }
 
-int overlay_mdp_service_rhizomeresponse(struct internal_mdp_header *UNUSED(header), struct overlay_buffer *payload)
+int overlay_mdp_service_rhizomeresponse(struct internal_mdp_header *header, struct overlay_buffer *payload)
 {
   IN();
   
@@ -160,11 +685,64 @@ int overlay_mdp_service_rhizomeresponse(struct internal_mdp_header *UNUSED(heade
 	 a slot to capture this files as it is being requested
 	 by someone else.
       */
-      rhizome_received_content(bidprefix,version,offset, count, bytes);
+      rhizome_received_content(header->source, bidprefix,version,offset, count, bytes);
 
       RETURN(0);
     }
     break;
+  case 'Z': /* compressed data block */
+    {
+      unsigned char *bidprefix=ob_get_bytes_ptr(payload, 16);
+      uint64_t version=ob_get_ui64_rv(payload);
+      uint64_t offset=ob_get_ui64_rv(payload);
+      uint16_t length=ob_get_ui16_rv(payload);
+      if (ob_overrun(payload))
+	RETURN(WHYF("Payload too short"));
+      unsigned char block[1024];
+      if (length > sizeof block)
+	RETURN(WHYF("Invalid block length %u", length));
+      if (lz4_decompress_block(ob_current_ptr(payload), ob_remaining(payload), block, length) != length)
+	RETURN(WHYF("Malformed compressed block"));
+      
+      if (config.debug.rhizome_mdp_rx)
+	DEBUGF("bidprefix=%02x%02x%02x%02x*, offset=%"PRId64", count=%u compressed to %zu",
+	       bidprefix[0],bidprefix[1],bidprefix[2],bidprefix[3],offset,length,ob_remaining(payload));
+      
+      rhizome_received_content(header->source, bidprefix, version, offset, length, block);
+      RETURN(0);
+    }
+    break;
+  case 'H': /* block hashes */
+    {
+      unsigned char *bidprefix=ob_get_bytes_ptr(payload, 16);
+      uint64_t version=ob_get_ui64_rv(payload);
+      uint32_t first=ob_get_ui32_rv(payload);
+      if (ob_overrun(payload))
+	RETURN(WHYF("Payload too short"));
+      size_t count = ob_remaining(payload) / RHIZOME_BLOCK_HASH_BYTES;
+      rhizome_received_block_hashes(bidprefix, version, first, count, ob_current_ptr(payload));
+      RETURN(0);
+    }
+    break;
+  case 'C': /* chunk list */
+    {
+      unsigned char *bidprefix=ob_get_bytes_ptr(payload, 16);
+      uint64_t version=ob_get_ui64_rv(payload);
+      uint32_t first=ob_get_ui32_rv(payload);
+      uint32_t total=ob_get_ui32_rv(payload);
+      if (ob_overrun(payload))
+	RETURN(WHYF("Payload too short"));
+      struct rhizome_chunk_ref refs[RHIZOME_CHUNKS_PER_PACKET];
+      size_t count = 0;
+      while (count < RHIZOME_CHUNKS_PER_PACKET && ob_remaining(payload) >= 4 + RHIZOME_CHUNK_HASH_BYTES) {
+	refs[count].length = ob_get_ui32_rv(payload);
+	bcopy(ob_get_bytes_ptr(payload, RHIZOME_CHUNK_HASH_BYTES), refs[count].hash, RHIZOME_CHUNK_HASH_BYTES);
+	++count;
+      }
+      rhizome_received_chunk_list(bidprefix, version, first, total, refs, count);
+      RETURN(0);
+    }
+    break;
   }
 
   RETURN(-1);
@@ -370,7 +948,7 @@ static int overlay_mdp_service_manifest_requests(struct internal_mdp_header *hea
       rhizome_advertise_manifest(header->source, m);
       // pre-emptively send the payload if it will fit in a single packet
       if (m->filesize > 0 && m->filesize <= 1024)
-	rhizome_mdp_send_block(header->source, &m->cryptoSignPublic, m->version, 0, 0, m->filesize);
+	rhizome_mdp_send_block(header->source, &m->cryptoSignPublic, m->version, 0, (const uint8_t *)"\0", 1, m->filesize, 0);
     }
     rhizome_manifest_free(m);
   }
@@ -384,6 +962,8 @@ void overlay_mdp_bind_internal_services()
   mdp_bind_internal(NULL, MDP_PORT_RHIZOME_REQUEST, overlay_mdp_service_rhizomerequest);
   mdp_bind_internal(NULL, MDP_PORT_RHIZOME_MANIFEST_REQUEST, overlay_mdp_service_manifest_requests);
   mdp_bind_internal(NULL, MDP_PORT_RHIZOME_SYNC, overlay_mdp_service_rhizome_sync);
+  mdp_bind_internal(NULL, MDP_PORT_RHIZOME_BLOCKHASH_REQUEST, overlay_mdp_service_rhizome_blockhash_request);
+  mdp_bind_internal(NULL, MDP_PORT_RHIZOME_CHUNK_REQUEST, overlay_mdp_service_rhizome_chunk_request);
   mdp_bind_internal(NULL, MDP_PORT_RHIZOME_RESPONSE, overlay_mdp_service_rhizomeresponse);
   mdp_bind_internal(NULL, MDP_PORT_PROBE, overlay_mdp_service_probe);
   mdp_bind_internal(NULL, MDP_PORT_STUNREQ, overlay_mdp_service_stun_req);
@@ -43,6 +43,50 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 // assumed to always be 2^n
 #define RHIZOME_CRYPT_PAGE_SIZE         4096
 
+/* A payload may be accompanied by a hash of each block of its stored (encrypted) content, so that
+ * blocks can be verified as they are read or fetched, long before the whole payload can be checked
+ * against its filehash.  The manifest's "blockhash" field is the root hash over all the block
+ * hashes.
+ */
+#define RHIZOME_BLOCK_HASH_SIZE         RHIZOME_CRYPT_PAGE_SIZE
+#define RHIZOME_BLOCK_HASH_BYTES        16
+#define RHIZOME_BLOCKHASH_BYTES         32
+// as many block hashes as fit in one MDP packet
+#define RHIZOME_BLOCK_HASHES_PER_PACKET 64
+
+/* A request for payload blocks over MDP names a window of up to this many blocks, with a bitmap of
+ * those the requester already holds.  The first 32 are also sent in the original fixed size bitmap,
+ * so that peers which only understand that still answer the start of the window.
+ */
+#define RHIZOME_MDP_MAX_WINDOW          256
+#define RHIZOME_MDP_LEGACY_WINDOW       32
+// flags that may follow the bitmap, to say what else the requester understands: blocks compressed
+// in the LZ4 block format (see lz4.c)
+#define RHIZOME_MDP_REQUEST_COMPRESS    0x01
+
+/* Large payloads may be stored as content-defined chunks that are shared between payloads (see
+ * rhizome_chunk.c).  Chunk boundaries must be found the same way by every node.
+ */
+#define RHIZOME_CHUNK_MIN_SIZE          2048
+#define RHIZOME_CHUNK_AVG_BITS          13
+#define RHIZOME_CHUNK_MAX_SIZE          (64*1024)
+#define RHIZOME_CHUNK_HASH_BYTES        32
+// payloads smaller than this are never chunked
+#define RHIZOME_CHUNK_MIN_PAYLOAD       RHIZOME_CHUNK_MAX_SIZE
+// as many chunk list entries (length and hash) as fit in one MDP packet
+#define RHIZOME_CHUNKS_PER_PACKET       28
+
+/* A new version of a payload may be fetched as a delta against the version already held (see
+ * rhizome_delta.c), built from blocks of the old payload and literal bytes of the new one.
+ */
+#define RHIZOME_DELTA_MIN_BLOCK         256
+#define RHIZOME_DELTA_MAX_BLOCK         (64*1024)
+#define RHIZOME_DELTA_MAX_SIGNATURES    (64*1024)
+// weak checksum and truncated strong hash of each block
+#define RHIZOME_DELTA_SIGNATURE_BYTES   12
+// payloads smaller than this are always fetched whole
+#define RHIZOME_DELTA_MIN_PAYLOAD       (16*1024)
+
 extern time_ms_t rhizome_voice_timeout;
 
 #define RHIZOME_IDLE_TIMEOUT 20000
@@ -60,6 +104,17 @@ typedef struct rhizome_signature {
 #define MAX_MANIFEST_BYTES 8192
 #define MAX_MANIFEST_FIELD_LABEL_LEN 80
 
+/* Length of the digest that identifies a (manifest hash, signature block) pair in the signature
+ * cache and the store.
+ */
+#define RHIZOME_SIGNATURE_KEY_BYTES 32
+
+/* Enough to hold the fields and signatories of most manifests without a malloc(3).
+ */
+#define RHIZOME_MANIFEST_ARENA_BYTES 1024
+
+struct rhizome_manifest_arena_block;
+
 typedef struct rhizome_manifest
 {
   int manifest_record_number;
@@ -89,25 +144,42 @@ typedef struct rhizome_manifest
 
   /* All the manifest fields in original order (the order affects the manifest
    * hash which was used to sign the manifest, so the signature can only be
-   * checked if order is preserved).
+   * checked if order is preserved).  The array (var_alloc elements, at most
+   * MAX_MANIFEST_VARS) is allocated from the manifest's arena.  Labels and
+   * values are NOT NUL terminated: a freshly parsed field refers to its text in
+   * manifestdata[], and is only copied into the arena if it is modified, or
+   * when the manifest is re-packed.
    *
    * TODO: reduce to only unknown fields.
-   *
-   * TODO: store all vars and values as NUL terminated strings within
-   * manifestdata[], not malloc()/free() heap, to reduce memory fragmentation
-   * and allow manifest struct copying without string lifetime issues.
    */
   unsigned short var_count;
-  const char *vars[MAX_MANIFEST_VARS];
-  const char *values[MAX_MANIFEST_VARS];
-
-  /* Parties who have signed this manifest (binary format, malloc(3)).
+  unsigned short var_alloc;
+  struct rhizome_manifest_field {
+    const char *label;
+    const char *value;
+    unsigned short label_len;
+    unsigned short value_len;
+  } *fields;
+
+  /* Parties who have signed this manifest (binary format, in the arena, at
+   * most MAX_MANIFEST_VARS).
    * Recognised signature types:
    *    0x17 = crypto_sign_edwards25519sha512batch()
    */
   unsigned short sig_count;
-  unsigned char *signatories[MAX_MANIFEST_VARS];
-  uint8_t signatureTypes[MAX_MANIFEST_VARS];
+  unsigned short sig_alloc;
+  unsigned char **signatories;
+  uint8_t *signatureTypes;
+
+  /* Storage for the field strings and signatories.  Allocation only ever
+   * appends, so nothing moves once stored, and everything is released at once
+   * when the manifest is cleared or freed.  The first
+   * RHIZOME_MANIFEST_ARENA_BYTES are in arena_data[], the rest in a chain of
+   * malloc(3)ed blocks.
+   */
+  struct rhizome_manifest_arena_block *arena_blocks;
+  char *arena_next;
+  size_t arena_left;
 
   /* Set to non-NULL if a manifest has been parsed that cannot be fully
    * understood by this version of Rhizome (probably from a future or a very
@@ -130,6 +202,12 @@ typedef struct rhizome_manifest
    */
   bool_t selfSigned;
 
+  /* Set if selfsig_key identifies a self-signature that has been verified (or
+   * made) against the current manifest hash, so the store can remember that.
+   */
+  bool_t has_selfsig_key;
+  unsigned char selfsig_key[RHIZOME_SIGNATURE_KEY_BYTES];
+
   /* If set, unlink(2) the associated file when freeing the manifest.
    */
   bool_t dataFileUnlinkOnFree;
@@ -162,6 +240,11 @@ typedef struct rhizome_manifest
   bool_t has_sender;
   bool_t has_recipient;
 
+  /* Set if the blockhash field is valid, ie, the manifest contains a valid
+   * "blockhash" field.
+   */
+  bool_t has_blockhash;
+
   /* Local authorship.  Useful for dividing bundle lists between "sent" and
    * "inbox" views.
    */
@@ -192,12 +275,13 @@ typedef struct rhizome_manifest
    */
   time_ms_t date;
 
-  /* From the "service" field, which should always be present.
+  /* From the "service" field, which should always be present.  A NUL
+   * terminated copy in the arena.
    */
   const char *service;
 
   /* From the optional "name" field.  NULL if there is no "name" field in the
-   * manifest.
+   * manifest.  A NUL terminated copy in the arena.
    */
   const char *name;
 
@@ -210,6 +294,10 @@ typedef struct rhizome_manifest
   sid_t sender;
   sid_t recipient;
 
+  /* Root of the payload's block hashes, from the "blockhash" field if present.
+   */
+  unsigned char blockhash[RHIZOME_BLOCKHASH_BYTES];
+
   /* Local data, not encapsulated in the bundle.  The ROWID of the SQLite
    * MANIFESTS table row in which this manifest is stored.  Zero if the
    * manifest has not been stored yet.
@@ -228,16 +316,16 @@ typedef struct rhizome_manifest
    */
   sid_t author;
 
-  /* Unused.  SHOULD BE DELETED.
-   */
-  unsigned group_count;
-  char *groups[MAX_MANIFEST_VARS];
-
   size_t manifest_body_bytes;
   size_t manifest_all_bytes;
-  unsigned char manifestdata[MAX_MANIFEST_BYTES];
   unsigned char manifesthash[crypto_hash_sha512_BYTES];
 
+  /* The remaining buffers are not zeroed when a manifest record is allocated,
+   * as only their used portions are ever read.
+   */
+  uintptr_t arena_data[RHIZOME_MANIFEST_ARENA_BYTES / sizeof(uintptr_t)];
+  unsigned char manifestdata[MAX_MANIFEST_BYTES];
+
 } rhizome_manifest;
 
 /* These setter functions (methods) are needed because the relevant attributes
@@ -267,6 +355,7 @@ typedef struct rhizome_manifest
 #define rhizome_manifest_set_recipient(m,v)     _rhizome_manifest_set_recipient(__WHENCE__,(m),(v))
 #define rhizome_manifest_del_recipient(m)       _rhizome_manifest_del_recipient(__WHENCE__,(m))
 #define rhizome_manifest_set_crypt(m,v)         _rhizome_manifest_set_crypt(__WHENCE__,(m),(v))
+#define rhizome_manifest_set_blockhash(m,v)     _rhizome_manifest_set_blockhash(__WHENCE__,(m),(v))
 #define rhizome_manifest_set_rowid(m,v)         _rhizome_manifest_set_rowid(__WHENCE__,(m),(v))
 #define rhizome_manifest_set_inserttime(m,v)    _rhizome_manifest_set_inserttime(__WHENCE__,(m),(v))
 #define rhizome_manifest_set_author(m,v)        _rhizome_manifest_set_author(__WHENCE__,(m),(v))
@@ -290,6 +379,7 @@ void _rhizome_manifest_del_sender(struct __sourceloc, rhizome_manifest *);
 void _rhizome_manifest_set_recipient(struct __sourceloc, rhizome_manifest *, const sid_t *);
 void _rhizome_manifest_del_recipient(struct __sourceloc, rhizome_manifest *);
 void _rhizome_manifest_set_crypt(struct __sourceloc, rhizome_manifest *, enum rhizome_manifest_crypt);
+void _rhizome_manifest_set_blockhash(struct __sourceloc, rhizome_manifest *, const unsigned char *);
 void _rhizome_manifest_set_rowid(struct __sourceloc, rhizome_manifest *, uint64_t);
 void _rhizome_manifest_set_inserttime(struct __sourceloc, rhizome_manifest *, time_ms_t);
 void _rhizome_manifest_set_author(struct __sourceloc, rhizome_manifest *, const sid_t *);
@@ -336,6 +426,8 @@ serval_uuid_t rhizome_db_uuid;
 int rhizome_opendb();
 int rhizome_close_db();
 void verify_bundles();
+int rhizome_unverify_bundles();
+int rhizome_verify_step(time_ms_t slice_ms);
 
 typedef struct sqlite_retry_state {
   unsigned int limit; // do not retry once elapsed >= limit
@@ -343,12 +435,27 @@ typedef struct sqlite_retry_state {
   unsigned int elapsed; // the total number of milliseconds elapsed doing retries
   time_ms_t start; // the gettime_ms() value just after the current SQL query first returned BUSY
   unsigned int busytries; // the number of times the current SQL query has returned BUSY
+  char async; // in the server, return BUSY to the caller instead of sleeping
+  char yielded; // set when a query returned BUSY without sleeping, until the caller resumes
 }
     sqlite_retry_state;
 
 sqlite_retry_state sqlite_retry_state_init(int serverLimit, int serverSleep, int otherLimit, int otherSleep);
+sqlite_retry_state sqlite_retry_state_async();
 
 #define SQLITE_RETRY_STATE_DEFAULT sqlite_retry_state_init(-1,-1,-1,-1)
+#define SQLITE_RETRY_STATE_ASYNC sqlite_retry_state_async()
+
+/* Counts of BUSY results from the database in this process, kept since it started.
+ */
+struct sqlite_busy_stats {
+  uint64_t busy_events; // the number of times a query returned BUSY or LOCKED
+  uint64_t yields; // the number of BUSY queries handed back to the caller to retry later
+  uint64_t timeouts; // the number of queries abandoned after reaching their retry limit
+  time_ms_t wait_ms; // total time spent sleeping while waiting for locks
+  time_ms_t deferred_ms; // total time from a yield until the same operation succeeded
+};
+extern struct sqlite_busy_stats sqlite_busy_stats;
 
 struct rhizome_cleanup_report {
     unsigned deleted_stale_incoming_files;
@@ -356,11 +463,15 @@ struct rhizome_cleanup_report {
     unsigned deleted_orphan_files;
     unsigned deleted_orphan_fileblobs;
     unsigned deleted_orphan_manifests;
+    unsigned deleted_orphan_blobs;
+    unsigned deleted_stale_partials;
 };
 
 int rhizome_cleanup(struct rhizome_cleanup_report *report);
+int rhizome_cleanup_step(time_ms_t slice_ms);
 int rhizome_store_cleanup(struct rhizome_cleanup_report *report);
 void rhizome_vacuum_db(sqlite_retry_state *retry);
+int rhizome_checkpoint_db();
 int rhizome_manifest_createid(rhizome_manifest *m);
 int rhizome_get_bundle_from_seed(rhizome_manifest *m, const char *seed);
 int rhizome_get_bundle_from_secret(rhizome_manifest *m, const rhizome_bk_t *bsk);
@@ -410,6 +521,8 @@ const char *rhizome_payload_status_message(enum rhizome_payload_status);
 
 int rhizome_write_manifest_file(rhizome_manifest *m, const char *filename, char append);
 int rhizome_manifest_selfsign(rhizome_manifest *m);
+int rhizome_manifest_sign(rhizome_manifest *m);
+int rhizome_manifest_adopt_signed(rhizome_manifest *m, const unsigned char *data, size_t body_bytes, size_t all_bytes);
 int rhizome_read_manifest_from_file(rhizome_manifest *m, const char *filename);
 int rhizome_manifest_validate(rhizome_manifest *m);
 const char *rhizome_manifest_validate_reason(rhizome_manifest *m);
@@ -422,6 +535,14 @@ void _rhizome_manifest_free(struct __sourceloc, rhizome_manifest *m);
 #define rhizome_manifest_free(m) _rhizome_manifest_free(__WHENCE__,m)
 rhizome_manifest *_rhizome_new_manifest(struct __sourceloc);
 #define rhizome_new_manifest() _rhizome_new_manifest(__WHENCE__)
+int rhizome_manifest_add_signatory(rhizome_manifest *m, uint8_t type, const unsigned char *public_key);
+
+struct rhizome_manifest_pool_stats {
+  unsigned slots; // manifest records allocated from the heap so far
+  unsigned in_use;
+  uint64_t arena_mallocs; // arena blocks that have had to be malloc(3)ed
+};
+void rhizome_manifest_pool_stats(struct rhizome_manifest_pool_stats *stats);
 
 int rhizome_store_manifest(rhizome_manifest *m);
 int rhizome_store_file(rhizome_manifest *m,const unsigned char *key);
@@ -487,6 +608,7 @@ enum sqlbind_type {
 };
 
 sqlite3_stmt *_sqlite_prepare(struct __sourceloc, int log_level, sqlite_retry_state *retry, const char *sqltext);
+sqlite3_stmt *_sqlite_prepare_read(struct __sourceloc, int log_level, sqlite_retry_state *retry, const char *sqltext);
 int _sqlite_bind(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, sqlite3_stmt *statement, ...);
 int _sqlite_vbind(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, sqlite3_stmt *statement, va_list ap);
 sqlite3_stmt *_sqlite_prepare_bind(struct __sourceloc, int log_level, sqlite_retry_state *retry, const char *sqltext, ...);
@@ -529,12 +651,15 @@ int _sqlite_blob_close(struct __sourceloc, int log_level, sqlite3_blob *blob);
 // one, even if it is only 'END' to make no bindings at all.
 #define sqlite_prepare(rs,sql)                          _sqlite_prepare(__WHENCE__, LOG_LEVEL_ERROR, (rs), (sql))
 #define sqlite_prepare_loglevel(ll,rs,sql)              _sqlite_prepare(__WHENCE__, (ll), (rs), (sql))
+#define sqlite_prepare_read(rs,sql)                     _sqlite_prepare_read(__WHENCE__, LOG_LEVEL_ERROR, (rs), (sql))
 #define sqlite_prepare_bind(rs,sql,arg,...)             _sqlite_prepare_bind(__WHENCE__, LOG_LEVEL_ERROR, (rs), (sql), arg, ##__VA_ARGS__)
 #define sqlite_prepare_bind_loglevel(ll,rs,sql,arg,...) _sqlite_prepare_bind(__WHENCE__, (ll), (rs), (sql), arg, ##__VA_ARGS__)
 #define sqlite_bind(rs,stmt,arg,...)                    _sqlite_bind(__WHENCE__, LOG_LEVEL_ERROR, (rs), (stmt), arg, ##__VA_ARGS__)
 #define sqlite_bind_loglevel(ll,rs,stmt,arg,...)        _sqlite_bind(__WHENCE__, (ll), (rs), (stmt), arg, ##__VA_ARGS__)
 #define sqlite_retry(rs,action)                         _sqlite_retry(__WHENCE__, (rs), (action))
 #define sqlite_retry_done(rs,action)                    _sqlite_retry_done(__WHENCE__, (rs), (action))
+#define sqlite_retry_yielded(rs)                        ((rs)->yielded)
+#define sqlite_retry_resume(rs)                         ((rs)->yielded = 0)
 #define sqlite_exec(stmt)                               _sqlite_exec(__WHENCE__, LOG_LEVEL_ERROR, NULL, (stmt))
 #define sqlite_exec_retry(rs,stmt)                      _sqlite_exec(__WHENCE__, LOG_LEVEL_ERROR, (rs), (stmt))
 #define sqlite_exec_retry_loglevel(ll,rs,stmt)          _sqlite_exec(__WHENCE__, (ll), (rs), (stmt))
@@ -553,8 +678,26 @@ int _sqlite_blob_close(struct __sourceloc, int log_level, sqlite3_blob *blob);
 #define sqlite_blob_close(blob)                         _sqlite_blob_close(__WHENCE__, LOG_LEVEL_ERROR, (blob));
 #define sqlite_blob_write_retry(rs,blob,buf,siz,off)    _sqlite_blob_write_retry(__WHENCE__, LOG_LEVEL_ERROR, (rs), (blob), (buf), (siz), (off))
 
+int _rhizome_db_begin(struct __sourceloc, sqlite_retry_state *retry);
+int _rhizome_db_commit(struct __sourceloc, sqlite_retry_state *retry);
+void _rhizome_db_rollback(struct __sourceloc, sqlite_retry_state *retry);
+#define rhizome_db_begin(rs)                            _rhizome_db_begin(__WHENCE__, (rs))
+#define rhizome_db_commit(rs)                           _rhizome_db_commit(__WHENCE__, (rs))
+#define rhizome_db_rollback(rs)                         _rhizome_db_rollback(__WHENCE__, (rs))
+
 double rhizome_manifest_get_double(rhizome_manifest *m,char *var,double default_value);
 int rhizome_manifest_extract_signature(rhizome_manifest *m, unsigned *ofs);
+void rhizome_signature_key(const unsigned char *hash, const unsigned char *sig, size_t sig_len, unsigned char *key);
+int rhizome_signature_is_stored(const unsigned char *key);
+
+struct rhizome_signature_cache_stats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t stored_hits; // misses that were found verified in the store
+  uint64_t verifications;
+  uint64_t evictions;
+};
+extern struct rhizome_signature_cache_stats rhizome_signature_cache_stats;
 enum rhizome_bundle_status rhizome_find_duplicate(const rhizome_manifest *m, rhizome_manifest **found);
 int rhizome_manifest_to_bar(rhizome_manifest *m, rhizome_bar_t *bar);
 int rhizome_is_bar_interesting(const rhizome_bar_t *bar);
@@ -620,6 +763,9 @@ struct rhizome_list_cursor {
   // moves in descending (reverse chronological) order starting from the most
   // recent bundle.
   uint64_t rowid_since;
+  // If set (and rowid_since is not), the cursor starts from the most recent
+  // bundle with rowid < rowid_before, to page backwards through the list.
+  uint64_t rowid_before;
   // Set by calling the next() function.
   rhizome_manifest *manifest;
   // Private state - implementation that could change.
@@ -631,18 +777,42 @@ struct rhizome_list_cursor {
 
 int rhizome_list_open(struct rhizome_list_cursor *);
 int rhizome_list_next(struct rhizome_list_cursor *);
+int rhizome_list_count(struct rhizome_list_cursor *, uint64_t *countp);
+int rhizome_list_matches(const struct rhizome_list_cursor *, const rhizome_manifest *);
 void rhizome_list_commit(struct rhizome_list_cursor *);
 void rhizome_list_release(struct rhizome_list_cursor *);
 
-/* one manifest is required per candidate, plus a few spare.
-   so MAX_RHIZOME_MANIFESTS must be > MAX_CANDIDATES. 
+/* Listeners are told about each bundle as it is stored, so that they need not poll the database,
+ * eg, paused "newsince" HTTP responses.  The 'rowid' field is the highest rowid the listener has
+ * already seen, and only later bundles are notified.  Bundles stored by other processes sharing
+ * the database (eg, the command line) are only noticed by a single poll of the highest rowid, which
+ * runs while anything is listening, and are notified with a NULL manifest.  The notify() function
+ * may unlisten its own listener, but no other.
+ */
+struct rhizome_bundle_listener {
+  uint64_t rowid;
+  void (*notify)(struct rhizome_bundle_listener *, const rhizome_manifest *);
+  void *context;
+  // Private state - implementation that could change.
+  struct rhizome_bundle_listener *_next;
+  struct rhizome_bundle_listener **_prevp;
+};
+
+int rhizome_bundle_listen(struct rhizome_bundle_listener *);
+void rhizome_bundle_unlisten(struct rhizome_bundle_listener *);
+void rhizome_bundle_notify(const rhizome_manifest *);
+
+/* one manifest is required per candidate, plus some spare.
+   so MAX_RHIZOME_MANIFESTS must be > MAX_CANDIDATES.  The pool grows as needed,
+   so this is only a ceiling to catch leaks.
 */
-#define MAX_RHIZOME_MANIFESTS 40
+#define MAX_RHIZOME_MANIFESTS 1024
 #define MAX_CANDIDATES 32
 
 int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, const struct socket_address *addr, const struct subscriber *peer);
 rhizome_manifest * rhizome_fetch_search(const unsigned char *id, int prefix_length);
 int rhizome_fetch_bar_queued(const rhizome_bar_t *bar);
+int rhizome_fetch_add_source(const rhizome_bar_t *bar, const struct subscriber *peer);
 
 /* Rhizome file storage api */
 struct rhizome_write_buffer
@@ -674,6 +844,18 @@ struct rhizome_write
   uint64_t blob_rowid;
   int blob_fd;
   sqlite3_blob *sql_blob;
+
+  // Hash of each block of the stored content; either computed as the content is processed, or
+  // supplied in advance (verify_blocks) so that each block is checked before it is accepted.
+  char block_hashing;
+  char verify_blocks;
+  unsigned char *block_hashes;
+  uint32_t block_hash_count;
+  uint32_t block_hash_alloc;
+  SHA512_CTX block_context;
+  // set by rhizome_finish_write() if block_hashing
+  char has_block_root;
+  unsigned char block_root[RHIZOME_BLOCKHASH_BYTES];
 };
 
 struct rhizome_read_buffer{
@@ -696,14 +878,36 @@ struct rhizome_read
   
   uint64_t blob_rowid;
   int blob_fd;
+  // external payload files are read through a shared memory map where possible
+  struct rhizome_mapping *mapping;
+  uint64_t advise_start;
+  uint64_t advise_end;
+  
+  // block hashes are loaded on the first out of order read, so each block read can be verified
+  char block_hashes_loaded;
+  unsigned char *block_hashes;
+  uint32_t block_hash_count;
+  unsigned char *blocks_verified;
+  
+  // payloads held in the chunk store are read one chunk at a time
+  char chunked;
+  uint64_t chunk_offset;
+  uint64_t chunk_length;
+  uint64_t chunk_rowid;
+  unsigned char *chunk_data; // the whole of the current chunk, if it is stored compressed
   
   uint64_t tail;
   uint64_t offset;
   uint64_t length;
 };
 
-int rhizome_received_content(const unsigned char *bidprefix,uint64_t version, 
+int rhizome_received_content(const struct subscriber *peer, const unsigned char *bidprefix,uint64_t version, 
 			     uint64_t offset, size_t count,unsigned char *bytes);
+int rhizome_received_block_hashes(const unsigned char *bidprefix, uint64_t version,
+				  uint32_t first, size_t count, const unsigned char *hashes);
+struct rhizome_chunk_ref;
+int rhizome_received_chunk_list(const unsigned char *bidprefix, uint64_t version,
+				uint32_t first, uint32_t total, const struct rhizome_chunk_ref *refs, size_t count);
 
 int is_rhizome_enabled();
 int is_rhizome_mdp_enabled();
@@ -749,9 +953,30 @@ int rhizome_direct_get_bars(const rhizome_bid_t *bid_low,
 			    unsigned char *bars_out,
 			    int bars_requested);
 
+/* Range reconciliation of two stores for Rhizome Direct enquiries, see rhizome_direct_range.c.
+*/
+#define RHIZOME_DIRECT_RANGE_MAX_BYTES (1048576)
+
+enum rhizome_direct_range_action {
+  RHIZOME_DIRECT_RANGE_PUSH,
+  RHIZOME_DIRECT_RANGE_PULL
+};
+
+typedef void RHIZOME_DIRECT_RANGE_ACTION(void *context, enum rhizome_direct_range_action, const unsigned char *bar_prefix);
+
+struct overlay_buffer *rhizome_direct_range_begin();
+struct overlay_buffer *rhizome_direct_range_respond(const unsigned char *enquiry, size_t len);
+int rhizome_direct_range_resolve(const unsigned char *response, size_t len, struct overlay_buffer **next,
+				 RHIZOME_DIRECT_RANGE_ACTION *action, void *context);
+
 typedef struct rhizome_direct_sync_request {
   struct sched_ent alarm;
+  /* A sync walks either the cursor, sending lists of BARs, or (if the cursor is
+     NULL) reconciles ranges, in which case this is the next enquiry to send,
+     and NULL once there is nothing left to ask.
+  */
   rhizome_direct_bundle_cursor *cursor;
+  struct overlay_buffer *ranges;
 
   int pushP;
   int pullP;
@@ -769,6 +994,11 @@ typedef struct rhizome_direct_sync_request {
   /* General purpose pointer for transport-dependent state */
   void *transport_specific_state;
 
+  /* Called when a one-shot sync concludes, just before the request is freed,
+     so that the transport can close its connections and free its state.
+  */
+  void (*release_function)(struct rhizome_direct_sync_request *);
+
   /* Statistics.
      Each sync will consist of one or more "fills" of the cursor buffer, which 
      will then be dispatched by the transport-specific dispatch function.
@@ -799,12 +1029,41 @@ int rhizome_direct_conclude_sync_request(rhizome_direct_sync_request *r);
 rhizome_direct_bundle_cursor *rhizome_direct_get_fill_response
 (unsigned char *buffer,int size,int max_response_bytes);
 
+/* Queue of BAR prefixes of bundles waiting to be pushed or pulled.
+*/
+struct rhizome_direct_prefix_queue {
+  unsigned char *prefixes;
+  size_t head;
+  size_t count;
+  size_t alloc;
+};
+
+struct rhizome_direct_http_connection;
+
 typedef struct rhizome_direct_transport_state_http {
+  /* Wakes the client to hand out queued work, must be first */
+  struct sched_ent alarm;
   int port;
   char host[1024];  
+  struct socket_address addr;
+  rhizome_direct_sync_request *sync;
+  /* Connections to the peer, both busy and idle */
+  struct rhizome_direct_http_connection *connections;
+  unsigned connection_count;
+  /* The enquiry for the current cursor fill, at most one at a time */
+  enum rhizome_direct_enquiry_state {
+    RHIZOME_DIRECT_ENQUIRY_NONE = 0,
+    RHIZOME_DIRECT_ENQUIRY_QUEUED,
+    RHIZOME_DIRECT_ENQUIRY_SENT
+  } enquiry;
+  struct rhizome_direct_prefix_queue pushes;
+  struct rhizome_direct_prefix_queue pulls;
+  unsigned pushes_active;
+  bool_t pulls_started;
 } rhizome_direct_transport_state_http;
 
 void rhizome_direct_http_dispatch(rhizome_direct_sync_request *);
+void rhizome_direct_http_release(rhizome_direct_sync_request *);
 
 extern unsigned char favicon_bytes[];
 extern int favicon_len;
@@ -830,6 +1089,7 @@ rhizome_fetch_request_manifest_by_prefix(const struct socket_address *addr,
 int rhizome_any_fetch_active();
 int rhizome_any_fetch_queued();
 int rhizome_fetch_status_html(struct strbuf *b);
+void rhizome_fetch_close_all();
 int rhizome_fetch_has_queue_space(unsigned char log2_size);
 
 /* rhizome storage methods */
@@ -841,11 +1101,84 @@ int rhizome_random_write(struct rhizome_write *write_state, uint64_t offset, uin
 enum rhizome_payload_status rhizome_write_open_manifest(struct rhizome_write *write, rhizome_manifest *m);
 int rhizome_write_file(struct rhizome_write *write, const char *filename);
 void rhizome_fail_write(struct rhizome_write *write);
+void rhizome_suspend_write(struct rhizome_write *write_state, const rhizome_bid_t *bidp, uint64_t version);
+uint64_t rhizome_resume_write(struct rhizome_write *write, const rhizome_bid_t *bidp, uint64_t version);
 enum rhizome_payload_status rhizome_finish_write(struct rhizome_write *write);
+void rhizome_write_hash_blocks(struct rhizome_write *write);
+int rhizome_write_expect_block_hashes(struct rhizome_write *write, unsigned char *hashes, uint32_t count);
+uint32_t rhizome_block_hash_count(uint64_t length);
+void rhizome_block_hash_root(const unsigned char *hashes, uint32_t count, unsigned char root[RHIZOME_BLOCKHASH_BYTES]);
+int rhizome_read_block_hashes(const rhizome_filehash_t *hashp, uint32_t first, uint32_t count, unsigned char *hashes);
+
+struct rhizome_chunk_ref {
+  uint32_t length;
+  unsigned char hash[RHIZOME_CHUNK_HASH_BYTES];
+};
+
+struct rhizome_chunk_stats {
+  uint64_t files;
+  uint64_t chunks;
+  uint64_t payload_bytes;
+  uint64_t chunk_bytes; // of chunks, before any are compressed
+  uint64_t stored_bytes;
+};
+
+int rhizome_chunk_payloads();
+int rhizome_store_chunks(sqlite_retry_state *retry, const rhizome_filehash_t *hashp, uint64_t length,
+			 int fd, uint64_t blob_rowid, struct rhizome_chunk_stats *stats);
+int rhizome_chunked_exists(const rhizome_filehash_t *hashp);
+ssize_t rhizome_read_chunks(sqlite_retry_state *retry, struct rhizome_read *read_state, unsigned char *buffer, size_t bufsz);
+int rhizome_release_chunks(sqlite_retry_state *retry, const char *fileid);
+int rhizome_cleanup_chunks(sqlite_retry_state *retry, int64_t after_rowid, int64_t last_rowid);
+int rhizome_have_chunks();
+int rhizome_read_chunk_list(const rhizome_filehash_t *hashp, uint32_t first, uint32_t count,
+			    struct rhizome_chunk_ref *refs, uint32_t *total);
+ssize_t rhizome_read_chunk(const struct rhizome_chunk_ref *ref, unsigned char *buffer);
+int rhizome_chunk_stats(struct rhizome_chunk_stats *stats);
+
+struct rhizome_delta_op {
+  char copy;		// copy blocks of the old payload, or send literal bytes of the new one
+  uint64_t offset;	// first block to copy, or offset of the literal bytes
+  uint64_t length;	// number of blocks to copy, or of literal bytes
+};
+
+struct rhizome_delta {
+  uint32_t block_size;
+  struct rhizome_delta_op *ops;
+  size_t op_count;
+  size_t op_alloc;
+  uint64_t length;	// bytes of encoded delta
+  uint64_t literal_bytes;
+  size_t op_next;	// next op to encode
+  uint64_t op_sent;	// literal bytes of that op already encoded
+  uint64_t generated;	// bytes of delta encoded so far
+};
+
+struct rhizome_delta_decoder {
+  struct rhizome_read old;
+  uint32_t block_size;
+  uint32_t block_count;
+  unsigned char op[9];	// header of the op being received
+  unsigned op_len;
+  uint64_t literal;	// literal bytes of the current op still to come
+  uint64_t received;	// bytes of delta received
+  uint64_t copied;	// bytes copied from the old payload
+};
+
+uint32_t rhizome_delta_block_size(uint64_t length);
+int rhizome_delta_signatures(const rhizome_filehash_t *hashp, uint32_t *block_sizep, unsigned char **signaturesp, size_t *lengthp);
+int rhizome_delta_encode(struct rhizome_delta *delta, const rhizome_filehash_t *hashp, const unsigned char *signatures, size_t length);
+ssize_t rhizome_delta_generate(struct rhizome_delta *delta, struct rhizome_read *read_state, unsigned char *buffer, size_t bufsz);
+void rhizome_delta_free(struct rhizome_delta *delta);
+int rhizome_delta_decode_init(struct rhizome_delta_decoder *decoder, const rhizome_filehash_t *hashp, uint32_t block_size, uint32_t block_count);
+int rhizome_delta_decode(struct rhizome_delta_decoder *decoder, struct rhizome_write *write, unsigned char *buffer, size_t len);
+void rhizome_delta_decode_close(struct rhizome_delta_decoder *decoder);
 enum rhizome_payload_status rhizome_import_payload_from_file(rhizome_manifest *m, const char *filepath);
 enum rhizome_payload_status rhizome_import_buffer(rhizome_manifest *m, uint8_t *buffer, size_t length);
 enum rhizome_payload_status rhizome_stat_payload_file(rhizome_manifest *m, const char *filepath);
 enum rhizome_payload_status rhizome_store_payload_file(rhizome_manifest *m, const char *filepath);
+enum rhizome_payload_status rhizome_prepare_payload_file(rhizome_manifest *m, const char *filepath, uint64_t *temp_idp, rhizome_filehash_t *hashp);
+enum rhizome_payload_status rhizome_store_prepared_payload(rhizome_manifest *m, uint64_t temp_id, const rhizome_filehash_t *hashp);
 int rhizome_derive_payload_key(rhizome_manifest *m);
 
 enum rhizome_payload_status rhizome_append_journal_buffer(rhizome_manifest *m, uint64_t advance_by, uint8_t *buffer, size_t len);
@@ -865,6 +1198,15 @@ ssize_t rhizome_read_cached(const rhizome_bid_t *bid, uint64_t version, time_ms_
                             uint64_t fileOffset, unsigned char *buffer, size_t length);
 int rhizome_cache_close();
 
+struct rhizome_cache_stats {
+  unsigned open;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evicted;
+  uint64_t expired;
+};
+void rhizome_cache_get_stats(struct rhizome_cache_stats *stats);
+
 int rhizome_database_filehash_from_id(const rhizome_bid_t *bidp, uint64_t version, rhizome_filehash_t *hashp);
 
 int overlay_mdp_service_rhizome_sync(struct internal_mdp_header *header, struct overlay_buffer *payload);
@@ -0,0 +1,497 @@
+/*
+ Serval DNA - Rhizome bulk import
+ Copyright (C) 2014 Serval Project Inc.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <assert.h>
+#include <dirent.h>
+#include <sys/wait.h>
+#ifdef HAVE_SYS_MMAN_H
+#  include <sys/mman.h>
+#endif
+#include "serval.h"
+#include "cli.h"
+#include "conf.h"
+#include "keyring.h"
+#include "commandline.h"
+#include "rhizome.h"
+#include "instance.h"
+
+/* Bulk import proceeds in rounds of up to RHIZOME_BULK_ROUND files; few enough that the results of
+ * a round (each holding a whole manifest) don't take much memory.  In each round, the parent
+ * process fills in the manifests (creating bundle keys and deriving payload keys), then a pool of
+ * forked workers reads, encrypts and hashes the payloads into temporary blob files and signs the
+ * manifests.  Only the parent touches the database, storing each round's results inside one
+ * transaction that is committed every --batch files.
+ */
+#define RHIZOME_BULK_ROUND 20
+
+// written by a worker, read by the parent
+struct bulk_result {
+  enum rhizome_payload_status status;
+  uint64_t temp_id;
+  rhizome_filehash_t hash;
+  size_t body_bytes;
+  size_t all_bytes;
+  unsigned char manifestdata[MAX_MANIFEST_BYTES];
+};
+
+struct bulk_item {
+  char *payload_path;
+  char *manifest_path;
+  rhizome_manifest *m;
+  enum rhizome_bundle_status status;
+};
+
+struct bulk_source {
+  const char *path;
+  DIR *dir;
+  FILE *list;
+  unsigned lineno;
+};
+
+static int bulk_source_open(struct bulk_source *src, const char *path)
+{
+  bzero(src, sizeof *src);
+  src->path = path;
+  struct stat st;
+  if (stat(path, &st) == -1)
+    return WHYF_perror("stat(%s)", alloca_str_toprint(path));
+  if (S_ISDIR(st.st_mode)) {
+    if ((src->dir = opendir(path)) == NULL)
+      return WHYF_perror("opendir(%s)", alloca_str_toprint(path));
+  } else if ((src->list = fopen(path, "r")) == NULL)
+    return WHYF_perror("fopen(%s)", alloca_str_toprint(path));
+  return 0;
+}
+
+static void bulk_source_close(struct bulk_source *src)
+{
+  if (src->dir)
+    closedir(src->dir);
+  if (src->list)
+    fclose(src->list);
+  src->dir = NULL;
+  src->list = NULL;
+}
+
+/* Fetch the next payload (and optional manifest template) to import.  A directory yields every
+ * regular file in it that is not hidden.  A list file yields one payload path per line, optionally
+ * followed by a TAB and a manifest path; blank lines and lines starting with '#' are ignored.
+ * Returns 1 if an item was filled in, 0 at the end, -1 on error (logged).
+ */
+static int bulk_source_next(struct bulk_source *src, struct bulk_item *item)
+{
+  bzero(item, sizeof *item);
+  if (src->dir) {
+    struct dirent *de;
+    while ((de = readdir(src->dir)) != NULL) {
+      if (de->d_name[0] == '.')
+	continue;
+      char path[1024];
+      strbuf b = strbuf_local(path, sizeof path);
+      strbuf_sprintf(b, "%s/%s", src->path, de->d_name);
+      if (strbuf_overrun(b)) {
+	WARNF("path too long: %s/%s", src->path, alloca_str_toprint(de->d_name));
+	continue;
+      }
+      struct stat st;
+      if (lstat(path, &st) == -1) {
+	WARNF_perror("lstat(%s)", alloca_str_toprint(path));
+	continue;
+      }
+      if (!S_ISREG(st.st_mode))
+	continue;
+      if ((item->payload_path = str_edup(path)) == NULL)
+	return -1;
+      return 1;
+    }
+    return 0;
+  }
+  char line[2048];
+  while (fgets(line, sizeof line, src->list)) {
+    ++src->lineno;
+    size_t len = strlen(line);
+    if (len && line[len - 1] == '\n')
+      line[--len] = '\0';
+    else if (!feof(src->list))
+      return WHYF("%s:%u: line too long", src->path, src->lineno);
+    if (len == 0 || line[0] == '#')
+      continue;
+    char *tab = strchr(line, '\t');
+    if (tab) {
+      *tab++ = '\0';
+      if (*tab && (item->manifest_path = str_edup(tab)) == NULL)
+	return -1;
+    }
+    if ((item->payload_path = str_edup(line)) == NULL)
+      return -1;
+    return 1;
+  }
+  if (ferror(src->list))
+    return WHYF_perror("fgets(%s)", alloca_str_toprint(src->path));
+  return 0;
+}
+
+/* Everything that needs the keyring or the database is done here, in the parent process.  Leaves
+ * the item's status as RHIZOME_BUNDLE_STATUS_NEW if it is ready for a worker.
+ */
+static void bulk_prepare(struct bulk_item *item, const sid_t *authorSidp)
+{
+  item->status = RHIZOME_BUNDLE_STATUS_ERROR;
+  rhizome_manifest *m = item->m = rhizome_new_manifest();
+  if (m == NULL) {
+    WHY("Manifest struct could not be allocated");
+    return;
+  }
+  if (item->manifest_path && (rhizome_read_manifest_from_file(m, item->manifest_path) || m->malformed)) {
+    WHYF("Manifest file %s could not be loaded", alloca_str_toprint(item->manifest_path));
+    item->status = RHIZOME_BUNDLE_STATUS_INVALID;
+    return;
+  }
+  if (m->is_journal) {
+    WHYF("Manifest file %s is a journal", alloca_str_toprint(item->manifest_path));
+    item->status = RHIZOME_BUNDLE_STATUS_INVALID;
+    return;
+  }
+  if (m->service == NULL)
+    rhizome_manifest_set_service(m, RHIZOME_SERVICE_FILE);
+  if (rhizome_fill_manifest(m, item->payload_path, authorSidp))
+    return;
+  switch (rhizome_stat_payload_file(m, item->payload_path)) {
+    case RHIZOME_PAYLOAD_STATUS_NEW:
+      if (m->payloadEncryption == PAYLOAD_ENCRYPTED && !rhizome_derive_payload_key(m)) {
+	item->status = RHIZOME_BUNDLE_STATUS_READONLY;
+	return;
+      }
+      // fall through
+    case RHIZOME_PAYLOAD_STATUS_EMPTY:
+      item->status = RHIZOME_BUNDLE_STATUS_NEW;
+      return;
+    case RHIZOME_PAYLOAD_STATUS_WRONG_SIZE:
+      item->status = RHIZOME_BUNDLE_STATUS_INCONSISTENT;
+      return;
+    case RHIZOME_PAYLOAD_STATUS_ERROR:
+    case RHIZOME_PAYLOAD_STATUS_STORED:
+    case RHIZOME_PAYLOAD_STATUS_TOO_BIG:
+    case RHIZOME_PAYLOAD_STATUS_EVICTED:
+    case RHIZOME_PAYLOAD_STATUS_WRONG_HASH:
+    case RHIZOME_PAYLOAD_STATUS_CRYPTO_FAIL:
+      return;
+  }
+}
+
+/* The share of a round done by one worker.  Must not touch the database or the keyring, and must
+ * communicate only through the results array, because it may run in a forked process.
+ */
+static void bulk_work(struct bulk_item *items, struct bulk_result *results, unsigned count, unsigned worker, unsigned nworkers)
+{
+  unsigned i;
+  for (i = worker; i < count; i += nworkers) {
+    if (items[i].status != RHIZOME_BUNDLE_STATUS_NEW)
+      continue;
+    rhizome_manifest *m = items[i].m;
+    struct bulk_result *r = &results[i];
+    r->status = rhizome_prepare_payload_file(m, items[i].payload_path, &r->temp_id, &r->hash);
+    if (r->status == RHIZOME_PAYLOAD_STATUS_NEW)
+      rhizome_manifest_set_filehash(m, &r->hash);
+    else if (r->status != RHIZOME_PAYLOAD_STATUS_EMPTY)
+      continue;
+    if (rhizome_manifest_sign(m) == -1)
+      continue;
+    r->body_bytes = m->manifest_body_bytes;
+    r->all_bytes = m->manifest_all_bytes;
+    bcopy(m->manifestdata, r->manifestdata, m->manifest_all_bytes);
+  }
+}
+
+static void bulk_run_workers(struct bulk_item *items, struct bulk_result *results, unsigned count, unsigned nworkers)
+{
+  unsigned i;
+  for (i = 0; i != count; ++i) {
+    results[i].status = RHIZOME_PAYLOAD_STATUS_ERROR;
+    results[i].body_bytes = 0;
+  }
+  if (nworkers > count)
+    nworkers = count;
+  if (nworkers <= 1) {
+    bulk_work(items, results, count, 0, 1);
+    return;
+  }
+  // don't let the workers inherit unwritten log messages
+  logFlush();
+  pid_t pids[nworkers];
+  unsigned started = 0;
+  unsigned w;
+  for (w = 0; w != nworkers; ++w) {
+    pid_t pid = fork();
+    if (pid == -1) {
+      WHY_perror("fork");
+      break;
+    }
+    if (pid == 0) {
+      close_log_file();
+      bulk_work(items, results, count, w, nworkers);
+      _exit(0);
+    }
+    pids[started++] = pid;
+  }
+  // do the shares of any workers that could not be started
+  for (w = started; w != nworkers; ++w)
+    bulk_work(items, results, count, w, nworkers);
+  for (w = 0; w != started; ++w) {
+    int status;
+    if (waitpid(pids[w], &status, 0) == -1)
+      WHYF_perror("waitpid(%d)", pids[w]);
+    else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      WARNF("bulk import worker pid=%d failed, status=%#x", pids[w], status);
+  }
+}
+
+// remove a prepared payload that will not be stored
+static void bulk_discard(struct bulk_result *r)
+{
+  char blob_path[1024];
+  if (   r->status == RHIZOME_PAYLOAD_STATUS_NEW
+      && FORMF_RHIZOME_STORE_PATH(blob_path, "%s/%"PRIu64, RHIZOME_BLOB_SUBDIR, r->temp_id)
+      && unlink(blob_path) == -1)
+    WARNF_perror("unlink(%s)", alloca_str_toprint(blob_path));
+}
+
+/* Store one worker result, and return the bundle status as rhizome_manifest_finalise() would.  If
+ * the bundle is a duplicate of, or older than, one already in the store, then *mout is set to the
+ * stored manifest, which the caller must free.
+ */
+static enum rhizome_bundle_status bulk_store(rhizome_manifest *m, struct bulk_result *r, rhizome_manifest **mout)
+{
+  enum rhizome_payload_status pstatus = r->status;
+  if (pstatus == RHIZOME_PAYLOAD_STATUS_NEW)
+    pstatus = rhizome_store_prepared_payload(m, r->temp_id, &r->hash);
+  switch (pstatus) {
+    case RHIZOME_PAYLOAD_STATUS_EMPTY:
+    case RHIZOME_PAYLOAD_STATUS_STORED:
+    case RHIZOME_PAYLOAD_STATUS_NEW:
+      break;
+    case RHIZOME_PAYLOAD_STATUS_TOO_BIG:
+    case RHIZOME_PAYLOAD_STATUS_EVICTED:
+      return RHIZOME_BUNDLE_STATUS_NO_ROOM;
+    case RHIZOME_PAYLOAD_STATUS_WRONG_SIZE:
+    case RHIZOME_PAYLOAD_STATUS_WRONG_HASH:
+      return RHIZOME_BUNDLE_STATUS_INCONSISTENT;
+    case RHIZOME_PAYLOAD_STATUS_CRYPTO_FAIL:
+      return RHIZOME_BUNDLE_STATUS_READONLY;
+    case RHIZOME_PAYLOAD_STATUS_ERROR:
+      return RHIZOME_BUNDLE_STATUS_ERROR;
+  }
+  if (m->filesize)
+    rhizome_manifest_set_filehash(m, &r->hash);
+  if (r->body_bytes == 0 || rhizome_manifest_adopt_signed(m, r->manifestdata, r->body_bytes, r->all_bytes) == -1)
+    return RHIZOME_BUNDLE_STATUS_ERROR;
+  *mout = NULL;
+  if (m->haveSecret != EXISTING_BUNDLE_ID) {
+    enum rhizome_bundle_status status = rhizome_find_duplicate(m, mout);
+    if (status != RHIZOME_BUNDLE_STATUS_NEW)
+      return status;
+  }
+  *mout = m;
+  return rhizome_add_manifest(m, mout);
+}
+
+DEFINE_CMD(app_rhizome_add_bulk, 0,
+  "Add every file in a directory, or every payload (and manifest) listed in a file, to Rhizome",
+  "rhizome","add","bulk" KEYRING_PIN_OPTIONS,"[--workers=<n>]","[--batch=<n>]","<author_sid>","<path>");
+static int app_rhizome_add_bulk(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+  const char *path, *authorSidHex, *workers_text, *batch_text;
+  if (   cli_arg(parsed, "--workers", &workers_text, cli_uint, "") == -1
+      || cli_arg(parsed, "--batch", &batch_text, cli_uint, "1000") == -1
+      || cli_arg(parsed, "author_sid", &authorSidHex, cli_optional_sid, "") == -1)
+    return -1;
+  cli_arg(parsed, "path", &path, NULL, "");
+  sid_t authorSid;
+  if (authorSidHex[0] && str_to_sid_t(&authorSid, authorSidHex) == -1)
+    return WHYF("invalid author_sid: %s", authorSidHex);
+  unsigned batch = atoi(batch_text);
+  if (batch == 0)
+    batch = 1;
+  long nworkers = workers_text[0] ? atoi(workers_text) : 0;
+#ifdef _SC_NPROCESSORS_ONLN
+  if (nworkers == 0)
+    nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  if (nworkers < 1)
+    nworkers = 1;
+  if (nworkers > RHIZOME_BULK_ROUND)
+    nworkers = RHIZOME_BULK_ROUND;
+
+  // workers return their results through memory shared with the parent
+  struct bulk_result *results = NULL;
+  size_t results_size = RHIZOME_BULK_ROUND * sizeof *results;
+#ifdef HAVE_SYS_MMAN_H
+  results = mmap(NULL, results_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (results == MAP_FAILED) {
+    WARNF_perror("mmap(%zu)", results_size);
+    results = NULL;
+  }
+#endif
+  int shared = results != NULL;
+  if (!shared) {
+    if ((results = emalloc(results_size)) == NULL)
+      return -1;
+    nworkers = 1;
+  }
+
+  int ret = -1;
+  struct bulk_source src;
+  if (create_serval_instance_dir() == -1 || bulk_source_open(&src, path) == -1)
+    goto unmap;
+  if (!(keyring = keyring_open_instance_cli(parsed)))
+    goto close;
+  if (rhizome_opendb() == -1)
+    goto close;
+
+  const char *names[] = {
+    "_id", "status", "manifestid", "filesize", "path"
+  };
+  cli_columns(context, 5, names);
+
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  time_ms_t start = gettime_ms();
+  unsigned rows = 0, failed = 0, uncommitted = 0;
+  uint64_t bytes = 0;
+  int in_transaction = 0;
+  int more = 1;
+  ret = 0;
+  while (more) {
+    struct bulk_item items[RHIZOME_BULK_ROUND];
+    unsigned count = 0;
+    while (count < RHIZOME_BULK_ROUND) {
+      int r = bulk_source_next(&src, &items[count]);
+      if (r != 1) {
+	if (r == -1)
+	  ret = -1;
+	more = 0;
+	break;
+      }
+      bulk_prepare(&items[count], authorSidHex[0] ? &authorSid : NULL);
+      ++count;
+    }
+    bulk_run_workers(items, results, count, nworkers);
+    if (count && !in_transaction) {
+      if (sqlite_exec_void_retry(&retry, "BEGIN TRANSACTION;", END) == -1) {
+	ret = -1;
+	more = 0;
+      } else
+	in_transaction = 1;
+    }
+    unsigned i;
+    for (i = 0; i != count; ++i) {
+      struct bulk_item *item = &items[i];
+      rhizome_manifest *mout = NULL;
+      if (item->status == RHIZOME_BUNDLE_STATUS_NEW) {
+	if (in_transaction)
+	  item->status = bulk_store(item->m, &results[i], &mout);
+	else {
+	  item->status = RHIZOME_BUNDLE_STATUS_ERROR;
+	  bulk_discard(&results[i]);
+	}
+	if (results[i].status == RHIZOME_PAYLOAD_STATUS_NEW)
+	  bytes += item->m->filesize;
+      }
+      cli_put_long(context, rows++, ":");
+      cli_put_long(context, item->status, ":");
+      switch (item->status) {
+	case RHIZOME_BUNDLE_STATUS_NEW:
+	case RHIZOME_BUNDLE_STATUS_SAME:
+	case RHIZOME_BUNDLE_STATUS_DUPLICATE:
+	case RHIZOME_BUNDLE_STATUS_OLD:
+	  assert(mout != NULL);
+	  cli_put_hexvalue(context, mout->cryptoSignPublic.binary, sizeof mout->cryptoSignPublic.binary, ":");
+	  cli_put_long(context, mout->filesize, ":");
+	  ++uncommitted;
+	  break;
+	case RHIZOME_BUNDLE_STATUS_INVALID:
+	case RHIZOME_BUNDLE_STATUS_FAKE:
+	case RHIZOME_BUNDLE_STATUS_INCONSISTENT:
+	case RHIZOME_BUNDLE_STATUS_NO_ROOM:
+	case RHIZOME_BUNDLE_STATUS_READONLY:
+	case RHIZOME_BUNDLE_STATUS_BUSY:
+	case RHIZOME_BUNDLE_STATUS_ERROR:
+	  cli_put_string(context, "", ":");
+	  cli_put_string(context, "", ":");
+	  ++failed;
+	  break;
+      }
+      cli_put_string(context, item->payload_path, "\n");
+      if (mout && mout != item->m)
+	rhizome_manifest_free(mout);
+      if (item->m)
+	rhizome_manifest_free(item->m);
+      free(item->payload_path);
+      free(item->manifest_path);
+    }
+    if (in_transaction && (uncommitted >= batch || !more)) {
+      if (sqlite_exec_void_retry(&retry, "COMMIT;", END) == -1) {
+	WHYF("Failed to commit %u imported bundles", uncommitted);
+	sqlite_exec_void_retry(&retry, "ROLLBACK;", END);
+	ret = -1;
+	more = 0;
+      }
+      in_transaction = 0;
+      uncommitted = 0;
+    }
+  }
+  cli_row_count(context, rows);
+
+  time_ms_t elapsed = gettime_ms() - start;
+  double seconds = (elapsed ? elapsed : 1) / 1e3;
+  char rate[40];
+  cli_field_name(context, "files", ":");
+  cli_put_long(context, rows, "\n");
+  cli_field_name(context, "failed", ":");
+  cli_put_long(context, failed, "\n");
+  cli_field_name(context, "bytes", ":");
+  cli_put_long(context, bytes, "\n");
+  cli_field_name(context, "seconds", ":");
+  snprintf(rate, sizeof rate, "%.3f", elapsed / 1e3);
+  cli_put_string(context, rate, "\n");
+  cli_field_name(context, "files_per_sec", ":");
+  snprintf(rate, sizeof rate, "%.1f", rows / seconds);
+  cli_put_string(context, rate, "\n");
+  cli_field_name(context, "mb_per_sec", ":");
+  snprintf(rate, sizeof rate, "%.3f", bytes / seconds / (1024 * 1024));
+  cli_put_string(context, rate, "\n");
+  INFOF("Bulk import of %u files (%"PRIu64" bytes, %u failed) took %.3fs using %ld worker%s",
+	rows, bytes, failed, elapsed / 1e3, nworkers, nworkers == 1 ? "" : "s");
+  if (ret == 0 && failed)
+    ret = 1;
+close:
+  bulk_source_close(&src);
+  keyring_free(keyring);
+  keyring = NULL;
+unmap:
+#ifdef HAVE_SYS_MMAN_H
+  if (shared) {
+    munmap(results, results_size);
+    results = NULL;
+  }
+#endif
+  free(results);
+  return ret;
+}
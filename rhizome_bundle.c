@@ -19,6 +19,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <assert.h>
 #include <sys/uio.h>
 #include "serval.h"
@@ -29,27 +30,154 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "keyring.h"
 #include "dataformats.h"
 
-static const char *rhizome_manifest_get(const rhizome_manifest *m, const char *var)
+struct rhizome_manifest_arena_block {
+  struct rhizome_manifest_arena_block *next;
+  uintptr_t data[];
+};
+
+static uint64_t arena_mallocs = 0;
+
+static void rhizome_manifest_arena_reset(rhizome_manifest *m)
+{
+  while (m->arena_blocks) {
+    struct rhizome_manifest_arena_block *block = m->arena_blocks;
+    m->arena_blocks = block->next;
+    free(block);
+  }
+  m->arena_next = (char *) m->arena_data;
+  m->arena_left = sizeof m->arena_data;
+}
+
+/* Allocate storage that lasts until the manifest is cleared or freed.  Returns NULL if out of
+ * memory (already logged).
+ */
+static void *rhizome_manifest_arena_alloc(rhizome_manifest *m, size_t size)
+{
+  // keep every allocation pointer-aligned
+  size = (size + sizeof(uintptr_t) - 1) & ~(sizeof(uintptr_t) - 1);
+  if (size > m->arena_left) {
+    size_t block_size = size > sizeof m->arena_data ? size : sizeof m->arena_data;
+    struct rhizome_manifest_arena_block *block = emalloc(sizeof *block + block_size);
+    if (block == NULL)
+      return NULL;
+    ++arena_mallocs;
+    block->next = m->arena_blocks;
+    m->arena_blocks = block;
+    m->arena_next = (char *) block->data;
+    m->arena_left = block_size;
+  }
+  void *ret = m->arena_next;
+  m->arena_next += size;
+  m->arena_left -= size;
+  return ret;
+}
+
+static const char *rhizome_manifest_arena_strdup(rhizome_manifest *m, const char *str)
+{
+  size_t len = strlen(str) + 1;
+  char *ret = rhizome_manifest_arena_alloc(m, len);
+  if (ret)
+    memcpy(ret, str, len);
+  return ret;
+}
+
+/* Ensure there is room for one more field.  The old array is simply abandoned in the arena; as it
+ * doubles in size each time, that wastes less than the final array takes.
+ */
+static int rhizome_manifest_reserve_field(rhizome_manifest *m)
+{
+  if (m->var_count < m->var_alloc)
+    return 0;
+  if (m->var_alloc >= MAX_MANIFEST_VARS)
+    return WHY("no more manifest vars");
+  unsigned short alloc = m->var_alloc ? m->var_alloc * 2 : 16;
+  if (alloc > MAX_MANIFEST_VARS)
+    alloc = MAX_MANIFEST_VARS;
+  struct rhizome_manifest_field *fields = rhizome_manifest_arena_alloc(m, alloc * sizeof *fields);
+  if (fields == NULL)
+    return -1;
+  if (m->var_count)
+    memcpy(fields, m->fields, m->var_count * sizeof *fields);
+  m->fields = fields;
+  m->var_alloc = alloc;
+  return 0;
+}
+
+/* Move any field labels and values that still refer to the text in manifestdata[] into the arena,
+ * so that manifestdata[] can be overwritten.  Returns -1 if out of memory.
+ */
+static int rhizome_manifest_detach_fields(rhizome_manifest *m)
 {
+  const char *const start = (const char *) m->manifestdata;
+  const char *const limit = start + sizeof m->manifestdata;
+  size_t len = 0;
   unsigned i;
-  for (i = 0; i < m->var_count; ++i)
-    if (strcmp(m->vars[i], var) == 0)
-      return m->values[i];
-  return NULL;
+  for (i = 0; i < m->var_count; ++i) {
+    const struct rhizome_manifest_field *f = &m->fields[i];
+    if (f->label >= start && f->label < limit && (size_t)(f->label - start) + f->label_len > len)
+      len = (f->label - start) + f->label_len;
+    if (f->value >= start && f->value < limit && (size_t)(f->value - start) + f->value_len > len)
+      len = (f->value - start) + f->value_len;
+  }
+  if (len == 0)
+    return 0;
+  char *copy = rhizome_manifest_arena_alloc(m, len);
+  if (copy == NULL)
+    return -1;
+  memcpy(copy, start, len);
+  for (i = 0; i < m->var_count; ++i) {
+    struct rhizome_manifest_field *f = &m->fields[i];
+    if (f->label >= start && f->label < limit)
+      f->label = copy + (f->label - start);
+    if (f->value >= start && f->value < limit)
+      f->value = copy + (f->value - start);
+  }
+  return 0;
 }
 
-#if 0
-static uint64_t rhizome_manifest_get_ui64(rhizome_manifest *m, const char *var)
+/* Record a party that has signed the manifest.  Returns -1 if out of memory.
+ */
+int rhizome_manifest_add_signatory(rhizome_manifest *m, uint8_t type, const unsigned char *public_key)
+{
+  assert(m->sig_count < MAX_MANIFEST_VARS);
+  if (m->sig_count == m->sig_alloc) {
+    unsigned short alloc = m->sig_alloc ? m->sig_alloc * 2 : 2;
+    if (alloc > MAX_MANIFEST_VARS)
+      alloc = MAX_MANIFEST_VARS;
+    unsigned char **signatories = rhizome_manifest_arena_alloc(m, alloc * sizeof *signatories);
+    uint8_t *types = rhizome_manifest_arena_alloc(m, alloc * sizeof *types);
+    if (signatories == NULL || types == NULL)
+      return -1;
+    if (m->sig_count) {
+      memcpy(signatories, m->signatories, m->sig_count * sizeof *signatories);
+      memcpy(types, m->signatureTypes, m->sig_count * sizeof *types);
+    }
+    m->signatories = signatories;
+    m->signatureTypes = types;
+    m->sig_alloc = alloc;
+  }
+  unsigned char *key = rhizome_manifest_arena_alloc(m, crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES);
+  if (key == NULL)
+    return -1;
+  memcpy(key, public_key, crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES);
+  m->signatories[m->sig_count] = key;
+  m->signatureTypes[m->sig_count] = type;
+  m->sig_count++;
+  return 0;
+}
+
+/* Return the index of the field with the given label, or -1 if there is none.
+ */
+static int rhizome_manifest_find_field(const rhizome_manifest *m, const char *label, size_t label_len)
 {
   unsigned i;
   for (i = 0; i < m->var_count; ++i)
-    if (strcmp(m->vars[i], var) == 0) {
-      uint64_t val;
-      return str_to_uint64(m->values[i], 10, &val, NULL) ? val : -1;
-    }
+    if (m->fields[i].label_len == label_len && memcmp(m->fields[i].label, label, label_len) == 0)
+      return i;
   return -1;
 }
-#endif
+
+#define rhizome_manifest_has(m,var) (rhizome_manifest_find_field((m), (var), strlen(var)) != -1)
 
 /* Remove the field with the given label from the manifest
  *
@@ -59,52 +187,51 @@ static int _rhizome_manifest_del(struct __sourceloc __whence, rhizome_manifest *
 {
   if (config.debug.rhizome_manifest)
     DEBUGF("DEL manifest[%d].%s", m->manifest_record_number, var);
-  int ret = 0;
-  unsigned i;
-  for (i = 0; i < m->var_count; ++i)
-    if (strcmp(m->vars[i], var) == 0) {
-      free((char *) m->vars[i]);
-      free((char *) m->values[i]);
-      --m->var_count;
-      ret = 1;
-      break;
-    }
-  for (; i < m->var_count; ++i) {
-    m->vars[i] = m->vars[i + 1];
-    m->values[i] = m->values[i + 1];
-  }
-  return ret;
+  int i = rhizome_manifest_find_field(m, var, strlen(var));
+  if (i == -1)
+    return 0;
+  --m->var_count;
+  memmove(&m->fields[i], &m->fields[i + 1], (m->var_count - i) * sizeof m->fields[i]);
+  return 1;
 }
 
 #define rhizome_manifest_set(m,var,value) _rhizome_manifest_set(__WHENCE__, (m), (var), (value))
 #define rhizome_manifest_set_ui64(m,var,value) _rhizome_manifest_set_ui64(__WHENCE__, (m), (var), (value))
 #define rhizome_manifest_del(m,var) _rhizome_manifest_del(__WHENCE__, (m), (var))
 
+/* Set the value of a field, appending the field if it is not already present.  If the field already
+ * has the same value (eg, it was just parsed from manifestdata[]), then it is left as it is, without
+ * copying.  Returns a pointer to the stored value (not NUL terminated), or NULL if out of memory.
+ */
 static const char *_rhizome_manifest_set(struct __sourceloc __whence, rhizome_manifest *m, const char *var, const char *value)
 {
   if (config.debug.rhizome_manifest)
     DEBUGF("SET manifest[%d].%s = %s", m->manifest_record_number, var, alloca_str_toprint(value));
-  unsigned i;
-  for(i=0;i<m->var_count;i++)
-    if (strcmp(m->vars[i],var) == 0) {
-      const char *ret = str_edup(value);
-      if (ret == NULL)
-	return NULL;
-      free((char *)m->values[i]);
-      m->values[i] = ret;
-      return ret;
-    }
-  if (m->var_count >= NELS(m->vars))
-    return WHYNULL("no more manifest vars");
-  if ((m->vars[m->var_count] = str_edup(var)) == NULL)
+  size_t value_len = strlen(value);
+  int i = rhizome_manifest_find_field(m, var, strlen(var));
+  if (i != -1) {
+    struct rhizome_manifest_field *f = &m->fields[i];
+    if (f->value_len == value_len && memcmp(f->value, value, value_len) == 0)
+      return f->value;
+    // the old value stays in the arena until the manifest is cleared
+    const char *ret = rhizome_manifest_arena_strdup(m, value);
+    if (ret == NULL)
+      return NULL;
+    f->value = ret;
+    f->value_len = value_len;
+    return ret;
+  }
+  if (rhizome_manifest_reserve_field(m) == -1)
     return NULL;
-  const char *ret = m->values[m->var_count] = str_edup(value);
-  if (ret == NULL) {
-    free((char *)m->vars[i]);
-    m->vars[i] = NULL;
+  const char *label = rhizome_manifest_arena_strdup(m, var);
+  const char *ret = rhizome_manifest_arena_strdup(m, value);
+  if (label == NULL || ret == NULL)
     return NULL;
-  }
-  m->var_count++;
+  struct rhizome_manifest_field *f = &m->fields[m->var_count++];
+  f->label = label;
+  f->label_len = strlen(var);
+  f->value = ret;
+  f->value_len = value_len;
   return ret;
 }
 
@@ -115,12 +242,32 @@ static const char *_rhizome_manifest_set_ui64(struct __sourceloc __whence, rhizo
   return rhizome_manifest_set(m, var, str);
 }
 
+/* Set a field to the upper case hex representation of a binary value.  Compares a freshly parsed
+ * value with the binary directly, to avoid formatting it only to find that it is unchanged.
+ */
+static const char *_rhizome_manifest_set_hex(struct __sourceloc __whence, rhizome_manifest *m, const char *var, const unsigned char *bin, size_t len)
+{
+  static const char digits[] = "0123456789ABCDEF";
+  int i = rhizome_manifest_find_field(m, var, strlen(var));
+  if (i != -1 && m->fields[i].value_len == len * 2) {
+    const char *hex = m->fields[i].value;
+    size_t j;
+    for (j = 0; j != len && hex[j * 2] == digits[bin[j] >> 4] && hex[j * 2 + 1] == digits[bin[j] & 0xf]; ++j)
+      ;
+    if (j == len)
+      return hex;
+  }
+  return _rhizome_manifest_set(__whence, m, var, alloca_tohex(bin, len));
+}
+
+#define rhizome_manifest_set_hex(m,var,bin,len) _rhizome_manifest_set_hex(__WHENCE__, (m), (var), (bin), (len))
+
 void _rhizome_manifest_set_id(struct __sourceloc __whence, rhizome_manifest *m, const rhizome_bid_t *bidp)
 {
   if (bidp) {
     if (m->has_id && (bidp == &m->cryptoSignPublic || cmp_rhizome_bid_t(&m->cryptoSignPublic, bidp) == 0))
       return; // unchanged
-    const char *v = rhizome_manifest_set(m, "id", alloca_tohex_rhizome_bid_t(*bidp));
+    const char *v = rhizome_manifest_set_hex(m, "id", bidp->binary, sizeof bidp->binary);
     assert(v); // TODO: remove known manifest fields from vars[]
     m->cryptoSignPublic = *bidp;
     m->has_id = 1;
@@ -172,8 +319,11 @@ void _rhizome_manifest_set_filesize(struct __sourceloc __whence, rhizome_manifes
  */
 void _rhizome_manifest_set_filehash(struct __sourceloc __whence, rhizome_manifest *m, const rhizome_filehash_t *hash)
 {
+  // block hashes of a previous payload no longer apply
+  if (m->has_blockhash && m->has_filehash && !(hash && cmp_rhizome_filehash_t(hash, &m->filehash) == 0))
+    rhizome_manifest_set_blockhash(m, NULL);
   if (hash) {
-    const char *v = rhizome_manifest_set(m, "filehash", alloca_tohex_rhizome_filehash_t(*hash));
+    const char *v = rhizome_manifest_set_hex(m, "filehash", hash->binary, sizeof hash->binary);
     assert(v); // TODO: remove known manifest fields from vars[]
     m->filehash = *hash;
     m->has_filehash = 1;
@@ -202,7 +352,7 @@ void _rhizome_manifest_set_tail(struct __sourceloc __whence, rhizome_manifest *m
 void _rhizome_manifest_set_bundle_key(struct __sourceloc __whence, rhizome_manifest *m, const rhizome_bk_t *bkp)
 {
   if (bkp) {
-    const char *v = rhizome_manifest_set(m, "BK", alloca_tohex_rhizome_bk_t(*bkp));
+    const char *v = rhizome_manifest_set_hex(m, "BK", bkp->binary, sizeof bkp->binary);
     assert(v); // TODO: remove known manifest fields from vars[]
     m->bundle_key = *bkp;
     m->has_bundle_key = 1;
@@ -219,7 +369,7 @@ void _rhizome_manifest_del_bundle_key(struct __sourceloc __whence, rhizome_manif
     m->bundle_key = RHIZOME_BK_NONE; // not strictly necessary, but aids debugging
     m->finalised = 0;
   } else
-    assert(rhizome_manifest_get(m, "BK") == NULL);
+    assert(!rhizome_manifest_has(m, "BK"));
   // Once there is no BK field, any authenticated authorship is no longer.
   if (m->authorship == AUTHOR_AUTHENTIC)
     m->authorship = AUTHOR_LOCAL;
@@ -231,7 +381,9 @@ void _rhizome_manifest_set_service(struct __sourceloc __whence, rhizome_manifest
     assert(rhizome_str_is_manifest_service(service));
     const char *v = rhizome_manifest_set(m, "service", service);
     assert(v); // TODO: remove known manifest fields from vars[]
-    m->service = v;
+    if (!(m->service && strcmp(m->service, service) == 0))
+      m->service = rhizome_manifest_arena_strdup(m, service);
+    assert(m->service);
     m->finalised = 0;
   } else
     _rhizome_manifest_del_service(__whence, m);
@@ -244,7 +396,7 @@ void _rhizome_manifest_del_service(struct __sourceloc __whence, rhizome_manifest
     m->finalised = 0;
     rhizome_manifest_del(m, "service");
   } else
-    assert(rhizome_manifest_get(m, "service") == NULL);
+    assert(!rhizome_manifest_has(m, "service"));
 }
 
 void _rhizome_manifest_set_name(struct __sourceloc __whence, rhizome_manifest *m, const char *name)
@@ -254,7 +406,9 @@ void _rhizome_manifest_set_name(struct __sourceloc __whence, rhizome_manifest *m
     assert(rhizome_str_is_manifest_name(name));
     const char *v = rhizome_manifest_set(m, "name", name);
     assert(v); // TODO: remove known manifest fields from vars[]
-    m->name = v;
+    if (!(m->name && strcmp(m->name, name) == 0))
+      m->name = rhizome_manifest_arena_strdup(m, name);
+    assert(m->name);
   } else {
     rhizome_manifest_del(m, "name");
     m->name = NULL;
@@ -268,7 +422,7 @@ void _rhizome_manifest_del_name(struct __sourceloc __whence, rhizome_manifest *m
     m->finalised = 0;
     rhizome_manifest_del(m, "name");
   } else
-    assert(rhizome_manifest_get(m, "name") == NULL);
+    assert(!rhizome_manifest_has(m, "name"));
 }
 
 void _rhizome_manifest_set_date(struct __sourceloc __whence, rhizome_manifest *m, time_ms_t date)
@@ -287,13 +441,13 @@ void _rhizome_manifest_del_date(struct __sourceloc __whence, rhizome_manifest *m
     m->finalised = 0;
     rhizome_manifest_del(m, "date");
   } else
-    assert(rhizome_manifest_get(m, "date") == NULL);
+    assert(!rhizome_manifest_has(m, "date"));
 }
 
 void _rhizome_manifest_set_sender(struct __sourceloc __whence, rhizome_manifest *m, const sid_t *sidp)
 {
   if (sidp) {
-    const char *v = rhizome_manifest_set(m, "sender", alloca_tohex_sid_t(*sidp));
+    const char *v = rhizome_manifest_set_hex(m, "sender", sidp->binary, sizeof sidp->binary);
     assert(v); // TODO: remove known manifest fields from vars[]
     m->sender = *sidp;
     m->has_sender = 1;
@@ -310,13 +464,13 @@ void _rhizome_manifest_del_sender(struct __sourceloc __whence, rhizome_manifest
     m->has_sender = 0;
     m->finalised = 0;
   } else
-    assert(rhizome_manifest_get(m, "sender") == NULL);
+    assert(!rhizome_manifest_has(m, "sender"));
 }
 
 void _rhizome_manifest_set_recipient(struct __sourceloc __whence, rhizome_manifest *m, const sid_t *sidp)
 {
   if (sidp) {
-    const char *v = rhizome_manifest_set(m, "recipient", alloca_tohex_sid_t(*sidp));
+    const char *v = rhizome_manifest_set_hex(m, "recipient", sidp->binary, sizeof sidp->binary);
     assert(v); // TODO: remove known manifest fields from vars[]
     m->recipient = *sidp;
     m->has_recipient = 1;
@@ -333,7 +487,7 @@ void _rhizome_manifest_del_recipient(struct __sourceloc __whence, rhizome_manife
     m->has_recipient = 0;
     m->finalised = 0;
   } else
-    assert(rhizome_manifest_get(m, "recipient") == NULL);
+    assert(!rhizome_manifest_has(m, "recipient"));
 }
 
 void _rhizome_manifest_set_crypt(struct __sourceloc __whence, rhizome_manifest *m, enum rhizome_manifest_crypt flag)
@@ -358,6 +512,21 @@ void _rhizome_manifest_set_crypt(struct __sourceloc __whence, rhizome_manifest *
   m->finalised = 0;
 }
 
+void _rhizome_manifest_set_blockhash(struct __sourceloc __whence, rhizome_manifest *m, const unsigned char *root)
+{
+  if (root) {
+    const char *v = rhizome_manifest_set_hex(m, "blockhash", root, RHIZOME_BLOCKHASH_BYTES);
+    assert(v); // TODO: remove known manifest fields from vars[]
+    memcpy(m->blockhash, root, sizeof m->blockhash);
+    m->has_blockhash = 1;
+  } else {
+    rhizome_manifest_del(m, "blockhash");
+    bzero(m->blockhash, sizeof m->blockhash);
+    m->has_blockhash = 0;
+  }
+  m->finalised = 0;
+}
+
 void _rhizome_manifest_set_rowid(struct __sourceloc __whence, rhizome_manifest *m, uint64_t rowid)
 {
   if (config.debug.rhizome_manifest)
@@ -447,20 +616,20 @@ int rhizome_manifest_verify(rhizome_manifest *m)
 
 static void rhizome_manifest_clear(rhizome_manifest *m)
 {
-  while (m->var_count) {
-    --m->var_count;
-    free((char *) m->vars[m->var_count]);
-    free((char *) m->values[m->var_count]);
-    m->vars[m->var_count] = m->values[m->var_count] = NULL;
-  }
-  while (m->sig_count) {
-    --m->sig_count;
-    free(m->signatories[m->sig_count]);
-    m->signatories[m->sig_count] = NULL;
-  }
+  m->var_count = m->var_alloc = 0;
+  m->fields = NULL;
+  m->sig_count = m->sig_alloc = 0;
+  m->signatories = NULL;
+  m->signatureTypes = NULL;
+  // these point into the arena
+  m->service = NULL;
+  m->name = NULL;
+  rhizome_manifest_arena_reset(m);
   m->malformed = NULL;
+  m->has_selfsig_key = 0;
   m->has_id = 0;
   m->has_filehash = 0;
+  m->has_blockhash = 0;
   m->is_journal = 0;
   m->filesize = RHIZOME_SIZE_UNSET;
   m->tail = RHIZOME_SIZE_UNSET;
@@ -555,14 +724,17 @@ int rhizome_manifest_inspect(const char *buf, size_t len, struct rhizome_manifes
  *       CR is ASCII 13
  *       LF is ASCII 10
  *
- * Unpacks all parsed field labels and string values into the m->vars[] and m->values[] arrays, as
- * pointers to malloc(3)ed NUL terminated strings, in the order they appear, and sets m->var_count
- * to the number of fields unpacked.  Sets m->manifest_body_bytes to the number of bytes in the text
- * portion up to and including the optional NUL that starts the signature block (if present).
+ * Parses in a single pass without copying or modifying the text: records all parsed field labels
+ * and values in the m->fields[] array, in the order they appear, as references into manifestdata[]
+ * (known fields whose values are not in canonical form get a canonical copy in the arena), and sets
+ * m->var_count to the number of fields unpacked.  Sets m->manifest_body_bytes to the number of
+ * bytes in the text portion up to and including the optional NUL that starts the signature block
+ * (if present).  Since manifestdata[] is unchanged, signature extraction and the manifest hash see
+ * exactly the bytes that were received.
  *
  * Returns 1 if the manifest is not well formed (syntax violation), any essential field is
- * malformed, or if there are any duplicate fields.  In this case the m->vars[] and m->values[]
- * arrays are not set and the manifest is returned to the state it was in prior to calling.
+ * malformed, or if there are any duplicate fields.  In this case the m->fields[] array is not set
+ * and the manifest is returned to the state it was in prior to calling.
  *
  * Returns 0 if the manifest is well formed, if there are no duplicate fields, and if all essential
  * fields are valid.  Counts invalid non-essential fields and unrecognised fields in m->malformed.
@@ -571,6 +743,9 @@ int rhizome_manifest_inspect(const char *buf, size_t len, struct rhizome_manifes
  *
  * @author Andrew Bettison <andrew@servalproject.com>
  */
+static enum rhizome_manifest_parse_status
+_rhizome_manifest_parse_field(rhizome_manifest *m, const char *field_label, size_t field_label_len, const char *field_value, size_t field_value_len, int in_place);
+
 int rhizome_manifest_parse(rhizome_manifest *m)
 {
   IN();
@@ -588,6 +763,7 @@ int rhizome_manifest_parse(rhizome_manifest *m)
   assert(!m->has_date);
   assert(!m->has_sender);
   assert(!m->has_recipient);
+  assert(!m->has_blockhash);
   assert(m->payloadEncryption == PAYLOAD_CRYPT_UNKNOWN);
   unsigned invalid = 0;
   unsigned has_invalid_core = 0;
@@ -616,7 +792,7 @@ int rhizome_manifest_parse(rhizome_manifest *m)
       break;
     }
     const char *const eol = (p > pvalue && p[-1] == '\r') ? p - 1 : p;
-    enum rhizome_manifest_parse_status status = rhizome_manifest_parse_field(m, plabel, pvalue - plabel - 1, pvalue, eol - pvalue);
+    enum rhizome_manifest_parse_status status = _rhizome_manifest_parse_field(m, plabel, pvalue - plabel - 1, pvalue, eol - pvalue, 1);
     int status_ok = 0;
     switch (status) {
       case RHIZOME_MANIFEST_ERROR:
@@ -867,6 +1043,23 @@ static int _rhizome_manifest_parse_crypt(rhizome_manifest *m, const char *text)
   return 1;
 }
 
+static int _rhizome_manifest_test_blockhash(rhizome_manifest *m)
+{
+  return m->has_blockhash;
+}
+static void _rhizome_manifest_unset_blockhash(rhizome_manifest *m)
+{
+  rhizome_manifest_set_blockhash(m, NULL);
+}
+static int _rhizome_manifest_parse_blockhash(rhizome_manifest *m, const char *text)
+{
+  unsigned char root[RHIZOME_BLOCKHASH_BYTES];
+  if (fromhexstr(root, text, sizeof root) == -1)
+    return 0;
+  rhizome_manifest_set_blockhash(m, root);
+  return 1;
+}
+
 static struct rhizome_manifest_field_descriptor {
     const char *label;
     int core;
@@ -887,8 +1080,63 @@ static struct rhizome_manifest_field_descriptor {
         { "recipient",	0, _rhizome_manifest_test_recipient,	_rhizome_manifest_unset_recipient,	_rhizome_manifest_parse_recipient },
         { "name",	0, _rhizome_manifest_test_name,		_rhizome_manifest_unset_name,		_rhizome_manifest_parse_name },
         { "crypt",	0, _rhizome_manifest_test_crypt,	_rhizome_manifest_unset_crypt,		_rhizome_manifest_parse_crypt },
+        { "blockhash",	0, _rhizome_manifest_test_blockhash,	_rhizome_manifest_unset_blockhash,	_rhizome_manifest_parse_blockhash },
     };
 
+/* Find the descriptor of a known field, ignoring case, by switching on the label's length and first
+ * character, so that at most one string comparison is needed.  Returns NULL if the label is not a
+ * known field.
+ */
+static struct rhizome_manifest_field_descriptor *rhizome_manifest_field_lookup(const char *label, size_t label_len)
+{
+  unsigned i;
+  switch (label_len) {
+    case 2:
+      switch (label[0]) {
+	case 'i': case 'I': i = 0; break; // id
+	case 'b': case 'B': i = 5; break; // BK
+	default: return NULL;
+      }
+      break;
+    case 4:
+      switch (label[0]) {
+	case 't': case 'T': i = 4; break; // tail
+	case 'd': case 'D': i = 7; break; // date
+	case 'n': case 'N': i = 10; break; // name
+	default: return NULL;
+      }
+      break;
+    case 5: i = 11; break; // crypt
+    case 6: i = 8; break; // sender
+    case 7:
+      switch (label[0]) {
+	case 'v': case 'V': i = 1; break; // version
+	case 's': case 'S': i = 6; break; // service
+	default: return NULL;
+      }
+      break;
+    case 8:
+      // filehash and filesize only differ in their fifth character
+      if (label[4] == 'h' || label[4] == 'H')
+	i = 2;
+      else
+	i = 3;
+      break;
+    case 9:
+      switch (label[0]) {
+	case 'r': case 'R': i = 9; break; // recipient
+	case 'b': case 'B': i = 12; break; // blockhash
+	default: return NULL;
+      }
+      break;
+    default:
+      return NULL;
+  }
+  assert(i < NELS(rhizome_manifest_fields));
+  assert(strlen(rhizome_manifest_fields[i].label) == label_len);
+  return strncasecmp(label, rhizome_manifest_fields[i].label, label_len) == 0 ? &rhizome_manifest_fields[i] : NULL;
+}
+
 int rhizome_manifest_field_label_is_valid(const char *field_label, size_t field_label_len)
 {
   if (field_label_len == 0 || field_label_len > MAX_MANIFEST_FIELD_LABEL_LEN)
@@ -933,9 +1181,9 @@ int rhizome_manifest_field_value_is_valid(const char *field_value, size_t field_
  * RHIZOME_MANIFEST_MALFORMED and leaves the manifest unchanged.  Unsupported fields are not parsed;
  * their value string is simply stored, so they cannot evoke a MALFORMED result.
  *
- * Otherwise, sets the relevant element(s) of the manifest structure and appends the field_label and
- * field_value strings into the m->vars[] and m->values[] arrays, as pointers to malloc(3)ed NUL
- * terminated strings, and increments m->var_count.  Returns RHIZOME_MANIFEST_OK.
+ * Otherwise, sets the relevant element(s) of the manifest structure and appends copies of the
+ * field_label and field_value strings in the manifest's arena to the m->fields[] array, and
+ * increments m->var_count.  Returns RHIZOME_MANIFEST_OK.
  *
  * Returns -1 (RHIZOME_MANIFEST_ERROR) if there is an unrecoverable error (eg, malloc(3) returns
  * NULL, out of memory).
@@ -944,6 +1192,15 @@ int rhizome_manifest_field_value_is_valid(const char *field_value, size_t field_
  */
 enum rhizome_manifest_parse_status
 rhizome_manifest_parse_field(rhizome_manifest *m, const char *field_label, size_t field_label_len, const char *field_value, size_t field_value_len)
+{
+  return _rhizome_manifest_parse_field(m, field_label, field_label_len, field_value, field_value_len, 0);
+}
+
+/* If 'in_place' is set, then the field_label and field_value must be in m->manifestdata[], and the
+ * new field refers to them instead of copying them.
+ */
+static enum rhizome_manifest_parse_status
+_rhizome_manifest_parse_field(rhizome_manifest *m, const char *field_label, size_t field_label_len, const char *field_value, size_t field_value_len, int in_place)
 {
   // Syntax check on field label.
   if (!rhizome_manifest_field_label_is_valid(field_label, field_label_len)) {
@@ -951,40 +1208,55 @@ rhizome_manifest_parse_field(rhizome_manifest *m, const char *field_label, size_
       DEBUGF("Invalid manifest field name: %s", alloca_toprint(100, field_label, field_label_len));
     return RHIZOME_MANIFEST_SYNTAX_ERROR;
   }
-  const char *label = alloca_strndup(field_label, field_label_len);
   // Sanity and syntax check on field value.
   if (!rhizome_manifest_field_value_is_valid(field_value, field_value_len)) {
     if (config.debug.rhizome_manifest)
-      DEBUGF("Invalid manifest field value: %s=%s", label, alloca_toprint(100, field_value, field_value_len));
+      DEBUGF("Invalid manifest field value: %s=%s", alloca_toprint(100, field_label, field_label_len), alloca_toprint(100, field_value, field_value_len));
     return RHIZOME_MANIFEST_SYNTAX_ERROR;
   }
-  const char *value = alloca_strndup(field_value, field_value_len);
-  struct rhizome_manifest_field_descriptor *desc = NULL;
-  unsigned i;
-  for (i = 0; desc == NULL && i < NELS(rhizome_manifest_fields); ++i)
-    if (strcasecmp(label, rhizome_manifest_fields[i].label) == 0)
-      desc = &rhizome_manifest_fields[i];
+  struct rhizome_manifest_field_descriptor *desc = rhizome_manifest_field_lookup(field_label, field_label_len);
   enum rhizome_manifest_parse_status status = RHIZOME_MANIFEST_OK;
-  assert(m->var_count <= NELS(m->vars));
-  if (desc ? desc->test(m) : rhizome_manifest_get(m, label) != NULL) {
+  assert(m->var_count <= MAX_MANIFEST_VARS);
+  if (desc ? desc->test(m) : rhizome_manifest_find_field(m, field_label, field_label_len) != -1) {
     if (config.debug.rhizome_manifest)
-      DEBUGF("Duplicate field at %s=%s", label, alloca_toprint(100, field_value, field_value_len));
-    status = RHIZOME_MANIFEST_DUPLICATE_FIELD;
-  } else if (m->var_count == NELS(m->vars)) {
+      DEBUGF("Duplicate field at %s=%s", alloca_toprint(100, field_label, field_label_len), alloca_toprint(100, field_value, field_value_len));
+    return RHIZOME_MANIFEST_DUPLICATE_FIELD;
+  }
+  if (m->var_count == MAX_MANIFEST_VARS) {
     if (config.debug.rhizome_manifest)
-      DEBUGF("Manifest field limit reached at %s=%s", label, alloca_toprint(100, field_value, field_value_len));
-    status = RHIZOME_MANIFEST_OVERFLOW;
-  } else if (desc) {
+      DEBUGF("Manifest field limit reached at %s=%s", alloca_toprint(100, field_label, field_label_len), alloca_toprint(100, field_value, field_value_len));
+    return RHIZOME_MANIFEST_OVERFLOW;
+  }
+  if (in_place) {
+    // Append the field referring to its text.  If it is a known field, its setter will find it
+    // already present, and will only copy the value into the arena if its canonical form differs.
+    if (rhizome_manifest_reserve_field(m) == -1)
+      return RHIZOME_MANIFEST_ERROR;
+    struct rhizome_manifest_field *f = &m->fields[m->var_count++];
+    f->label = desc ? desc->label : field_label;
+    f->label_len = field_label_len;
+    f->value = field_value;
+    f->value_len = field_value_len;
+    if (!desc)
+      return RHIZOME_MANIFEST_OK;
+  }
+  // Field parsers need a NUL terminated value, so give them a temporary copy on the stack.
+  const char *value = alloca_strndup(field_value, field_value_len);
+  if (desc) {
     if (!desc->parse(m, value)) {
       if (config.debug.rhizome_manifest)
-	DEBUGF("Manifest field parse failed at %s=%s", label, alloca_toprint(100, field_value, field_value_len));
+	DEBUGF("Manifest field parse failed at %s=%s", desc->label, alloca_toprint(100, field_value, field_value_len));
       status = desc->core ? RHIZOME_MANIFEST_INVALID : RHIZOME_MANIFEST_MALFORMED;
+      if (in_place) {
+	assert(m->var_count > 0 && m->fields[m->var_count - 1].value == field_value);
+	--m->var_count;
+      }
     }
-  } else if ((rhizome_manifest_set(m, label, value)) == NULL)
+  } else if ((rhizome_manifest_set(m, alloca_strndup(field_label, field_label_len), value)) == NULL)
     status = RHIZOME_MANIFEST_ERROR;
   if (status != RHIZOME_MANIFEST_OK) {
     if (config.debug.rhizome_manifest)
-      DEBUGF("SKIP manifest[%d].%s = %s (status=%d)", m->manifest_record_number, label, alloca_str_toprint(value), status);
+      DEBUGF("SKIP manifest[%d].%s = %s (status=%d)", m->manifest_record_number, alloca_toprint(100, field_label, field_label_len), alloca_str_toprint(value), status);
   }
   return status;
 }
@@ -1000,14 +1272,9 @@ int rhizome_manifest_remove_field(rhizome_manifest *m, const char *field_label,
       DEBUGF("Invalid manifest field name: %s", alloca_toprint(100, field_label, field_label_len));
     return 0;
   }
-  const char *label = alloca_strndup(field_label, field_label_len);
-  struct rhizome_manifest_field_descriptor *desc = NULL;
-  unsigned i;
-  for (i = 0; desc == NULL && i < NELS(rhizome_manifest_fields); ++i)
-    if (strcasecmp(label, rhizome_manifest_fields[i].label) == 0)
-      desc = &rhizome_manifest_fields[i];
+  struct rhizome_manifest_field_descriptor *desc = rhizome_manifest_field_lookup(field_label, field_label_len);
   if (!desc)
-    return rhizome_manifest_del(m, label);
+    return rhizome_manifest_del(m, alloca_strndup(field_label, field_label_len));
   if (!desc->test(m))
     return 0;
   desc->unset(m);
@@ -1050,6 +1317,8 @@ const char *rhizome_manifest_validate_reason(rhizome_manifest *m)
     reason = "Spurious 'filehash' field";
   else if (m->filesize != 0 && !m->has_filehash)
     reason = "Missing 'filehash' field";
+  else if (m->filesize == 0 && m->has_blockhash)
+    reason = "Spurious 'blockhash' field";
   if (reason && config.debug.rhizome_manifest)
     DEBUG(reason);
   if (m->service == NULL)
@@ -1127,65 +1396,105 @@ int rhizome_hash_file(rhizome_manifest *m, const char *path, rhizome_filehash_t
   return 0;
 }
 
-rhizome_manifest manifests[MAX_RHIZOME_MANIFESTS];
-char manifest_free[MAX_RHIZOME_MANIFESTS];
-int manifest_first_free=-1;
-struct __sourceloc manifest_alloc_whence[MAX_RHIZOME_MANIFESTS];
-struct __sourceloc manifest_free_whence[MAX_RHIZOME_MANIFESTS];
+/* Manifest records are allocated from the heap in blocks of RHIZOME_MANIFEST_POOL_BLOCK as they are
+ * needed, up to MAX_RHIZOME_MANIFESTS, and are never returned to the heap.  A freed record goes on a
+ * free list for re-use, after releasing any arena blocks it malloc(3)ed.
+ */
+#define RHIZOME_MANIFEST_POOL_BLOCK 16
+
+struct manifest_slot {
+  rhizome_manifest manifest; // must be first
+  struct manifest_slot *next_free;
+  bool_t free;
+  struct __sourceloc alloc_whence;
+  struct __sourceloc free_whence;
+};
+
+static struct manifest_slot *manifest_pool[MAX_RHIZOME_MANIFESTS / RHIZOME_MANIFEST_POOL_BLOCK];
+static unsigned manifest_slot_count = 0;
+static unsigned manifest_in_use = 0;
+static struct manifest_slot *manifest_free_list = NULL;
+
+static struct manifest_slot *manifest_slot(int mid)
+{
+  if (mid < 0 || (unsigned)mid >= manifest_slot_count)
+    return NULL;
+  return &manifest_pool[mid / RHIZOME_MANIFEST_POOL_BLOCK][mid % RHIZOME_MANIFEST_POOL_BLOCK];
+}
 
 static void _log_manifest_trace(struct __sourceloc __whence, const char *operation)
 {
-  int count_free = 0;
-  unsigned i;
-  for (i = 0; i != MAX_RHIZOME_MANIFESTS; ++i)
-    if (manifest_free[i])
-      ++count_free;
-  DEBUGF("%s(): count_free = %d", operation, count_free);
+  DEBUGF("%s(): count_free = %u of %u", operation, manifest_slot_count - manifest_in_use, manifest_slot_count);
 }
 
-rhizome_manifest *_rhizome_new_manifest(struct __sourceloc __whence)
+void rhizome_manifest_pool_stats(struct rhizome_manifest_pool_stats *stats)
 {
-  if (manifest_first_free<0) {
-    /* Setup structures */
-    unsigned i;
-    for(i=0;i<MAX_RHIZOME_MANIFESTS;i++) {
-      manifest_alloc_whence[i]=__NOWHERE__;
-      manifest_free_whence[i]=__NOWHERE__;
-      manifest_free[i]=1;
-    }
-    manifest_first_free=0;
+  stats->slots = manifest_slot_count;
+  stats->in_use = manifest_in_use;
+  stats->arena_mallocs = arena_mallocs;
+}
+
+/* Add a block of free records to the pool.  Returns -1 if the pool is at its limit or out of
+ * memory.
+ */
+static int manifest_pool_grow()
+{
+  unsigned b = manifest_slot_count / RHIZOME_MANIFEST_POOL_BLOCK;
+  if (b >= NELS(manifest_pool))
+    return -1;
+  struct manifest_slot *block = emalloc(RHIZOME_MANIFEST_POOL_BLOCK * sizeof *block);
+  if (block == NULL)
+    return -1;
+  manifest_pool[b] = block;
+  // push in reverse, so that the lowest numbered record is used first
+  unsigned i;
+  for (i = RHIZOME_MANIFEST_POOL_BLOCK; i != 0; --i) {
+    struct manifest_slot *slot = &block[i - 1];
+    slot->manifest.manifest_record_number = manifest_slot_count + i - 1;
+    slot->free = 1;
+    slot->alloc_whence = __NOWHERE__;
+    slot->free_whence = __NOWHERE__;
+    slot->next_free = manifest_free_list;
+    manifest_free_list = slot;
   }
+  manifest_slot_count += RHIZOME_MANIFEST_POOL_BLOCK;
+  return 0;
+}
 
+rhizome_manifest *_rhizome_new_manifest(struct __sourceloc __whence)
+{
   /* No free manifests */
-  if (manifest_first_free>=MAX_RHIZOME_MANIFESTS)
+  if (manifest_free_list == NULL && manifest_pool_grow() == -1)
     {
       unsigned i;
       WHYF("%s(): no free manifest records, this probably indicates a memory leak", __FUNCTION__);
       WHYF("   Slot# | Last allocated by");
-      for(i=0;i<MAX_RHIZOME_MANIFESTS;i++) {
+      for(i=0;i<manifest_slot_count;i++) {
+	struct manifest_slot *slot = manifest_slot(i);
 	WHYF("   %-5d | %s:%d in %s()",
 		i,
-		manifest_alloc_whence[i].file,
-		manifest_alloc_whence[i].line,
-		manifest_alloc_whence[i].function
+		slot->alloc_whence.file,
+		slot->alloc_whence.line,
+		slot->alloc_whence.function
 	    );
       }
       return NULL;
     }
 
-  rhizome_manifest *m=&manifests[manifest_first_free];
-  bzero(m,sizeof(rhizome_manifest));
-  m->manifest_record_number=manifest_first_free;
+  struct manifest_slot *slot = manifest_free_list;
+  manifest_free_list = slot->next_free;
+  int mid = slot->manifest.manifest_record_number;
+  rhizome_manifest *m = &slot->manifest;
+  bzero(m, offsetof(rhizome_manifest, arena_data));
+  m->manifest_record_number=mid;
 
   /* Indicate where manifest was allocated, and that it is no longer
      free. */
-  manifest_alloc_whence[manifest_first_free]=__whence;
-  manifest_free[manifest_first_free]=0;
-  manifest_free_whence[manifest_first_free]=__NOWHERE__;
-
-  /* Work out where next free manifest record lives */
-  for (; manifest_first_free < MAX_RHIZOME_MANIFESTS && !manifest_free[manifest_first_free]; ++manifest_first_free)
-    ;
+  slot->alloc_whence=__whence;
+  slot->free=0;
+  slot->free_whence=__NOWHERE__;
+  slot->next_free = NULL;
+  ++manifest_in_use;
 
   if (config.debug.manifests) _log_manifest_trace(__whence, __FUNCTION__);
 
@@ -1199,18 +1508,19 @@ void _rhizome_manifest_free(struct __sourceloc __whence, rhizome_manifest *m)
 {
   if (!m) return;
   int mid=m->manifest_record_number;
+  struct manifest_slot *slot = manifest_slot(mid);
 
-  if (m!=&manifests[mid])
+  if (slot == NULL || m != &slot->manifest)
     FATALF("%s(): asked to free manifest %p, which claims to be manifest slot #%d (%p), but isn't",
-	  __FUNCTION__, m, mid, &manifests[mid]
+	  __FUNCTION__, m, mid, slot ? &slot->manifest : NULL
       );
 
-  if (manifest_free[mid])
+  if (slot->free)
     FATALF("%s(): asked to free manifest slot #%d (%p), which was already freed at %s:%d:%s()",
 	  __FUNCTION__, mid, m,
-	  manifest_free_whence[mid].file,
-	  manifest_free_whence[mid].line,
-	  manifest_free_whence[mid].function
+	  slot->free_whence.file,
+	  slot->free_whence.line,
+	  slot->free_whence.function
 	);
 
   /* Free variable and signature blocks. */
@@ -1222,9 +1532,11 @@ void _rhizome_manifest_free(struct __sourceloc __whence, rhizome_manifest *m)
     m->dataFileName = NULL;
   }
 
-  manifest_free[mid]=1;
-  manifest_free_whence[mid]=__whence;
-  if (mid<manifest_first_free) manifest_first_free=mid;
+  slot->free=1;
+  slot->free_whence=__whence;
+  slot->next_free = manifest_free_list;
+  manifest_free_list = slot;
+  --manifest_in_use;
 
   if (config.debug.manifests) _log_manifest_trace(__whence, __FUNCTION__);
 
@@ -1235,13 +1547,15 @@ void _rhizome_manifest_free(struct __sourceloc __whence, rhizome_manifest *m)
  */
 static int rhizome_manifest_pack_variables(rhizome_manifest *m)
 {
-  assert(m->var_count <= NELS(m->vars));
+  assert(m->var_count <= MAX_MANIFEST_VARS);
+  if (rhizome_manifest_detach_fields(m) == -1)
+    return -1;
   strbuf sb = strbuf_local((char*)m->manifestdata, sizeof m->manifestdata);
   unsigned i;
   for (i = 0; i < m->var_count; ++i) {
-    strbuf_puts(sb, m->vars[i]);
+    strbuf_ncat(sb, m->fields[i].label, m->fields[i].label_len);
     strbuf_putc(sb, '=');
-    strbuf_puts(sb, m->values[i]);
+    strbuf_ncat(sb, m->fields[i].value, m->fields[i].value_len);
     strbuf_putc(sb, '\n');
   }
   if (strbuf_overrun(sb))
@@ -1251,6 +1565,7 @@ static int rhizome_manifest_pack_variables(rhizome_manifest *m)
     DEBUGF("Repacked variables into manifest: %zu bytes", m->manifest_body_bytes);
   m->manifest_all_bytes = m->manifest_body_bytes;
   m->selfSigned = 0;
+  m->has_selfsig_key = 0;
   return 0;
 }
 
@@ -1280,6 +1595,47 @@ int rhizome_manifest_selfsign(rhizome_manifest *m)
   bcopy(sig.signature, m->manifestdata + m->manifest_body_bytes, sig.signatureLength);
   m->manifest_all_bytes = m->manifest_body_bytes + sig.signatureLength;
   m->selfSigned = 1;
+  rhizome_signature_key(m->manifesthash, sig.signature + 1, sig.signatureLength - 1, m->selfsig_key);
+  m->has_selfsig_key = 1;
+  return 0;
+}
+
+/* Validate, pack and sign a manifest without consulting the Rhizome store, so that this may be done
+ * in a forked worker process.  Unlike rhizome_manifest_finalise(), does not check for duplicates.
+ */
+int rhizome_manifest_sign(rhizome_manifest *m)
+{
+  if (!m->finalised && !rhizome_manifest_validate(m))
+    return WHY("Invalid manifest");
+  if (rhizome_manifest_pack_variables(m))
+    return WHY("Could not convert manifest to wire format");
+  return rhizome_manifest_selfsign(m);
+}
+
+/* Adopt the signed wire form of a manifest that was produced by rhizome_manifest_sign() on an
+ * identical copy of this manifest in another process, instead of signing it again.  Returns -1 if
+ * the given body does not match this manifest's own.
+ */
+int rhizome_manifest_adopt_signed(rhizome_manifest *m, const unsigned char *data, size_t body_bytes, size_t all_bytes)
+{
+  if (!m->finalised && !rhizome_manifest_validate(m))
+    return WHY("Invalid manifest");
+  if (rhizome_manifest_pack_variables(m))
+    return WHY("Could not convert manifest to wire format");
+  if (   body_bytes != m->manifest_body_bytes
+      || all_bytes <= body_bytes
+      || all_bytes > sizeof m->manifestdata
+      || memcmp(data, m->manifestdata, body_bytes) != 0)
+    return WHY("Signed manifest does not match");
+  crypto_hash_sha512(m->manifesthash, m->manifestdata, m->manifest_body_bytes);
+  bcopy(data + body_bytes, m->manifestdata + body_bytes, all_bytes - body_bytes);
+  m->manifest_all_bytes = all_bytes;
+  m->selfSigned = 1;
+  // the worker's signature is the first block
+  if (m->manifestdata[body_bytes] == 0x17 && body_bytes + 97 <= all_bytes) {
+    rhizome_signature_key(m->manifesthash, m->manifestdata + body_bytes + 1, 96, m->selfsig_key);
+    m->has_selfsig_key = 1;
+  }
   return 0;
 }
 
@@ -1317,7 +1673,7 @@ int rhizome_manifest_dump(rhizome_manifest *m, const char *msg)
   unsigned i;
   WHYF("Dumping manifest %s:", msg);
   for(i=0;i<m->var_count;i++)
-    WHYF("[%s]=[%s]\n", m->vars[i], m->values[i]);
+    WHYF("[%.*s]=[%.*s]\n", m->fields[i].label_len, m->fields[i].label, m->fields[i].value_len, m->fields[i].value);
   return 0;
 }
 
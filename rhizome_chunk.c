@@ -0,0 +1,525 @@
+/*
+ Serval DNA - Rhizome content-defined chunk store
+ Copyright (C) 2014 Serval Project Inc.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <assert.h>
+#include "serval.h"
+#include "cli.h"
+#include "conf.h"
+#include "commandline.h"
+#include "rhizome.h"
+#include "instance.h"
+#include "lz4.h"
+
+/* When rhizome.chunked_store is enabled, large payloads are not stored as a single FILEBLOBS row or
+ * external blob file, but cut into variable sized chunks at content-defined boundaries.  Each chunk
+ * is stored once in the CHUNKS table under its own hash, with a count of references to it, and
+ * FILECHUNKS lists the chunks of each payload by offset.  Successive versions of a large bundle, and
+ * payloads that share most of their content, only add the chunks that differ.
+ *
+ * Boundaries are found with a "gear" rolling hash, which depends only on the last 64 bytes, so an
+ * insertion or deletion only moves the boundaries near it.  Every node must choose the same
+ * boundaries for chunks to be shared between nodes, so the gear table and the constants below are
+ * part of the protocol and must never change.
+ *
+ * If rhizome.compress_chunks is enabled, each new chunk is stored compressed in the LZ4 block format
+ * if that makes it smaller, with its compressed length in CHUNKS.stored.  A chunk's hash and length
+ * are always those of its uncompressed content, so compressed and uncompressed stores share chunks
+ * in the same way.
+ */
+
+#define CHUNK_MASK (((UINT64_C(1) << RHIZOME_CHUNK_AVG_BITS) - 1) << (64 - RHIZOME_CHUNK_AVG_BITS))
+
+static uint64_t gear[256];
+static int gear_ready = 0;
+
+static void gear_init()
+{
+  if (gear_ready)
+    return;
+  // splitmix64, from a fixed seed
+  uint64_t x = UINT64_C(0x5265CDC3A7B1E0D9);
+  unsigned i;
+  for (i = 0; i < NELS(gear); ++i) {
+    uint64_t z = (x += UINT64_C(0x9E3779B97F4A7C15));
+    z = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94D049BB133111EB);
+    gear[i] = z ^ (z >> 31);
+  }
+  gear_ready = 1;
+}
+
+/* Return the length of the chunk that starts at the beginning of the given data, which must either
+ * hold at least RHIZOME_CHUNK_MAX_SIZE bytes or run to the end of the payload.
+ */
+static size_t chunk_boundary(const unsigned char *data, size_t len)
+{
+  if (len <= RHIZOME_CHUNK_MIN_SIZE)
+    return len;
+  if (len > RHIZOME_CHUNK_MAX_SIZE)
+    len = RHIZOME_CHUNK_MAX_SIZE;
+  uint64_t h = 0;
+  size_t i;
+  for (i = RHIZOME_CHUNK_MIN_SIZE; i < len; ++i) {
+    h = (h << 1) + gear[data[i]];
+    if ((h & CHUNK_MASK) == 0)
+      return i + 1;
+  }
+  return len;
+}
+
+static void chunk_hash(const unsigned char *data, size_t len, unsigned char hash[RHIZOME_CHUNK_HASH_BYTES])
+{
+  SHA512_CTX context;
+  unsigned char digest[SHA512_DIGEST_LENGTH];
+  SHA512_Init(&context);
+  SHA512_Update(&context, data, len);
+  SHA512_Final(digest, &context);
+  SHA512_End(&context, NULL);
+  bcopy(digest, hash, RHIZOME_CHUNK_HASH_BYTES);
+}
+
+int rhizome_chunk_payloads()
+{
+  return config.rhizome.chunked_store;
+}
+
+static int store_chunk(sqlite_retry_state *retry, const rhizome_filehash_t *hashp, uint64_t offset,
+		       const unsigned char *data, size_t len, struct rhizome_chunk_stats *stats)
+{
+  unsigned char hash[RHIZOME_CHUNK_HASH_BYTES];
+  chunk_hash(data, len, hash);
+  int changes = sqlite_exec_void_retry(retry,
+      "UPDATE CHUNKS SET refs = refs + 1 WHERE id = ?;",
+      TOHEX, hash, sizeof hash,
+      END);
+  if (changes == -1)
+    return -1;
+  if (changes == 0) {
+    unsigned char *packed = NULL;
+    size_t packed_len = 0;
+    if (config.rhizome.compress_chunks && (packed = emalloc(len)) != NULL)
+      packed_len = lz4_compress_block(data, len, packed, len - 1);
+    int ret;
+    if (packed_len)
+      ret = sqlite_exec_void_retry(retry,
+	  "INSERT INTO CHUNKS(id,length,refs,data,stored) VALUES(?,?,1,?,?);",
+	  TOHEX, hash, sizeof hash,
+	  INT64, (int64_t)len,
+	  STATIC_BLOB, packed, (int)packed_len,
+	  INT64, (int64_t)packed_len,
+	  END);
+    else
+      ret = sqlite_exec_void_retry(retry,
+	  "INSERT INTO CHUNKS(id,length,refs,data) VALUES(?,?,1,?);",
+	  TOHEX, hash, sizeof hash,
+	  INT64, (int64_t)len,
+	  STATIC_BLOB, data, (int)len,
+	  END);
+    free(packed);
+    if (ret == -1)
+      return -1;
+    stats->chunk_bytes += len;
+    stats->stored_bytes += packed_len ? packed_len : len;
+  }
+  if (sqlite_exec_void_retry(retry,
+	"INSERT OR REPLACE INTO FILECHUNKS(fileid,offset,length,chunk) VALUES(?,?,?,?);",
+	RHIZOME_FILEHASH_T, hashp,
+	INT64, (int64_t)offset,
+	INT64, (int64_t)len,
+	TOHEX, hash, sizeof hash,
+	END) == -1)
+    return -1;
+  stats->chunks++;
+  stats->payload_bytes += len;
+  return 0;
+}
+
+/* Store the content of a payload that has been written to a temporary external file (fd) or
+ * FILEBLOBS row (blob_rowid) as chunks, under the payload's hash.  Must be called inside a
+ * transaction, which must be rolled back if this fails.
+ */
+int rhizome_store_chunks(sqlite_retry_state *retry, const rhizome_filehash_t *hashp, uint64_t length,
+			 int fd, uint64_t blob_rowid, struct rhizome_chunk_stats *stats)
+{
+  gear_init();
+  bzero(stats, sizeof *stats);
+  stats->files = 1;
+  unsigned char *buffer = emalloc(RHIZOME_CHUNK_MAX_SIZE);
+  if (!buffer)
+    return -1;
+  sqlite3_blob *blob = NULL;
+  if (fd == -1 && sqlite_blob_open_retry(retry, "main", "FILEBLOBS", "data", blob_rowid, 0 /* read only */, &blob) == -1) {
+    free(buffer);
+    return WHY("blob open failed");
+  }
+  int ret = 0;
+  uint64_t offset = 0; // of buffer[0] in the payload
+  uint64_t read_offset = 0;
+  size_t len = 0;
+  while (offset < length) {
+    // keep the buffer full, so that every boundary is found the same way
+    size_t want = RHIZOME_CHUNK_MAX_SIZE - len;
+    if (want > length - read_offset)
+      want = (size_t)(length - read_offset);
+    if (want) {
+      if (fd != -1) {
+	ssize_t r = pread(fd, buffer + len, want, (off_t)read_offset);
+	if (r == -1) {
+	  ret = WHYF_perror("pread(%d,%zu,%"PRIu64")", fd, want, read_offset);
+	  break;
+	}
+	if ((size_t)r != want) {
+	  ret = WHYF("Short read of payload, expected %zu bytes, got %zu", want, (size_t)r);
+	  break;
+	}
+      } else {
+	int code;
+	do {
+	  code = sqlite3_blob_read(blob, buffer + len, (int)want, (int)read_offset);
+	} while (sqlite_code_busy(code) && sqlite_retry(retry, "sqlite3_blob_read"));
+	if (code != SQLITE_OK) {
+	  ret = WHYF("sqlite3_blob_read() failed: %s", sqlite3_errmsg(rhizome_db));
+	  break;
+	}
+      }
+      len += want;
+      read_offset += want;
+    }
+    size_t cut = chunk_boundary(buffer, len);
+    assert(cut > 0 && cut <= len);
+    if (store_chunk(retry, hashp, offset, buffer, cut, stats) == -1) {
+      ret = -1;
+      break;
+    }
+    memmove(buffer, buffer + cut, len - cut);
+    len -= cut;
+    offset += cut;
+  }
+  if (blob)
+    sqlite_blob_close(blob);
+  free(buffer);
+  if (ret == 0 && config.debug.rhizome_store)
+    DEBUGF("Stored file %s as %"PRIu64" chunks, %"PRIu64" of %"PRIu64" bytes new, taking %"PRIu64" bytes",
+	alloca_tohex_rhizome_filehash_t(*hashp), stats->chunks, stats->chunk_bytes, stats->payload_bytes, stats->stored_bytes);
+  return ret;
+}
+
+/* Return 1 if the payload is held in the chunk store, 0 if not, -1 on error.
+ */
+int rhizome_chunked_exists(const rhizome_filehash_t *hashp)
+{
+  uint64_t count = 0;
+  if (sqlite_exec_uint64(&count, "SELECT COUNT(*) FROM FILECHUNKS WHERE fileid = ? AND offset = 0;",
+	RHIZOME_FILEHASH_T, hashp, END) == -1)
+    return -1;
+  return count ? 1 : 0;
+}
+
+/* Read the whole of a compressed chunk from its row in CHUNKS and decompress it into the buffer,
+ * which must hold the chunk's length.
+ */
+static int read_compressed_chunk(sqlite_retry_state *retry, uint64_t rowid, size_t stored, unsigned char *buffer, size_t length)
+{
+  unsigned char *packed = emalloc(stored);
+  if (!packed)
+    return -1;
+  sqlite3_blob *blob = NULL;
+  if (sqlite_blob_open_retry(retry, "main", "CHUNKS", "data", rowid, 0 /* read only */, &blob) == -1) {
+    free(packed);
+    return WHY("blob open failed");
+  }
+  int code;
+  do {
+    code = sqlite3_blob_read(blob, packed, (int)stored, 0);
+  } while (sqlite_code_busy(code) && sqlite_retry(retry, "sqlite3_blob_read"));
+  sqlite_blob_close(blob);
+  int ret = 0;
+  if (code != SQLITE_OK)
+    ret = WHYF("sqlite3_blob_read() failed: %s", sqlite3_errmsg(rhizome_db));
+  else if (lz4_decompress_block(packed, stored, buffer, length) != (ssize_t)length)
+    ret = WHYF("Compressed chunk at rowid %"PRIu64" is corrupt", rowid);
+  free(packed);
+  return ret;
+}
+
+/* Read a chunked payload from read_state->offset, reassembling it from as many chunks as it takes to
+ * fill the buffer.  The chunk most recently read from is remembered, so sequential reads only look up
+ * each chunk once, and only decompress it once if it is stored compressed.
+ */
+ssize_t rhizome_read_chunks(sqlite_retry_state *retry, struct rhizome_read *read_state, unsigned char *buffer, size_t bufsz)
+{
+  if (buffer == NULL || bufsz == 0 || read_state->offset >= read_state->length)
+    return 0;
+  uint64_t offset = read_state->offset;
+  size_t total = 0;
+  while (total < bufsz && offset < read_state->length) {
+    if (   read_state->chunk_rowid == 0
+	|| offset < read_state->chunk_offset
+	|| offset >= read_state->chunk_offset + read_state->chunk_length
+    ) {
+      sqlite3_stmt *statement = sqlite_prepare_bind(retry,
+	  "SELECT FILECHUNKS.offset, FILECHUNKS.length, CHUNKS.rowid, CHUNKS.stored "
+	  "FROM FILECHUNKS, CHUNKS "
+	  "WHERE FILECHUNKS.fileid = ? AND FILECHUNKS.offset <= ? AND CHUNKS.id = FILECHUNKS.chunk "
+	  "ORDER BY FILECHUNKS.offset DESC LIMIT 1;",
+	  RHIZOME_FILEHASH_T, &read_state->id,
+	  INT64, (int64_t)offset,
+	  END);
+      if (!statement)
+	return -1;
+      read_state->chunk_rowid = 0;
+      free(read_state->chunk_data);
+      read_state->chunk_data = NULL;
+      uint64_t stored = 0;
+      if (sqlite_step_retry(retry, statement) == SQLITE_ROW) {
+	read_state->chunk_offset = sqlite3_column_int64(statement, 0);
+	read_state->chunk_length = sqlite3_column_int64(statement, 1);
+	read_state->chunk_rowid = sqlite3_column_int64(statement, 2);
+	stored = sqlite3_column_int64(statement, 3);
+      }
+      sqlite3_finalize(statement);
+      if (   read_state->chunk_rowid == 0
+	  || offset >= read_state->chunk_offset + read_state->chunk_length
+      ) {
+	read_state->chunk_rowid = 0;
+	return WHYF("Payload %s has no chunk at offset %"PRIu64, alloca_tohex_rhizome_filehash_t(read_state->id), offset);
+      }
+      if (stored) {
+	if (   (read_state->chunk_data = emalloc(read_state->chunk_length)) == NULL
+	    || read_compressed_chunk(retry, read_state->chunk_rowid, stored, read_state->chunk_data, read_state->chunk_length) == -1
+	) {
+	  free(read_state->chunk_data);
+	  read_state->chunk_data = NULL;
+	  read_state->chunk_rowid = 0;
+	  return -1;
+	}
+      }
+    }
+    size_t n = (size_t)(read_state->chunk_offset + read_state->chunk_length - offset);
+    if (n > bufsz - total)
+      n = bufsz - total;
+    if (read_state->chunk_data) {
+      bcopy(read_state->chunk_data + (offset - read_state->chunk_offset), buffer + total, n);
+      total += n;
+      offset += n;
+      continue;
+    }
+    sqlite3_blob *blob = NULL;
+    if (sqlite_blob_open_retry(retry, "main", "CHUNKS", "data", read_state->chunk_rowid, 0 /* read only */, &blob) == -1)
+      return WHY("blob open failed");
+    int code;
+    do {
+      code = sqlite3_blob_read(blob, buffer + total, (int)n, (int)(offset - read_state->chunk_offset));
+    } while (sqlite_code_busy(code) && sqlite_retry(retry, "sqlite3_blob_read"));
+    sqlite_blob_close(blob);
+    if (code != SQLITE_OK)
+      return WHYF("sqlite3_blob_read() failed: %s", sqlite3_errmsg(rhizome_db));
+    total += n;
+    offset += n;
+  }
+  if (config.debug.rhizome_store)
+    DEBUGF("Read %zu bytes from chunks @%"PRIx64, total, read_state->offset);
+  return total;
+}
+
+/* Drop a payload's references to its chunks, and remove any chunks no longer referenced by any
+ * payload.
+ */
+int rhizome_release_chunks(sqlite_retry_state *retry, const char *fileid)
+{
+  if (sqlite_exec_void_retry(retry,
+	"UPDATE CHUNKS SET refs = refs - ("
+	  "SELECT COUNT(*) FROM FILECHUNKS WHERE FILECHUNKS.fileid = ? AND FILECHUNKS.chunk = CHUNKS.id"
+	") WHERE id IN (SELECT chunk FROM FILECHUNKS WHERE fileid = ?);",
+	STATIC_TEXT, fileid,
+	STATIC_TEXT, fileid,
+	END) == -1)
+    return -1;
+  if (sqlite_exec_void_retry(retry,
+	"DELETE FROM CHUNKS WHERE refs <= 0 AND id IN (SELECT chunk FROM FILECHUNKS WHERE fileid = ?);",
+	STATIC_TEXT, fileid,
+	END) == -1)
+    return -1;
+  int ret = sqlite_exec_void_retry(retry, "DELETE FROM FILECHUNKS WHERE fileid = ?;", STATIC_TEXT, fileid, END);
+  if (ret > 0 && config.debug.rhizome_store)
+    DEBUGF("Released %d chunks of file %s", ret, fileid);
+  return ret;
+}
+
+/* Remove the chunk list entries in the given range of FILECHUNKS rowids whose payloads no longer
+ * exist, releasing their chunks, and then any of those chunks that are no longer referenced.  Returns
+ * the number of chunks removed, or -1 on error.
+ */
+#define ORPHAN_FILECHUNKS \
+  "FILECHUNKS.rowid > ? AND FILECHUNKS.rowid <= ? " \
+  "AND NOT EXISTS( SELECT 1 FROM FILES WHERE FILES.id = FILECHUNKS.fileid )"
+
+int rhizome_cleanup_chunks(sqlite_retry_state *retry, int64_t after_rowid, int64_t last_rowid)
+{
+  if (rhizome_db_begin(retry) == -1)
+    return -1;
+  int ret = 0;
+  if (   sqlite_exec_void_retry(retry,
+	    "UPDATE CHUNKS SET refs = refs - ("
+	      "SELECT COUNT(*) FROM FILECHUNKS WHERE FILECHUNKS.chunk = CHUNKS.id AND " ORPHAN_FILECHUNKS
+	    ") WHERE id IN (SELECT chunk FROM FILECHUNKS WHERE " ORPHAN_FILECHUNKS ");",
+	    INT64, after_rowid, INT64, last_rowid,
+	    INT64, after_rowid, INT64, last_rowid,
+	    END) == -1
+      || (ret = sqlite_exec_void_retry(retry,
+	    "DELETE FROM CHUNKS WHERE refs <= 0 AND id IN (SELECT chunk FROM FILECHUNKS WHERE " ORPHAN_FILECHUNKS ");",
+	    INT64, after_rowid, INT64, last_rowid,
+	    END)) == -1
+      || sqlite_exec_void_retry(retry,
+	    "DELETE FROM FILECHUNKS WHERE " ORPHAN_FILECHUNKS ";",
+	    INT64, after_rowid, INT64, last_rowid,
+	    END) == -1
+      || rhizome_db_commit(retry) == -1
+  ) {
+    rhizome_db_rollback(retry);
+    return -1;
+  }
+  if (ret > 0 && config.debug.rhizome_store)
+    DEBUGF("Removed %d orphan chunks", ret);
+  return ret;
+}
+
+/* Return 1 if there are any chunks in the store, so that a fetch could make use of them.
+ */
+int rhizome_have_chunks()
+{
+  uint64_t count = 0;
+  if (sqlite_exec_uint64(&count, "SELECT EXISTS(SELECT 1 FROM CHUNKS);", END) == -1)
+    return 0;
+  return count ? 1 : 0;
+}
+
+/* Read up to count entries of a stored payload's chunk list, starting at chunk number first.  Sets
+ * *total to the number of chunks in the payload (zero if it is not chunked).  Returns the number of
+ * entries read, or -1 on error.
+ */
+int rhizome_read_chunk_list(const rhizome_filehash_t *hashp, uint32_t first, uint32_t count,
+			    struct rhizome_chunk_ref *refs, uint32_t *total)
+{
+  uint64_t n = 0;
+  if (sqlite_exec_uint64(&n, "SELECT COUNT(*) FROM FILECHUNKS WHERE fileid = ?;", RHIZOME_FILEHASH_T, hashp, END) == -1)
+    return -1;
+  *total = (uint32_t)n;
+  if (first >= *total)
+    return 0;
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
+      "SELECT length, chunk FROM FILECHUNKS WHERE fileid = ? ORDER BY offset LIMIT ? OFFSET ?;",
+      RHIZOME_FILEHASH_T, hashp,
+      INT, (int)count,
+      INT64, (int64_t)first,
+      END);
+  if (!statement)
+    return -1;
+  int ret = 0;
+  while ((uint32_t)ret < count && sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
+    const char *hex = (const char *) sqlite3_column_text(statement, 1);
+    refs[ret].length = (uint32_t) sqlite3_column_int64(statement, 0);
+    if (!hex || fromhexstr(refs[ret].hash, hex, RHIZOME_CHUNK_HASH_BYTES) == -1) {
+      ret = WHYF("Invalid chunk id %s", alloca_str_toprint(hex));
+      break;
+    }
+    ++ret;
+  }
+  sqlite3_finalize(statement);
+  return ret;
+}
+
+/* Read a whole chunk from the store, if we have it.  Returns the length of the chunk, or 0 if we
+ * don't have it (or it isn't the expected length), or -1 on error.
+ */
+ssize_t rhizome_read_chunk(const struct rhizome_chunk_ref *ref, unsigned char *buffer)
+{
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
+      "SELECT data, stored FROM CHUNKS WHERE id = ? AND length = ?;",
+      TOHEX, ref->hash, sizeof ref->hash,
+      INT64, (int64_t)ref->length,
+      END);
+  if (!statement)
+    return -1;
+  ssize_t ret = 0;
+  if (sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
+    const unsigned char *data = sqlite3_column_blob(statement, 0);
+    size_t bytes = (size_t)sqlite3_column_bytes(statement, 0);
+    if (sqlite3_column_type(statement, 1) != SQLITE_NULL) {
+      if (lz4_decompress_block(data, bytes, buffer, ref->length) == (ssize_t)ref->length)
+	ret = ref->length;
+    } else if (bytes == ref->length) {
+      bcopy(data, buffer, ref->length);
+      ret = ref->length;
+    }
+  }
+  sqlite3_finalize(statement);
+  return ret;
+}
+
+int rhizome_chunk_stats(struct rhizome_chunk_stats *stats)
+{
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  if (   sqlite_exec_uint64_retry(&retry, &stats->files, "SELECT COUNT(*) FROM FILECHUNKS WHERE offset = 0;", END) == -1
+      || sqlite_exec_uint64_retry(&retry, &stats->payload_bytes, "SELECT IFNULL(SUM(length),0) FROM FILECHUNKS;", END) == -1
+      || sqlite_exec_uint64_retry(&retry, &stats->chunks, "SELECT COUNT(*) FROM CHUNKS;", END) == -1
+      || sqlite_exec_uint64_retry(&retry, &stats->chunk_bytes, "SELECT IFNULL(SUM(length),0) FROM CHUNKS;", END) == -1
+      || sqlite_exec_uint64_retry(&retry, &stats->stored_bytes, "SELECT IFNULL(SUM(IFNULL(stored,length)),0) FROM CHUNKS;", END) == -1)
+    return -1;
+  return 0;
+}
+
+DEFINE_CMD(app_rhizome_chunks, 0,
+  "Report how much space the Rhizome chunk store saves by sharing chunks between payloads and compressing them",
+  "rhizome","chunks");
+static int app_rhizome_chunks(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+  if (create_serval_instance_dir() == -1)
+    return -1;
+  if (rhizome_opendb() == -1)
+    return -1;
+  struct rhizome_chunk_stats stats;
+  if (rhizome_chunk_stats(&stats) == -1)
+    return -1;
+  uint64_t saved = stats.payload_bytes > stats.stored_bytes ? stats.payload_bytes - stats.stored_bytes : 0;
+  char ratio[32], compression[32];
+  snprintf(ratio, sizeof ratio, "%.2f", stats.chunk_bytes ? (double)stats.payload_bytes / (double)stats.chunk_bytes : 1.0);
+  snprintf(compression, sizeof compression, "%.2f", stats.stored_bytes ? (double)stats.chunk_bytes / (double)stats.stored_bytes : 1.0);
+  cli_field_name(context, "files", ":");
+  cli_put_long(context, stats.files, "\n");
+  cli_field_name(context, "chunks", ":");
+  cli_put_long(context, stats.chunks, "\n");
+  cli_field_name(context, "payload_bytes", ":");
+  cli_put_long(context, stats.payload_bytes, "\n");
+  cli_field_name(context, "chunk_bytes", ":");
+  cli_put_long(context, stats.chunk_bytes, "\n");
+  cli_field_name(context, "stored_bytes", ":");
+  cli_put_long(context, stats.stored_bytes, "\n");
+  cli_field_name(context, "saved_bytes", ":");
+  cli_put_long(context, saved, "\n");
+  cli_field_name(context, "dedup_ratio", ":");
+  cli_put_string(context, ratio, "\n");
+  cli_field_name(context, "compression_ratio", ":");
+  cli_put_string(context, compression, "\n");
+  return 0;
+}
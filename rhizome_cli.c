@@ -23,6 +23,7 @@
 #include "commandline.h"
 #include "rhizome.h"
 #include "instance.h"
+#include "mem.h"
 
 static void cli_put_manifest(struct cli_context *context, const rhizome_manifest *m)
 {
@@ -548,9 +549,239 @@ static int app_rhizome_clean(const struct cli_parsed *parsed, struct cli_context
   cli_put_long(context, report.deleted_orphan_fileblobs, "\n");
   cli_field_name(context, "deleted_orphan_manifests", ":");
   cli_put_long(context, report.deleted_orphan_manifests, "\n");
+  cli_field_name(context, "deleted_orphan_blobs", ":");
+  cli_put_long(context, report.deleted_orphan_blobs, "\n");
+  cli_field_name(context, "deleted_stale_partials", ":");
+  cli_put_long(context, report.deleted_stale_partials, "\n");
   return 0;
 }
 
+/* Write the text of a typical MeshMS ply manifest, which has most of the fields that appear in
+ * practice, with random identifiers.  Returns its length.
+ */
+static size_t manifest_test_text(char *text, size_t size)
+{
+  rhizome_bid_t bid;
+  rhizome_filehash_t hash;
+  sid_t sender, recipient;
+  urandombytes(bid.binary, sizeof bid.binary);
+  urandombytes(hash.binary, sizeof hash.binary);
+  urandombytes(sender.binary, sizeof sender.binary);
+  urandombytes(recipient.binary, sizeof recipient.binary);
+  int len = snprintf(text, size,
+      "service=MeshMS2\nid=%s\nversion=%"PRIu64"\nfilesize=1024\nfilehash=%s\n"
+      "date=%"PRIu64"\nsender=%s\nrecipient=%s\ncrypt=1\ntail=0\nname=bench\n",
+      alloca_tohex_rhizome_bid_t(bid),
+      (uint64_t) gettime_ms(),
+      alloca_tohex_rhizome_filehash_t(hash),
+      (uint64_t) gettime_ms(),
+      alloca_tohex_sid_t(sender),
+      alloca_tohex_sid_t(recipient));
+  assert(len > 0 && (size_t)len < size);
+  return len;
+}
+
+DEFINE_CMD(app_rhizome_manifest_bench, 0,
+  "Measure manifest parsing throughput and memory use with <count> manifests resident",
+  "rhizome","test","manifest","[<count>]");
+static int app_rhizome_manifest_bench(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+  const char *count_ascii;
+  if (cli_arg(parsed, "count", &count_ascii, cli_uint, "1000") == -1)
+    return -1;
+  unsigned count = atoi(count_ascii);
+  if (count < 1 || count > MAX_RHIZOME_MANIFESTS - 1)
+    return WHYF("count must be between 1 and %u", MAX_RHIZOME_MANIFESTS - 1);
+  rhizome_manifest **resident = emalloc_zero(count * sizeof(rhizome_manifest *));
+  if (resident == NULL)
+    return -1;
+  char text[MAX_MANIFEST_BYTES];
+  size_t len = manifest_test_text(text, sizeof text);
+  struct rhizome_manifest_pool_stats before;
+  rhizome_manifest_pool_stats(&before);
+  const unsigned rounds = 20;
+  int ret = 0;
+  time_ms_t start = gettime_ms();
+  unsigned r, i;
+  for (r = 0; r < rounds && ret == 0; ++r) {
+    for (i = 0; i < count; ++i) {
+      rhizome_manifest *m = resident[i] = rhizome_new_manifest();
+      if (m == NULL) {
+	ret = -1;
+	break;
+      }
+      memcpy(m->manifestdata, text, len);
+      m->manifest_all_bytes = len;
+      if (rhizome_manifest_parse(m) == -1 || m->malformed) {
+	ret = WHYF("benchmark manifest did not parse: %s", m->malformed ? m->malformed : "error");
+	break;
+      }
+    }
+    for (i = 0; i < count && resident[i]; ++i) {
+      rhizome_manifest_free(resident[i]);
+      resident[i] = NULL;
+    }
+  }
+  time_ms_t elapsed = gettime_ms() - start;
+  free(resident);
+  if (ret == -1)
+    return -1;
+  struct rhizome_manifest_pool_stats after;
+  rhizome_manifest_pool_stats(&after);
+  uint64_t parses = (uint64_t) rounds * count;
+  cli_field_name(context, "manifest_struct_bytes", ":");
+  cli_put_long(context, sizeof(rhizome_manifest), "\n");
+  cli_field_name(context, "resident", ":");
+  cli_put_long(context, count, "\n");
+  cli_field_name(context, "pool_slots", ":");
+  cli_put_long(context, after.slots, "\n");
+  cli_field_name(context, "parses", ":");
+  cli_put_long(context, parses, "\n");
+  cli_field_name(context, "elapsed_ms", ":");
+  cli_put_long(context, elapsed, "\n");
+  cli_field_name(context, "parses_per_second", ":");
+  cli_put_long(context, elapsed ? parses * 1000 / elapsed : 0, "\n");
+  cli_field_name(context, "arena_mallocs", ":");
+  cli_put_long(context, after.arena_mallocs - before.arena_mallocs, "\n");
+  return 0;
+}
+
+/* Check the invariants of a manifest that has just been parsed from the given text.  Returns the
+ * number of violations found (already logged).
+ */
+static unsigned manifest_fuzz_check(const rhizome_manifest *m, int parsed, const char *text, size_t len)
+{
+  unsigned failures = 0;
+  const char *const data = (const char *) m->manifestdata;
+  if (memcmp(data, text, len) != 0) {
+    WHY("parsing modified the manifest text");
+    ++failures;
+  }
+  if (parsed != 0)
+    return failures;
+  if (m->manifest_body_bytes > len) {
+    WHYF("body of %zu bytes exceeds the %zu bytes given", m->manifest_body_bytes, len);
+    ++failures;
+  }
+  unsigned i;
+  for (i = 0; i < m->var_count; ++i) {
+    const struct rhizome_manifest_field *f = &m->fields[i];
+    if (f->value >= data && f->value < data + sizeof m->manifestdata) {
+      const char *end = f->value + f->value_len;
+      if (end >= data + m->manifest_body_bytes || (*end != '\n' && *end != '\r') || f->value[-1] != '=') {
+	WHYF("field %u value is not a whole value in the text", i);
+	++failures;
+      }
+    }
+    if (f->label >= data && f->label < data + sizeof m->manifestdata && f->label[f->label_len] != '=') {
+      WHYF("field %u label is not a whole label in the text", i);
+      ++failures;
+    }
+  }
+  // The summary from the light-weight inspector must agree with the full parse.
+  struct rhizome_manifest_summary summ;
+  if (rhizome_manifest_inspect(text, len, &summ)) {
+    if (!m->has_id || cmp_rhizome_bid_t(&summ.bid, &m->cryptoSignPublic) != 0 || summ.version != m->version) {
+      WHY("inspect and parse disagree on id or version");
+      ++failures;
+    }
+    if (summ.body_len != m->manifest_body_bytes) {
+      WHYF("inspect body_len=%zu, parse manifest_body_bytes=%zu", summ.body_len, m->manifest_body_bytes);
+      ++failures;
+    }
+  }
+  return failures;
+}
+
+DEFINE_CMD(app_rhizome_manifest_fuzz, 0,
+  "Parse <iterations> randomly mutated manifests and check the parser's invariants",
+  "rhizome","fuzz","manifest","[<iterations>]","[<seed>]");
+static int app_rhizome_manifest_fuzz(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+  const char *iterations_ascii, *seed_ascii;
+  if (cli_arg(parsed, "iterations", &iterations_ascii, cli_uint, "10000") == -1
+   || cli_arg(parsed, "seed", &seed_ascii, cli_uint, "1") == -1)
+    return -1;
+  unsigned iterations = atoi(iterations_ascii);
+  // xorshift, so that any failure can be reproduced from the seed
+  uint32_t x = atoi(seed_ascii) | 1;
+#define FUZZ_RAND() (x ^= x << 13, x ^= x >> 17, x ^= x << 5, x)
+  char base[MAX_MANIFEST_BYTES];
+  size_t base_len = manifest_test_text(base, sizeof base);
+  base_len += snprintf(base + base_len, sizeof base - base_len, "comment=fuzz\r\n");
+  // a signature block follows the NUL that ends the body
+  base[base_len++] = '\0';
+  urandombytes((unsigned char *)base + base_len, 64);
+  base_len += 64;
+  static const char special[] = { '=', '\n', '\r', '\0', 'a', 'Z', '0', '9', ' ' };
+  unsigned ok = 0, rejected = 0, failures = 0, n;
+  for (n = 0; n < iterations; ++n) {
+    char text[MAX_MANIFEST_BYTES];
+    size_t len = base_len;
+    memcpy(text, base, len);
+    unsigned mutations = 1 + FUZZ_RAND() % 4;
+    while (mutations-- && len) {
+      size_t pos = FUZZ_RAND() % len;
+      switch (FUZZ_RAND() % 5) {
+	case 0: // overwrite with a syntactically significant character
+	  text[pos] = special[FUZZ_RAND() % sizeof special];
+	  break;
+	case 1: // overwrite with any byte
+	  text[pos] = FUZZ_RAND();
+	  break;
+	case 2: // delete
+	  memmove(text + pos, text + pos + 1, len - pos - 1);
+	  --len;
+	  break;
+	case 3: // insert
+	  if (len < sizeof text) {
+	    memmove(text + pos + 1, text + pos, len - pos);
+	    text[pos] = special[FUZZ_RAND() % sizeof special];
+	    ++len;
+	  }
+	  break;
+	case 4: // truncate
+	  len = pos + 1;
+	  break;
+      }
+    }
+    rhizome_manifest *m = rhizome_new_manifest();
+    if (m == NULL)
+      return -1;
+    memcpy(m->manifestdata, text, len);
+    m->manifest_all_bytes = len;
+    int r = rhizome_manifest_parse(m);
+    if (r == -1)
+      ++failures;
+    else {
+      if (r == 0) {
+	++ok;
+	rhizome_manifest_validate(m);
+      } else
+	++rejected;
+      unsigned f = manifest_fuzz_check(m, r, text, len);
+      if (f)
+	WHYF("iteration %u (seed %s): %s", n, seed_ascii, alloca_toprint(-1, text, len));
+      failures += f;
+    }
+    rhizome_manifest_free(m);
+  }
+#undef FUZZ_RAND
+  cli_field_name(context, "iterations", ":");
+  cli_put_long(context, iterations, "\n");
+  cli_field_name(context, "parsed", ":");
+  cli_put_long(context, ok, "\n");
+  cli_field_name(context, "rejected", ":");
+  cli_put_long(context, rejected, "\n");
+  cli_field_name(context, "failures", ":");
+  cli_put_long(context, failures, "\n");
+  return failures ? 1 : 0;
+}
+
 DEFINE_CMD(app_rhizome_extract, 0,
   "Export a manifest and payload file to the given paths, without decrypting.",
   "rhizome","export","bundle" KEYRING_PIN_OPTIONS,
@@ -727,7 +958,7 @@ static int app_rhizome_export_file(const struct cli_parsed *parsed, struct cli_c
 
 DEFINE_CMD(app_rhizome_list, 0,
   "List all manifests and files in Rhizome",
-  "rhizome","list" KEYRING_PIN_OPTIONS,
+  "rhizome","list" KEYRING_PIN_OPTIONS,"[--count]",
 	"[<service>]","[<name>]","[<sender_sid>]","[<recipient_sid>]","[<offset>]","[<limit>]");
 static int app_rhizome_list(const struct cli_parsed *parsed, struct cli_context *context)
 {
@@ -740,6 +971,7 @@ static int app_rhizome_list(const struct cli_parsed *parsed, struct cli_context
   cli_arg(parsed, "recipient_sid", &recipient_hex, cli_optional_sid, "");
   cli_arg(parsed, "offset", &offset_ascii, cli_uint, "0");
   cli_arg(parsed, "limit", &limit_ascii, cli_uint, "0");
+  int count_only = 0 == cli_arg(parsed, "--count", NULL, NULL, NULL);
   /* Create the instance directory if it does not yet exist */
   if (create_serval_instance_dir() == -1)
     return -1;
@@ -766,6 +998,17 @@ static int app_rhizome_list(const struct cli_parsed *parsed, struct cli_context
       return WHYF("Invalid <recipient: %s", recipient_hex);
     cursor.is_recipient_set = 1;
   }
+  if (count_only) {
+    uint64_t count;
+    int ret = rhizome_list_count(&cursor, &count);
+    keyring_free(keyring);
+    keyring = NULL;
+    if (ret == -1)
+      return -1;
+    cli_field_name(context, "count", ":");
+    cli_put_long(context, count, "\n");
+    return 0;
+  }
   if (rhizome_list_open(&cursor) == -1) {
     keyring_free(keyring);
     keyring = NULL;
@@ -793,33 +1036,40 @@ static int app_rhizome_list(const struct cli_parsed *parsed, struct cli_context
     ++rowcount;
     if (rowcount <= rowoffset)
       continue;
-    if (rowlimit == 0 || rowcount <= rowoffset + rowlimit) {
-      rhizome_manifest *m = cursor.manifest;
-      assert(m->filesize != RHIZOME_SIZE_UNSET);
-      rhizome_lookup_author(m);
-      cli_put_long(context, m->rowid, ":");
-      cli_put_string(context, m->service, ":");
-      cli_put_hexvalue(context, m->cryptoSignPublic.binary, sizeof m->cryptoSignPublic.binary, ":");
-      cli_put_long(context, m->version, ":");
-      cli_put_long(context, m->has_date ? m->date : 0, ":");
-      cli_put_long(context, m->inserttime, ":");
-      switch (m->authorship) {
-	case AUTHOR_LOCAL:
-	case AUTHOR_AUTHENTIC:
-	  cli_put_hexvalue(context, m->author.binary, sizeof m->author.binary, ":");
-	  cli_put_long(context, 1, ":");
-	  break;
-	default:
-	  cli_put_string(context, NULL, ":");
-	  cli_put_long(context, 0, ":");
-	  break;
-      }
-      cli_put_long(context, m->filesize, ":");
-      cli_put_hexvalue(context, m->filesize ? m->filehash.binary : NULL, sizeof m->filehash.binary, ":");
-      cli_put_hexvalue(context, m->has_sender ? m->sender.binary : NULL, sizeof m->sender.binary, ":");
-      cli_put_hexvalue(context, m->has_recipient ? m->recipient.binary : NULL, sizeof m->recipient.binary, ":");
-      cli_put_string(context, m->name, "\n");
+    if (rowlimit != 0 && rowcount > rowoffset + rowlimit) {
+      // Count the rest of the rows instead of reading all their manifests.
+      uint64_t count;
+      cursor.rowid_before = cursor.manifest->rowid;
+      rhizome_list_release(&cursor);
+      if ((n = rhizome_list_count(&cursor, &count)) == 0)
+	rowcount += count;
+      break;
     }
+    rhizome_manifest *m = cursor.manifest;
+    assert(m->filesize != RHIZOME_SIZE_UNSET);
+    rhizome_lookup_author(m);
+    cli_put_long(context, m->rowid, ":");
+    cli_put_string(context, m->service, ":");
+    cli_put_hexvalue(context, m->cryptoSignPublic.binary, sizeof m->cryptoSignPublic.binary, ":");
+    cli_put_long(context, m->version, ":");
+    cli_put_long(context, m->has_date ? m->date : 0, ":");
+    cli_put_long(context, m->inserttime, ":");
+    switch (m->authorship) {
+      case AUTHOR_LOCAL:
+      case AUTHOR_AUTHENTIC:
+	cli_put_hexvalue(context, m->author.binary, sizeof m->author.binary, ":");
+	cli_put_long(context, 1, ":");
+	break;
+      default:
+	cli_put_string(context, NULL, ":");
+	cli_put_long(context, 0, ":");
+	break;
+    }
+    cli_put_long(context, m->filesize, ":");
+    cli_put_hexvalue(context, m->filesize ? m->filehash.binary : NULL, sizeof m->filehash.binary, ":");
+    cli_put_hexvalue(context, m->has_sender ? m->sender.binary : NULL, sizeof m->sender.binary, ":");
+    cli_put_hexvalue(context, m->has_recipient ? m->recipient.binary : NULL, sizeof m->recipient.binary, ":");
+    cli_put_string(context, m->name, "\n");
   }
   rhizome_list_release(&cursor);
   keyring_free(keyring);
@@ -484,39 +484,87 @@ int rhizome_sign_hash_with_key(rhizome_manifest *m,const unsigned char *sk,
   OUT();
 }
 
-typedef struct manifest_signature_block_cache {
-  unsigned char manifest_hash[crypto_hash_sha512_BYTES];
-  unsigned char signature_bytes[256];
-  int signature_length;
-  int signature_valid;
-} manifest_signature_block_cache;
+/* Compute the digest that identifies a signature block (without its type byte) over a manifest
+ * hash.  The manifest hash is already a SHA-512 digest, but the signature must be bound in too, so
+ * hash them together.
+ */
+void rhizome_signature_key(const unsigned char *hash, const unsigned char *sig, size_t sig_len, unsigned char *key)
+{
+  unsigned char buf[crypto_hash_sha512_BYTES + 256];
+  unsigned char digest[crypto_hash_sha512_BYTES];
+  assert(sig_len <= 256);
+  bcopy(hash, buf, crypto_hash_sha512_BYTES);
+  bcopy(sig, buf + crypto_hash_sha512_BYTES, sig_len);
+  crypto_hash_sha512(digest, buf, crypto_hash_sha512_BYTES + sig_len);
+  bcopy(digest, key, RHIZOME_SIGNATURE_KEY_BYTES);
+}
 
-#define SIG_CACHE_SIZE 1024
-manifest_signature_block_cache sig_cache[SIG_CACHE_SIZE];
+/* The signature cache is set associative: a key's set is chosen by its digest, and within the set
+ * the least recently used entry is replaced.  Invalid signatures are remembered too, so a peer
+ * repeatedly advertising a bad manifest costs only one verification.
+ */
+#define SIG_CACHE_WAYS 4
 
-static int rhizome_manifest_lookup_signature_validity(const unsigned char *hash, const unsigned char *sig, int sig_len)
-{
-  IN();
-  unsigned int slot=0;
-  int i;
+struct sig_cache_entry {
+  unsigned char key[RHIZOME_SIGNATURE_KEY_BYTES];
+  uint32_t last_used; // zero if the entry is empty
+  int valid;
+};
+
+static struct sig_cache_entry *sig_cache = NULL;
+static unsigned sig_cache_sets = 0;
+static uint32_t sig_cache_clock = 0;
 
-  for(i=0;i<crypto_hash_sha512_BYTES;i++) {
-    slot=(slot<<1)+(slot&0x80000000?1:0);
-    slot+=hash[i];
+struct rhizome_signature_cache_stats rhizome_signature_cache_stats;
+
+/* Return the entry for the given key, or the entry to replace with it, in which case its key
+ * differs.  Returns NULL if the cache cannot be allocated.
+ */
+static struct sig_cache_entry *sig_cache_find(const unsigned char *key)
+{
+  unsigned sets = config.rhizome.signature_cache_size / SIG_CACHE_WAYS;
+  if (sets == 0)
+    sets = 1;
+  if (sets != sig_cache_sets) {
+    free(sig_cache);
+    sig_cache_sets = 0;
+    if ((sig_cache = emalloc_zero(sets * SIG_CACHE_WAYS * sizeof *sig_cache)) == NULL)
+      return NULL;
+    sig_cache_sets = sets;
   }
-  for(i=0;i<sig_len;i++) {
-    slot=(slot<<1)+(slot&0x80000000?1:0);
-    slot+=sig[i];
+  // The key is a cryptographic digest, so any of its bytes are as good as any hash of it.
+  struct sig_cache_entry *set = &sig_cache[(read_uint32(key) % sig_cache_sets) * SIG_CACHE_WAYS];
+  struct sig_cache_entry *victim = &set[0];
+  unsigned i;
+  for (i = 0; i != SIG_CACHE_WAYS; ++i) {
+    if (set[i].last_used && memcmp(set[i].key, key, RHIZOME_SIGNATURE_KEY_BYTES) == 0)
+      return &set[i];
+    if (set[i].last_used < victim->last_used)
+      victim = &set[i];
   }
-  slot%=SIG_CACHE_SIZE;
-
-  if (sig_cache[slot].signature_length!=sig_len || 
-      memcmp(hash, sig_cache[slot].manifest_hash, crypto_hash_sha512_BYTES) ||
-      memcmp(sig, sig_cache[slot].signature_bytes, sig_len)){
-    bcopy(hash, sig_cache[slot].manifest_hash, crypto_hash_sha512_BYTES);
-    bcopy(sig, sig_cache[slot].signature_bytes, sig_len);
-    sig_cache[slot].signature_length=sig_len;
+  return victim;
+}
 
+static int rhizome_manifest_lookup_signature_validity(const unsigned char *hash, const unsigned char *sig, int sig_len, unsigned char *key)
+{
+  IN();
+  rhizome_signature_key(hash, sig, sig_len, key);
+  if (++sig_cache_clock == 0)
+    ++sig_cache_clock; // zero marks an empty entry
+  struct sig_cache_entry *entry = sig_cache_find(key);
+  if (entry && entry->last_used && memcmp(entry->key, key, RHIZOME_SIGNATURE_KEY_BYTES) == 0) {
+    ++rhizome_signature_cache_stats.hits;
+    entry->last_used = sig_cache_clock;
+    RETURN(entry->valid);
+  }
+  ++rhizome_signature_cache_stats.misses;
+  int valid;
+  if (config.rhizome.signature_cache_persist && rhizome_signature_is_stored(key) == 1) {
+    ++rhizome_signature_cache_stats.stored_hits;
+    if (config.debug.rhizome)
+      DEBUG("Signature already verified in store");
+    valid = 0;
+  } else {
     unsigned char sigBuf[256];
     unsigned char verifyBuf[256];
     unsigned char publicKey[256];
@@ -530,12 +578,17 @@ static int rhizome_manifest_lookup_signature_validity(const unsigned char *hash,
     bcopy(&sig[64],&publicKey[0],crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES);
 
     unsigned long long mlen=0;
-    sig_cache[slot].signature_valid=
-      crypto_sign_edwards25519sha512batch_open(verifyBuf,&mlen,&sigBuf[0],128,
-					       publicKey)
-      ? -1 : 0;
+    ++rhizome_signature_cache_stats.verifications;
+    valid = crypto_sign_edwards25519sha512batch_open(verifyBuf,&mlen,&sigBuf[0],128, publicKey) ? -1 : 0;
   }
-  RETURN(sig_cache[slot].signature_valid);
+  if (entry) {
+    if (entry->last_used)
+      ++rhizome_signature_cache_stats.evictions;
+    bcopy(key, entry->key, RHIZOME_SIGNATURE_KEY_BYTES);
+    entry->last_used = sig_cache_clock;
+    entry->valid = valid;
+  }
+  RETURN(valid);
   OUT();
 }
 
@@ -555,8 +608,8 @@ int rhizome_manifest_extract_signature(rhizome_manifest *m, unsigned *ofs)
     RETURN(1);
   }
   *ofs += len;
-  assert (m->sig_count <= NELS(m->signatories));
-  if (m->sig_count == NELS(m->signatories)) {
+  assert (m->sig_count <= MAX_MANIFEST_VARS);
+  if (m->sig_count == MAX_MANIFEST_VARS) {
     WARN("Too many signature blocks in manifest");
     RETURN(2);
   }
@@ -565,16 +618,18 @@ int rhizome_manifest_extract_signature(rhizome_manifest *m, unsigned *ofs)
     {
       assert(len == 97);
       /* Reconstitute signature block */
-      int r = rhizome_manifest_lookup_signature_validity(m->manifesthash, sig + 1, 96);
+      unsigned char key[RHIZOME_SIGNATURE_KEY_BYTES];
+      int r = rhizome_manifest_lookup_signature_validity(m->manifesthash, sig + 1, 96, key);
       if (r) {
 	WARN("Signature verification failed");
 	RETURN(4);
       }
-      m->signatureTypes[m->sig_count] = len;
-      if ((m->signatories[m->sig_count] = emalloc(crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES)) == NULL)
+      if (!m->has_selfsig_key && memcmp(sig + 1 + 64, m->cryptoSignPublic.binary, sizeof m->cryptoSignPublic.binary) == 0) {
+	bcopy(key, m->selfsig_key, sizeof m->selfsig_key);
+	m->has_selfsig_key = 1;
+      }
+      if (rhizome_manifest_add_signatory(m, len, sig + 1 + 64) == -1)
 	RETURN(-1);
-      bcopy(sig + 1 + 64, m->signatories[m->sig_count], crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES);
-      m->sig_count++;
       if (config.debug.rhizome)
 	DEBUG("Signature verified");
       RETURN(0);
@@ -22,6 +22,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <time.h>
 #include <ctype.h>
 #include <assert.h>
+#include <dirent.h>
+#include <signal.h>
 #include "serval.h"
 #include "conf.h"
 #include "rhizome.h"
@@ -46,6 +48,12 @@ static int create_rhizome_store_dir()
 
 sqlite3 *rhizome_db = NULL;
 serval_uuid_t rhizome_db_uuid;
+/* In write-ahead log mode, long running read-only queries (bundle lists and sync cursors) use their
+ * own connection, so that they read a consistent snapshot without holding up writers.
+ */
+static sqlite3 *rhizome_read_db = NULL;
+static char rhizome_db_wal = 0;
+struct sqlite_busy_stats sqlite_busy_stats;
 static time_ms_t rhizomeRetryLimit = -1;
 
 int is_debug_rhizome()
@@ -116,40 +124,115 @@ void sqlite_log(void *UNUSED(ignored), int result, const char *msg)
   WARNF("Sqlite: %d %s", result, msg);
 }
 
-void verify_bundles()
+/* Manifests are checked again by marking their MANIFESTS rows with verified = 0, which is cheap
+ * enough to do while opening the database.  Until it is checked, a manifest is still listed and
+ * served, but its signature is checked each time it is retrieved.  The marks are the record of
+ * progress, so checking resumes where it left off after a restart.
+ */
+int rhizome_unverify_bundles()
+{
+  return sqlite_exec_void("UPDATE MANIFESTS SET verified = 0;", END) == -1 ? -1 : 0;
+}
+
+/* Check the next unverified manifest.  Returns 1 if one was checked, 0 if there are none left, or
+ * -1 on error.
+ */
+static int verify_next_bundle(sqlite_retry_state *retry)
 {
   // assume that only the manifest itself can be trusted
-  // fetch all manifests and reinsert them.
-  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
-  // This cursor must be ordered descending as re-inserting the manifests will give them a new higher manifest id.
-  // If we didn't, we'd get stuck in an infinite loop.
-  sqlite3_stmt *statement = sqlite_prepare(&retry, "SELECT ROWID, MANIFEST FROM MANIFESTS ORDER BY ROWID DESC;");
-  while (sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
-    sqlite3_int64 rowid = sqlite3_column_int64(statement, 0);
-    const void *blob = sqlite3_column_blob(statement, 1);
-    size_t blob_length = sqlite3_column_bytes(statement, 1);
-    rhizome_manifest *m = rhizome_new_manifest();
-    if (m) {
-      memcpy(m->manifestdata, blob, blob_length);
-      m->manifest_all_bytes = blob_length;
-      int ret = -1;
-      if (   rhizome_manifest_parse(m) != -1
-	  && rhizome_manifest_validate(m)
-	  && rhizome_manifest_verify(m)
-      ) {
-	assert(m->finalised);
-	// Store it again, to ensure that MANIFESTS columns are up to date.
-	ret = rhizome_store_manifest(m);
-      }
-      if (ret) {
-	if (config.debug.rhizome)
-	  DEBUGF("Removing invalid manifest entry @%lld", rowid);
-	sqlite_exec_void_retry(&retry, "DELETE FROM MANIFESTS WHERE ROWID = ?;", INT64, rowid, END);
-      }
-      rhizome_manifest_free(m);
-    }
+  sqlite3_stmt *statement = sqlite_prepare(retry, "SELECT ROWID, MANIFEST FROM MANIFESTS WHERE verified = 0 ORDER BY ROWID DESC LIMIT 1;");
+  if (!statement)
+    return -1;
+  int r = sqlite_step_retry(retry, statement);
+  if (r != SQLITE_ROW) {
+    sqlite3_finalize(statement);
+    return r == SQLITE_DONE ? 0 : -1;
+  }
+  sqlite3_int64 rowid = sqlite3_column_int64(statement, 0);
+  const void *blob = sqlite3_column_blob(statement, 1);
+  size_t blob_length = sqlite3_column_bytes(statement, 1);
+  rhizome_manifest *m = rhizome_new_manifest();
+  if (!m) {
+    sqlite3_finalize(statement);
+    return -1;
+  }
+  if (blob_length <= sizeof m->manifestdata) {
+    memcpy(m->manifestdata, blob, blob_length);
+    m->manifest_all_bytes = blob_length;
   }
   sqlite3_finalize(statement);
+  if (   m->manifest_all_bytes
+      && rhizome_manifest_parse(m) != -1
+      && rhizome_manifest_validate(m)
+      && rhizome_manifest_verify(m)
+      && (m->filesize == 0 || rhizome_exists(&m->filehash))
+  ) {
+    assert(m->finalised);
+    /* Bring the MANIFESTS columns up to date and clear the mark.  The row is updated in place, not
+     * stored again, so that its ROWID (and hence every peer's sync position) stays the same.
+     */
+    rhizome_bar_t bar;
+    rhizome_manifest_to_bar(m, &bar);
+    int ret = sqlite_exec_void_retry(retry,
+	"UPDATE MANIFESTS SET verified = NULL, version = ?, bar = ?, filesize = ?, filehash = ?, "
+	"service = ?, name = ?, sender = ?, recipient = ?, tail = ?, sigkey = ? WHERE ROWID = ?;",
+	INT64, m->version,
+	RHIZOME_BAR_T, &bar,
+	INT64, m->filesize,
+	RHIZOME_FILEHASH_T|NUL, m->filesize > 0 ? &m->filehash : NULL,
+	STATIC_TEXT, m->service,
+	STATIC_TEXT|NUL, m->name,
+	SID_T|NUL, m->has_sender ? &m->sender : NULL,
+	SID_T|NUL, m->has_recipient ? &m->recipient : NULL,
+	INT64, m->tail,
+	STATIC_BLOB|NUL, config.rhizome.signature_cache_persist && m->has_selfsig_key ? m->selfsig_key : NULL, RHIZOME_SIGNATURE_KEY_BYTES,
+	INT64, rowid,
+	END) == -1 ? -1 : 1;
+    rhizome_manifest_free(m);
+    return ret;
+  }
+  rhizome_manifest_free(m);
+  if (config.debug.rhizome)
+    DEBUGF("Removing invalid manifest entry @%lld", rowid);
+  if (sqlite_exec_void_retry(retry, "DELETE FROM MANIFESTS WHERE ROWID = ?;", INT64, rowid, END) == -1)
+    return -1;
+  return 1;
+}
+
+/* Check every manifest in the store, before returning.
+ */
+void verify_bundles()
+{
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  if (rhizome_unverify_bundles() == -1)
+    return;
+  while (verify_next_bundle(&retry) == 1)
+    ;
+}
+
+/* Check unverified manifests in the background, until the slice of time is used up.  Returns 1 if
+ * there are more to check, 0 when there are none left.
+ */
+int rhizome_verify_step(time_ms_t slice_ms)
+{
+  static sqlite_retry_state retry;
+  static unsigned verified = 0;
+  if (!verified)
+    retry = SQLITE_RETRY_STATE_ASYNC;
+  sqlite_retry_resume(&retry);
+  time_ms_t deadline = gettime_ms() + slice_ms;
+  int ret;
+  while ((ret = verify_next_bundle(&retry)) == 1) {
+    ++verified;
+    if (gettime_ms() >= deadline)
+      return 1;
+  }
+  if (ret == -1 && sqlite_retry_yielded(&retry))
+    return 1;
+  if (verified && config.debug.rhizome)
+    DEBUGF("Background verification checked %u manifests", verified);
+  verified = 0;
+  return 0;
 }
 
 /*
@@ -230,6 +313,7 @@ int rhizome_opendb()
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
 
   uint64_t version;
+  int reverify = 0;
   if (sqlite_exec_uint64_retry(&retry, &version, "PRAGMA user_version;", END) == -1)
     RETURN(-1);
   
@@ -250,7 +334,9 @@ int rhizome_opendb()
 		      "name text, "
 		      "sender text collate nocase, "
 		      "recipient text collate nocase, "
-		      "tail integer"
+		      "tail integer, "
+		      "verified integer, "
+		      "sigkey blob"
 		  ");", END) == -1
       ||	sqlite_exec_void_retry(&retry, 
 		  "CREATE TABLE IF NOT EXISTS FILES("
@@ -285,7 +371,7 @@ int rhizome_opendb()
     sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "ALTER TABLE MANIFESTS ADD COLUMN name text;", END);
     sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "ALTER TABLE MANIFESTS ADD COLUMN sender text collate nocase;", END);
     sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "ALTER TABLE MANIFESTS ADD COLUMN recipient text collate nocase;", END);
-    verify_bundles();
+    reverify = 1;
     sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=2;", END);
   }
   if (version<3){
@@ -313,6 +399,52 @@ int rhizome_opendb()
     }
     sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=7;", END);
   }
+  if (version<8){
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TABLE IF NOT EXISTS BLOCKHASHES(id text not null primary key, hashes blob);", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=8;", END);
+  }
+  if (version<9){
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TABLE IF NOT EXISTS CHUNKS(id text not null primary key, length integer, refs integer, data blob);", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TABLE IF NOT EXISTS FILECHUNKS(fileid text not null, offset integer not null, length integer, chunk text not null, primary key(fileid, offset));", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE INDEX IF NOT EXISTS IDXFILECHUNKS_CHUNK ON FILECHUNKS(chunk);", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=9;", END);
+  }
+  if (version<10){
+    // a NULL verified column means the manifest has been checked
+    if (meta.mtime.tv_sec != -1)
+      sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "ALTER TABLE MANIFESTS ADD COLUMN verified integer;", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE INDEX IF NOT EXISTS IDX_MANIFESTS_VERIFIED ON MANIFESTS(verified);", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=10;", END);
+  }
+  if (version<11){
+    // digest of the manifest hash and its verified self-signature, see rhizome_signature_is_stored()
+    if (meta.mtime.tv_sec != -1)
+      sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "ALTER TABLE MANIFESTS ADD COLUMN sigkey blob;", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE INDEX IF NOT EXISTS IDX_MANIFESTS_SIGKEY ON MANIFESTS(sigkey);", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=11;", END);
+  }
+  if (version<12){
+    // payloads that were partly fetched, kept so that the fetch can be resumed, see rhizome_suspend_write()
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TABLE IF NOT EXISTS PARTIALS(bid text not null, version integer not null, filehash text not null, temp_id integer not null, length integer, ranges blob, updated integer, primary key(bid, version, filehash));", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=12;", END);
+  }
+  if (version<13){
+    // length of the chunk's data if it is stored compressed, see rhizome_chunk.c
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "ALTER TABLE CHUNKS ADD COLUMN stored integer;", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=13;", END);
+  }
+  if (version<14){
+    // listing bundles by service, sender and recipient, see rhizome_list_index()
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE INDEX IF NOT EXISTS IDX_MANIFESTS_SERVICE ON MANIFESTS(service);", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE INDEX IF NOT EXISTS IDX_MANIFESTS_SENDER ON MANIFESTS(sender);", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE INDEX IF NOT EXISTS IDX_MANIFESTS_RECIPIENT ON MANIFESTS(recipient);", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE INDEX IF NOT EXISTS IDX_MANIFESTS_SERVICE_SENDER ON MANIFESTS(service, sender);", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE INDEX IF NOT EXISTS IDX_MANIFESTS_SERVICE_RECIPIENT ON MANIFESTS(service, recipient);", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=14;", END);
+  }
+  // Rather than hold up startup, let the server check the manifests in the background.
+  if (reverify)
+    rhizome_unverify_bundles();
   
   // TODO recreate tables with collate nocase on all hex columns
 
@@ -343,6 +475,33 @@ int rhizome_opendb()
       DEBUGF("Set Rhizome database UUID to %s", alloca_uuid_str(rhizome_db_uuid));
   }
 
+  /* With a write-ahead log, readers (in this or any other process) no longer block a writer from
+   * committing, nor a writer block readers.  Must be done outside any transaction.  Another process
+   * holding the database open can prevent the mode from changing, in which case we carry on in
+   * whatever mode it is in.
+   */
+  strbuf mode = strbuf_alloca(16);
+  if (sqlite_exec_strbuf_retry(&retry, mode, config.rhizome.wal ? "PRAGMA journal_mode=WAL;" : "PRAGMA journal_mode=DELETE;", END) == -1)
+    WARN("Could not set Rhizome database journal mode");
+  rhizome_db_wal = strcasecmp(strbuf_str(mode), "wal") == 0;
+  if (rhizome_db_wal) {
+    // a commit need only reach the log, not the database, before returning
+    sqlite_exec_void_loglevel(loglevel, "PRAGMA synchronous=NORMAL;", END);
+    // the server checkpoints from an alarm, not in the middle of a commit
+    if (serverMode)
+      sqlite_exec_void_loglevel(loglevel, "PRAGMA wal_autocheckpoint=0;", END);
+    if (sqlite3_open_v2(dbpath, &rhizome_read_db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+      WARNF("SQLite could not open database %s for reading: %s", dbpath, sqlite3_errmsg(rhizome_read_db));
+      sqlite3_close(rhizome_read_db);
+      rhizome_read_db = NULL;
+    } else {
+      sqlite3_trace(rhizome_read_db, sqlite_trace_callback, NULL);
+      sqlite3_profile(rhizome_read_db, sqlite_profile_callback, NULL);
+    }
+  }
+  if (config.debug.rhizome)
+    DEBUGF("Rhizome database journal mode is %s%s", strbuf_str(mode), rhizome_read_db ? ", with a separate read connection" : "");
+
   // We can't delete a file that is being transferred in another process at this very moment...
   if (config.rhizome.clean_on_open)
     rhizome_cleanup(NULL);
@@ -351,12 +510,41 @@ int rhizome_opendb()
   OUT();
 }
 
+static void rhizome_cleanup_abort();
+
 int rhizome_close_db()
 {
   IN();
   if (rhizome_db) {
+    rhizome_cleanup_abort();
     rhizome_cache_close();
+    if (serverMode && rhizome_signature_cache_stats.misses)
+      INFOF("Manifest signature cache: %"PRIu64" hits, %"PRIu64" misses, %"PRIu64" found in store, %"PRIu64" verified, %"PRIu64" evicted",
+	  rhizome_signature_cache_stats.hits,
+	  rhizome_signature_cache_stats.misses,
+	  rhizome_signature_cache_stats.stored_hits,
+	  rhizome_signature_cache_stats.verifications,
+	  rhizome_signature_cache_stats.evictions
+	);
+    if (serverMode && sqlite_busy_stats.busy_events)
+      INFOF("Rhizome database was busy %"PRIu64" times: %"PRIu64" yields, %"PRIu64" timeouts, %"PRId64"ms waiting, %"PRId64"ms deferred",
+	  sqlite_busy_stats.busy_events,
+	  sqlite_busy_stats.yields,
+	  sqlite_busy_stats.timeouts,
+	  sqlite_busy_stats.wait_ms,
+	  sqlite_busy_stats.deferred_ms
+	);
     
+    if (rhizome_read_db) {
+      sqlite3_stmt *stmt = NULL;
+      while ((stmt = sqlite3_next_stmt(rhizome_read_db, stmt))) {
+	const char *sql = sqlite3_sql(stmt);
+	WARNF("closing Rhizome read db with unfinalised statement: %s", sql ? sql : "BLOB");
+      }
+      if (sqlite3_close(rhizome_read_db) != SQLITE_OK)
+	WHYF("Failed to close sqlite read database, %s", sqlite3_errmsg(rhizome_read_db));
+      rhizome_read_db = NULL;
+    }
     if (!sqlite3_get_autocommit(rhizome_db)){
       WHY("Uncommitted transaction!");
       sqlite_exec_void("ROLLBACK;", END);
@@ -371,6 +559,7 @@ int rhizome_close_db()
       RETURN(WHYF("Failed to close sqlite database, %s",sqlite3_errmsg(rhizome_db)));
   }
   rhizome_db=NULL;
+  rhizome_db_wal = 0;
   RETURN(0);
   OUT();
 }
@@ -408,6 +597,15 @@ int rhizome_close_db()
    latency, not just to each individual query, which could potentially add up to much greater
    latency than desired.  However, in non-server processes, each query may be allowed its own
    timeout, giving a greater chance of success at the expense of potentially greater latency.
+
+   Sleeping in the server stalls everything else it does, so code that runs from an alarm can use a
+   SQLITE_RETRY_STATE_ASYNC variable instead.  In the server, sqlite_retry() then never sleeps, but
+   sets the 'yielded' flag and returns false, so the operation fails as if it had timed out
+   (without logging an error).  The caller should check sqlite_retry_yielded(), leave its state
+   so that the operation can be repeated, and reschedule its alarm to try again after 'sleep' ms.
+   The flag stays set, even if the caller then rolls back successfully, until the caller clears it
+   with sqlite_retry_resume() before trying again.  In other processes, an async retry state
+   behaves like the default one.
  */
 
 /* In the servald server process, by default we retry every 10 ms for up to 50 ms, so as to not
@@ -422,18 +620,37 @@ sqlite_retry_state sqlite_retry_state_init(int serverLimit, int serverSleep, int
       .sleep = serverMode ? (serverSleep < 0 ? 10 : serverSleep) : (otherSleep < 0 ? 100 : otherSleep),
       .elapsed = 0,
       .start = -1,
-      .busytries = 0
+      .busytries = 0,
+      .async = 0,
+      .yielded = 0
     };
 }
 
+sqlite_retry_state sqlite_retry_state_async()
+{
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  retry.async = serverMode ? 1 : 0;
+  return retry;
+}
+
 int _sqlite_retry(struct __sourceloc __whence, sqlite_retry_state *retry, const char *action)
 {
   time_ms_t now = gettime_ms();
   ++retry->busytries;
+  ++sqlite_busy_stats.busy_events;
   if (retry->start == -1)
     retry->start = now;
   retry->elapsed = now - retry->start;
   
+  if (retry->async) {
+    if (config.debug.rhizome)
+      DEBUGF("%s, yielding after %.3f seconds: %s", sqlite3_errmsg(rhizome_db), (retry->elapsed) / 1e3, action);
+    ++sqlite_busy_stats.yields;
+    retry->yielded = 1;
+    retry->busytries = 0;
+    return 0; // tell caller to try again from its next alarm
+  }
+  
   INFOF("%s on try %u after %.3f seconds (limit %.3f): %s",
       sqlite3_errmsg(rhizome_db),
       retry->busytries,
@@ -444,14 +661,17 @@ int _sqlite_retry(struct __sourceloc __whence, sqlite_retry_state *retry, const
   
   if (retry->elapsed >= retry->limit) {
     // reset ready for next query
+    ++sqlite_busy_stats.timeouts;
     retry->busytries = 0;
     if (!serverMode)
       retry->start = -1;
     return 0; // tell caller to stop trying
   }
   
-  if (retry->sleep)
+  if (retry->sleep) {
     sleep_ms(retry->sleep);
+    sqlite_busy_stats.wait_ms += retry->sleep;
+  }
   return 1; // tell caller to try again
 }
 
@@ -466,6 +686,14 @@ void _sqlite_retry_done(struct __sourceloc __whence, sqlite_retry_state *retry,
 	action
       );
   }
+  if (retry->async && !retry->yielded && retry->start != -1) {
+    // the first query to succeed since resuming
+    time_ms_t now = gettime_ms();
+    if (config.debug.rhizome)
+      DEBUGF("succeeded %.3f seconds after yielding: %s", (now - retry->start) / 1e3, action);
+    sqlite_busy_stats.deferred_ms += now - retry->start;
+    retry->start = -1;
+  }
   // reset ready for next query
   retry->busytries = 0;
   if (!serverMode)
@@ -488,13 +716,13 @@ void _sqlite_retry_done(struct __sourceloc __whence, sqlite_retry_state *retry,
  *
  * @author Andrew Bettison <andrew@servalproject.com>
  */
-sqlite3_stmt *_sqlite_prepare(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, const char *sqltext)
+static sqlite3_stmt *sqlite_prepare_db(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, sqlite3 *db, const char *sqltext)
 {
   IN();
   sqlite3_stmt *statement = NULL;
-  assert(rhizome_db);
+  assert(db);
   while (1) {
-    switch (sqlite3_prepare_v2(rhizome_db, sqltext, -1, &statement, NULL)) {
+    switch (sqlite3_prepare_v2(db, sqltext, -1, &statement, NULL)) {
       case SQLITE_OK:
 	sqlite_trace_done = 0;
 	RETURN(statement);
@@ -503,15 +731,33 @@ sqlite3_stmt *_sqlite_prepare(struct __sourceloc __whence, int log_level, sqlite
 	if (retry && _sqlite_retry(__whence, retry, sqltext)) {
 	  break; // back to sqlite3_prepare_v2()
 	}
+	if (retry && retry->yielded) {
+	  sqlite3_finalize(statement);
+	  RETURN(NULL);
+	}
 	// fall through...
       default:
-	LOGF(log_level, "query invalid, %s: %s", sqlite3_errmsg(rhizome_db), sqltext);
+	LOGF(log_level, "query invalid, %s: %s", sqlite3_errmsg(db), sqltext);
 	sqlite3_finalize(statement);
 	RETURN(NULL);
     }
   }
 }
 
+sqlite3_stmt *_sqlite_prepare(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, const char *sqltext)
+{
+  return sqlite_prepare_db(__whence, log_level, retry, rhizome_db, sqltext);
+}
+
+/* Prepare a read-only query on the separate read connection, if there is one.  The query sees only
+ * committed transactions, so must not be used to read back anything written inside a transaction
+ * that is still open.
+ */
+sqlite3_stmt *_sqlite_prepare_read(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, const char *sqltext)
+{
+  return sqlite_prepare_db(__whence, log_level, retry, rhizome_read_db ? rhizome_read_db : rhizome_db, sqltext);
+}
+
 /* Bind some parameters to a prepared SQL statement.  Returns -1 if an error occurs (logged as an
  * error), otherwise zero with the prepared statement in *statement.
  *
@@ -521,7 +767,7 @@ sqlite3_stmt *_sqlite_prepare(struct __sourceloc __whence, int log_level, sqlite
  */
 int _sqlite_vbind(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, sqlite3_stmt *statement, va_list ap)
 {
-  const int index_limit = sqlite3_limit(rhizome_db, SQLITE_LIMIT_VARIABLE_NUMBER, -1);
+  const int index_limit = sqlite3_limit(sqlite3_db_handle(statement), SQLITE_LIMIT_VARIABLE_NUMBER, -1);
   unsigned argnum = 0;
   int index_counter = 0;
   enum sqlbind_type typ;
@@ -576,7 +822,7 @@ int _sqlite_vbind(struct __sourceloc __whence, int log_level, sqlite_retry_state
 	      if (retry && _sqlite_retry(__whence, retry, #FUNC "()")) \
 		continue; \
 	    default: \
-	      LOGF(log_level, #FUNC "(%d) failed, %s: %s", index, sqlite3_errmsg(rhizome_db), sqlite3_sql(statement)); \
+	      LOGF(log_level, #FUNC "(%d) failed, %s: %s", index, sqlite3_errmsg(sqlite3_db_handle(statement)), sqlite3_sql(statement)); \
 	      sqlite3_finalize(statement); \
 	      return -1; \
 	  } \
@@ -881,9 +1127,13 @@ int _sqlite_step(struct __sourceloc __whence, int log_level, sqlite_retry_state
 	  break; // back to sqlite3_step()
 	}
 	ret = stepcode;
+	if (retry && retry->yielded) {
+	  statement = NULL;
+	  break;
+	}
 	// fall through...
       default:
-	LOGF(log_level, "query failed (%d), %s: %s", stepcode, sqlite3_errmsg(rhizome_db), sqlite3_sql(statement));
+	LOGF(log_level, "query failed (%d), %s: %s", stepcode, sqlite3_errmsg(sqlite3_db_handle(statement)), sqlite3_sql(statement));
 	statement = NULL;
 	break;
     }
@@ -974,6 +1224,26 @@ int _sqlite_exec_void_retry(struct __sourceloc __whence, int log_level, sqlite_r
   return ret;
 }
 
+/* Rhizome store updates that must be atomic are bracketed with these instead of BEGIN and COMMIT,
+ * so that they can be nested inside a larger batch transaction (eg, bulk import).  Outside of any
+ * transaction, a SAVEPOINT behaves exactly like BEGIN DEFERRED, and releasing it commits.
+ */
+int _rhizome_db_begin(struct __sourceloc __whence, sqlite_retry_state *retry)
+{
+  return _sqlite_exec_void_retry(__whence, LOG_LEVEL_ERROR, retry, "SAVEPOINT rhizome;", END);
+}
+
+int _rhizome_db_commit(struct __sourceloc __whence, sqlite_retry_state *retry)
+{
+  return _sqlite_exec_void_retry(__whence, LOG_LEVEL_ERROR, retry, "RELEASE rhizome;", END);
+}
+
+void _rhizome_db_rollback(struct __sourceloc __whence, sqlite_retry_state *retry)
+{
+  if (_sqlite_exec_void_retry(__whence, LOG_LEVEL_ERROR, retry, "ROLLBACK TO rhizome;", END) != -1)
+    _sqlite_exec_void_retry(__whence, LOG_LEVEL_ERROR, retry, "RELEASE rhizome;", END);
+}
+
 static int _sqlite_vexec_uint64(struct __sourceloc __whence, sqlite_retry_state *retry, uint64_t *result, const char *sqltext, va_list ap)
 {
   sqlite3_stmt *statement = _sqlite_prepare(__whence, LOG_LEVEL_ERROR, retry, sqltext);
@@ -1187,6 +1457,38 @@ int rhizome_database_filehash_from_id(const rhizome_bid_t *bidp, uint64_t versio
   OUT();
 }
 
+/* Return 1 if a stored manifest's self-signature with the given key (see rhizome_signature_key())
+ * has already been verified, so the same signature over the same manifest need not be verified
+ * again, 0 if not, or -1 on error.
+ */
+int rhizome_signature_is_stored(const unsigned char *key)
+{
+  if (!rhizome_db)
+    return 0;
+  uint64_t found = 0;
+  int r = sqlite_exec_uint64(&found, "SELECT 1 FROM MANIFESTS WHERE sigkey = ? LIMIT 1;",
+      STATIC_BLOB, key, RHIZOME_SIGNATURE_KEY_BYTES, END);
+  return r == -1 ? -1 : r > 0;
+}
+
+/* Copy committed transactions from the write-ahead log into the database without waiting for any
+ * reader or writer, so that the log doesn't keep growing.  The server calls this from an alarm
+ * instead of letting SQLite do it during a commit.
+ */
+int rhizome_checkpoint_db()
+{
+  if (!rhizome_db || !rhizome_db_wal)
+    return 0;
+  int log_frames = 0;
+  int checkpointed = 0;
+  int r = sqlite3_wal_checkpoint_v2(rhizome_db, NULL, SQLITE_CHECKPOINT_PASSIVE, &log_frames, &checkpointed);
+  if (r != SQLITE_OK && r != SQLITE_BUSY && r != SQLITE_LOCKED)
+    return WHYF("sqlite3_wal_checkpoint_v2() failed (%d), %s", r, sqlite3_errmsg(rhizome_db));
+  if (config.debug.rhizome && log_frames > 0)
+    DEBUGF("Checkpointed %d of %d write-ahead log frames", checkpointed, log_frames);
+  return 0;
+}
+
 void rhizome_vacuum_db(sqlite_retry_state *retry){
   sqlite3_stmt *statement = sqlite_prepare_bind(retry, "PRAGMA incremental_vacuum;", END);
   if (!statement)
@@ -1194,74 +1496,390 @@ void rhizome_vacuum_db(sqlite_retry_state *retry){
   sqlite_exec_retry(retry, statement);
 }
 
-int rhizome_cleanup(struct rhizome_cleanup_report *report)
-{
-  IN();
-  if (config.debug.rhizome && report == NULL)
-    report = alloca(sizeof *report);
-  if (report)
-    bzero(report, sizeof *report);
-  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+/* Cleanup works through the store a phase at a time, in batches of at most RHIZOME_CLEANUP_BATCH
+ * rows (or blob directory entries), keeping a cursor for the current phase so that it can stop at
+ * any batch boundary and resume later.  The server runs it from an idle alarm a slice at a time (see
+ * rhizome_cleanup_step()), so that a large store never stalls the event loop with whole table scans,
+ * while "rhizome clean" and clean_on_open just run every batch at once.
+ */
 
-  // make sure we are under our database size limit
-  rhizome_store_cleanup(report);
-  
+#define RHIZOME_CLEANUP_BATCH 100
+#define RHIZOME_CLEANUP_VACUUM_PAGES 256
+// blob files are only ever removed once they have been left alone for this long
+#define RHIZOME_ORPHAN_BLOB_AGE_MS (10 * 60 * 1000)
+
+enum rhizome_cleanup_phase {
+  CLEANUP_STORE_SPACE = 0,
+  CLEANUP_STALE_FILES,
+  CLEANUP_ORPHAN_FILES,
+  CLEANUP_ORPHAN_FILEBLOBS,
+  CLEANUP_ORPHAN_BLOCKHASHES,
+  CLEANUP_ORPHAN_CHUNKS,
+  CLEANUP_ORPHAN_MANIFESTS,
+  CLEANUP_STALE_PARTIALS,
+  CLEANUP_BLOB_DIR,
+  CLEANUP_VACUUM,
+  CLEANUP_DONE
+};
+
+static const char *cleanup_phase_names[] = {
+  "store space",
+  "stale files",
+  "orphan files",
+  "orphan fileblobs",
+  "orphan blockhashes",
+  "orphan chunks",
+  "orphan manifests",
+  "stale partials",
+  "blob directory",
+  "vacuum",
+  "done"
+};
+
+struct rhizome_cleanup_state {
+  sqlite_retry_state retry;
+  enum rhizome_cleanup_phase phase;
+  // rowid of the last row examined in the current phase
+  int64_t cursor;
+  DIR *blob_dir;
+  time_ms_t insert_horizon;
+  time_ms_t blob_horizon;
+  time_ms_t partial_horizon;
+  time_ms_t elapsed;
+  unsigned slices;
+  struct rhizome_cleanup_report report;
+};
+
+static void cleanup_start(struct rhizome_cleanup_state *state, sqlite_retry_state retry)
+{
+  bzero(state, sizeof *state);
+  state->retry = retry;
   /* For testing, it helps to speed up the cleanup process. */
   const char *orphan_payload_persist_ms = getenv("SERVALD_ORPHAN_PAYLOAD_PERSIST_MS");
   time_ms_t now = gettime_ms();
-  time_ms_t insert_horizon_no_manifest = now - (orphan_payload_persist_ms ? atoi(orphan_payload_persist_ms) : 1000); // 1 second ago
+  state->insert_horizon = now - (orphan_payload_persist_ms ? atoi(orphan_payload_persist_ms) : 1000); // 1 second ago
+  state->blob_horizon = now - (orphan_payload_persist_ms ? atoi(orphan_payload_persist_ms) : RHIZOME_ORPHAN_BLOB_AGE_MS);
+  state->partial_horizon = now - config.rhizome.partial_max_age_ms;
+}
 
-  // Remove external payload files for stale, incomplete payloads.
-  sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
-      "SELECT id FROM FILES WHERE datavalid = 0;", END);
-  while (sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
-    const char *id = (const char *) sqlite3_column_text(statement, 0);
-    if (rhizome_delete_file_id(id)==0 && report)
-      ++report->deleted_stale_incoming_files;
+static void cleanup_next_phase(struct rhizome_cleanup_state *state)
+{
+  if (state->blob_dir) {
+    closedir(state->blob_dir);
+    state->blob_dir = NULL;
   }
-  sqlite3_finalize(statement);
+  state->phase++;
+  state->cursor = 0;
+}
+
+/* Find the rowid of the last row of the next batch of a table, or zero if the cursor has reached the
+ * end of the table.
+ */
+static int64_t cleanup_batch_end(sqlite_retry_state *retry, struct rhizome_cleanup_state *state, const char *table)
+{
+  char sql[160];
+  snprintf(sql, sizeof sql, "SELECT MAX(rowid) FROM (SELECT rowid FROM %s WHERE rowid > ? ORDER BY rowid LIMIT ?);", table);
+  uint64_t end = 0;
+  if (sqlite_exec_uint64_retry(retry, &end, sql, INT64, state->cursor, INT, RHIZOME_CLEANUP_BATCH, END) == -1)
+    return -1;
+  return (int64_t)end;
+}
 
-  // Remove external payload files for old, unreferenced payloads.
-  statement = sqlite_prepare_bind(&retry,
-      "SELECT id FROM FILES WHERE inserttime < ? AND NOT EXISTS( SELECT 1 FROM MANIFESTS WHERE MANIFESTS.filehash = FILES.id);",
-      INT64, insert_horizon_no_manifest, END);
-  while (sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
+/* Remove the FILES rows (and everything stored with them) in the next batch that match the given
+ * condition, which takes the insert horizon as its only parameter if it has one.  Returns the
+ * number removed, or -1 on error.
+ */
+static int cleanup_files_batch(sqlite_retry_state *retry, struct rhizome_cleanup_state *state, int64_t end,
+			       const char *condition, int bind_horizon)
+{
+  char sql[256];
+  snprintf(sql, sizeof sql, "SELECT id FROM FILES WHERE rowid > ? AND rowid <= ? AND %s;", condition);
+  char ids[RHIZOME_CLEANUP_BATCH][RHIZOME_FILEHASH_STRLEN + 1];
+  unsigned count = 0;
+  sqlite3_stmt *statement = bind_horizon
+    ? sqlite_prepare_bind(retry, sql, INT64, state->cursor, INT64, end, INT64, state->insert_horizon, END)
+    : sqlite_prepare_bind(retry, sql, INT64, state->cursor, INT64, end, END);
+  if (!statement)
+    return -1;
+  while (count < RHIZOME_CLEANUP_BATCH && sqlite_step_retry(retry, statement) == SQLITE_ROW) {
     const char *id = (const char *) sqlite3_column_text(statement, 0);
-    if (rhizome_delete_file_id(id)==0 && report)
-      ++report->deleted_orphan_files;
+    if (id && strlen(id) <= RHIZOME_FILEHASH_STRLEN)
+      strcpy(ids[count++], id);
   }
   sqlite3_finalize(statement);
+  if (sqlite_retry_yielded(retry))
+    return -1;
+  int deleted = 0;
+  unsigned i;
+  for (i = 0; i < count; ++i)
+    if (rhizome_delete_file_id(ids[i]) == 0)
+      ++deleted;
+  return deleted;
+}
 
-  // TODO Iterate through all files in RHIZOME_BLOB_SUBDIR and delete any which are no longer
-  // referenced or are stale.  This could take a long time, so for scalability should be done
-  // in an incremental background task.  See GitHub issue #50.
- 
-  // Remove payload blobs that are no longer referenced.
-  int ret = sqlite_exec_void_retry(&retry,
-      "DELETE FROM FILEBLOBS WHERE NOT EXISTS( SELECT 1 FROM FILES WHERE FILES.id = FILEBLOBS.id );",
-      END);
-  if (ret > 0 && report)
-    report->deleted_orphan_fileblobs += ret;
-
-  // delete manifests that no longer have payload files
-  ret = sqlite_exec_void_retry(&retry,
-      "DELETE FROM MANIFESTS WHERE filesize > 0 AND NOT EXISTS( SELECT 1 FROM FILES WHERE MANIFESTS.filehash = FILES.id);", END);
-  if (report && ret > 0)
-    report->deleted_orphan_manifests += ret;
-  
-  rhizome_vacuum_db(&retry);
-  
-  if (config.debug.rhizome && report)
-    DEBUGF("report deleted_stale_incoming_files=%u deleted_orphan_files=%u deleted_orphan_fileblobs=%u deleted_orphan_manifests=%u",
-	report->deleted_stale_incoming_files,
-	report->deleted_orphan_files,
-	report->deleted_orphan_fileblobs,
-	report->deleted_orphan_manifests
+/* Remove the partly fetched payloads in the next batch that have not been resumed since the partial
+ * horizon, and their files.  Returns the number removed, or -1 on error.
+ */
+static int cleanup_partials_batch(sqlite_retry_state *retry, struct rhizome_cleanup_state *state, int64_t end)
+{
+  uint64_t temp_ids[RHIZOME_CLEANUP_BATCH];
+  unsigned count = 0;
+  sqlite3_stmt *statement = sqlite_prepare_bind(retry,
+      "SELECT temp_id FROM PARTIALS WHERE rowid > ? AND rowid <= ? AND updated < ?;",
+      INT64, state->cursor, INT64, end, INT64, state->partial_horizon, END);
+  if (!statement)
+    return -1;
+  while (count < RHIZOME_CLEANUP_BATCH && sqlite_step_retry(retry, statement) == SQLITE_ROW)
+    temp_ids[count++] = (uint64_t)sqlite3_column_int64(statement, 0);
+  sqlite3_finalize(statement);
+  if (sqlite_retry_yielded(retry))
+    return -1;
+  int deleted = 0;
+  unsigned i;
+  for (i = 0; i < count; ++i) {
+    char blob_path[1024];
+    if (FORMF_RHIZOME_STORE_PATH(blob_path, "%s/%"PRIu64, RHIZOME_BLOB_SUBDIR, temp_ids[i])
+	&& unlink(blob_path) == -1 && errno != ENOENT)
+      WARNF_perror("unlink(%s)", alloca_str_toprint(blob_path));
+    if (sqlite_exec_void_retry(retry, "DELETE FROM PARTIALS WHERE temp_id = ?;", INT64, (int64_t)temp_ids[i], END) == -1)
+      return -1;
+    if (config.debug.rhizome_store)
+      DEBUGF("Deleted stale partial payload %"PRIu64, temp_ids[i]);
+    ++deleted;
+  }
+  return deleted;
+}
+
+/* Remove files in the blob directory that no payload refers to: temporary files whose writer has
+ * gone, and payload files whose FILES row has been removed.  Anything modified recently is left
+ * alone, in case another process is still writing or committing it.
+ */
+static int cleanup_blob_dir_batch(struct rhizome_cleanup_state *state)
+{
+  char dir_path[1024];
+  if (!state->blob_dir) {
+    if (!FORMF_RHIZOME_STORE_PATH(dir_path, "%s", RHIZOME_BLOB_SUBDIR))
+      return -1;
+    if ((state->blob_dir = opendir(dir_path)) == NULL) {
+      if (errno == ENOENT)
+	return 0;
+      return WHYF_perror("opendir(%s)", alloca_str_toprint(dir_path));
+    }
+  }
+  unsigned examined = 0;
+  struct dirent *entry;
+  while (examined < RHIZOME_CLEANUP_BATCH && (entry = readdir(state->blob_dir)) != NULL) {
+    const char *name = entry->d_name;
+    if (name[0] == '.')
+      continue;
+    ++examined;
+    char blob_path[1024];
+    if (!FORMF_RHIZOME_STORE_PATH(blob_path, "%s/%s", RHIZOME_BLOB_SUBDIR, name))
+      continue;
+    struct stat st;
+    if (lstat(blob_path, &st) == -1 || !S_ISREG(st.st_mode))
+      continue;
+    if ((time_ms_t)st.st_mtime * 1000 > state->blob_horizon)
+      continue;
+    const char *end;
+    uint64_t temp_id;
+    rhizome_filehash_t hash;
+    if (str_to_uint64(name, 10, &temp_id, &end) && *end == '\0') {
+      // temporary file, named by rhizome_open_write() after the process that is writing it
+      pid_t pid = (pid_t)(temp_id >> 16);
+      if (pid == getpid() || kill(pid, 0) == 0 || errno != ESRCH)
+	continue;
+      // or kept after a fetch stopped, until it is resumed or goes stale
+      uint64_t count = 0;
+      if (sqlite_exec_uint64(&count, "SELECT COUNT(*) FROM PARTIALS WHERE temp_id = ?;", INT64, (int64_t)temp_id, END) == -1 || count)
+	continue;
+    } else if (str_to_rhizome_filehash_t(&hash, name) == 0) {
+      uint64_t count = 0;
+      if (sqlite_exec_uint64(&count, "SELECT COUNT(*) FROM FILES WHERE id = ?;", RHIZOME_FILEHASH_T, &hash, END) == -1 || count)
+	continue;
+    } else
+      continue;
+    if (unlink(blob_path) == -1) {
+      WARNF_perror("unlink(%s)", alloca_str_toprint(blob_path));
+      continue;
+    }
+    if (config.debug.rhizome_store)
+      DEBUGF("Deleted orphan blob file %s", blob_path);
+    ++state->report.deleted_orphan_blobs;
+  }
+  return entry ? 1 : 0;
+}
+
+/* Run one batch of the current phase, moving on to the next phase when it is finished.  Returns 1
+ * if there is more to do, 0 when cleanup is complete, or -1 on error.
+ */
+static int cleanup_batch(sqlite_retry_state *retry, struct rhizome_cleanup_state *state)
+{
+  int64_t end = 0;
+  int ret = 0;
+  switch (state->phase) {
+    case CLEANUP_STORE_SPACE:
+      // make sure we are under our database size limit
+      rhizome_store_cleanup(&state->report);
+      break;
+    case CLEANUP_STALE_FILES:
+      // Remove external payload files for stale, incomplete payloads.
+      if ((end = cleanup_batch_end(retry, state, "FILES")) > 0
+	  && (ret = cleanup_files_batch(retry, state, end, "datavalid = 0", 0)) > 0)
+	state->report.deleted_stale_incoming_files += ret;
+      break;
+    case CLEANUP_ORPHAN_FILES:
+      // Remove external payload files for old, unreferenced payloads.
+      if ((end = cleanup_batch_end(retry, state, "FILES")) > 0
+	  && (ret = cleanup_files_batch(retry, state, end,
+	      "inserttime < ? AND NOT EXISTS( SELECT 1 FROM MANIFESTS WHERE MANIFESTS.filehash = FILES.id)", 1)) > 0)
+	state->report.deleted_orphan_files += ret;
+      break;
+    case CLEANUP_ORPHAN_FILEBLOBS:
+      // Remove payload blobs that are no longer referenced.
+      if ((end = cleanup_batch_end(retry, state, "FILEBLOBS")) > 0
+	  && (ret = sqlite_exec_void_retry(retry,
+	      "DELETE FROM FILEBLOBS WHERE rowid > ? AND rowid <= ? AND NOT EXISTS( SELECT 1 FROM FILES WHERE FILES.id = FILEBLOBS.id );",
+	      INT64, state->cursor, INT64, end, END)) > 0)
+	state->report.deleted_orphan_fileblobs += ret;
+      break;
+    case CLEANUP_ORPHAN_BLOCKHASHES:
+      if ((end = cleanup_batch_end(retry, state, "BLOCKHASHES")) > 0)
+	ret = sqlite_exec_void_retry(retry,
+	    "DELETE FROM BLOCKHASHES WHERE rowid > ? AND rowid <= ? AND NOT EXISTS( SELECT 1 FROM FILES WHERE FILES.id = BLOCKHASHES.id );",
+	    INT64, state->cursor, INT64, end, END);
+      break;
+    case CLEANUP_ORPHAN_CHUNKS:
+      if ((end = cleanup_batch_end(retry, state, "FILECHUNKS")) > 0)
+	ret = rhizome_cleanup_chunks(retry, state->cursor, end);
+      break;
+    case CLEANUP_ORPHAN_MANIFESTS:
+      // delete manifests that no longer have payload files
+      if ((end = cleanup_batch_end(retry, state, "MANIFESTS")) > 0
+	  && (ret = sqlite_exec_void_retry(retry,
+	      "DELETE FROM MANIFESTS WHERE rowid > ? AND rowid <= ? AND filesize > 0 AND NOT EXISTS( SELECT 1 FROM FILES WHERE MANIFESTS.filehash = FILES.id);",
+	      INT64, state->cursor, INT64, end, END)) > 0)
+	state->report.deleted_orphan_manifests += ret;
+      break;
+    case CLEANUP_STALE_PARTIALS:
+      if ((end = cleanup_batch_end(retry, state, "PARTIALS")) > 0
+	  && (ret = cleanup_partials_batch(retry, state, end)) > 0)
+	state->report.deleted_stale_partials += ret;
+      break;
+    case CLEANUP_BLOB_DIR:
+      if ((ret = cleanup_blob_dir_batch(state)) == 1)
+	return 1;
+      break;
+    case CLEANUP_VACUUM: {
+	// free a bounded number of pages at a time
+	uint64_t free_pages = 0;
+	if (sqlite_exec_uint64_retry(retry, &free_pages, "PRAGMA freelist_count;", END) == -1)
+	  return -1;
+	if (free_pages) {
+	  char sql[64];
+	  snprintf(sql, sizeof sql, "PRAGMA incremental_vacuum(%u);", RHIZOME_CLEANUP_VACUUM_PAGES);
+	  sqlite3_stmt *statement = sqlite_prepare_bind(retry, sql, END);
+	  if (!statement || sqlite_exec_retry(retry, statement) == -1)
+	    return -1;
+	  if (free_pages > RHIZOME_CLEANUP_VACUUM_PAGES)
+	    return 1;
+	}
+      }
+      break;
+    case CLEANUP_DONE:
+      return 0;
+  }
+  if (ret == -1 || end == -1)
+    return -1;
+  if (end > 0) {
+    state->cursor = end;
+    return 1;
+  }
+  cleanup_next_phase(state);
+  return state->phase == CLEANUP_DONE ? 0 : 1;
+}
+
+/* Run batches until the deadline passes, or cleanup is complete.  Returns 1 if there is more to do,
+ * 0 when cleanup is complete, or -1 on error.
+ */
+static int cleanup_slice(struct rhizome_cleanup_state *state, time_ms_t deadline)
+{
+  time_ms_t start = gettime_ms();
+  sqlite_retry_resume(&state->retry);
+  int ret;
+  do {
+    ret = cleanup_batch(&state->retry, state);
+  } while (ret == 1 && gettime_ms() < deadline);
+  // a batch that found the database locked leaves the cursor alone, so is simply repeated later
+  if (ret == -1 && sqlite_retry_yielded(&state->retry))
+    ret = 1;
+  time_ms_t spent = gettime_ms() - start;
+  state->elapsed += spent;
+  state->slices++;
+  if (config.debug.rhizome)
+    DEBUGF("Cleanup slice %u took %"PRId64"ms (%"PRId64"ms in total), at %s rowid=%"PRId64,
+	state->slices, spent, state->elapsed, cleanup_phase_names[state->phase], state->cursor);
+  if (ret == -1) {
+    cleanup_next_phase(state);
+    state->phase = CLEANUP_DONE;
+  }
+  if (ret != 1 && config.debug.rhizome)
+    DEBUGF("report deleted_stale_incoming_files=%u deleted_orphan_files=%u deleted_orphan_fileblobs=%u deleted_orphan_manifests=%u deleted_orphan_blobs=%u deleted_stale_partials=%u",
+	state->report.deleted_stale_incoming_files,
+	state->report.deleted_orphan_files,
+	state->report.deleted_orphan_fileblobs,
+	state->report.deleted_orphan_manifests,
+	state->report.deleted_orphan_blobs,
+	state->report.deleted_stale_partials
       );
-  RETURN(0);
+  return ret;
+}
+
+int rhizome_cleanup(struct rhizome_cleanup_report *report)
+{
+  IN();
+  struct rhizome_cleanup_state state;
+  cleanup_start(&state, SQLITE_RETRY_STATE_DEFAULT);
+  int ret;
+  while ((ret = cleanup_slice(&state, TIME_MS_NEVER_WILL)) == 1)
+    ;
+  if (report)
+    *report = state.report;
+  RETURN(ret);
   OUT();
 }
 
+static struct rhizome_cleanup_state background_cleanup;
+static char background_cleanup_running = 0;
+
+/* Do up to slice_ms of background cleanup, starting a new pass if none is in progress.  Returns 1
+ * if there is more to do, so the caller should call again soon, or 0 when the pass is complete.
+ */
+int rhizome_cleanup_step(time_ms_t slice_ms)
+{
+  if (!background_cleanup_running) {
+    cleanup_start(&background_cleanup, SQLITE_RETRY_STATE_ASYNC);
+    background_cleanup_running = 1;
+  }
+  if (cleanup_slice(&background_cleanup, gettime_ms() + slice_ms) == 1)
+    return 1;
+  background_cleanup_running = 0;
+  if (config.debug.rhizome)
+    DEBUGF("Background cleanup finished in %u slices, %"PRId64"ms",
+	background_cleanup.slices, background_cleanup.elapsed);
+  return 0;
+}
+
+static void rhizome_cleanup_abort()
+{
+  if (background_cleanup_running) {
+    if (background_cleanup.blob_dir)
+      closedir(background_cleanup.blob_dir);
+    background_cleanup.blob_dir = NULL;
+    background_cleanup_running = 0;
+  }
+}
+
 /*
   Store the specified manifest into the sqlite database.
   We assume that sufficient space has been made for us.
@@ -1297,7 +1915,7 @@ int rhizome_store_manifest(rhizome_manifest *m)
     return WHY("File should already be stored by now");
 
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
-  if (sqlite_exec_void_retry(&retry, "BEGIN TRANSACTION;", END) == -1)
+  if (rhizome_db_begin(&retry) == -1)
     return WHY("Failed to begin transaction");
 
   time_ms_t now = gettime_ms();
@@ -1321,9 +1939,10 @@ int rhizome_store_manifest(rhizome_manifest *m)
 	  "name,"
 	  "sender,"
 	  "recipient,"
-	  "tail"
+	  "tail,"
+	  "sigkey"
 	") VALUES("
-	  "?,?,?,?,?,?,?,?,?,?,?,?,?"
+	  "?,?,?,?,?,?,?,?,?,?,?,?,?,?"
 	");",
 	RHIZOME_BID_T, &m->cryptoSignPublic,
 	STATIC_BLOB, m->manifestdata, m->manifest_all_bytes,
@@ -1339,6 +1958,7 @@ int rhizome_store_manifest(rhizome_manifest *m)
 	SID_T|NUL, m->has_sender ? &m->sender : NULL,
 	SID_T|NUL, m->has_recipient ? &m->recipient : NULL,
 	INT64, m->tail,
+	STATIC_BLOB|NUL, config.rhizome.signature_cache_persist && m->has_selfsig_key ? m->selfsig_key : NULL, RHIZOME_SIGNATURE_KEY_BYTES,
 	END
       )
   ) == NULL)
@@ -1350,7 +1970,7 @@ int rhizome_store_manifest(rhizome_manifest *m)
   rhizome_manifest_set_rowid(m, sqlite3_last_insert_rowid(rhizome_db));
   rhizome_manifest_set_inserttime(m, now);
 
-  if (sqlite_exec_void_retry(&retry, "COMMIT;", END) != -1){
+  if (rhizome_db_commit(&retry) != -1){
     // This message used in tests; do not modify or remove.
     INFOF("RHIZOME ADD MANIFEST service=%s bid=%s version=%"PRIu64,
 	  m->service ? m->service : "NULL",
@@ -1358,6 +1978,7 @@ int rhizome_store_manifest(rhizome_manifest *m)
 	  m->version
 	);
     monitor_announce_bundle(m);
+    rhizome_bundle_notify(m);
     if (serverMode){
       time_ms_t now = gettime_ms();
       RESCHEDULE(&ALARM_STRUCT(rhizome_sync_announce), now, now, TIME_MS_NEVER_WILL);
@@ -1368,10 +1989,76 @@ rollback:
   if (stmt)
     sqlite3_finalize(stmt);
   WHYF("Failed to store bundle bid=%s", alloca_tohex_rhizome_bid_t(m->cryptoSignPublic));
-  sqlite_exec_void_retry(&retry, "ROLLBACK;", END);
+  rhizome_db_rollback(&retry);
   return -1;
 }
 
+/* Pick the index that serves a listing's filters.  Every index also orders its entries by rowid, so
+ * the listing comes out of the index already in order, instead of scanning the whole table or
+ * sorting.  SQLite cannot tell how selective a sender or recipient is, and on a large store it may
+ * otherwise prefer to walk the table in rowid order, so the choice is made explicitly.  The name
+ * filter is a LIKE pattern, which no index can serve.
+ */
+static const char *rhizome_list_index(const struct rhizome_list_cursor *c)
+{
+  if (c->service && c->is_sender_set)
+    return "IDX_MANIFESTS_SERVICE_SENDER";
+  if (c->service && c->is_recipient_set)
+    return "IDX_MANIFESTS_SERVICE_RECIPIENT";
+  if (c->is_sender_set)
+    return "IDX_MANIFESTS_SENDER";
+  if (c->is_recipient_set)
+    return "IDX_MANIFESTS_RECIPIENT";
+  if (c->service)
+    return "IDX_MANIFESTS_SERVICE";
+  return NULL;
+}
+
+/* Append the FROM and WHERE clauses that select the cursor's bundles, not including those it has
+ * already listed.
+ */
+static void rhizome_list_sql(struct rhizome_list_cursor *c, strbuf b)
+{
+  const char *index = rhizome_list_index(c);
+  strbuf_puts(b, " FROM manifests");
+  if (index)
+    strbuf_sprintf(b, " INDEXED BY %s", index);
+  strbuf_puts(b, " WHERE 1=1");
+  if (c->service)
+    strbuf_puts(b, " AND service = @service");
+  if (c->name)
+    strbuf_puts(b, " AND name like @name");
+  if (c->is_sender_set)
+    strbuf_puts(b, " AND sender = @sender");
+  if (c->is_recipient_set)
+    strbuf_puts(b, " AND recipient = @recipient");
+  if (c->rowid_since) {
+    strbuf_puts(b, " AND rowid > @last");
+    if (c->_rowid_last < c->rowid_since)
+      c->_rowid_last = c->rowid_since;
+  } else {
+    if (c->rowid_before && (c->_rowid_last == 0 || c->_rowid_last > c->rowid_before))
+      c->_rowid_last = c->rowid_before;
+    if (c->_rowid_last)
+      strbuf_puts(b, " AND rowid < @last");
+  }
+}
+
+static int rhizome_list_bind(struct rhizome_list_cursor *c, sqlite_retry_state *retry, sqlite3_stmt *statement)
+{
+  if (c->service && sqlite_bind(retry, statement, NAMED|STATIC_TEXT, "@service", c->service, END) == -1)
+    return -1;
+  if (c->name && sqlite_bind(retry, statement, NAMED|STATIC_TEXT, "@name", c->name, END) == -1)
+    return -1;
+  if (c->is_sender_set && sqlite_bind(retry, statement, NAMED|SID_T, "@sender", &c->sender, END) == -1)
+    return -1;
+  if (c->is_recipient_set && sqlite_bind(retry, statement, NAMED|SID_T, "@recipient", &c->recipient, END) == -1)
+    return -1;
+  if (c->_rowid_last && sqlite_bind(retry, statement, NAMED|INT64, "@last", c->_rowid_last, END) == -1)
+    return -1;
+  return 0;
+}
+
 /* The cursor struct must be zerofilled and the query parameters optionally filled in prior to
  * calling this function.
  *
@@ -1380,59 +2067,66 @@ rollback:
 int rhizome_list_open(struct rhizome_list_cursor *c)
 {
   if (config.debug.rhizome)
-    DEBUGF("c=%p c->service=%s c->name=%s c->sender=%s c->recipient=%s c->rowid_since=%"PRIu64" c->_rowid_last=%"PRIu64,
+    DEBUGF("c=%p c->service=%s c->name=%s c->sender=%s c->recipient=%s c->rowid_since=%"PRIu64" c->rowid_before=%"PRIu64" c->_rowid_last=%"PRIu64,
 	c,
 	alloca_str_toprint(c->service),
 	alloca_str_toprint(c->name),
 	c->is_sender_set ? alloca_tohex_sid_t(c->sender) : "UNSET",
 	c->is_recipient_set ? alloca_tohex_sid_t(c->recipient) : "UNSET",
 	c->rowid_since,
+	c->rowid_before,
 	c->_rowid_last
       );
   IN();
   strbuf b = strbuf_alloca(1024);
-  strbuf_sprintf(b, "SELECT id, manifest, version, inserttime, author, rowid FROM manifests WHERE 1=1");
-  if (c->service)
-    strbuf_puts(b, " AND service = @service");
-  if (c->name)
-    strbuf_puts(b, " AND name like @name");
-  if (c->is_sender_set)
-    strbuf_puts(b, " AND sender = @sender");
-  if (c->is_recipient_set)
-    strbuf_puts(b, " AND recipient = @recipient");
-  if (c->rowid_since) {
-    strbuf_puts(b, " AND rowid > @last ORDER BY rowid ASC"); // oldest first
-    if (c->_rowid_last < c->rowid_since)
-      c->_rowid_last = c->rowid_since;
-  } else {
-    if (c->_rowid_last)
-      strbuf_puts(b, " AND rowid < @last");
+  strbuf_puts(b, "SELECT id, manifest, version, inserttime, author, rowid");
+  rhizome_list_sql(c, b);
+  if (c->rowid_since)
+    strbuf_puts(b, " ORDER BY rowid ASC"); // oldest first
+  else
     strbuf_puts(b, " ORDER BY rowid DESC"); // most recent first
-  }
   if (strbuf_overrun(b))
     RETURN(WHYF("SQL command too long: %s", strbuf_str(b)));
+  if (config.debug.rhizome)
+    DEBUGF("%s", strbuf_str(b));
   c->_retry = SQLITE_RETRY_STATE_DEFAULT;
-  c->_statement = sqlite_prepare(&c->_retry, strbuf_str(b));
+  c->_statement = sqlite_prepare_read(&c->_retry, strbuf_str(b));
   if (c->_statement == NULL)
     RETURN(-1);
-  if (c->service && sqlite_bind(&c->_retry, c->_statement, NAMED|STATIC_TEXT, "@service", c->service, END) == -1)
-    goto failure;
-  if (c->name && sqlite_bind(&c->_retry, c->_statement, NAMED|STATIC_TEXT, "@name", c->name, END) == -1)
-    goto failure;
-  if (c->is_sender_set && sqlite_bind(&c->_retry, c->_statement, NAMED|SID_T, "@sender", &c->sender, END) == -1)
-    goto failure;
-  if (c->is_recipient_set && sqlite_bind(&c->_retry, c->_statement, NAMED|SID_T, "@recipient", &c->recipient, END) == -1)
-    goto failure;
-  if (c->_rowid_last && sqlite_bind(&c->_retry, c->_statement, NAMED|INT64, "@last", c->_rowid_last, END) == -1)
-    goto failure;
+  if (rhizome_list_bind(c, &c->_retry, c->_statement) == -1) {
+    sqlite3_finalize(c->_statement);
+    c->_statement = NULL;
+    RETURN(-1);
+  }
   c->manifest = NULL;
   c->_rowid_current = 0;
   RETURN(0);
   OUT();
-failure:
-  sqlite3_finalize(c->_statement);
-  c->_statement = NULL;
-  RETURN(-1);
+}
+
+/* Count the bundles that the cursor would list, without reading any manifests.  Unlike
+ * rhizome_list_next(), does not skip rows whose manifests are invalid, nor apply the service filter
+ * case-insensitively.
+ */
+int rhizome_list_count(struct rhizome_list_cursor *c, uint64_t *countp)
+{
+  IN();
+  strbuf b = strbuf_alloca(1024);
+  strbuf_puts(b, "SELECT COUNT(*)");
+  rhizome_list_sql(c, b);
+  if (strbuf_overrun(b))
+    RETURN(WHYF("SQL command too long: %s", strbuf_str(b)));
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = sqlite_prepare_read(&retry, strbuf_str(b));
+  if (statement == NULL)
+    RETURN(-1);
+  int ret = -1;
+  if (rhizome_list_bind(c, &retry, statement) != -1 && sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
+    *countp = sqlite3_column_int64(statement, 0);
+    ret = 0;
+  }
+  sqlite3_finalize(statement);
+  RETURN(ret);
   OUT();
 }
 
@@ -1519,11 +2213,7 @@ int rhizome_list_next(struct rhizome_list_cursor *c)
       rhizome_manifest_set_author(m, author);
     rhizome_manifest_set_rowid(m, q_rowid);
     rhizome_manifest_set_inserttime(m, q_inserttime);
-    if (c->service && !(m->service && strcasecmp(c->service, m->service) == 0))
-      continue;
-    if (c->is_sender_set && !(m->has_sender && cmp_sid_t(&c->sender, &m->sender) == 0))
-      continue;
-    if (c->is_recipient_set && !(m->has_recipient && cmp_sid_t(&c->recipient, &m->recipient) == 0))
+    if (!rhizome_list_matches(c, m))
       continue;
     assert(c->_rowid_current != 0);
     // Don't do rhizome_verify_author(m); too CPU expensive for a listing.  Save that for when
@@ -1535,6 +2225,21 @@ int rhizome_list_next(struct rhizome_list_cursor *c)
   OUT();
 }
 
+/* Return true if the given manifest could be listed by the cursor, ie, it passes the cursor's service,
+ * sender and recipient filters.  The name filter is an SQL LIKE pattern, so is left to the query,
+ * and any manifest passes it.
+ */
+int rhizome_list_matches(const struct rhizome_list_cursor *c, const rhizome_manifest *m)
+{
+  if (c->service && !(m->service && strcasecmp(c->service, m->service) == 0))
+    return 0;
+  if (c->is_sender_set && !(m->has_sender && cmp_sid_t(&c->sender, &m->sender) == 0))
+    return 0;
+  if (c->is_recipient_set && !(m->has_recipient && cmp_sid_t(&c->recipient, &m->recipient) == 0))
+    return 0;
+  return 1;
+}
+
 void rhizome_list_commit(struct rhizome_list_cursor *c)
 {
   if (config.debug.rhizome)
@@ -1560,6 +2265,91 @@ void rhizome_list_release(struct rhizome_list_cursor *c)
   }
 }
 
+static struct rhizome_bundle_listener *rhizome_bundle_listeners = NULL;
+
+DEFINE_ALARM(rhizome_bundle_listen_poll);
+
+static int rhizome_max_rowid(uint64_t *rowidp)
+{
+  *rowidp = 0;
+  return sqlite_exec_uint64(rowidp, "SELECT MAX(rowid) FROM MANIFESTS;", END) == -1 ? -1 : 0;
+}
+
+/* Start telling a listener about every bundle stored after its 'rowid', or after the most recently
+ * stored bundle if its 'rowid' is zero.  Returns -1 if the database cannot be queried.
+ */
+int rhizome_bundle_listen(struct rhizome_bundle_listener *l)
+{
+  assert(l->notify != NULL);
+  if (l->_prevp)
+    return 0;
+  if (l->rowid == 0 && rhizome_max_rowid(&l->rowid) == -1)
+    return -1;
+  if ((l->_next = rhizome_bundle_listeners) != NULL)
+    l->_next->_prevp = &l->_next;
+  l->_prevp = &rhizome_bundle_listeners;
+  rhizome_bundle_listeners = l;
+  struct sched_ent *alarm = &ALARM_STRUCT(rhizome_bundle_listen_poll);
+  if (!is_scheduled(alarm)) {
+    time_ms_t next = gettime_ms() + config.api.restful.newsince_poll_ms;
+    RESCHEDULE(alarm, next, next, next + config.api.restful.newsince_poll_ms);
+  }
+  return 0;
+}
+
+void rhizome_bundle_unlisten(struct rhizome_bundle_listener *l)
+{
+  if (!l->_prevp)
+    return;
+  if ((*l->_prevp = l->_next) != NULL)
+    l->_next->_prevp = l->_prevp;
+  l->_next = NULL;
+  l->_prevp = NULL;
+  if (rhizome_bundle_listeners == NULL)
+    unschedule(&ALARM_STRUCT(rhizome_bundle_listen_poll));
+}
+
+/* Tell every listener that has not yet seen it about a bundle.  A NULL manifest means that bundles
+ * up to the given rowid were stored by another process, and are not known.  If a listener has
+ * missed any bundles before this one, it is told about unknown bundles instead.
+ */
+static void rhizome_bundle_notify_listeners(const rhizome_manifest *m, uint64_t rowid)
+{
+  struct rhizome_bundle_listener *l = rhizome_bundle_listeners;
+  while (l) {
+    struct rhizome_bundle_listener *next = l->_next;
+    if (l->rowid < rowid) {
+      const rhizome_manifest *seen = l->rowid + 1 == rowid ? m : NULL;
+      l->rowid = rowid;
+      l->notify(l, seen);
+    }
+    l = next;
+  }
+}
+
+void rhizome_bundle_notify(const rhizome_manifest *m)
+{
+  if (rhizome_bundle_listeners)
+    rhizome_bundle_notify_listeners(m, m->rowid);
+}
+
+/* While anything is listening, bundles stored by other processes are noticed by polling the highest
+ * rowid, a single query no matter how many listeners there are.
+ */
+void rhizome_bundle_listen_poll(struct sched_ent *alarm)
+{
+  uint64_t rowid;
+  if (rhizome_bundle_listeners && rhizome_max_rowid(&rowid) != -1) {
+    if (config.debug.rhizome)
+      DEBUGF("Highest rowid=%"PRIu64, rowid);
+    rhizome_bundle_notify_listeners(NULL, rowid);
+  }
+  if (rhizome_bundle_listeners) {
+    time_ms_t next = gettime_ms() + config.api.restful.newsince_poll_ms;
+    RESCHEDULE(alarm, next, next, next + config.api.restful.newsince_poll_ms);
+  }
+}
+
 void rhizome_bytes_to_hex_upper(unsigned const char *in, char *out, int byteCount)
 {
   (void) tohex(out, byteCount * 2, in);
@@ -1675,10 +2465,14 @@ static enum rhizome_bundle_status unpack_manifest_row(sqlite_retry_state *retry,
   const char *q_author = (const char *) sqlite3_column_text(statement, 4);
   size_t q_blobsize = sqlite3_column_bytes(statement, 1); // must call after sqlite3_column_blob()
   uint64_t q_rowid = sqlite3_column_int64(statement, 5);
+  int q_unverified = sqlite3_column_type(statement, 6) != SQLITE_NULL && sqlite3_column_int(statement, 6) == 0;
   memcpy(m->manifestdata, q_blob, q_blobsize);
   m->manifest_all_bytes = q_blobsize;
   if (rhizome_manifest_parse(m) == -1 || !rhizome_manifest_validate(m))
     return WHYF("Manifest bid=%s in database but invalid", q_id);
+  // not yet checked by background verification, so don't trust it until its signature is checked
+  if (q_unverified && !rhizome_manifest_verify(m))
+    return WHYF("Manifest bid=%s in database but signature is invalid", q_id);
   if (q_author) {
     sid_t author;
     if (str_to_sid_t(&author, q_author) == -1)
@@ -1707,7 +2501,7 @@ enum rhizome_bundle_status rhizome_retrieve_manifest(const rhizome_bid_t *bidp,
     DEBUGF("retrieve manifest bid=%s", bidp ? alloca_tohex_rhizome_bid_t(*bidp) : "<NULL>");
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
   sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
-      "SELECT id, manifest, version, inserttime, author, rowid FROM manifests WHERE id = ?",
+      "SELECT id, manifest, version, inserttime, author, rowid, verified FROM manifests WHERE id = ?",
       RHIZOME_BID_T, bidp,
       END);
   if (!statement)
@@ -1734,7 +2528,7 @@ enum rhizome_bundle_status rhizome_retrieve_manifest_by_prefix(const unsigned ch
   like[prefix_strlen] = '%';
   like[prefix_strlen + 1] = '\0';
   sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
-      "SELECT id, manifest, version, inserttime, author, rowid FROM manifests WHERE id like ?",
+      "SELECT id, manifest, version, inserttime, author, rowid, verified FROM manifests WHERE id like ?",
       TEXT, like,
       END);
   if (!statement)
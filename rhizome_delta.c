@@ -0,0 +1,466 @@
+/*
+ Serval DNA - Rhizome payload deltas
+ Copyright (C) 2014 Serval Project Inc.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <assert.h>
+#include "serval.h"
+#include "conf.h"
+#include "rhizome.h"
+#include "dataformats.h"
+
+/* A node fetching a new version of a bundle whose old version it already holds can ask for the new
+ * payload as a delta against the old one, in the manner of rsync.  The fetcher cuts the old payload
+ * into fixed size blocks, and sends a weak rolling checksum and a strong hash of each one.  The
+ * sender slides a window over the new payload, looking up the rolling checksum at every byte and
+ * confirming a match with the strong hash, so blocks are found wherever an edit has moved them to.
+ * The delta it sends back is a list of ops:
+ *
+ *    'C' first:ui32 count:ui32      copy count blocks of the old payload, starting at block first
+ *    'L' length:ui32 bytes[length]  literal bytes of the new payload
+ *
+ * The signatures are sent as block size:ui32 and count:ui32, then the weak checksum:ui32 and the
+ * first eight bytes of the SHA-512 hash of each block.  A short block at the end of the old payload
+ * is never signed.  All numbers are big endian.  The fetcher writes the new payload in order, so it
+ * is hashed as it is written and checked against the manifest as any other fetched payload is.
+ */
+
+#define RHIZOME_DELTA_STRONG_BYTES (RHIZOME_DELTA_SIGNATURE_BYTES - 4)
+// literal runs longer than this are sent as several ops
+#define RHIZOME_DELTA_MAX_LITERAL (1024*1024)
+#define RHIZOME_DELTA_COPY_OP_BYTES 9
+#define RHIZOME_DELTA_LITERAL_OP_BYTES 5
+
+/* The rsync rolling checksum of a block: the sum of its bytes, and the sum of those running sums,
+ * each modulo 2^16.
+ */
+struct rolling {
+  uint32_t a;
+  uint32_t b;
+  uint32_t len;
+};
+
+static void rolling_init(struct rolling *r, const unsigned char *data, uint32_t len)
+{
+  uint32_t a = 0, b = 0, i;
+  for (i = 0; i < len; ++i) {
+    a += data[i];
+    b += (len - i) * (uint32_t)data[i];
+  }
+  r->a = a & 0xFFFF;
+  r->b = b & 0xFFFF;
+  r->len = len;
+}
+
+static void rolling_roll(struct rolling *r, unsigned char out, unsigned char in)
+{
+  r->a = (r->a - out + in) & 0xFFFF;
+  r->b = (r->b - r->len * (uint32_t)out + r->a) & 0xFFFF;
+}
+
+static uint32_t rolling_digest(const struct rolling *r)
+{
+  return r->a | (r->b << 16);
+}
+
+static void strong_hash(const unsigned char *data, size_t len, unsigned char hash[RHIZOME_DELTA_STRONG_BYTES])
+{
+  SHA512_CTX context;
+  unsigned char digest[SHA512_DIGEST_LENGTH];
+  SHA512_Init(&context);
+  SHA512_Update(&context, data, len);
+  SHA512_Final(digest, &context);
+  SHA512_End(&context, NULL);
+  memcpy(hash, digest, RHIZOME_DELTA_STRONG_BYTES);
+}
+
+/* Choose a block size of about the square root of the payload size, which balances the size of the
+ * signatures against the size of the literal runs that an edit costs.
+ */
+uint32_t rhizome_delta_block_size(uint64_t length)
+{
+  uint32_t block_size = RHIZOME_DELTA_MIN_BLOCK;
+  while (   block_size < RHIZOME_DELTA_MAX_BLOCK
+	 && (   (uint64_t)block_size * block_size < length
+	     || length / block_size > RHIZOME_DELTA_MAX_SIGNATURES))
+    block_size <<= 1;
+  return block_size;
+}
+
+/* Compute the signatures of every whole block of a stored payload, into a newly allocated buffer.
+ * Returns 0 if successful, -1 if the payload cannot be read.
+ */
+int rhizome_delta_signatures(const rhizome_filehash_t *hashp, uint32_t *block_sizep, unsigned char **signaturesp, size_t *lengthp)
+{
+  struct rhizome_read read_state;
+  bzero(&read_state, sizeof read_state);
+  read_state.blob_fd = -1;
+  unsigned char *signatures = NULL;
+  unsigned char *block = NULL;
+  if (rhizome_open_read(&read_state, hashp) != RHIZOME_PAYLOAD_STATUS_STORED)
+    goto fail;
+  if (read_state.length == RHIZOME_SIZE_UNSET && rhizome_read(&read_state, NULL, 0))
+    goto fail;
+  uint32_t block_size = rhizome_delta_block_size(read_state.length);
+  uint64_t count = read_state.length / block_size;
+  if (count > RHIZOME_DELTA_MAX_SIGNATURES)
+    count = RHIZOME_DELTA_MAX_SIGNATURES;
+  size_t length = 8 + (size_t)count * RHIZOME_DELTA_SIGNATURE_BYTES;
+  if ((signatures = emalloc(length)) == NULL || (block = emalloc(block_size)) == NULL)
+    goto fail;
+  write_uint32(signatures, block_size);
+  write_uint32(signatures + 4, (uint32_t)count);
+  unsigned char *p = signatures + 8;
+  uint64_t i;
+  for (i = 0; i < count; ++i) {
+    size_t got = 0;
+    while (got < block_size) {
+      ssize_t r = rhizome_read(&read_state, block + got, block_size - got);
+      if (r <= 0)
+	goto fail;
+      got += (size_t) r;
+    }
+    struct rolling weak;
+    rolling_init(&weak, block, block_size);
+    write_uint32(p, rolling_digest(&weak));
+    strong_hash(block, block_size, p + 4);
+    p += RHIZOME_DELTA_SIGNATURE_BYTES;
+  }
+  free(block);
+  rhizome_read_close(&read_state);
+  *block_sizep = block_size;
+  *signaturesp = signatures;
+  *lengthp = length;
+  return 0;
+fail:
+  if (signatures)
+    free(signatures);
+  if (block)
+    free(block);
+  rhizome_read_close(&read_state);
+  return -1;
+}
+
+static int delta_add_op(struct rhizome_delta *delta, char copy, uint64_t offset, uint64_t length)
+{
+  if (copy && delta->op_count) {
+    // consecutive blocks are copied in one op
+    struct rhizome_delta_op *last = &delta->ops[delta->op_count - 1];
+    if (last->copy && last->offset + last->length == offset) {
+      last->length += length;
+      return 0;
+    }
+  }
+  if (delta->op_count == delta->op_alloc) {
+    size_t alloc = delta->op_alloc ? delta->op_alloc * 2 : 64;
+    struct rhizome_delta_op *ops = erealloc(delta->ops, alloc * sizeof *ops);
+    if (!ops)
+      return -1;
+    delta->ops = ops;
+    delta->op_alloc = alloc;
+  }
+  struct rhizome_delta_op *op = &delta->ops[delta->op_count++];
+  op->copy = copy;
+  op->offset = offset;
+  op->length = length;
+  if (copy)
+    delta->length += RHIZOME_DELTA_COPY_OP_BYTES;
+  else {
+    delta->length += RHIZOME_DELTA_LITERAL_OP_BYTES + length;
+    delta->literal_bytes += length;
+  }
+  return 0;
+}
+
+static int delta_add_literal(struct rhizome_delta *delta, uint64_t offset, uint64_t end)
+{
+  while (offset < end) {
+    uint64_t length = end - offset;
+    if (length > RHIZOME_DELTA_MAX_LITERAL)
+      length = RHIZOME_DELTA_MAX_LITERAL;
+    if (delta_add_op(delta, 0, offset, length) == -1)
+      return -1;
+    offset += length;
+  }
+  return 0;
+}
+
+/* Work out the ops that build a stored payload from the blocks that the given signatures describe.
+ * Only the ops are kept; literal bytes are read from the payload again as the delta is sent.
+ * Returns 0 if successful, -1 if the signatures are malformed or the payload cannot be read.
+ */
+int rhizome_delta_encode(struct rhizome_delta *delta, const rhizome_filehash_t *hashp, const unsigned char *signatures, size_t length)
+{
+  bzero(delta, sizeof *delta);
+  if (length < 8)
+    return WHY("Delta signatures truncated");
+  uint32_t block_size = read_uint32(signatures);
+  uint32_t count = read_uint32(signatures + 4);
+  if (   block_size < RHIZOME_DELTA_MIN_BLOCK
+      || block_size > RHIZOME_DELTA_MAX_BLOCK
+      || count > RHIZOME_DELTA_MAX_SIGNATURES
+      || length != 8 + (size_t)count * RHIZOME_DELTA_SIGNATURE_BYTES)
+    return WHYF("Malformed delta signatures (block size %"PRIu32", %"PRIu32" blocks, %zu bytes)", block_size, count, length);
+  delta->block_size = block_size;
+  const unsigned char *sigs = signatures + 8;
+
+  // index the blocks by weak checksum
+  uint32_t buckets = 1;
+  while (buckets < count * 2)
+    buckets <<= 1;
+  int32_t *heads = NULL, *next = NULL;
+  unsigned char *window = NULL;
+  struct rhizome_read read_state;
+  bzero(&read_state, sizeof read_state);
+  read_state.blob_fd = -1;
+  if ((heads = emalloc(buckets * sizeof *heads)) == NULL || (next = emalloc((count + 1) * sizeof *next)) == NULL)
+    goto fail;
+  memset(heads, 0xFF, buckets * sizeof *heads);
+  uint32_t i;
+  for (i = count; i > 0; --i) {
+    uint32_t weak = read_uint32(sigs + (i - 1) * RHIZOME_DELTA_SIGNATURE_BYTES);
+    uint32_t bucket = (weak ^ (weak >> 16)) & (buckets - 1);
+    next[i - 1] = heads[bucket];
+    heads[bucket] = i - 1;
+  }
+
+  if (rhizome_open_read(&read_state, hashp) != RHIZOME_PAYLOAD_STATUS_STORED)
+    goto fail;
+  if (read_state.length == RHIZOME_SIZE_UNSET && rhizome_read(&read_state, NULL, 0))
+    goto fail;
+  uint64_t file_length = read_state.length;
+
+  // the window holds the new payload from the current position onwards
+  size_t window_size = 4 * (size_t)block_size;
+  if (window_size < 64*1024)
+    window_size = 64*1024;
+  if ((window = emalloc(window_size)) == NULL)
+    goto fail;
+  uint64_t window_start = 0;
+  size_t window_len = 0;
+  uint64_t pos = 0, literal_start = 0;
+  struct rolling weak;
+  int rolling = 0;
+  while (count && pos + block_size <= file_length) {
+    // make sure the window holds the block at pos, and the byte after it
+    if (pos + block_size + 1 > window_start + window_len && window_start + window_len < file_length) {
+      size_t keep = window_start + window_len - pos;
+      memmove(window, window + (pos - window_start), keep);
+      window_start = pos;
+      window_len = keep;
+      while (window_len < window_size && window_start + window_len < file_length) {
+	ssize_t r = rhizome_read(&read_state, window + window_len, window_size - window_len);
+	if (r <= 0)
+	  goto fail;
+	window_len += (size_t) r;
+      }
+    }
+    const unsigned char *data = window + (pos - window_start);
+    if (!rolling) {
+      rolling_init(&weak, data, block_size);
+      rolling = 1;
+    }
+    uint32_t digest = rolling_digest(&weak);
+    int32_t match = heads[(digest ^ (digest >> 16)) & (buckets - 1)];
+    unsigned char strong[RHIZOME_DELTA_STRONG_BYTES];
+    int hashed = 0;
+    for (; match != -1; match = next[match]) {
+      const unsigned char *sig = sigs + match * RHIZOME_DELTA_SIGNATURE_BYTES;
+      if (read_uint32(sig) != digest)
+	continue;
+      if (!hashed) {
+	strong_hash(data, block_size, strong);
+	hashed = 1;
+      }
+      if (memcmp(sig + 4, strong, RHIZOME_DELTA_STRONG_BYTES) == 0)
+	break;
+    }
+    if (match != -1) {
+      if (   delta_add_literal(delta, literal_start, pos) == -1
+	  || delta_add_op(delta, 1, match, 1) == -1)
+	goto fail;
+      pos += block_size;
+      literal_start = pos;
+      rolling = 0;
+    } else {
+      if (pos + block_size < file_length)
+	rolling_roll(&weak, data[0], data[block_size]);
+      ++pos;
+    }
+  }
+  if (delta_add_literal(delta, literal_start, file_length) == -1)
+    goto fail;
+  free(window);
+  free(heads);
+  free(next);
+  rhizome_read_close(&read_state);
+  return 0;
+fail:
+  if (window)
+    free(window);
+  if (heads)
+    free(heads);
+  if (next)
+    free(next);
+  rhizome_read_close(&read_state);
+  rhizome_delta_free(delta);
+  return -1;
+}
+
+/* Encode as much more of the delta as fits in the buffer, reading the literal bytes from the new
+ * payload.  Returns the number of bytes encoded, which is 0 once the whole delta has been encoded,
+ * or -1 on error.
+ */
+ssize_t rhizome_delta_generate(struct rhizome_delta *delta, struct rhizome_read *read_state, unsigned char *buffer, size_t bufsz)
+{
+  size_t len = 0;
+  while (delta->op_next < delta->op_count) {
+    const struct rhizome_delta_op *op = &delta->ops[delta->op_next];
+    if (op->copy) {
+      if (bufsz - len < RHIZOME_DELTA_COPY_OP_BYTES)
+	break;
+      buffer[len] = 'C';
+      write_uint32(buffer + len + 1, (uint32_t)op->offset);
+      write_uint32(buffer + len + 5, (uint32_t)op->length);
+      len += RHIZOME_DELTA_COPY_OP_BYTES;
+      delta->op_next++;
+      continue;
+    }
+    if (delta->op_sent == 0) {
+      if (bufsz - len < RHIZOME_DELTA_LITERAL_OP_BYTES + 1)
+	break;
+      buffer[len] = 'L';
+      write_uint32(buffer + len + 1, (uint32_t)op->length);
+      len += RHIZOME_DELTA_LITERAL_OP_BYTES;
+      read_state->offset = op->offset;
+    }
+    if (len == bufsz)
+      break;
+    size_t size = bufsz - len;
+    if (size > op->length - delta->op_sent)
+      size = op->length - delta->op_sent;
+    ssize_t r = rhizome_read(read_state, buffer + len, size);
+    if (r <= 0)
+      return WHYF("Cannot read literal bytes of delta @%"PRIu64, op->offset + delta->op_sent);
+    len += (size_t) r;
+    delta->op_sent += (size_t) r;
+    if (delta->op_sent == op->length) {
+      delta->op_sent = 0;
+      delta->op_next++;
+    }
+  }
+  delta->generated += len;
+  return len;
+}
+
+void rhizome_delta_free(struct rhizome_delta *delta)
+{
+  if (delta->ops)
+    free(delta->ops);
+  delta->ops = NULL;
+  delta->op_count = delta->op_alloc = 0;
+  delta->op_next = delta->op_sent = delta->generated = 0;
+}
+
+/* Get ready to build a new payload from a delta against the blocks of an old one.
+ */
+int rhizome_delta_decode_init(struct rhizome_delta_decoder *decoder, const rhizome_filehash_t *hashp, uint32_t block_size, uint32_t block_count)
+{
+  bzero(decoder, sizeof *decoder);
+  decoder->old.blob_fd = -1;
+  decoder->block_size = block_size;
+  decoder->block_count = block_count;
+  if (rhizome_open_read(&decoder->old, hashp) != RHIZOME_PAYLOAD_STATUS_STORED) {
+    rhizome_read_close(&decoder->old);
+    return -1;
+  }
+  return 0;
+}
+
+static int delta_copy(struct rhizome_delta_decoder *decoder, struct rhizome_write *write, uint32_t first, uint32_t count)
+{
+  if ((uint64_t)first + count > decoder->block_count)
+    return WHYF("Delta copies blocks %"PRIu32"+%"PRIu32" of only %"PRIu32, first, count, decoder->block_count);
+  uint64_t length = (uint64_t)count * decoder->block_size;
+  if (length > write->file_length - write->file_offset)
+    return WHY("Delta copies past the end of the payload");
+  decoder->old.offset = (uint64_t)first * decoder->block_size;
+  unsigned char buffer[RHIZOME_CRYPT_PAGE_SIZE];
+  while (length > 0) {
+    size_t size = sizeof buffer;
+    if (size > length)
+      size = length;
+    ssize_t r = rhizome_read(&decoder->old, buffer, size);
+    if (r <= 0)
+      return WHY("Cannot read blocks copied by delta");
+    if (rhizome_write_buffer(write, buffer, (size_t) r))
+      return -1;
+    length -= (size_t) r;
+    decoder->copied += (size_t) r;
+  }
+  return 0;
+}
+
+/* Apply the next bytes of a delta, copying blocks from the old payload and writing literal bytes, in
+ * order.  Returns 0 if successful, -1 if the delta is malformed or cannot be applied.
+ */
+int rhizome_delta_decode(struct rhizome_delta_decoder *decoder, struct rhizome_write *write, unsigned char *buffer, size_t len)
+{
+  decoder->received += len;
+  while (len > 0) {
+    if (decoder->literal) {
+      size_t size = len;
+      if (size > decoder->literal)
+	size = decoder->literal;
+      if (size > write->file_length - write->file_offset)
+	return WHY("Delta writes past the end of the payload");
+      if (rhizome_write_buffer(write, buffer, size))
+	return -1;
+      buffer += size;
+      len -= size;
+      decoder->literal -= size;
+      continue;
+    }
+    // gather the op header, which may be split between reads
+    size_t need = 1;
+    if (decoder->op_len)
+      need = decoder->op[0] == 'C' ? RHIZOME_DELTA_COPY_OP_BYTES : RHIZOME_DELTA_LITERAL_OP_BYTES;
+    size_t size = need - decoder->op_len;
+    if (size > len)
+      size = len;
+    memcpy(decoder->op + decoder->op_len, buffer, size);
+    decoder->op_len += size;
+    buffer += size;
+    len -= size;
+    if (decoder->op_len == 1 && decoder->op[0] != 'C' && decoder->op[0] != 'L')
+      return WHYF("Unknown delta op 0x%02x", decoder->op[0]);
+    if (decoder->op_len == 1 || decoder->op_len < need)
+      continue;
+    decoder->op_len = 0;
+    if (decoder->op[0] == 'C') {
+      if (delta_copy(decoder, write, read_uint32(decoder->op + 1), read_uint32(decoder->op + 5)) == -1)
+	return -1;
+    } else
+      decoder->literal = read_uint32(decoder->op + 1);
+  }
+  return 0;
+}
+
+void rhizome_delta_decode_close(struct rhizome_delta_decoder *decoder)
+{
+  rhizome_read_close(&decoder->old);
+}
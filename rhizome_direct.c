@@ -110,6 +110,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "serval.h"
 #include "conf.h"
 #include "rhizome.h"
+#include "overlay_buffer.h"
 #include "str.h"
 #include "commandline.h"
 #include <assert.h>
@@ -154,8 +155,13 @@ rhizome_direct_sync_request
   r->pushP=mode&1;
   r->pullP=mode&2;
   r->interval=interval;
-  r->cursor=rhizome_direct_bundle_iterator(buffer_size);
-  assert(r->cursor);
+  /* A buffer size of zero asks for the sync to reconcile ranges of the store,
+     rather than walk it with a cursor. */
+  if (buffer_size)
+    r->cursor=rhizome_direct_bundle_iterator(buffer_size);
+  else
+    r->ranges=rhizome_direct_range_begin();
+  assert(r->cursor || r->ranges);
   
   rd_sync_handles[rd_sync_handle_count++]=r;
   return r;
@@ -187,8 +193,25 @@ int rhizome_direct_continue_sync_request(rhizome_direct_sync_request *r)
 
      In short, if the cursor's current position is the limit position, 
      then we can stop. 
+
+     When reconciling ranges, we stop once a response leaves nothing more to
+     ask.
   */
 
+  if (r->cursor==NULL) {
+    if (r->ranges==NULL) {
+      if (!r->bundle_transfers_in_progress) {
+	DEBUG("All ranges reconciled");
+	return rhizome_direct_conclude_sync_request(r);
+      }
+      DEBUG("Stuck on in-progress transfers");
+      return 0;
+    }
+    r->dispatch_function(r);
+    r->fills_sent++;
+    return 0;
+  }
+
   if (r->cursor->size_high>=r->cursor->limit_size_high)
     {
       DEBUG("Out of bins");
@@ -202,8 +225,11 @@ int rhizome_direct_continue_sync_request(rhizome_direct_sync_request *r)
 	  /* seems that all is done */
 	  DEBUG("All done");
 	  return rhizome_direct_conclude_sync_request(r);
-	} else 
+	}
+	/* The transport calls us again once its transfers finish, so there is
+	   nothing more to send until then. */
 	DEBUG("Stuck on in-progress transfers");
+	return 0;
       } else
 	DEBUGF("bid_low<limit_bid_high");
     }
@@ -235,7 +261,12 @@ int rhizome_direct_conclude_sync_request(rhizome_direct_sync_request *r)
       if (r==rd_sync_handles[i])
 	{
 	  DEBUG("Found it");
-	  rhizome_direct_bundle_iterator_free(&r->cursor);
+	  if (r->release_function)
+	    r->release_function(r);
+	  if (r->cursor)
+	    rhizome_direct_bundle_iterator_free(&r->cursor);
+	  if (r->ranges)
+	    ob_free(r->ranges);
 	  free(r);
 	  
 	  if (i!=rd_sync_handle_count-1)
@@ -476,30 +507,37 @@ static int rhizome_sync_with_peers(int mode, int peer_count, const struct config
 
   /* Get iterator capable of 64KB buffering.
      In future we should parse the sync URL and base the buffer size on the
-     transport and allowable traffic volumes. */
-  rhizome_direct_transport_state_http *state = emalloc_zero(sizeof(rhizome_direct_transport_state_http));
-  /* XXX This code runs each sync in series, when we can probably do them in
-     parallel.  But we can't really do them in parallel until we make the
-     synchronisation process fully asynchronous, which probably won't happen
-     for a while yet.
+     transport and allowable traffic volumes.
+     All the peers are synchronised at once, each over its own asynchronous
+     HTTP client, which frees its transport state when its sync concludes.
      Also, we don't currently parse the URI protocol field fully. */
   int peer_number;
   for (peer_number = 0; peer_number < peer_count; ++peer_number) {
     const struct config_rhizome_peer *peer = peers[peer_number];
     if (strcasecmp(peer->protocol, "http") != 0)
       return WHYF("Unsupported Rhizome Direct protocol %s", alloca_str_toprint(peer->protocol));
+    if (strlen(peer->host) >= sizeof ((rhizome_direct_transport_state_http *)NULL)->host)
+      return WHYF("Rhizome Direct host name too long: %s", alloca_str_toprint(peer->host));
+  }
+  for (peer_number = 0; peer_number < peer_count; ++peer_number) {
+    const struct config_rhizome_peer *peer = peers[peer_number];
+    rhizome_direct_transport_state_http *state = emalloc_zero(sizeof(rhizome_direct_transport_state_http));
+    if (!state)
+      break;
     strbuf h = strbuf_local(state->host, sizeof state->host);
     strbuf_puts(h, peer->host);
-    if (strbuf_overrun(h))
-      return WHYF("Rhizome Direct host name too long: %s", alloca_str_toprint(peer->host));
     state->port = peer->port;
     DEBUGF("Rhizome direct peer is %s://%s:%d", peer->protocol, state->host, state->port);
-    rhizome_direct_sync_request *s = rhizome_direct_new_sync_request(rhizome_direct_http_dispatch, 65536, 0, mode, state);
+    rhizome_direct_sync_request *s = rhizome_direct_new_sync_request(rhizome_direct_http_dispatch, 0, 0, mode, state);
+    if (!s) {
+      free(state);
+      break;
+    }
+    s->release_function = rhizome_direct_http_release;
     rhizome_direct_start_sync_request(s);
-    if (rd_sync_handle_count > 0)
-      while (fd_poll() && rd_sync_handle_count > 0)
-	;
   }
+  while (rd_sync_handle_count > 0 && fd_poll())
+    ;
   return 0;
 }
 
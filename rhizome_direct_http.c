@@ -30,6 +30,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "strbuf.h"
 #include "strbuf_helpers.h"
 #include "socket.h"
+#include "overlay_buffer.h"
 
 
 static int _form_temporary_file_path(struct __sourceloc __whence, httpd_request *r, char *pathbuf, size_t bufsiz, const char *field)
@@ -395,6 +396,88 @@ int rhizome_direct_enquiry(httpd_request *r, const char *remainder)
   return 1;
 }
 
+/* A range enquiry is binary, and small enough to take in memory (see rhizome_direct_range.c).
+ */
+static char PART_RANGES[] = "ranges";
+
+static void finalise_union_direct_range(httpd_request *r)
+{
+  form_buf_malloc_release(&r->u.direct_range.ranges);
+}
+
+static int rhizome_direct_range_part_start(struct http_request *hr)
+{
+  httpd_request *r = (httpd_request *) hr;
+  assert(r->u.direct_range.current_part == NULL);
+  return 0;
+}
+
+static int rhizome_direct_range_part_end(struct http_request *hr)
+{
+  httpd_request *r = (httpd_request *) hr;
+  if (r->u.direct_range.current_part == PART_RANGES)
+    r->u.direct_range.received_ranges = 1;
+  r->u.direct_range.current_part = NULL;
+  return 0;
+}
+
+static int rhizome_direct_range_part_header(struct http_request *hr, const struct mime_part_headers *h)
+{
+  httpd_request *r = (httpd_request *) hr;
+  if (strcmp(h->content_disposition.name, PART_RANGES) != 0)
+    return 0;
+  if (r->u.direct_range.received_ranges)
+    return http_response_form_part(r, "Duplicate", PART_RANGES, NULL, 0);
+  r->u.direct_range.current_part = PART_RANGES;
+  form_buf_malloc_init(&r->u.direct_range.ranges, RHIZOME_DIRECT_RANGE_MAX_BYTES);
+  return 0;
+}
+
+static int rhizome_direct_range_part_body(struct http_request *hr, char *buf, size_t len)
+{
+  httpd_request *r = (httpd_request *) hr;
+  if (r->u.direct_range.current_part == PART_RANGES)
+    return form_buf_malloc_accumulate(r, PART_RANGES, &r->u.direct_range.ranges, buf, len);
+  return 0;
+}
+
+static int rhizome_direct_range_end(struct http_request *hr)
+{
+  httpd_request *r = (httpd_request *) hr;
+  if (!r->u.direct_range.received_ranges) {
+    http_request_simple_response(&r->http, 400, "Missing 'ranges' part");
+    return 0;
+  }
+  struct overlay_buffer *reply = rhizome_direct_range_respond(
+      (const unsigned char *) r->u.direct_range.ranges.buffer, r->u.direct_range.ranges.length);
+  if (reply == NULL) {
+    http_request_simple_response(&r->http, 400, "Malformed range enquiry");
+    return 0;
+  }
+  if (http_request_set_response_bufsize(&r->http, ob_position(reply)) == -1)
+    http_request_simple_response(&r->http, 500, "Internal Error: Out of memory");
+  else
+    http_request_response_static(&r->http, 200, CONTENT_TYPE_BLOB, (const char *)ob_ptr(reply), ob_position(reply));
+  ob_free(reply);
+  return 0;
+}
+
+int rhizome_direct_range_enquiry(httpd_request *r, const char *remainder)
+{
+  if (*remainder)
+    return 404;
+  if (r->http.verb != HTTP_VERB_POST)
+    return 405;
+  assert(r->finalise_union == NULL);
+  r->finalise_union = finalise_union_direct_range;
+  r->http.form_data.handle_mime_part_start = rhizome_direct_range_part_start;
+  r->http.form_data.handle_mime_part_end = rhizome_direct_range_part_end;
+  r->http.form_data.handle_mime_part_header = rhizome_direct_range_part_header;
+  r->http.form_data.handle_mime_body = rhizome_direct_range_part_body;
+  r->http.handle_content_end = rhizome_direct_range_end;
+  return 1;
+}
+
 /* Servald can be configured to accept files without manifests via HTTP from localhost, so that
  * rhizome bundles can be created programatically.  There are probably still some security
  * loop-holes here, which is part of why we leave it disabled by default, but it will be sufficient
@@ -436,398 +519,830 @@ int rhizome_direct_dispatch(httpd_request *r, const char *UNUSED(remainder))
   return 404;
 }
 
-static int receive_http_response(int sock, char *buffer, size_t buffer_len, struct http_response_parts *parts)
+
+/* The Rhizome Direct HTTP client.
+
+   Each peer being synchronised has its own transport state, which owns a small pool of
+   non-blocking connections to the peer, all driven by the scheduler, so a slow or distant peer
+   never holds up the process.  Each range enquiry (or, for a peer too old to answer those, each
+   cursor fill) goes out on whichever connection is free, and the bundles that its response says to
+   push or pull are queued.  Pushes are POSTed on
+   the other connections while the next enquiry is under way, and pulls are handed to the ordinary
+   Rhizome fetch slots.  Every request asks the server to keep its connection open, so that one
+   connection carries many requests.
+
+   Memory is bounded by the number of connections to each peer (rhizome.direct.connections) and by
+   holding back the next enquiry while too many pushes and pulls are queued
+   (rhizome.direct.queue_limit).
+*/
+
+#define RHIZOME_DIRECT_HTTP_MAX_RESPONSE (1048576)
+
+enum rhizome_direct_http_phase {
+  RD_HTTP_CONNECTING,
+  RD_HTTP_SEND_HEAD,
+  RD_HTTP_SEND_BODY,
+  RD_HTTP_SEND_TAIL,
+  RD_HTTP_RECV_HEADER,
+  RD_HTTP_RECV_BODY,
+  RD_HTTP_IDLE
+};
+
+enum rhizome_direct_http_job {
+  RD_HTTP_JOB_NONE,
+  RD_HTTP_JOB_ENQUIRY,
+  RD_HTTP_JOB_PUSH
+};
+
+struct rhizome_direct_http_connection {
+  struct sched_ent alarm;
+  struct rhizome_direct_http_connection *next;
+  rhizome_direct_transport_state_http *state;
+  enum rhizome_direct_http_phase phase;
+  enum rhizome_direct_http_job job;
+  // number of requests started on this connection
+  unsigned requests;
+  // the bundle being pushed, and how much of its payload has been sent
+  unsigned char prefix[RHIZOME_BAR_PREFIX_BYTES];
+  rhizome_manifest *manifest;
+  struct rhizome_read read;
+  bool_t read_open;
+  uint64_t payload_offset;
+  // the bytes being written
+  const unsigned char *out;
+  size_t out_len;
+  char head[MAX_MANIFEST_BYTES + 512];
+  size_t head_len;
+  char tail[48];
+  unsigned char chunk[4096];
+  // the response
+  char header[8192];
+  size_t header_len;
+  struct http_response_parts parts;
+  unsigned char *body;
+  uint64_t body_received;
+};
+
+static struct profile_total rd_http_stats = { .name="rhizome_direct_http_poll" };
+static struct profile_total rd_http_pump_stats = { .name="rhizome_direct_http_pump" };
+
+static void rd_http_poll(struct sched_ent *alarm);
+static void rd_http_pump(struct sched_ent *alarm);
+
+static int prefix_queue_append(struct rhizome_direct_prefix_queue *q, const unsigned char *prefix)
 {
-  size_t len = 0;
-  ssize_t count;
-  do {
-      if ((count = read(sock, &buffer[len], buffer_len - len)) == -1)
-	return WHYF_perror("read(%d, %p, %d)", sock, &buffer[len], (int)(buffer_len - len));
-      len += (size_t)count;
-  } while (len < buffer_len && count != 0 && !is_http_header_complete(buffer, len, len));
-  if (config.debug.rhizome_rx)
-    DEBUGF("Received HTTP response %s", alloca_toprint(-1, buffer, len));
-  if (unpack_http_response(buffer, parts) == -1)
-    return -1;
-  if (parts->code != 200 && parts->code != 201) {
-    INFOF("Failed HTTP request: server returned %03u %s", parts->code, parts->reason);
-    return -1;
-  }
-  if (parts->content_length == HTTP_RESPONSE_CONTENT_LENGTH_UNSET) {
-    if (config.debug.rhizome_rx)
-      DEBUGF("Invalid HTTP reply: missing Content-Length header");
-    return -1;
+  if (q->head + q->count == q->alloc) {
+    if (q->head) {
+      memmove(q->prefixes, q->prefixes + q->head * RHIZOME_BAR_PREFIX_BYTES, q->count * RHIZOME_BAR_PREFIX_BYTES);
+      q->head = 0;
+    } else {
+      size_t alloc = q->alloc ? q->alloc * 2 : 64;
+      unsigned char *prefixes = erealloc(q->prefixes, alloc * RHIZOME_BAR_PREFIX_BYTES);
+      if (!prefixes)
+	return -1;
+      q->prefixes = prefixes;
+      q->alloc = alloc;
+    }
   }
-  if (config.debug.rhizome_rx)
-    DEBUGF("content_length=%"PRIu64, parts->content_length);
-  return len - (parts->content_start - buffer);
+  memcpy(q->prefixes + (q->head + q->count++) * RHIZOME_BAR_PREFIX_BYTES, prefix, RHIZOME_BAR_PREFIX_BYTES);
+  return 0;
 }
 
-static int fill_buffer(int sock, unsigned char *buffer, int len, int buffer_size){
-  int count;
-  do {
-    if ((count = read(sock, &buffer[len], buffer_size - len)) == -1)
-      return WHYF_perror("read(%d, %p, %d)", sock, &buffer[len], buffer_size - len);
-    len += count;
-  } while (len < buffer_size);
-  return 0;
+static const unsigned char *prefix_queue_first(const struct rhizome_direct_prefix_queue *q)
+{
+  return q->count ? q->prefixes + q->head * RHIZOME_BAR_PREFIX_BYTES : NULL;
 }
 
-void rhizome_direct_http_dispatch(rhizome_direct_sync_request *r)
+static void prefix_queue_shift(struct rhizome_direct_prefix_queue *q)
 {
-  if (config.debug.rhizome_tx)
-    DEBUGF("Dispatch size_high=%"PRId64,r->cursor->size_high);
-  rhizome_direct_transport_state_http *state = r->transport_specific_state;
+  assert(q->count);
+  ++q->head;
+  if (--q->count == 0)
+    q->head = 0;
+}
+
+static void rd_http_wake(rhizome_direct_transport_state_http *state)
+{
+  unschedule(&state->alarm);
+  state->alarm.alarm = gettime_ms();
+  state->alarm.deadline = state->alarm.alarm + 1000;
+  schedule(&state->alarm);
+}
 
-  int sock=socket(AF_INET, SOCK_STREAM, 0);
-  if (sock==-1) {
-    WHY_perror("socket");
-    goto end;
+static void rd_http_touch(struct rhizome_direct_http_connection *c)
+{
+  unschedule(&c->alarm);
+  c->alarm.alarm = gettime_ms() + config.rhizome.idle_timeout;
+  c->alarm.deadline = c->alarm.alarm + config.rhizome.idle_timeout;
+  schedule(&c->alarm);
+}
+
+static void rd_http_watch(struct rhizome_direct_http_connection *c, short events)
+{
+  c->alarm.poll.events = events;
+  watch(&c->alarm);
+  rd_http_touch(c);
+}
+
+static void rd_http_end_job(struct rhizome_direct_http_connection *c)
+{
+  if (c->job == RD_HTTP_JOB_PUSH)
+    --c->state->pushes_active;
+  if (c->read_open) {
+    rhizome_read_close(&c->read);
+    c->read_open = 0;
+  }
+  if (c->manifest) {
+    rhizome_manifest_free(c->manifest);
+    c->manifest = NULL;
   }
+  free(c->body);
+  c->body = NULL;
+  c->job = RD_HTTP_JOB_NONE;
+}
 
-  struct hostent *hostent;
-  hostent = gethostbyname(state->host);
-  if (!hostent) {
-    if (config.debug.rhizome_tx)
-      DEBUGF("could not resolve hostname");
-    goto end;
+static void rd_http_close(struct rhizome_direct_http_connection *c)
+{
+  rhizome_direct_transport_state_http *state = c->state;
+  if (config.debug.rhizome_tx)
+    DEBUGF("Close connection %d to %s after %u requests", c->alarm.poll.fd, alloca_socket_address(&state->addr), c->requests);
+  struct rhizome_direct_http_connection **cp;
+  for (cp = &state->connections; *cp; cp = &(*cp)->next)
+    if (*cp == c) {
+      *cp = c->next;
+      break;
+    }
+  --state->connection_count;
+  rd_http_end_job(c);
+  unschedule(&c->alarm);
+  if (is_watching(&c->alarm))
+    unwatch(&c->alarm);
+  close(c->alarm.poll.fd);
+  free(c);
+}
+
+/* Move on from an enquiry that could not be made.  A cursor moves on to its next fill, but ranges
+ * have nowhere to move on to, so the sync ends.
+ */
+static void rd_http_abandon_enquiry(rhizome_direct_transport_state_http *state)
+{
+  rhizome_direct_sync_request *r = state->sync;
+  if (r->ranges) {
+    ob_free(r->ranges);
+    r->ranges = NULL;
   }
+  state->enquiry = RHIZOME_DIRECT_ENQUIRY_NONE;
+}
 
-  struct socket_address addr;
-  bzero(&addr,sizeof(addr));
-  addr.addrlen = sizeof(addr.inet);
-  addr.inet.sin_family = AF_INET;
-  addr.inet.sin_port = htons(state->port);
-  addr.inet.sin_addr = *((struct in_addr *)hostent->h_addr);
+/* Give up on the request in progress and close its connection.  A server may close an idle
+ * connection just as it is reused, in which case the request was never seen, so it is tried again
+ * on a new connection.
+ */
+static void rd_http_fail(struct rhizome_direct_http_connection *c, const char *reason)
+{
+  rhizome_direct_transport_state_http *state = c->state;
+  bool_t retry = c->requests > 1 && c->header_len == 0;
+  switch (c->job) {
+  case RD_HTTP_JOB_ENQUIRY:
+    if (retry)
+      state->enquiry = RHIZOME_DIRECT_ENQUIRY_QUEUED;
+    else {
+      WARNF("Rhizome Direct enquiry to %s failed: %s", alloca_socket_address(&state->addr), reason);
+      rd_http_abandon_enquiry(state);
+    }
+    break;
+  case RD_HTTP_JOB_PUSH:
+    if (retry)
+      prefix_queue_append(&state->pushes, c->prefix);
+    else
+      WARNF("Rhizome Direct push of %s* to %s failed: %s",
+	  alloca_tohex(c->prefix, RHIZOME_BAR_PREFIX_BYTES), alloca_socket_address(&state->addr), reason);
+    break;
+  case RD_HTTP_JOB_NONE:
+    break;
+  }
+  if (retry && config.debug.rhizome_tx)
+    DEBUGF("Reused connection %d failed (%s), retrying request", c->alarm.poll.fd, reason);
+  rd_http_close(c);
+  rd_http_wake(state);
+}
 
-  if (connect(sock, &addr.addr, addr.addrlen) == -1) {
-    WHYF_perror("connect(%s)", alloca_socket_address(&addr));
+static struct rhizome_direct_http_connection *rd_http_connect(rhizome_direct_transport_state_http *state)
+{
+  if (state->addr.addrlen == 0)
+    return NULL;
+  int sock = esocket(AF_INET, SOCK_STREAM, 0);
+  if (sock == -1)
+    return NULL;
+  if (set_nonblock(sock) == -1) {
+    close(sock);
+    return NULL;
+  }
+  if (connect(sock, &state->addr.addr, state->addr.addrlen) == -1 && errno != EINPROGRESS) {
+    WHYF_perror("connect(%d, %s)", sock, alloca_socket_address(&state->addr));
+    close(sock);
+    return NULL;
+  }
+  struct rhizome_direct_http_connection *c = emalloc_zero(sizeof *c);
+  if (!c) {
     close(sock);
-    goto end;
+    return NULL;
   }
+  c->state = state;
+  c->phase = RD_HTTP_CONNECTING;
+  c->alarm.poll.fd = sock;
+  c->alarm.function = rd_http_poll;
+  c->alarm.stats = &rd_http_stats;
+  c->next = state->connections;
+  state->connections = c;
+  ++state->connection_count;
+  if (config.debug.rhizome_tx)
+    DEBUGF("Open connection %d to %s", sock, alloca_socket_address(&state->addr));
+  rd_http_watch(c, POLLOUT);
+  return c;
+}
 
-  char boundary[20];
-  char buffer[8192];
+static struct rhizome_direct_http_connection *rd_http_free_connection(rhizome_direct_transport_state_http *state)
+{
+  struct rhizome_direct_http_connection *c;
+  for (c = state->connections; c; c = c->next)
+    if (c->job == RD_HTTP_JOB_NONE)
+      return c;
+  return NULL;
+}
 
+/* Start sending the request that has been formed in c->head and c->tail.
+ */
+static void rd_http_begin(struct rhizome_direct_http_connection *c, enum rhizome_direct_http_job job)
+{
+  c->job = job;
+  ++c->requests;
+  c->out = (const unsigned char *) c->head;
+  c->out_len = c->head_len;
+  c->header_len = 0;
+  c->body_received = 0;
+  if (config.debug.rhizome_tx)
+    DEBUGF("Request %u on connection %d: %s", c->requests, c->alarm.poll.fd, alloca_toprint(-1, c->head, c->head_len));
+  if (c->phase != RD_HTTP_CONNECTING)
+    c->phase = RD_HTTP_SEND_HEAD;
+  rd_http_watch(c, POLLOUT);
+}
+
+/* The body of the enquiry for the current cursor fill, or the next range enquiry.
+ */
+static const unsigned char *rd_http_enquiry_body(rhizome_direct_sync_request *r, size_t *lenp)
+{
+  if (r->cursor) {
+    *lenp = r->cursor->buffer_offset_bytes + r->cursor->buffer_used;
+    return r->cursor->buffer;
+  }
+  *lenp = ob_position(r->ranges);
+  return ob_ptr(r->ranges);
+}
+
+static void rd_http_start_enquiry(struct rhizome_direct_http_connection *c)
+{
+  rhizome_direct_sync_request *r = c->state->sync;
+  size_t body_len;
+  rd_http_enquiry_body(r, &body_len);
+  char boundary[20];
   strbuf bb = strbuf_local(boundary, sizeof boundary);
   strbuf_sprintf(bb, "%08lx%08lx", random(), random());
   assert(!strbuf_overrun(bb));
   strbuf content_preamble = strbuf_alloca(200);
-  strbuf content_postamble = strbuf_alloca(40);
   strbuf_sprintf(content_preamble,
       "--%s\r\n"
-      "Content-Disposition: form-data; name=\"data\"; filename=\"IHAVEs\"\r\n"
+      "Content-Disposition: form-data; name=\"%s\"; filename=\"IHAVEs\"\r\n"
       "Content-Type: %s\r\n"
       "\r\n",
-      boundary, CONTENT_TYPE_BLOB
+      boundary, r->cursor ? "data" : "ranges", CONTENT_TYPE_BLOB
     );
-  strbuf_sprintf(content_postamble, "\r\n--%s--\r\n", boundary);
   assert(!strbuf_overrun(content_preamble));
-  assert(!strbuf_overrun(content_postamble));
-  int content_length = strbuf_len(content_preamble)
-		     + r->cursor->buffer_offset_bytes
-		     + r->cursor->buffer_used
-		     + strbuf_len(content_postamble);
-  strbuf request = strbuf_local(buffer, sizeof buffer);
+  strbuf tail = strbuf_local(c->tail, sizeof c->tail);
+  strbuf_sprintf(tail, "\r\n--%s--\r\n", boundary);
+  assert(!strbuf_overrun(tail));
+  size_t content_length = strbuf_len(content_preamble)
+			+ body_len
+			+ strbuf_len(tail);
+  strbuf request = strbuf_local(c->head, sizeof c->head);
   strbuf_sprintf(request,
-      "POST /rhizome/enquiry HTTP/1.0\r\n"
-      "Content-Length: %d\r\n"
+      "POST /rhizome/%s HTTP/1.0\r\n"
+      "Connection: keep-alive\r\n"
+      "Content-Length: %zu\r\n"
       "Content-Type: multipart/form-data; boundary=%s\r\n"
       "\r\n%s",
-      content_length, boundary, strbuf_str(content_preamble)
+      r->cursor ? "enquiry" : "rangeenquiry", content_length, boundary, strbuf_str(content_preamble)
     );
   assert(!strbuf_overrun(request));
+  c->head_len = strbuf_len(request);
+  c->state->enquiry = RHIZOME_DIRECT_ENQUIRY_SENT;
+  rd_http_begin(c, RD_HTTP_JOB_ENQUIRY);
+}
 
-  /* TODO: Refactor this code so that it uses our asynchronous framework.
-   */
-  int len = strbuf_len(request);
-  int sent=0;
-  while(sent<len) {
-    if (config.debug.rhizome_tx)
-      DEBUGF("write(%d, %s, %d)", sock, alloca_toprint(-1, &buffer[sent], len-sent), len-sent);
-    int count=write(sock,&buffer[sent],len-sent);
-    if (count == -1) {
-      if (errno==EPIPE) goto rx;
-      WHYF_perror("write(%d)", len - sent);
-      close(sock);
-      goto end;
-    }
-    sent+=count;
-  }
-
-  len=r->cursor->buffer_offset_bytes+r->cursor->buffer_used;
-  sent=0;
-  while(sent<len) {
-    int count=write(sock,&r->cursor->buffer[sent],len-sent);
-    if (count == -1) {
-      if (errno == EPIPE)
-	goto rx;
-      WHYF_perror("write(%d)", count);
-      close(sock);
-      goto end;
-    }
-    sent+=count;
-  }
-
-  strbuf_reset(request);
-  strbuf_puts(request, strbuf_str(content_postamble));
-  len = strbuf_len(request);
-  sent=0;
-  while(sent<len) {
-    if (config.debug.rhizome_tx)
-      DEBUGF("write(%d, %s, %d)", sock, alloca_toprint(-1, &buffer[sent], len-sent), len-sent);
-    int count=write(sock,&buffer[sent],len-sent);
-    if (count == -1) {
-      if (errno==EPIPE) goto rx;
-      WHYF_perror("write(%d)", len - sent);
-      close(sock);
-      goto end;
-    }
-    sent+=count;
+static int rd_http_start_push(struct rhizome_direct_http_connection *c, const unsigned char *prefix)
+{
+  /* Start by getting the manifest, which is the main thing we need, and also
+     gives us the information we need for sending any associated file. */
+  rhizome_manifest *m = rhizome_direct_get_manifest((unsigned char *)prefix, RHIZOME_BAR_PREFIX_BYTES);
+  if (m == NULL)
+    return WHYF("The manifest %s* exists, but when I went looking for it, it doesn't appear to be there.",
+	alloca_tohex(prefix, RHIZOME_BAR_PREFIX_BYTES));
+  if (config.debug.rhizome_tx) {
+    DEBUGF("bundle id = %s", alloca_tohex_rhizome_bid_t(m->cryptoSignPublic));
+    DEBUGF("bundle filehash = %s", alloca_tohex_rhizome_filehash_t(m->filehash));
+    DEBUGF("file size = %"PRId64, m->filesize);
+    DEBUGF("version = %"PRIu64, m->version);
+    DEBUGF("manifest_all_bytes=%zu, manifest_body_bytes=%zu", m->manifest_all_bytes, m->manifest_body_bytes);
   }
-
-  struct http_response_parts parts;
- rx:
-  /* request sent, now get response back. */
-  len=receive_http_response(sock, buffer, sizeof buffer, &parts);
-  if (len == -1) {
-    close(sock);
-    goto end;
+  assert(m->filesize != RHIZOME_SIZE_UNSET);
+  rhizome_filehash_t filehash;
+  if (rhizome_database_filehash_from_id(&m->cryptoSignPublic, m->version, &filehash) == -1) {
+    rhizome_manifest_free(m);
+    return -1;
+  }
+  bzero(&c->read, sizeof c->read);
+  enum rhizome_payload_status pstatus = rhizome_open_read(&c->read, &filehash);
+  switch (pstatus) {
+    case RHIZOME_PAYLOAD_STATUS_EMPTY:
+    case RHIZOME_PAYLOAD_STATUS_STORED:
+      break;
+    case RHIZOME_PAYLOAD_STATUS_NEW:
+    case RHIZOME_PAYLOAD_STATUS_ERROR:
+    case RHIZOME_PAYLOAD_STATUS_WRONG_SIZE:
+    case RHIZOME_PAYLOAD_STATUS_WRONG_HASH:
+    case RHIZOME_PAYLOAD_STATUS_CRYPTO_FAIL:
+    case RHIZOME_PAYLOAD_STATUS_TOO_BIG:
+    case RHIZOME_PAYLOAD_STATUS_EVICTED:
+      WHYF("Cannot read payload of bundle %s (%s)",
+	  alloca_tohex_rhizome_bid_t(m->cryptoSignPublic), rhizome_payload_status_message(pstatus));
+      rhizome_read_close(&c->read);
+      rhizome_manifest_free(m);
+      return -1;
+    // No "default" label, so the compiler will warn us if a case is not handled.
   }
 
-  /* Allocate a buffer to receive the entire action list */
-  content_length = parts.content_length;
-  unsigned char *actionlist=emalloc(content_length);
-  if (!actionlist){
-    close(sock);
-    goto end;
+  /* We now have everything we need to compose the POST request.  The payload
+     is read and sent a chunk at a time as the socket will take it. */
+  char boundary[20];
+  strbuf bb = strbuf_local(boundary, sizeof boundary);
+  strbuf_sprintf(bb, "%08lx%08lx", random(), random());
+  assert(!strbuf_overrun(bb));
+  strbuf manifest_preamble = strbuf_alloca(200);
+  strbuf_sprintf(manifest_preamble,
+      "--%s\r\n"
+      "Content-Disposition: form-data; name=\"manifest\"; filename=\"m\"\r\n"
+      "Content-Type: application/octet-stream\r\n"
+      "\r\n",
+      boundary
+    );
+  strbuf data_preamble = strbuf_alloca(200);
+  strbuf_sprintf(data_preamble,
+      "\r\n--%s\r\n"
+      "Content-Disposition: form-data; name=\"data\"; filename=\"d\"\r\n"
+      "Content-Type: application/octet-stream\r\n"
+      "\r\n",
+      boundary
+    );
+  assert(!strbuf_overrun(manifest_preamble));
+  assert(!strbuf_overrun(data_preamble));
+  strbuf tail = strbuf_local(c->tail, sizeof c->tail);
+  strbuf_sprintf(tail, "\r\n--%s--\r\n", boundary);
+  assert(!strbuf_overrun(tail));
+  uint64_t content_length = strbuf_len(manifest_preamble)
+			  + m->manifest_all_bytes
+			  + strbuf_len(data_preamble)
+			  + m->filesize
+			  + strbuf_len(tail);
+  strbuf request = strbuf_local(c->head, sizeof c->head);
+  strbuf_sprintf(request,
+      "POST /rhizome/import HTTP/1.0\r\n"
+      "Connection: keep-alive\r\n"
+      "Content-Length: %"PRIu64"\r\n"
+      "Content-Type: multipart/form-data; boundary=%s\r\n"
+      "\r\n%s",
+      content_length, boundary, strbuf_str(manifest_preamble)
+    );
+  assert(!strbuf_overrun(request));
+  size_t len = strbuf_len(request);
+  assert(len + m->manifest_all_bytes + strbuf_len(data_preamble) <= sizeof c->head);
+  memcpy(&c->head[len], m->manifestdata, m->manifest_all_bytes);
+  len += m->manifest_all_bytes;
+  memcpy(&c->head[len], strbuf_str(data_preamble), strbuf_len(data_preamble));
+  len += strbuf_len(data_preamble);
+  c->head_len = len;
+
+  memcpy(c->prefix, prefix, RHIZOME_BAR_PREFIX_BYTES);
+  c->manifest = m;
+  c->read_open = 1;
+  c->payload_offset = 0;
+  ++c->state->pushes_active;
+  rd_http_begin(c, RD_HTTP_JOB_PUSH);
+  return 0;
+}
+
+/* Called whenever the bytes in c->out have all been written, to supply the next ones.
+ */
+static int rd_http_next_output(struct rhizome_direct_http_connection *c)
+{
+  switch (c->phase) {
+  case RD_HTTP_SEND_HEAD:
+    c->phase = RD_HTTP_SEND_BODY;
+    if (c->job == RD_HTTP_JOB_ENQUIRY) {
+      c->out = rd_http_enquiry_body(c->state->sync, &c->out_len);
+      return 0;
+    }
+    // fall through
+  case RD_HTTP_SEND_BODY:
+    if (c->job == RD_HTTP_JOB_PUSH && c->payload_offset < c->manifest->filesize) {
+      c->read.offset = c->payload_offset;
+      ssize_t bytes_read = rhizome_read(&c->read, c->chunk, sizeof c->chunk);
+      if (bytes_read == -1)
+	return -1;
+      if (bytes_read == 0)
+	return WHYF("Payload of bundle %s ended at %"PRIu64" bytes",
+	    alloca_tohex_rhizome_bid_t(c->manifest->cryptoSignPublic), c->payload_offset);
+      c->payload_offset += (size_t) bytes_read;
+      c->out = c->chunk;
+      c->out_len = (size_t) bytes_read;
+      return 0;
+    }
+    c->phase = RD_HTTP_SEND_TAIL;
+    c->out = (const unsigned char *) c->tail;
+    c->out_len = strlen(c->tail);
+    return 0;
+  case RD_HTTP_SEND_TAIL:
+    c->phase = RD_HTTP_RECV_HEADER;
+    return 0;
+  default:
+    FATALF("phase = %d", c->phase);
   }
-  bcopy(parts.content_start, actionlist, len);
-  if (fill_buffer(sock, actionlist, len, content_length)==-1){
-    free(actionlist);
-    close(sock);
-    goto end;
+}
+
+static void rd_http_send(struct rhizome_direct_http_connection *c)
+{
+  if (c->phase == RD_HTTP_CONNECTING)
+    c->phase = RD_HTTP_SEND_HEAD;
+  while (c->phase != RD_HTTP_RECV_HEADER) {
+    if (c->out_len == 0) {
+      if (rd_http_next_output(c) == -1) {
+	rd_http_fail(c, "could not read payload");
+	return;
+      }
+      continue;
+    }
+    ssize_t written = write_nonblock(c->alarm.poll.fd, c->out, c->out_len);
+    if (written == -1) {
+      rd_http_fail(c, "write failed");
+      return;
+    }
+    if (written == 0)
+      break;
+    c->out += (size_t) written;
+    c->out_len -= (size_t) written;
   }
-  close(sock);
+  if (c->phase == RD_HTTP_RECV_HEADER) {
+    // done with the payload, so release it as soon as possible
+    if (c->read_open) {
+      rhizome_read_close(&c->read);
+      c->read_open = 0;
+    }
+    rd_http_watch(c, POLLIN);
+  } else
+    rd_http_touch(c);
+}
 
-  /* We now have the list of (1+RHIZOME_BAR_PREFIX_BYTES)-byte records that indicate
-     the list of BAR prefixes that differ between the two nodes.  We can now action
-     those which are relevant, i.e., based on whether we are pushing, pulling or
-     synchronising (both).
+/* We now have the list of (1+RHIZOME_BAR_PREFIX_BYTES)-byte records that indicate
+   the list of BAR prefixes that differ between the two nodes.  Queue those which
+   are relevant, i.e., based on whether we are pushing, pulling or synchronising
+   (both).
 
-     I am currently undecided as to whether it is cleaner to have some general
-     rhizome direct function for doing that, or whether it just adds unnecessary
-     complication, and the responses should just be handled in here.
+   XXX The cursor position is not adjusted according to the range covered by the
+   response.  If the far end returned an earlier cursor position than we are in,
+   we could end up in an infinite loop, so we simply carry on from our own
+   position, and re-attempt the sync until no actions result.
+ */
+static void rd_http_enquiry_response(rhizome_direct_transport_state_http *state, const unsigned char *actionlist, size_t content_length)
+{
+  rhizome_direct_sync_request *r = state->sync;
+  size_t i;
+  for (i = 10; i + 1 + RHIZOME_BAR_PREFIX_BYTES <= content_length; i += 1 + RHIZOME_BAR_PREFIX_BYTES) {
+    int type = actionlist[i];
+    if (type == 2 && r->pullP) {
+      if (config.debug.rhizome_tx)
+	DEBUGF("Queue fetch of manifest %s* @ 0x%zx", alloca_tohex(&actionlist[i], 1 + RHIZOME_BAR_PREFIX_BYTES), i);
+      prefix_queue_append(&state->pulls, &actionlist[i + 1]);
+    } else if (type == 1 && r->pushP) {
+      if (config.debug.rhizome_tx)
+	DEBUGF("Queue push of bundle %s* @ 0x%zx", alloca_tohex(&actionlist[i], 1 + RHIZOME_BAR_PREFIX_BYTES), i);
+      prefix_queue_append(&state->pushes, &actionlist[i + 1]);
+    }
+  }
+}
 
-     For now, I am just going to implement it in here, and we can generalise later.
-  */
-  int i;
-  for(i=10;i<content_length;i+=(1+RHIZOME_BAR_PREFIX_BYTES))
-    {
-      int type=actionlist[i];
-      if (type==2&&r->pullP) {
-	/* Need to fetch manifest.  Once we have the manifest, then we can
-	   use our normal bundle fetch routines from rhizome_fetch.c
-
-	   Generate a request like: GET /rhizome/manifestbybar/<hex of bar>
-	   and add it to our list of HTTP fetch requests, then watch
-	   until the request is finished.  That will give us the manifest.
-	   Then as noted above, we can use that to pull the file down using
-	   existing routines.
-	*/
-	if (config.debug.rhizome_tx)
-	  DEBUGF("Fetching manifest %s* @ 0x%x",alloca_tohex(&actionlist[i], 1+RHIZOME_BAR_PREFIX_BYTES),i);
-	if (!rhizome_fetch_request_manifest_by_prefix(&addr, NULL, &actionlist[i+1], RHIZOME_BAR_PREFIX_BYTES))
-	  {
-	    /* Fetching the manifest, and then using it to see if we want to
-	       fetch the file for import is all handled asynchronously, so just
-	       wait for it to finish. */
-	    while (rhizome_any_fetch_active() || rhizome_any_fetch_queued())
-	      fd_poll();
-	  }
-
-      } else if (type==1&&r->pushP) {
-	/* Form up the POST request to submit the appropriate bundle. */
-
-	/* Start by getting the manifest, which is the main thing we need, and also
-	   gives us the information we need for sending any associated file. */
-	rhizome_manifest *m = rhizome_direct_get_manifest(&actionlist[i+1], RHIZOME_BAR_PREFIX_BYTES);
-	if (m == NULL) {
-	  WHY("This should never happen.  The manifest exists, but when I went looking for it, it doesn't appear to be there.");
-	  goto next_item;
-	}
+static void rd_http_range_action(void *context, enum rhizome_direct_range_action action, const unsigned char *prefix)
+{
+  rhizome_direct_transport_state_http *state = context;
+  rhizome_direct_sync_request *r = state->sync;
+  switch (action) {
+  case RHIZOME_DIRECT_RANGE_PULL:
+    if (r->pullP) {
+      if (config.debug.rhizome_tx)
+	DEBUGF("Queue fetch of manifest %s*", alloca_tohex(prefix, RHIZOME_BAR_PREFIX_BYTES));
+      prefix_queue_append(&state->pulls, prefix);
+    }
+    break;
+  case RHIZOME_DIRECT_RANGE_PUSH:
+    if (r->pushP) {
+      if (config.debug.rhizome_tx)
+	DEBUGF("Queue push of bundle %s*", alloca_tohex(prefix, RHIZOME_BAR_PREFIX_BYTES));
+      prefix_queue_append(&state->pushes, prefix);
+    }
+    break;
+  }
+}
 
-	/* Get filehash and size from manifest if present */
-	if (config.debug.rhizome_tx) {
-	  DEBUGF("bundle id = %s", alloca_tohex_rhizome_bid_t(m->cryptoSignPublic));
-	  DEBUGF("bundle filehash = %s", alloca_tohex_rhizome_filehash_t(m->filehash));
-	  DEBUGF("file size = %"PRId64, m->filesize);
-	  DEBUGF("version = %"PRIu64, m->version);
-	}
+/* Queue the pushes and pulls that a range enquiry response calls for, and form the next enquiry
+ * from the ranges it leaves open, if any.
+ */
+static void rd_http_range_response(rhizome_direct_transport_state_http *state, const unsigned char *response, size_t content_length)
+{
+  rhizome_direct_sync_request *r = state->sync;
+  ob_free(r->ranges);
+  r->ranges = NULL;
+  if (rhizome_direct_range_resolve(response, content_length, &r->ranges, rd_http_range_action, state) == -1)
+    WARNF("Rhizome Direct enquiry to %s failed: malformed response", alloca_socket_address(&state->addr));
+}
 
-	/* We now have everything we need to compose the POST request and send it.
-	 */
-	char *template="POST /rhizome/import HTTP/1.0\r\n"
-	  "Content-Length: %d\r\n"
-	  "Content-Type: multipart/form-data; boundary=%s\r\n"
-	  "\r\n";
-	char *template2="--%s\r\n"
-	  "Content-Disposition: form-data; name=\"manifest\"; filename=\"m\"\r\n"
-	  "Content-Type: application/octet-stream\r\n"
-	  "\r\n";
-	char *template3=
-	  "\r\n--%s\r\n"
-	  "Content-Disposition: form-data; name=\"data\"; filename=\"d\"\r\n"
-	  "Content-Type: application/octet-stream\r\n"
-	  "\r\n";
-	/* Work out what the content length should be */
-	if (config.debug.rhizome_tx)
-	  DEBUGF("manifest_all_bytes=%zu, manifest_body_bytes=%zu", m->manifest_all_bytes, m->manifest_body_bytes);
-	assert(m->filesize != RHIZOME_SIZE_UNSET);
-	size_t content_length =
-	    strlen(template2) - 2 /* minus 2 for the "%s" that gets replaced */
-	  + strlen(boundary)
-	  + m->manifest_all_bytes
-	  + strlen(template3) - 2 /* minus 2 for the "%s" that gets replaced */
-	  + strlen(boundary)
-	  + m->filesize
-	  + strlen("\r\n--") + strlen(boundary) + strlen("--\r\n");
-
-	int len=snprintf(buffer,8192,template,content_length,boundary);
-	len+=snprintf(&buffer[len],8192-len,template2,boundary);
-	memcpy(&buffer[len],m->manifestdata,m->manifest_all_bytes);
-	len+=m->manifest_all_bytes;
-	len+=snprintf(&buffer[len],8192-len,template3,boundary);
-
-	sock=socket(AF_INET, SOCK_STREAM, 0);
-	if (sock==-1) {
-	  if (config.debug.rhizome_tx)
-	    DEBUGF("could not open socket");
-	  goto closeit;
-	}
-	if (connect(sock,&addr.addr,addr.addrlen) == -1) {
-	  if (config.debug.rhizome_tx)
-	    DEBUGF("Could not connect to remote");
-	  goto closeit;
-	}
+static void rd_http_complete(struct rhizome_direct_http_connection *c)
+{
+  rhizome_direct_transport_state_http *state = c->state;
+  rhizome_direct_sync_request *r = state->sync;
+  switch (c->job) {
+  case RD_HTTP_JOB_ENQUIRY:
+    if (r->cursor)
+      rd_http_enquiry_response(state, c->body, c->parts.content_length);
+    else
+      rd_http_range_response(state, c->body, c->parts.content_length);
+    r->fill_responses_processed++;
+    state->enquiry = RHIZOME_DIRECT_ENQUIRY_NONE;
+    break;
+  case RD_HTTP_JOB_PUSH:
+    if (c->parts.code == 200 || c->parts.code == 201) {
+      INFOF("Received HTTP response %03u %s", c->parts.code, c->parts.reason);
+      r->bundles_pushed++;
+    } else
+      INFOF("Failed HTTP request: server returned %03u %s", c->parts.code, c->parts.reason);
+    break;
+  case RD_HTTP_JOB_NONE:
+    break;
+  }
+  rd_http_end_job(c);
+  if (c->parts.keep_alive) {
+    c->phase = RD_HTTP_IDLE;
+    rd_http_watch(c, POLLIN);
+  } else
+    rd_http_close(c);
+  rd_http_wake(state);
+}
 
-	int sent=0;
-	/* Send buffer now */
-	while(sent<len) {
-	  int r=write(sock,&buffer[sent],len-sent);
-	  if (r>0) sent+=r;
-	  if (r<0) goto closeit;
+static void rd_http_receive(struct rhizome_direct_http_connection *c)
+{
+  int fd = c->alarm.poll.fd;
+  ssize_t bytes;
+  errno = 0;
+  if (c->phase == RD_HTTP_RECV_HEADER) {
+    if (c->header_len >= sizeof c->header - 1) {
+      rd_http_fail(c, "response header too long");
+      return;
+    }
+    if ((bytes = read_nonblock(fd, &c->header[c->header_len], sizeof c->header - 1 - c->header_len)) == -1) {
+      rd_http_fail(c, "read failed");
+      return;
+    }
+    if (bytes == 0) {
+      if (errno == 0)
+	rd_http_fail(c, "connection closed by server");
+      return;
+    }
+    c->header_len += (size_t) bytes;
+    rd_http_touch(c);
+    if (!is_http_header_complete(c->header, c->header_len, (size_t) bytes))
+      return;
+    c->header[c->header_len] = '\0';
+    if (config.debug.rhizome_rx)
+      DEBUGF("Received HTTP response %s", alloca_toprint(-1, c->header, c->header_len));
+    if (unpack_http_response(c->header, &c->parts) == -1) {
+      rd_http_fail(c, "malformed response");
+      return;
+    }
+    if (c->parts.content_length == HTTP_RESPONSE_CONTENT_LENGTH_UNSET) {
+      rd_http_fail(c, "missing Content-Length header");
+      return;
+    }
+    if (c->job == RD_HTTP_JOB_ENQUIRY) {
+      rhizome_direct_transport_state_http *state = c->state;
+      rhizome_direct_sync_request *r = state->sync;
+      if (c->parts.code == 404 && r->cursor == NULL) {
+	// a peer older than range enquiries, so walk the store with a cursor instead
+	INFOF("%s does not support range enquiries, sending lists of BARs", alloca_socket_address(&state->addr));
+	if ((r->cursor = rhizome_direct_bundle_iterator(65536)) == NULL) {
+	  rd_http_fail(c, "out of memory");
+	  return;
 	}
+	ob_free(r->ranges);
+	r->ranges = NULL;
+	state->enquiry = RHIZOME_DIRECT_ENQUIRY_NONE;
+	rd_http_close(c);
+	rd_http_wake(state);
+	return;
+      }
+      if (c->parts.code != 200) {
+	INFOF("Failed HTTP request: server returned %03u %s", c->parts.code, c->parts.reason);
+	rd_http_fail(c, "enquiry refused");
+	return;
+      }
+      if (c->parts.content_length > RHIZOME_DIRECT_HTTP_MAX_RESPONSE) {
+	rd_http_fail(c, "response too long");
+	return;
+      }
+      if ((c->body = emalloc(c->parts.content_length + 1)) == NULL) {
+	rd_http_fail(c, "out of memory");
+	return;
+      }
+    }
+    size_t already = &c->header[c->header_len] - c->parts.content_start;
+    if (already > c->parts.content_length) {
+      // we never send a request before the last one is answered, so this is junk
+      already = c->parts.content_length;
+      c->parts.keep_alive = 0;
+    }
+    if (c->body)
+      memcpy(c->body, c->parts.content_start, already);
+    c->body_received = already;
+    c->phase = RD_HTTP_RECV_BODY;
+  } else {
+    unsigned char buffer[4096];
+    uint64_t remaining = c->parts.content_length - c->body_received;
+    unsigned char *dst = c->body ? &c->body[c->body_received] : buffer;
+    size_t len = c->body || remaining < sizeof buffer ? (size_t) remaining : sizeof buffer;
+    if ((bytes = read_nonblock(fd, dst, len)) == -1) {
+      rd_http_fail(c, "read failed");
+      return;
+    }
+    if (bytes == 0) {
+      if (errno == 0)
+	rd_http_fail(c, "connection closed by server");
+      return;
+    }
+    c->body_received += (size_t) bytes;
+    rd_http_touch(c);
+  }
+  if (c->body_received >= c->parts.content_length)
+    rd_http_complete(c);
+}
 
-	/* send file contents */
-	{
-	  rhizome_filehash_t filehash;
-	  if (rhizome_database_filehash_from_id(&m->cryptoSignPublic, m->version, &filehash) == -1)
-	    goto closeit;
-
-	  struct rhizome_read read;
-	  bzero(&read, sizeof read);
-	  enum rhizome_payload_status pstatus = rhizome_open_read(&read, &filehash);
-	  switch (pstatus) {
-	    case RHIZOME_PAYLOAD_STATUS_EMPTY:
-	    case RHIZOME_PAYLOAD_STATUS_STORED:
-	      goto pstatus_ok;
-	    case RHIZOME_PAYLOAD_STATUS_NEW:
-	    case RHIZOME_PAYLOAD_STATUS_ERROR:
-	    case RHIZOME_PAYLOAD_STATUS_WRONG_SIZE:
-	    case RHIZOME_PAYLOAD_STATUS_WRONG_HASH:
-	    case RHIZOME_PAYLOAD_STATUS_CRYPTO_FAIL:
-	    case RHIZOME_PAYLOAD_STATUS_TOO_BIG:
-	    case RHIZOME_PAYLOAD_STATUS_EVICTED:
-	      goto closeit;
-	    // No "default" label, so the compiler will warn us if a case is not handled.
-	  }
-	  FATALF("pstatus = %d", pstatus);
-	pstatus_ok:
-	  ;
-	  uint64_t read_ofs;
-	  for(read_ofs=0;read_ofs<m->filesize;){
-	    unsigned char buffer[4096];
-	    read.offset=read_ofs;
-	    ssize_t bytes_read = rhizome_read(&read, buffer, sizeof buffer);
-	    if (bytes_read == -1) {
-	      rhizome_read_close(&read);
-	      goto closeit;
-	    }
-	    size_t write_ofs = 0;
-	    while (write_ofs < (size_t) bytes_read){
-	      ssize_t written = write(sock, buffer + write_ofs, (size_t) bytes_read - write_ofs);
-	      if (written == -1){
-		WHY_perror("write");
-		rhizome_read_close(&read);
-		goto closeit;
-	      }
-	      write_ofs += (size_t) written;
-	    }
-	    read_ofs += (size_t) bytes_read;
-	  }
-	  rhizome_read_close(&read);
-	}
-	/* Send final mime boundary */
-	len=snprintf(buffer,8192,"\r\n--%s--\r\n",boundary);
-	sent=0;
-	while(sent<len) {
-	  int r=write(sock,&buffer[sent],len-sent);
-	  if (r>0) sent+=r;
-	  if (r<0) goto closeit;
-	}
+static void rd_http_poll(struct sched_ent *alarm)
+{
+  struct rhizome_direct_http_connection *c = (struct rhizome_direct_http_connection *) alarm;
+  if (alarm->poll.revents == 0) {
+    if (c->job == RD_HTTP_JOB_NONE)
+      rd_http_close(c);
+    else
+      rd_http_fail(c, "timed out");
+    return;
+  }
+  if (c->job == RD_HTTP_JOB_NONE) {
+    // A new connection that has nothing to send yet, or the server has closed an idle one.
+    if (c->phase == RD_HTTP_CONNECTING && alarm->poll.revents == POLLOUT) {
+      c->phase = RD_HTTP_IDLE;
+      rd_http_watch(c, POLLIN);
+    } else
+      rd_http_close(c);
+    return;
+  }
+  if (alarm->poll.revents & POLLOUT)
+    rd_http_send(c);
+  else if (alarm->poll.revents & POLLIN)
+    rd_http_receive(c);
+  else
+    rd_http_fail(c, "connection error");
+}
 
-	/* get response back. */
-	if (receive_http_response(sock, buffer, sizeof buffer, &parts) == -1)
-	  goto closeit;
-	INFOF("Received HTTP response %03u %s", parts.code, parts.reason);
+/* Hand out queued work, and once the peer has no more to do for the current
+ * cursor fill, move on to the next one.
+ */
+static void rd_http_pump(struct sched_ent *alarm)
+{
+  rhizome_direct_transport_state_http *state = (rhizome_direct_transport_state_http *) alarm;
+  rhizome_direct_sync_request *r = state->sync;
 
-      closeit:
-	close(sock);
+  /* Fetching the manifests, and then using them to see if we want to fetch the
+     payloads for import, is all handled asynchronously by the fetch slots, so
+     start as many as they will take. */
+  const unsigned char *prefix;
+  while ((prefix = prefix_queue_first(&state->pulls)) != NULL) {
+    enum rhizome_start_fetch_result result =
+      rhizome_fetch_request_manifest_by_prefix(&state->addr, NULL, prefix, RHIZOME_BAR_PREFIX_BYTES);
+    if (result == SLOTBUSY)
+      break;
+    if (config.debug.rhizome_tx)
+      DEBUGF("Fetching manifest %s*, result=%d", alloca_tohex(prefix, RHIZOME_BAR_PREFIX_BYTES), result);
+    if (result == STARTED) {
+      state->pulls_started = 1;
+      r->bundles_pulled++;
+    }
+    prefix_queue_shift(&state->pulls);
+  }
 
-	if (m) rhizome_manifest_free(m);
+  /* The enquiry goes first, so that the peer works out the next fill while the
+     pushes from this one are sent. */
+  while (state->enquiry == RHIZOME_DIRECT_ENQUIRY_QUEUED || state->pushes.count) {
+    struct rhizome_direct_http_connection *c = rd_http_free_connection(state);
+    if (c == NULL) {
+      if (state->connection_count >= config.rhizome.direct.connections)
+	break;
+      if ((c = rd_http_connect(state)) == NULL) {
+	if (state->connection_count)
+	  break;
+	// nothing can reach the peer, so give up on everything queued for it
+	if (state->enquiry == RHIZOME_DIRECT_ENQUIRY_QUEUED) {
+	  WARNF("Rhizome Direct enquiry to %s:%d failed: cannot connect", state->host, state->port);
+	  rd_http_abandon_enquiry(state);
+	}
+	if (state->pushes.count)
+	  WARNF("Rhizome Direct dropped %zu pushes to %s:%d: cannot connect", state->pushes.count, state->host, state->port);
+	state->pushes.head = state->pushes.count = 0;
+	break;
       }
-    next_item:
-      continue;
     }
+    if (state->enquiry == RHIZOME_DIRECT_ENQUIRY_QUEUED)
+      rd_http_start_enquiry(c);
+    else {
+      unsigned char push[RHIZOME_BAR_PREFIX_BYTES];
+      memcpy(push, prefix_queue_first(&state->pushes), sizeof push);
+      prefix_queue_shift(&state->pushes);
+      rd_http_start_push(c, push);
+    }
+  }
 
-  free(actionlist);
+  r->bundle_transfers_in_progress = state->pushes.count + state->pushes_active + state->pulls.count;
+  if (state->pulls_started) {
+    if (rhizome_any_fetch_active() || rhizome_any_fetch_queued())
+      r->bundle_transfers_in_progress++;
+    else
+      state->pulls_started = 0;
+  }
+  if (state->pulls.count || state->pulls_started) {
+    // the fetch slots do not say when they are done, so look again shortly
+    unschedule(&state->alarm);
+    state->alarm.alarm = gettime_ms() + 100;
+    state->alarm.deadline = state->alarm.alarm + 1000;
+    schedule(&state->alarm);
+  }
 
-  /* now update cursor according to what range was covered in the response.
-     We set our current position to just past the high limit of the returned
-     cursor.
+  /* This may fill and dispatch the next enquiry, or conclude the sync, which
+     releases the transport state, so it must come last. */
+  if (   state->enquiry == RHIZOME_DIRECT_ENQUIRY_NONE
+      && state->pushes.count + state->pulls.count < config.rhizome.direct.queue_limit
+  )
+    rhizome_direct_continue_sync_request(r);
+}
 
-     XXX - This introduces potential problems with the returned cursor range.
-     If the far end returns an earlier cursor position than we are in, we could
-     end up in an infinite loop.  We could also end up in a very long finite loop
-     if the cursor doesn't advance far.  A simple solution is to not adjust the
-     cursor position, and simply re-attempt the sync until no actions result.
-     That will do for now.
- */
-#ifdef FANCY_CURSOR_POSITION_HANDLING
-  rhizome_direct_bundle_cursor *c=rhizome_direct_bundle_iterator(10);
-  assert(c!=NULL);
-  if (rhizome_direct_bundle_iterator_unpickle_range(c,(unsigned char *)&p[0],10)) {
-    if (config.debug.rhizome_tx)
-      DEBUGF("Couldn't unpickle range. This should never happen.  Assuming near and far cursor ranges match.");
+void rhizome_direct_http_dispatch(rhizome_direct_sync_request *r)
+{
+  if (config.debug.rhizome_tx) {
+    if (r->cursor)
+      DEBUGF("Dispatch size_high=%"PRId64,r->cursor->size_high);
+    else
+      DEBUGF("Dispatch range enquiry of %zu bytes", ob_position(r->ranges));
   }
-  else {
-    if (config.debug.rhizome_tx) {
-      DEBUGF("unpickled size_high=%"PRId64", limit_size_high=%"PRId64, c->size_high, c->limit_size_high);
-      DEBUGF("c->buffer_size=%d",c->buffer_size);
-    }
-    r->cursor->size_low=c->limit_size_high;
-    /* Set tail of BID to all high, as we assume the far end has returned all
-       BIDs with the specified prefix. */
-    r->cursor->bid_low = RHIZOME_BID_MAX;
-    bcopy(c->limit_bid_high.binary, r->cursor->bid_low.binary, 4);
-  }
-  rhizome_direct_bundle_iterator_free(&c);
-#endif
-
-  end:
-  /* Warning: tail recursion when done this way.
-     Should be triggered by an asynchronous event.
-     But this will do for now. */
-  rhizome_direct_continue_sync_request(r);
+  rhizome_direct_transport_state_http *state = r->transport_specific_state;
+  if (state->sync == NULL) {
+    state->sync = r;
+    state->alarm.function = rd_http_pump;
+    state->alarm.stats = &rd_http_pump_stats;
+    struct hostent *hostent = gethostbyname(state->host);
+    if (!hostent)
+      WHYF("Could not resolve Rhizome Direct host %s", alloca_str_toprint(state->host));
+    else {
+      state->addr.addrlen = sizeof(state->addr.inet);
+      state->addr.inet.sin_family = AF_INET;
+      state->addr.inet.sin_port = htons(state->port);
+      state->addr.inet.sin_addr = *((struct in_addr *)hostent->h_addr);
+    }
+  }
+  state->enquiry = RHIZOME_DIRECT_ENQUIRY_QUEUED;
+  rd_http_wake(state);
+}
+
+void rhizome_direct_http_release(rhizome_direct_sync_request *r)
+{
+  rhizome_direct_transport_state_http *state = r->transport_specific_state;
+  while (state->connections)
+    rd_http_close(state->connections);
+  unschedule(&state->alarm);
+  free(state->pushes.prefixes);
+  free(state->pulls.prefixes);
+  free(state);
+  r->transport_specific_state = NULL;
 }
@@ -0,0 +1,609 @@
+/*
+ Serval DNA - Rhizome Direct range reconciliation
+ Copyright (C) 2014 Serval Project Inc.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <assert.h>
+#include "serval.h"
+#include "conf.h"
+#include "rhizome.h"
+#include "overlay_buffer.h"
+#include "dataformats.h"
+#include "str.h"
+
+/* Rhizome Direct enquiries compare two stores by reconciling ranges of bundle IDs.
+
+   The space of bundle IDs is a tree of ranges, each named by a prefix of hex digits: the root range
+   holds every bundle, and each range divides into sixteen by the next digit.  The fingerprint of a
+   range is the number of bundles in it and the exclusive-or of a hash of each one's ID and version,
+   so a range that holds no differences is passed over in one step however many bundles it holds.
+
+   A message is a version byte followed by records, each a type byte, the range (its number of hex
+   digits, then the bytes holding them) and:
+
+     RANGE_FINGERPRINT  packed count of bundles, fingerprint
+     RANGE_ITEMS        packed count, then the BAR prefix and packed version of each bundle in order
+     RANGE_DIFF         packed count and bundles as above, then a packed count of bits and a bitmap
+
+   The client opens with the fingerprint of its whole store.  Whoever receives a fingerprint that
+   differs from its own answers with its own bundles in that range if it holds few of them, otherwise
+   with the fingerprints of the sixteen sub-ranges, or the bundles of those that hold few.  The client
+   works out for itself what to push and pull from a list of the server's bundles, and the server
+   answers a list of the client's with a RANGE_DIFF: the bundles of its own that the client should
+   pull, and a bitmap of those on the client's list that it should push.  Ranges that agree are left
+   out of a reply, so the sync is over when the client has nothing left to ask.
+
+   Every range is read in bundle ID order through the primary key index of the manifests table, so no
+   more than a few bundles of it are held in memory at a time.
+*/
+
+#define RANGE_VERSION 1
+
+#define RANGE_FINGERPRINT 1
+#define RANGE_ITEMS 2
+#define RANGE_DIFF 3
+
+#define RANGE_FANOUT 16
+#define RANGE_MAX_DEPTH (RHIZOME_BUNDLE_ID_STRLEN)
+#define RANGE_FINGERPRINT_BYTES 16
+// ranges that hold no more bundles than this are sent as a list
+#define RANGE_LIST_MAX 2
+// the most bundles in any one record, bigger ranges are split instead
+#define RANGE_ITEMS_MAX 1024
+// once a message has grown this long, differing ranges are passed back whole, to be split next round
+#define RANGE_MESSAGE_BUDGET (256 * 1024)
+
+struct range {
+  unsigned depth; // in hex digits
+  unsigned char prefix[RHIZOME_BUNDLE_ID_BYTES];
+};
+
+struct range_item {
+  unsigned char prefix[RHIZOME_BAR_PREFIX_BYTES];
+  uint64_t version;
+};
+
+struct range_fingerprint {
+  uint32_t count;
+  unsigned char hash[RANGE_FINGERPRINT_BYTES];
+};
+
+// A range and its sub-ranges, with the bundles of each sub-range as far as RANGE_LIST_MAX
+struct range_summary {
+  struct range_fingerprint whole;
+  struct range_fingerprint part[RANGE_FANOUT];
+  unsigned listed[RANGE_FANOUT];
+  struct range_item items[RANGE_FANOUT][RANGE_LIST_MAX];
+};
+
+typedef int RANGE_BUNDLE_FN(void *context, const rhizome_bid_t *bid, uint64_t version);
+
+static unsigned range_digit(const unsigned char *bytes, unsigned i)
+{
+  return i & 1 ? bytes[i / 2] & 0xF : bytes[i / 2] >> 4;
+}
+
+static void range_part(const struct range *range, unsigned digit, struct range *part)
+{
+  assert(range->depth < RANGE_MAX_DEPTH);
+  *part = *range;
+  if (range->depth & 1)
+    part->prefix[range->depth / 2] |= digit;
+  else
+    part->prefix[range->depth / 2] = digit << 4;
+  part->depth = range->depth + 1;
+}
+
+/* Call fn() for each bundle in the range, in bundle ID order, stopping if it returns nonzero.
+ */
+static int range_each_bundle(const struct range *range, RANGE_BUNDLE_FN *fn, void *context)
+{
+  // The range holds exactly the IDs that start with its digits, ie, from those digits up to (but not
+  // including) the next prefix of the same length, if there is one.
+  char low[RANGE_MAX_DEPTH + 1];
+  char high[RANGE_MAX_DEPTH + 1];
+  tohex(low, range->depth, range->prefix);
+  strcpy(high, low);
+  size_t len = range->depth;
+  while (len && high[len - 1] == 'F')
+    high[--len] = '\0';
+  if (len)
+    high[len - 1] = high[len - 1] == '9' ? 'A' : high[len - 1] + 1;
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement;
+  if (len)
+    statement = sqlite_prepare_bind(&retry,
+	"SELECT id, version FROM MANIFESTS WHERE id >= ? AND id < ? ORDER BY id",
+	STATIC_TEXT, low,
+	STATIC_TEXT, high,
+	END);
+  else
+    statement = sqlite_prepare_bind(&retry,
+	"SELECT id, version FROM MANIFESTS WHERE id >= ? ORDER BY id",
+	STATIC_TEXT, low,
+	END);
+  if (!statement)
+    return -1;
+  int ret = 0;
+  while (ret == 0 && sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
+    const char *id = (const char *) sqlite3_column_text(statement, 0);
+    rhizome_bid_t bid;
+    if (str_to_rhizome_bid_t(&bid, id) == -1) {
+      WARNF("Malformed manifest id %s", alloca_str_toprint(id));
+      continue;
+    }
+    ret = fn(context, &bid, sqlite3_column_int64(statement, 1));
+  }
+  sqlite3_finalize(statement);
+  return ret;
+}
+
+static void range_hash(const rhizome_bid_t *bid, uint64_t version, unsigned char hash[crypto_hash_sha512_BYTES])
+{
+  unsigned char item[RHIZOME_BUNDLE_ID_BYTES + 8];
+  memcpy(item, bid->binary, RHIZOME_BUNDLE_ID_BYTES);
+  write_uint64(&item[RHIZOME_BUNDLE_ID_BYTES], version);
+  crypto_hash_sha512(hash, item, sizeof item);
+}
+
+static void range_fingerprint_add(struct range_fingerprint *f, const unsigned char *hash)
+{
+  unsigned i;
+  for (i = 0; i < RANGE_FINGERPRINT_BYTES; ++i)
+    f->hash[i] ^= hash[i];
+  ++f->count;
+}
+
+static int range_fingerprint_equal(const struct range_fingerprint *a, const struct range_fingerprint *b)
+{
+  return a->count == b->count && memcmp(a->hash, b->hash, RANGE_FINGERPRINT_BYTES) == 0;
+}
+
+struct range_summarise_context {
+  const struct range *range;
+  struct range_summary *summary;
+};
+
+static int range_summarise_bundle(void *context, const rhizome_bid_t *bid, uint64_t version)
+{
+  struct range_summarise_context *sc = context;
+  struct range_summary *s = sc->summary;
+  // a range of full length holds at most one bundle, so is never split
+  unsigned digit = sc->range->depth < RANGE_MAX_DEPTH ? range_digit(bid->binary, sc->range->depth) : 0;
+  unsigned char hash[crypto_hash_sha512_BYTES];
+  range_hash(bid, version, hash);
+  range_fingerprint_add(&s->whole, hash);
+  range_fingerprint_add(&s->part[digit], hash);
+  if (s->listed[digit] < RANGE_LIST_MAX) {
+    struct range_item *item = &s->items[digit][s->listed[digit]++];
+    memcpy(item->prefix, bid->binary, sizeof item->prefix);
+    item->version = version;
+  }
+  return 0;
+}
+
+static int range_summarise(const struct range *range, struct range_summary *s)
+{
+  bzero(s, sizeof *s);
+  struct range_summarise_context sc = { .range = range, .summary = s };
+  return range_each_bundle(range, range_summarise_bundle, &sc);
+}
+
+static void range_append(struct overlay_buffer *b, unsigned char type, const struct range *range)
+{
+  ob_append_byte(b, type);
+  ob_append_byte(b, range->depth);
+  if (range->depth)
+    ob_append_bytes(b, range->prefix, (range->depth + 1) / 2);
+}
+
+static void range_append_fingerprint(struct overlay_buffer *b, const struct range *range, const struct range_fingerprint *f)
+{
+  range_append(b, RANGE_FINGERPRINT, range);
+  ob_append_packed_ui32(b, f->count);
+  ob_append_bytes(b, f->hash, RANGE_FINGERPRINT_BYTES);
+}
+
+static void range_append_items(struct overlay_buffer *b, unsigned char type, const struct range *range, const struct range_item *items, unsigned count)
+{
+  range_append(b, type, range);
+  ob_append_packed_ui32(b, count);
+  unsigned i;
+  for (i = 0; i < count; ++i) {
+    ob_append_bytes(b, items[i].prefix, sizeof items[i].prefix);
+    ob_append_packed_ui64(b, items[i].version);
+  }
+}
+
+/* Answer a range whose fingerprint differs from ours with our own bundles in it if there are few of
+ * them, otherwise with the fingerprints of its sub-ranges, or the bundles of those that hold few.
+ */
+static void range_append_split(struct overlay_buffer *b, const struct range *range, const struct range_summary *s)
+{
+  if (ob_position(b) >= RANGE_MESSAGE_BUDGET) {
+    range_append_fingerprint(b, range, &s->whole);
+    return;
+  }
+  unsigned i;
+  if (s->whole.count <= RANGE_LIST_MAX || range->depth == RANGE_MAX_DEPTH) {
+    struct range_item items[RANGE_LIST_MAX];
+    unsigned count = 0;
+    for (i = 0; i < RANGE_FANOUT; ++i) {
+      memcpy(&items[count], s->items[i], s->listed[i] * sizeof items[0]);
+      count += s->listed[i];
+    }
+    range_append_items(b, RANGE_ITEMS, range, items, count);
+    return;
+  }
+  for (i = 0; i < RANGE_FANOUT; ++i) {
+    struct range part;
+    range_part(range, i, &part);
+    if (s->part[i].count <= RANGE_LIST_MAX)
+      range_append_items(b, RANGE_ITEMS, &part, s->items[i], s->listed[i]);
+    else
+      range_append_fingerprint(b, &part, &s->part[i]);
+  }
+}
+
+static int range_get(struct overlay_buffer *b, struct range *range)
+{
+  int depth = ob_get(b);
+  if (depth < 0 || depth > RANGE_MAX_DEPTH)
+    return -1;
+  bzero(range, sizeof *range);
+  range->depth = depth;
+  size_t len = (range->depth + 1) / 2;
+  if (len) {
+    const unsigned char *prefix = ob_get_bytes_ptr(b, len);
+    if (!prefix)
+      return -1;
+    memcpy(range->prefix, prefix, len);
+    if (range->depth & 1)
+      range->prefix[len - 1] &= 0xF0;
+  }
+  return 0;
+}
+
+static int range_get_fingerprint(struct overlay_buffer *b, struct range_fingerprint *f)
+{
+  f->count = ob_get_packed_ui32(b);
+  const unsigned char *hash = ob_get_bytes_ptr(b, RANGE_FINGERPRINT_BYTES);
+  if (!hash)
+    return -1;
+  memcpy(f->hash, hash, RANGE_FINGERPRINT_BYTES);
+  return 0;
+}
+
+/* Read a list of bundles into items[], which must have room for RANGE_ITEMS_MAX.
+ */
+static int range_get_items(struct overlay_buffer *b, struct range_item *items, unsigned *countp)
+{
+  uint32_t count = ob_get_packed_ui32(b);
+  if (count > RANGE_ITEMS_MAX)
+    return -1;
+  unsigned i;
+  for (i = 0; i < count; ++i) {
+    const unsigned char *prefix = ob_get_bytes_ptr(b, sizeof items[i].prefix);
+    if (!prefix)
+      return -1;
+    memcpy(items[i].prefix, prefix, sizeof items[i].prefix);
+    items[i].version = ob_get_packed_ui64(b);
+  }
+  *countp = count;
+  return 0;
+}
+
+/* Walk our bundles in a range alongside the other party's list of theirs, finding the ones that only
+ * they hold or hold a newer version of (wanted), and those that only we hold or hold a newer version
+ * of (offered).
+ */
+struct range_merge {
+  const struct range_item *theirs;
+  unsigned count;
+  unsigned next;
+  void (*want)(struct range_merge *, unsigned index);
+  void (*offer)(struct range_merge *, const rhizome_bid_t *bid, uint64_t version);
+};
+
+static int range_merge_bundle(void *context, const rhizome_bid_t *bid, uint64_t version)
+{
+  struct range_merge *m = context;
+  while (m->next < m->count) {
+    const struct range_item *their = &m->theirs[m->next];
+    int cmp = memcmp(their->prefix, bid->binary, sizeof their->prefix);
+    if (cmp > 0)
+      break;
+    ++m->next;
+    if (cmp < 0)
+      m->want(m, m->next - 1);
+    else {
+      if (their->version > version)
+	m->want(m, m->next - 1);
+      else if (their->version < version)
+	m->offer(m, bid, version);
+      return 0;
+    }
+  }
+  m->offer(m, bid, version);
+  return 0;
+}
+
+static int range_merge(const struct range *range, struct range_merge *m)
+{
+  m->next = 0;
+  if (range_each_bundle(range, range_merge_bundle, m) == -1)
+    return -1;
+  while (m->next < m->count)
+    m->want(m, m->next++);
+  return 0;
+}
+
+/* The server's answer to a list of the client's bundles.
+ */
+struct range_diff {
+  struct range_merge merge; // must be first
+  struct range_item *offers;
+  unsigned offered;
+  bool_t overflow;
+  bool_t wanted;
+  unsigned char bitmap[(RANGE_ITEMS_MAX + 7) / 8];
+};
+
+static void range_diff_want(struct range_merge *m, unsigned index)
+{
+  struct range_diff *d = (struct range_diff *) m;
+  d->bitmap[index / 8] |= 1 << (index & 7);
+  d->wanted = 1;
+}
+
+static void range_diff_offer(struct range_merge *m, const rhizome_bid_t *bid, uint64_t version)
+{
+  struct range_diff *d = (struct range_diff *) m;
+  if (d->offered == RANGE_ITEMS_MAX) {
+    d->overflow = 1;
+    return;
+  }
+  struct range_item *item = &d->offers[d->offered++];
+  memcpy(item->prefix, bid->binary, sizeof item->prefix);
+  item->version = version;
+}
+
+/* Returns 1 if we hold too many bundles in the range to list them, so it must be split instead.
+ */
+static int range_append_diff(struct overlay_buffer *b, const struct range *range, const struct range_item *theirs, unsigned count, struct range_item *offers)
+{
+  struct range_diff d;
+  bzero(&d, sizeof d);
+  d.merge.theirs = theirs;
+  d.merge.count = count;
+  d.merge.want = range_diff_want;
+  d.merge.offer = range_diff_offer;
+  d.offers = offers;
+  if (range_merge(range, &d.merge) == -1)
+    return -1;
+  if (d.overflow)
+    return 1;
+  if (d.offered || d.wanted) {
+    range_append_items(b, RANGE_DIFF, range, d.offers, d.offered);
+    ob_append_packed_ui32(b, count);
+    if (count)
+      ob_append_bytes(b, d.bitmap, (count + 7) / 8);
+  }
+  return 0;
+}
+
+struct overlay_buffer *rhizome_direct_range_begin()
+{
+  struct range root;
+  bzero(&root, sizeof root);
+  struct range_summary s;
+  if (range_summarise(&root, &s) == -1)
+    return NULL;
+  struct overlay_buffer *b = ob_new();
+  if (b == NULL)
+    return NULL;
+  ob_append_byte(b, RANGE_VERSION);
+  range_append_fingerprint(b, &root, &s.whole);
+  return b;
+}
+
+struct overlay_buffer *rhizome_direct_range_respond(const unsigned char *enquiry, size_t len)
+{
+  struct overlay_buffer *b = ob_static((unsigned char *) enquiry, len);
+  struct overlay_buffer *reply = ob_new();
+  struct range_item *theirs = emalloc(RANGE_ITEMS_MAX * sizeof *theirs);
+  struct range_item *offers = emalloc(RANGE_ITEMS_MAX * sizeof *offers);
+  unsigned records = 0;
+  if (!b || !reply || !theirs || !offers)
+    goto error;
+  ob_limitsize(b, len);
+  if (ob_get(b) != RANGE_VERSION) {
+    WHY("Unsupported range enquiry");
+    goto error;
+  }
+  ob_append_byte(reply, RANGE_VERSION);
+  while (ob_remaining(b)) {
+    int type = ob_get(b);
+    struct range range;
+    if (range_get(b, &range) == -1)
+      goto malformed;
+    struct range_summary s;
+    switch (type) {
+    case RANGE_FINGERPRINT: {
+	struct range_fingerprint f;
+	if (range_get_fingerprint(b, &f) == -1)
+	  goto malformed;
+	if (range_summarise(&range, &s) == -1)
+	  goto error;
+	if (!range_fingerprint_equal(&f, &s.whole))
+	  range_append_split(reply, &range, &s);
+      }
+      break;
+    case RANGE_ITEMS: {
+	unsigned count;
+	if (range_get_items(b, theirs, &count) == -1)
+	  goto malformed;
+	int ret = ob_position(reply) < RANGE_MESSAGE_BUDGET ? range_append_diff(reply, &range, theirs, count, offers) : 1;
+	if (ret == -1)
+	  goto error;
+	if (ret == 1) {
+	  if (range_summarise(&range, &s) == -1)
+	    goto error;
+	  range_append_split(reply, &range, &s);
+	}
+      }
+      break;
+    default:
+      goto malformed;
+    }
+    ++records;
+  }
+  if (config.debug.rhizome)
+    DEBUGF("Answered range enquiry of %u records, %zu bytes, with %zu bytes", records, len, ob_position(reply));
+  ob_free(b);
+  free(theirs);
+  free(offers);
+  return reply;
+malformed:
+  WHYF("Malformed range enquiry at byte %zu of %zu", ob_position(b), len);
+error:
+  if (b)
+    ob_free(b);
+  if (reply)
+    ob_free(reply);
+  free(theirs);
+  free(offers);
+  return NULL;
+}
+
+/* The client's resolution of a list of the server's bundles.
+ */
+struct range_resolve {
+  struct range_merge merge; // must be first
+  RHIZOME_DIRECT_RANGE_ACTION *action;
+  void *context;
+  // for a RANGE_DIFF, the bitmap of our bundles to push
+  const unsigned char *bitmap;
+  unsigned bits;
+  unsigned index;
+};
+
+static void range_resolve_want(struct range_merge *m, unsigned index)
+{
+  struct range_resolve *r = (struct range_resolve *) m;
+  r->action(r->context, RHIZOME_DIRECT_RANGE_PULL, m->theirs[index].prefix);
+}
+
+static void range_resolve_offer(struct range_merge *m, const rhizome_bid_t *bid, uint64_t UNUSED(version))
+{
+  struct range_resolve *r = (struct range_resolve *) m;
+  r->action(r->context, RHIZOME_DIRECT_RANGE_PUSH, bid->binary);
+}
+
+static int range_resolve_wanted(void *context, const rhizome_bid_t *bid, uint64_t UNUSED(version))
+{
+  struct range_resolve *r = context;
+  if (r->index >= r->bits)
+    return 1;
+  if (r->bitmap[r->index / 8] & (1 << (r->index & 7)))
+    r->action(r->context, RHIZOME_DIRECT_RANGE_PUSH, bid->binary);
+  ++r->index;
+  return 0;
+}
+
+int rhizome_direct_range_resolve(const unsigned char *response, size_t len, struct overlay_buffer **nextp, RHIZOME_DIRECT_RANGE_ACTION *action, void *context)
+{
+  *nextp = NULL;
+  struct overlay_buffer *b = ob_static((unsigned char *) response, len);
+  struct overlay_buffer *next = ob_new();
+  struct range_item *theirs = emalloc(RANGE_ITEMS_MAX * sizeof *theirs);
+  unsigned records = 0;
+  if (!b || !next || !theirs)
+    goto error;
+  ob_limitsize(b, len);
+  if (ob_get(b) != RANGE_VERSION) {
+    WHY("Unsupported range enquiry response");
+    goto error;
+  }
+  ob_append_byte(next, RANGE_VERSION);
+  while (ob_remaining(b)) {
+    int type = ob_get(b);
+    struct range range;
+    if (range_get(b, &range) == -1)
+      goto malformed;
+    struct range_resolve r;
+    bzero(&r, sizeof r);
+    r.merge.theirs = theirs;
+    r.merge.want = range_resolve_want;
+    r.merge.offer = range_resolve_offer;
+    r.action = action;
+    r.context = context;
+    switch (type) {
+    case RANGE_FINGERPRINT: {
+	struct range_fingerprint f;
+	if (range_get_fingerprint(b, &f) == -1)
+	  goto malformed;
+	struct range_summary s;
+	if (range_summarise(&range, &s) == -1)
+	  goto error;
+	if (!range_fingerprint_equal(&f, &s.whole))
+	  range_append_split(next, &range, &s);
+      }
+      break;
+    case RANGE_ITEMS:
+      if (range_get_items(b, theirs, &r.merge.count) == -1)
+	goto malformed;
+      if (range_merge(&range, &r.merge) == -1)
+	goto error;
+      break;
+    case RANGE_DIFF: {
+	if (range_get_items(b, theirs, &r.merge.count) == -1)
+	  goto malformed;
+	unsigned i;
+	for (i = 0; i < r.merge.count; ++i)
+	  range_resolve_want(&r.merge, i);
+	r.bits = ob_get_packed_ui32(b);
+	if (r.bits > RANGE_ITEMS_MAX || (r.bitmap = ob_get_bytes_ptr(b, (r.bits + 7) / 8)) == NULL)
+	  goto malformed;
+	if (range_each_bundle(&range, range_resolve_wanted, &r) == -1)
+	  goto error;
+      }
+      break;
+    default:
+      goto malformed;
+    }
+    ++records;
+  }
+  if (config.debug.rhizome)
+    DEBUGF("Resolved range response of %u records, %zu bytes, next enquiry %zu bytes", records, len, ob_position(next));
+  ob_free(b);
+  free(theirs);
+  if (ob_position(next) > 1)
+    *nextp = next;
+  else
+    ob_free(next);
+  return 0;
+malformed:
+  WHYF("Malformed range enquiry response at byte %zu of %zu", ob_position(b), len);
+error:
+  if (b)
+    ob_free(b);
+  if (next)
+    ob_free(next);
+  free(theirs);
+  return -1;
+}
@@ -42,8 +42,44 @@ struct rhizome_fetch_candidate {
      for MDP. */
   struct socket_address addr;
   const struct subscriber *peer;
+
+  time_ms_t queued_time;
+  /* When the candidate was queued, plus a penalty for everything that makes it less worth fetching
+     soon.  The candidate with the lowest priority is fetched first, so every candidate is
+     eventually fetched however large its penalty. */
+  time_ms_t priority;
+  unsigned char size_class;
+};
+
+/* A neighbour that holds the payload of an active MDP fetch.  Each one is asked for its own window
+ * of blocks, so that a payload advertised by several neighbours is fetched from all of them at once.
+ */
+struct rhizome_fetch_source {
+  const struct subscriber *peer;
+  uint64_t window;		// file offset of the blocks last requested from this peer
+  uint64_t window_bytes;	// length of the window last requested from this peer
+  uint16_t block_length;	// block length of the window last requested from this peer
+  int requested;		// blocks requested from this peer in its last window
+  int outstanding;		// blocks requested from this peer that have not arrived yet
+  int highest;			// highest block of the last window that has arrived, or -1
+  int stalls;			// requests in a row that this peer has not answered in time
+  time_ms_t request_time;	// time of the last request to this peer
+  time_ms_t last_activity;	// time of the last request to or block from this peer
+  uint64_t bytes_received;
+
+  /* Pacing.  The window grows while whole windows arrive, and shrinks when blocks are lost, or
+     when a window no smaller than the best one so far delivers noticeably less, as blocks that
+     queue up behind each other instead of crossing the link will. */
+  int blocks;			// how many blocks to ask for in the next window
+  char legacy;			// peer only answers the first 32 blocks of a window
+  unsigned loss;		// smoothed share of requested blocks that were lost, per thousand
+  time_ms_t srtt;		// smoothed time for a window to arrive, 0 if not known yet
+  uint32_t best_goodput;	// most bytes per second delivered by one window, slowly forgotten
+  int best_blocks;		// size of the window that delivered them
 };
 
+#define RHIZOME_FETCH_MAX_SOURCES 8
+
 /* Represents an active fetch (in progress) of a bundle payload (.manifest != NULL) or of a bundle
  * manifest (.manifest == NULL).
  */
@@ -73,6 +109,14 @@ struct rhizome_fetch_slot {
   int request_len;
   int request_ofs;
   rhizome_manifest *previous;
+  
+  /* HTTP fetch of a new version as a delta against the payload of the version we hold: the
+     signatures of its blocks are sent after the request headers, and the ops that come back are
+     applied as they arrive */
+  unsigned char *upload;
+  size_t upload_len;
+  size_t upload_ofs;
+  struct rhizome_delta_decoder *delta;
 
   /* HTTP streaming reception of manifests */
   char manifest_buffer[1024];
@@ -84,53 +128,119 @@ struct rhizome_fetch_slot {
   int prefix_length;
   int mdpIdleTimeout;
   time_ms_t mdp_last_request_time;
-  uint64_t mdp_last_request_offset;
-  int mdpResponsesOutstanding;
   int mdpRXBlockLength;
-  unsigned char mdpRXWindow[32*200];
+  int mdpCleanWindows;		// windows in a row that arrived without loss
+  struct rhizome_fetch_source sources[RHIZOME_FETCH_MAX_SOURCES];
+  unsigned source_count;
+
+  /* Block hashes being fetched over MDP before the payload blocks, so that each block can be
+     verified as it arrives */
+  unsigned char *block_hashes;
+  uint32_t block_hash_count;
+  uint32_t block_hashes_received;
+  int block_hash_requests;
+
+  /* Chunk list of the payload being fetched over MDP, so that the chunks we already hold can be
+     copied from our own store, and only the rest fetched */
+  char chunk_list_wanted;
+  struct rhizome_chunk_ref *chunks;
+  uint32_t chunk_count;
+  uint32_t chunks_received;
+  int chunk_list_requests;
+  uint32_t chunk_next;
+  uint64_t chunk_next_offset;
+  uint64_t chunk_bytes_copied;
 };
 
+// how many times to ask for block hashes before giving up and fetching unverified blocks
+#define RHIZOME_BLOCK_HASH_REQUEST_LIMIT 3
+// how many times to ask for a chunk list before giving up and fetching every block
+#define RHIZOME_CHUNK_LIST_REQUEST_LIMIT 3
+// how much content to copy from held chunks before letting other work run
+#define RHIZOME_CHUNK_COPY_LIMIT (1024*1024)
+// how far past the write position other sources may be asked for blocks; well within the amount of
+// out of order content that rhizome_random_write() will hold
+#define RHIZOME_FETCH_SWARM_SPAN (256*1024)
+// how many stall timeouts in a row before a source is dropped, if others are still answering
+#define RHIZOME_FETCH_SOURCE_STALL_LIMIT 3
+// smallest pacing window of each source, in blocks; the largest is RHIZOME_MDP_MAX_WINDOW
+#define RHIZOME_FETCH_MIN_WINDOW 8
+// bounds of the block length, which shrinks on lossy links and grows on clean ones
+#define RHIZOME_FETCH_MIN_BLOCK_LENGTH 256
+#define RHIZOME_FETCH_MAX_BLOCK_LENGTH 1024
+// shortest stall timeout, however quickly windows have been arriving
+#define RHIZOME_FETCH_MIN_STALL_TIMEOUT 100
+
 static enum rhizome_start_fetch_result rhizome_fetch_switch_to_mdp(struct rhizome_fetch_slot *slot);
 static int rhizome_fetch_mdp_requestblocks(struct rhizome_fetch_slot *slot);
+static int rhizome_fetch_mdp_request_window(struct rhizome_fetch_slot *slot, struct rhizome_fetch_source *source);
+static int rhizome_fetch_mdp_touch_timeout(struct rhizome_fetch_slot *slot);
+static time_ms_t fetch_source_stall_timeout(const struct rhizome_fetch_source *source);
+static int rhizome_write_complete(struct rhizome_fetch_slot *slot);
+static void fetch_delta_free(struct rhizome_fetch_slot *slot);
+
+#define RHIZOME_FETCH_MAX_SLOTS 16
+// payloads and manifests no bigger than this always have a fetch slot they can use, however many
+// big fetches are in progress
+#define RHIZOME_FETCH_SMALL_SIZE (8*1024)
+
+/* Candidate priority penalties, in milliseconds of queueing time.
+ */
+#define RHIZOME_FETCH_SIZE_PENALTY 2000		// per doubling of payload size
+#define RHIZOME_FETCH_AGE_PENALTY 500		// per doubling of bundle age in minutes
+#define RHIZOME_FETCH_SERVICE_BONUS 20000	// for MeshMS conversations
+#define RHIZOME_FETCH_DROP_PENALTY 100		// per percent of packets lost on the path to the peer
+#define RHIZOME_FETCH_RETRY_PENALTY 10000	// per recent failed fetch of the same bundle
 
-/* Represents a queue of fetch candidates and a single active fetch for bundle payloads whose size
- * is less than a given threshold.
- *
- * TODO: If the queues ever get much larger, use pointer-linked queue instead of physically ordered
- * in memory, to avoid the need for memory copies when deleting or inserting queue entries.
- *
- * @author Andrew Bettison <andrew@servalproject.com>
+/* The fetch slots, of which config.rhizome.fetch_slots are used.
  */
-struct rhizome_fetch_queue {
-  struct rhizome_fetch_slot active; // must be first element in struct
-  unsigned candidate_queue_size;
-  struct rhizome_fetch_candidate *candidate_queue;
-  unsigned char log_size_threshold; // will only queue payloads smaller than this.
-};
+static struct rhizome_fetch_slot rhizome_fetch_slots[RHIZOME_FETCH_MAX_SLOTS];
+
+#define slotno(slot) (int)((slot) - &rhizome_fetch_slots[0])
 
-/* Static allocation of the candidate queues.
+/* Fetch candidates waiting for a free slot, as a binary heap ordered by priority.  It grows as
+ * needed up to config.rhizome.fetch_queue_size candidates, after which the least worthy candidate
+ * is dropped to make room for a better one.
  */
-struct rhizome_fetch_candidate queue0[10];
-struct rhizome_fetch_candidate queue1[8];
-struct rhizome_fetch_candidate queue2[6];
-struct rhizome_fetch_candidate queue3[4];
-struct rhizome_fetch_candidate queue4[2];
-struct rhizome_fetch_candidate queue5[2];
+static struct rhizome_fetch_candidate *candidates = NULL;
+static unsigned candidate_count = 0;
+static unsigned candidate_alloc = 0;
 
-#define slotno(slot) (int)((struct rhizome_fetch_queue *)(slot) - &rhizome_fetch_queues[0])
+/* Queueing statistics by payload size, kept for each power of eight.
+ */
+struct rhizome_fetch_queue_stats {
+  unsigned char log_size_threshold; // counts payloads smaller than this
+  unsigned waiting;
+  unsigned queued;
+  unsigned started;
+  unsigned dropped;
+  time_ms_t total_wait;
+  time_ms_t max_wait;
+};
+
+static struct rhizome_fetch_queue_stats queue_stats[] = {
+  { .log_size_threshold =   10 },
+  { .log_size_threshold =   13 },
+  { .log_size_threshold =   16 },
+  { .log_size_threshold =   19 },
+  { .log_size_threshold =   22 },
+  { .log_size_threshold = 0xFF }
+};
+
+#define NQUEUES	    NELS(queue_stats)
 
-/* Static allocation of the queue structures.  Must be in order of ascending log_size_threshold.
+/* Recent fetch failures, so that a bundle that keeps failing does not keep a slot from others.
  */
-struct rhizome_fetch_queue rhizome_fetch_queues[] = {
-  { .candidate_queue_size = NELS(queue0), .candidate_queue = queue0, .log_size_threshold =   10, .active = { .state = RHIZOME_FETCH_FREE } },
-  { .candidate_queue_size = NELS(queue1), .candidate_queue = queue1, .log_size_threshold =   13, .active = { .state = RHIZOME_FETCH_FREE } },
-  { .candidate_queue_size = NELS(queue2), .candidate_queue = queue2, .log_size_threshold =   16, .active = { .state = RHIZOME_FETCH_FREE } },
-  { .candidate_queue_size = NELS(queue3), .candidate_queue = queue3, .log_size_threshold =   19, .active = { .state = RHIZOME_FETCH_FREE } },
-  { .candidate_queue_size = NELS(queue4), .candidate_queue = queue4, .log_size_threshold =   22, .active = { .state = RHIZOME_FETCH_FREE } },
-  { .candidate_queue_size = NELS(queue5), .candidate_queue = queue5, .log_size_threshold = 0xFF, .active = { .state = RHIZOME_FETCH_FREE } }
+struct rhizome_fetch_retry {
+  unsigned char bid_prefix[RHIZOME_BAR_PREFIX_BYTES];
+  unsigned failures;
+  time_ms_t last_failure;
 };
 
-#define NQUEUES	    NELS(rhizome_fetch_queues)
+#define RHIZOME_FETCH_RETRY_BINS 64
+// how long before a failed fetch is forgotten
+#define RHIZOME_FETCH_RETRY_EXPIRY 600000
+static struct rhizome_fetch_retry fetch_retries[RHIZOME_FETCH_RETRY_BINS];
 
 static const char * fetch_state(int state)
 {
@@ -152,6 +262,20 @@ static const char * fetch_state(int state)
   }
 }
 
+static unsigned fetch_slot_count()
+{
+  unsigned count = config.rhizome.fetch_slots;
+  return count > RHIZOME_FETCH_MAX_SLOTS ? RHIZOME_FETCH_MAX_SLOTS : count;
+}
+
+static unsigned fetch_size_class(unsigned char log_size)
+{
+  unsigned i;
+  for (i = 0; i + 1 < NQUEUES && log_size >= queue_stats[i].log_size_threshold; ++i)
+    ;
+  return i;
+}
+
 DEFINE_ALARM(rhizome_fetch_status);
 void rhizome_fetch_status(struct sched_ent *alarm)
 {
@@ -159,25 +283,19 @@ void rhizome_fetch_status(struct sched_ent *alarm)
     return;
     
   unsigned i;
+  for(i=0;i<fetch_slot_count();i++){
+    struct rhizome_fetch_slot *slot=&rhizome_fetch_slots[i];
+    DEBUGF("Fetch slot %d, %s %"PRIu64" of %"PRIu64,
+      i,
+      fetch_state(slot->state),
+      slot->state==RHIZOME_FETCH_FREE?0:slot->write_state.file_offset,
+      slot->state!=RHIZOME_FETCH_FREE && slot->manifest?slot->manifest->filesize:0);
+  }
   for(i=0;i<NQUEUES;i++){
-    struct rhizome_fetch_queue *q=&rhizome_fetch_queues[i];
-    unsigned candidates=0;
-    uint64_t candidate_size = 0;
-    unsigned j;
-    for (j=0;j<q->candidate_queue_size;j++){
-      if (q->candidate_queue[j].manifest){
-	candidates++;
-	assert(q->candidate_queue[j].manifest->filesize != RHIZOME_SIZE_UNSET);
-	candidate_size += q->candidate_queue[j].manifest->filesize;
-      }
-    }
-//    if (candidates == 0 && q->active.state==RHIZOME_FETCH_FREE)
-//      continue;
-    DEBUGF("Fetch slot %d, candidates %u of %u %"PRIu64" bytes, %s %"PRIu64" of %"PRIu64,
-      i, candidates, q->candidate_queue_size, candidate_size,
-      fetch_state(q->active.state),
-      q->active.state==RHIZOME_FETCH_FREE?0:q->active.write_state.file_offset,
-      q->active.manifest?q->active.manifest->filesize:0);
+    const struct rhizome_fetch_queue_stats *q=&queue_stats[i];
+    DEBUGF("Fetch queue %d, %u waiting, %u queued, %u started, %u dropped, wait avg %"PRId64"ms max %"PRId64"ms",
+      i, q->waiting, q->queued, q->started, q->dropped,
+      q->started ? q->total_wait / q->started : 0, q->max_wait);
   }
   rhizome_sync_status();
   time_ms_t now = gettime_ms();
@@ -187,29 +305,25 @@ void rhizome_fetch_status(struct sched_ent *alarm)
 int rhizome_fetch_status_html(strbuf b)
 {
   unsigned i;
-  for(i=0;i<NQUEUES;i++){
-    struct rhizome_fetch_queue *q=&rhizome_fetch_queues[i];
-    unsigned candidates=0;
-    uint64_t candidate_size = 0;
-    unsigned j;
-    for (j=0;j<q->candidate_queue_size;j++){
-      if (q->candidate_queue[j].manifest){
-	candidates++;
-	assert(q->candidate_queue[j].manifest->filesize != RHIZOME_SIZE_UNSET);
-	candidate_size += q->candidate_queue[j].manifest->filesize;
-      }
-    }
-    strbuf_sprintf(b, "<p>Slot %u, (%u of %u [%"PRIu64" bytes]): ", i, candidates, q->candidate_queue_size, candidate_size);
-    if (q->active.state!=RHIZOME_FETCH_FREE && q->active.manifest){
+  for(i=0;i<fetch_slot_count();i++){
+    struct rhizome_fetch_slot *slot=&rhizome_fetch_slots[i];
+    strbuf_sprintf(b, "<p>Slot %u: ", i);
+    if (slot->state!=RHIZOME_FETCH_FREE && slot->manifest){
       strbuf_sprintf(b, "%s %"PRIu64" of %"PRIu64" from %s*",
-	fetch_state(q->active.state),
-	q->active.write_state.file_offset,
-	q->active.manifest->filesize,
-	q->active.peer?alloca_tohex_sid_t_trunc(q->active.peer->sid, 16):"unknown");
+	fetch_state(slot->state),
+	slot->write_state.file_offset,
+	slot->manifest->filesize,
+	slot->peer?alloca_tohex_sid_t_trunc(slot->peer->sid, 16):"unknown");
     }else{
       strbuf_puts(b, "inactive");
     }
   }
+  for(i=0;i<NQUEUES;i++){
+    const struct rhizome_fetch_queue_stats *q=&queue_stats[i];
+    strbuf_sprintf(b, "<p>Queue %u, (%u waiting, %u queued, %u started, %u dropped, wait avg %"PRId64"ms max %"PRId64"ms)",
+      i, q->waiting, q->queued, q->started, q->dropped,
+      q->started ? q->total_wait / q->started : 0, q->max_wait);
+  }
   return 0;
 }
 
@@ -217,37 +331,37 @@ static void rhizome_start_next_queued_fetches(struct sched_ent *alarm);
 static struct profile_total rsnqf_stats = { .name="rhizome_start_next_queued_fetches" };
 static struct sched_ent sched_activate = { .function = rhizome_start_next_queued_fetches, .stats = &rsnqf_stats };
 static struct profile_total fetch_stats = { .name="rhizome_fetch_poll" };
+// set while the server shuts down, so that closing one fetch does not start another
+static char fetch_closing = 0;
 
-/* Find a queue suitable for a fetch of the given number of bytes.  If there is no suitable queue,
- * return NULL.
- *
- * @author Andrew Bettison <andrew@servalproject.com>
+/* Return true if a fetch of the given number of bytes may take a free slot.  Big fetches may not
+ * take the last free slot, so that small ones, like MeshMS messages, are never stuck behind them.
  */
-static struct rhizome_fetch_queue *rhizome_find_queue(unsigned char log_size)
+static int fetch_slot_allowed(uint64_t size)
 {
-  unsigned i;
-  for (i = 0; i < NQUEUES; ++i) {
-    struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
-    if (log_size < q->log_size_threshold)
-      return q;
+  unsigned slots = fetch_slot_count();
+  if (size <= RHIZOME_FETCH_SMALL_SIZE || slots == 1)
+    return 1;
+  unsigned i, big = 0;
+  for (i = 0; i < slots; ++i) {
+    struct rhizome_fetch_slot *slot = &rhizome_fetch_slots[i];
+    if (slot->state != RHIZOME_FETCH_FREE && slot->manifest && slot->manifest->filesize > RHIZOME_FETCH_SMALL_SIZE)
+      ++big;
   }
-  return NULL;
+  return big + 1 < slots;
 }
 
-/* Find a free fetch slot suitable for fetching the given number of bytes.  This could be a slot in
- * any queue that would accept the candidate, ie, with a larger size threshold.  Returns NULL if
- * there is no suitable free slot.
- *
- * @author Andrew Bettison <andrew@servalproject.com>
+/* Find a free fetch slot suitable for fetching the given number of bytes.  Returns NULL if there
+ * is no suitable free slot.
  */
 static struct rhizome_fetch_slot *rhizome_find_fetch_slot(uint64_t size)
 {
-  unsigned char log_size = log2ll(size);
+  if (!fetch_slot_allowed(size))
+    return NULL;
   unsigned i;
-  for (i = 0; i < NQUEUES; ++i) {
-    struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
-    if (log_size < q->log_size_threshold && q->active.state == RHIZOME_FETCH_FREE)
-      return &q->active;
+  for (i = 0; i < fetch_slot_count(); ++i) {
+    if (rhizome_fetch_slots[i].state == RHIZOME_FETCH_FREE)
+      return &rhizome_fetch_slots[i];
   }
   return NULL;
 }
@@ -257,12 +371,12 @@ static struct rhizome_fetch_slot *rhizome_find_fetch_slot(uint64_t size)
 static struct rhizome_fetch_slot *fetch_search_slot(const unsigned char *id, int prefix_length)
 {
   unsigned i;
-  for (i = 0; i < NQUEUES; ++i) {
-    struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
+  for (i = 0; i < RHIZOME_FETCH_MAX_SLOTS; ++i) {
+    struct rhizome_fetch_slot *slot = &rhizome_fetch_slots[i];
     
-    if (q->active.state != RHIZOME_FETCH_FREE && 
-	memcmp(id, q->active.manifest->cryptoSignPublic.binary, prefix_length) == 0)
-      return &q->active;
+    if (slot->state != RHIZOME_FETCH_FREE && slot->manifest &&
+	memcmp(id, slot->manifest->cryptoSignPublic.binary, prefix_length) == 0)
+      return slot;
   }
   return NULL;
 }
@@ -271,17 +385,10 @@ static struct rhizome_fetch_slot *fetch_search_slot(const unsigned char *id, int
 static struct rhizome_fetch_candidate *fetch_search_candidate(const unsigned char *id, int prefix_length)
 {
   unsigned i;
-  for (i = 0; i < NQUEUES; ++i) {
-    struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
-    unsigned j;
-    for (j = 0; j < q->candidate_queue_size; j++) {
-      struct rhizome_fetch_candidate *c = &q->candidate_queue[j];
-      if (!c->manifest)
-	continue;
-      if (memcmp(c->manifest->cryptoSignPublic.binary, id, prefix_length))
-	continue;
+  for (i = 0; i < candidate_count; i++) {
+    struct rhizome_fetch_candidate *c = &candidates[i];
+    if (memcmp(c->manifest->cryptoSignPublic.binary, id, prefix_length) == 0)
       return c;
-    }
   }
   return NULL;
 }
@@ -308,65 +415,204 @@ int rhizome_fetch_bar_queued(const rhizome_bar_t *bar)
   return 0;
 }
 
-/* Insert a candidate into a given queue at a given position.  All candidates succeeding the given
- * position are copied backward in the queue to open up an empty element at the given position.  If
- * the queue was full, then the tail element is discarded, freeing the manifest it points to.
- *
- * @author Andrew Bettison <andrew@servalproject.com>
+static struct rhizome_fetch_source *fetch_find_source(struct rhizome_fetch_slot *slot, const struct subscriber *peer)
+{
+  unsigned i;
+  for (i = 0; i < slot->source_count; ++i)
+    if (slot->sources[i].peer == peer)
+      return &slot->sources[i];
+  return NULL;
+}
+
+/* Start the list of sources of a new fetch with the peer that offered it.
+ */
+static void fetch_init_source(struct rhizome_fetch_source *source, const struct subscriber *peer)
+{
+  bzero(source, sizeof *source);
+  source->peer = peer;
+  source->highest = -1;
+  source->blocks = RHIZOME_MDP_LEGACY_WINDOW;
+}
+
+static void fetch_reset_sources(struct rhizome_fetch_slot *slot)
+{
+  bzero(slot->sources, sizeof slot->sources);
+  slot->source_count = 0;
+  if (slot->peer != my_subscriber)
+    fetch_init_source(&slot->sources[slot->source_count++], slot->peer);
+}
+
+/* Remember another neighbour that holds the payload being fetched, and if the payload blocks are
+ * already being fetched over MDP, ask it for some of them straight away.  Returns 1 if the peer was
+ * added, 0 if it was already known or there is no room for it.
  */
-static struct rhizome_fetch_candidate *rhizome_fetch_insert(struct rhizome_fetch_queue *q, unsigned i)
+static int fetch_add_source(struct rhizome_fetch_slot *slot, const struct subscriber *peer)
 {
-  struct rhizome_fetch_candidate * const c = &q->candidate_queue[i];
-  struct rhizome_fetch_candidate * e = &q->candidate_queue[q->candidate_queue_size - 1];
+  // blocks are only requested from neighbours
+  if (!peer || !(peer->reachable & REACHABLE_DIRECT) || fetch_find_source(slot, peer))
+    return 0;
+  unsigned limit = config.rhizome.mdp_fetch_sources;
+  if (limit > RHIZOME_FETCH_MAX_SOURCES)
+    limit = RHIZOME_FETCH_MAX_SOURCES;
+  if (slot->source_count >= limit)
+    return 0;
+  struct rhizome_fetch_source *source = &slot->sources[slot->source_count++];
+  fetch_init_source(source, peer);
   if (config.debug.rhizome_rx)
-    DEBUGF("insert queue[%d] candidate[%u]", (int)(q - rhizome_fetch_queues), i);
-  assert(i < q->candidate_queue_size);
-  assert(i == 0 || c[-1].manifest);
-  if (e->manifest) // queue is full
-    rhizome_manifest_free(e->manifest);
-  else
-    while (e > c && !e[-1].manifest)
-      --e;
-  for (; e > c; --e)
-    e[0] = e[-1];
-  assert(e == c);
-  c->manifest = NULL;
+    DEBUGF("Fetching slot=%d from %s too, %u sources", slotno(slot), alloca_tohex_sid_t(peer->sid), slot->source_count);
+  if (slot->state == RHIZOME_FETCH_RXFILEMDP && !slot->block_hashes && !slot->chunk_list_wanted) {
+    rhizome_fetch_mdp_request_window(slot, source);
+    rhizome_fetch_mdp_touch_timeout(slot);
+  }
+  return 1;
+}
+
+/* Called when a peer advertises a bundle that may already be being fetched, so that the peer can
+ * supply blocks of its payload too.  Returns 1 if the peer was added as a source of the fetch.
+ */
+int rhizome_fetch_add_source(const rhizome_bar_t *bar, const struct subscriber *peer)
+{
+  struct rhizome_fetch_slot *slot = fetch_search_slot(rhizome_bar_prefix(bar), RHIZOME_BAR_PREFIX_BYTES);
+  if (!slot || slot->manifest->version != rhizome_bar_version(bar))
+    return 0;
+  return fetch_add_source(slot, peer);
+}
+
+static void candidate_swap(unsigned i, unsigned j)
+{
+  struct rhizome_fetch_candidate t = candidates[i];
+  candidates[i] = candidates[j];
+  candidates[j] = t;
+}
+
+static void candidate_sift_up(unsigned i)
+{
+  while (i > 0 && candidates[i].priority < candidates[(i - 1) / 2].priority) {
+    candidate_swap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+static void candidate_sift_down(unsigned i)
+{
+  while (1) {
+    unsigned best = i, child = 2 * i + 1;
+    if (child < candidate_count && candidates[child].priority < candidates[best].priority)
+      best = child;
+    if (child + 1 < candidate_count && candidates[child + 1].priority < candidates[best].priority)
+      best = child + 1;
+    if (best == i)
+      return;
+    candidate_swap(i, best);
+    i = best;
+  }
+}
+
+/* Add a candidate to the heap, growing it if there is room.  Returns -1 if the heap is full.
+ */
+static int candidate_push(const struct rhizome_fetch_candidate *c)
+{
+  if (candidate_count >= candidate_alloc) {
+    if (candidate_alloc >= config.rhizome.fetch_queue_size)
+      return -1;
+    unsigned alloc = candidate_alloc ? candidate_alloc * 2 : 16;
+    if (alloc > config.rhizome.fetch_queue_size)
+      alloc = config.rhizome.fetch_queue_size;
+    struct rhizome_fetch_candidate *n = realloc(candidates, alloc * sizeof *candidates);
+    if (!n)
+      return WHY_perror("realloc");
+    candidates = n;
+    candidate_alloc = alloc;
+  }
+  candidates[candidate_count] = *c;
+  candidate_sift_up(candidate_count++);
+  queue_stats[c->size_class].waiting++;
+  return 0;
+}
+
+/* Take the candidate at the given heap position out of the queue, without freeing its manifest.
+ */
+static struct rhizome_fetch_candidate candidate_take(unsigned i)
+{
+  assert(i < candidate_count);
+  struct rhizome_fetch_candidate c = candidates[i];
+  queue_stats[c.size_class].waiting--;
+  if (i != --candidate_count) {
+    candidates[i] = candidates[candidate_count];
+    candidate_sift_down(i);
+    candidate_sift_up(i);
+  }
   return c;
 }
 
-/* Remove the given candidate from a given queue.  If the element points to a manifest structure,
- * then frees the manifest.  All succeeding candidates are copied forward in the queue to close up
- * the gap, leaving an empty element at the tail of the queue.
- *
- * @author Andrew Bettison <andrew@servalproject.com>
+/* Remove the candidate at the given heap position and free its manifest.
  */
-static void rhizome_fetch_unqueue(struct rhizome_fetch_queue *q, unsigned i)
+static void rhizome_fetch_unqueue(unsigned i)
 {
-  assert(i < q->candidate_queue_size);
-  struct rhizome_fetch_candidate *c = &q->candidate_queue[i];
   if (config.debug.rhizome_rx)
-    DEBUGF("unqueue queue[%d] candidate[%d] manifest=%p", (int)(q - rhizome_fetch_queues), i, c->manifest);
-  if (c->manifest) {
-    rhizome_manifest_free(c->manifest);
-    c->manifest = NULL;
-  }
-  struct rhizome_fetch_candidate *e = &q->candidate_queue[q->candidate_queue_size - 1];
-  for (; c < e && c[1].manifest; ++c)
-    c[0] = c[1];
-  c->manifest = NULL;
+    DEBUGF("unqueue candidate[%u] manifest=%p", i, candidates[i].manifest);
+  struct rhizome_fetch_candidate c = candidate_take(i);
+  rhizome_manifest_free(c.manifest);
 }
 
 static void candidate_unqueue(struct rhizome_fetch_candidate *c)
 {
-  unsigned i;
-  for (i = 0; i < NQUEUES; ++i) {
-    struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
-    unsigned index = c - q->candidate_queue;
-    if (index < q->candidate_queue_size){
-      rhizome_fetch_unqueue(q, index);
-      return;
-    }
+  rhizome_fetch_unqueue(c - candidates);
+}
+
+/* Return the heap position of the least worthy candidate, which is always a leaf.
+ */
+static unsigned candidate_worst()
+{
+  assert(candidate_count);
+  unsigned i, worst = candidate_count / 2;
+  for (i = worst + 1; i < candidate_count; ++i)
+    if (candidates[i].priority > candidates[worst].priority)
+      worst = i;
+  return worst;
+}
+
+/* Record a failed fetch of a bundle, so that it is queued behind other bundles for a while.
+ */
+static void fetch_record_failure(const rhizome_manifest *m)
+{
+  struct rhizome_fetch_retry *r = &fetch_retries[m->cryptoSignPublic.binary[0] % RHIZOME_FETCH_RETRY_BINS];
+  time_ms_t now = gettime_ms();
+  if (memcmp(r->bid_prefix, m->cryptoSignPublic.binary, sizeof r->bid_prefix) != 0
+    || r->last_failure + RHIZOME_FETCH_RETRY_EXPIRY < now) {
+    memcpy(r->bid_prefix, m->cryptoSignPublic.binary, sizeof r->bid_prefix);
+    r->failures = 0;
+  }
+  r->failures++;
+  r->last_failure = now;
+}
+
+static unsigned fetch_recent_failures(const rhizome_manifest *m)
+{
+  const struct rhizome_fetch_retry *r = &fetch_retries[m->cryptoSignPublic.binary[0] % RHIZOME_FETCH_RETRY_BINS];
+  if (memcmp(r->bid_prefix, m->cryptoSignPublic.binary, sizeof r->bid_prefix) != 0
+    || r->last_failure + RHIZOME_FETCH_RETRY_EXPIRY < gettime_ms())
+    return 0;
+  return r->failures;
+}
+
+/* Work out when a candidate should be fetched, relative to the others.  Small payloads, recent
+ * bundles, MeshMS conversations and peers with good links go first, and bundles that have failed
+ * to arrive recently go last.
+ */
+static time_ms_t fetch_priority(const rhizome_manifest *m, const struct subscriber *peer, time_ms_t now)
+{
+  time_ms_t penalty = log2ll(m->filesize) * RHIZOME_FETCH_SIZE_PENALTY;
+  if (m->has_date) {
+    time_ms_t age_minutes = m->date < now ? (now - m->date) / 60000 : 0;
+    penalty += log2ll(age_minutes + 1) * RHIZOME_FETCH_AGE_PENALTY;
   }
+  if (m->service && (strcmp(m->service, RHIZOME_SERVICE_MESHMS2) == 0 || strcmp(m->service, RHIZOME_SERVICE_MESHMS) == 0))
+    penalty -= RHIZOME_FETCH_SERVICE_BONUS;
+  int drop_rate = peer ? link_path_drop_rate(peer) : -1;
+  penalty += (drop_rate < 0 ? 50 : drop_rate) * RHIZOME_FETCH_DROP_PENALTY;
+  penalty += fetch_recent_failures(m) * RHIZOME_FETCH_RETRY_PENALTY;
+  return now + penalty;
 }
 
 /* Return true if there are any active fetches currently in progress.
@@ -376,8 +622,8 @@ static void candidate_unqueue(struct rhizome_fetch_candidate *c)
 int rhizome_any_fetch_active()
 {
   unsigned i;
-  for (i = 0; i < NQUEUES; ++i)
-    if (rhizome_fetch_queues[i].active.state != RHIZOME_FETCH_FREE)
+  for (i = 0; i < RHIZOME_FETCH_MAX_SLOTS; ++i)
+    if (rhizome_fetch_slots[i].state != RHIZOME_FETCH_FREE)
       return 1;
   return 0;
 }
@@ -388,11 +634,7 @@ int rhizome_any_fetch_active()
  */
 int rhizome_any_fetch_queued()
 {
-  unsigned i;
-  for (i = 0; i < NQUEUES; ++i)
-    if (rhizome_fetch_queues[i].candidate_queue[0].manifest)
-      return 1;
-  return 0;
+  return candidate_count != 0;
 }
 
 typedef struct ignored_manifest {
@@ -489,6 +731,97 @@ static int rhizome_import_received_bundle(struct rhizome_manifest *m)
   }
 }
 
+/* If we hold an older version of a bundle whose payload is about to be fetched via HTTP, ask for the
+ * new payload as a delta against the old one, by posting the signatures of the old payload's blocks.
+ * Returns 1 if the request has been put together, 0 if the payload should be fetched whole.
+ */
+static int fetch_delta_request(struct rhizome_fetch_slot *slot, strbuf r)
+{
+  if (   !config.rhizome.delta_fetch
+      || slot->manifest->is_journal
+      || slot->manifest->filesize < RHIZOME_DELTA_MIN_PAYLOAD
+      || slot->write_state.file_offset
+      || slot->addr.addr.sa_family != AF_INET
+      || !slot->addr.inet.sin_port)
+    return 0;
+  rhizome_manifest *previous = rhizome_new_manifest();
+  if (!previous)
+    return 0;
+  rhizome_filehash_t base;
+  int found = rhizome_retrieve_manifest(&slot->manifest->cryptoSignPublic, previous) == RHIZOME_BUNDLE_STATUS_SAME
+	   && !previous->is_journal
+	   && previous->version < slot->manifest->version
+	   && previous->filesize >= RHIZOME_DELTA_MIN_PAYLOAD;
+  if (found)
+    base = previous->filehash;
+  rhizome_manifest_free(previous);
+  if (!found)
+    return 0;
+  
+  uint32_t block_size;
+  unsigned char *signatures;
+  size_t length;
+  if (rhizome_delta_signatures(&base, &block_size, &signatures, &length) == -1)
+    return 0;
+  if ((slot->delta = emalloc(sizeof *slot->delta)) == NULL
+      || rhizome_delta_decode_init(slot->delta, &base, block_size, read_uint32(signatures + 4)) == -1) {
+    free(signatures);
+    free(slot->delta);
+    slot->delta = NULL;
+    return 0;
+  }
+  
+  char boundary[20];
+  strbuf bb = strbuf_local(boundary, sizeof boundary);
+  strbuf_sprintf(bb, "%08lx%08lx", random(), random());
+  strbuf content_preamble = strbuf_alloca(200);
+  strbuf_sprintf(content_preamble,
+      "--%s\r\n"
+      "Content-Disposition: form-data; name=\"signatures\"\r\n"
+      "Content-Type: %s\r\n"
+      "\r\n",
+      boundary, CONTENT_TYPE_BLOB
+    );
+  // the signatures and the closing boundary are sent once the request headers have gone
+  size_t postamble = strlen(boundary) + 8;
+  if ((slot->upload = emalloc(length + postamble + 1)) == NULL) {
+    free(signatures);
+    fetch_delta_free(slot);
+    return 0;
+  }
+  memcpy(slot->upload, signatures, length);
+  sprintf((char *)slot->upload + length, "\r\n--%s--\r\n", boundary);
+  slot->upload_len = length + postamble;
+  slot->upload_ofs = 0;
+  free(signatures);
+  strbuf_sprintf(r,
+      "POST /rhizome/delta/%s HTTP/1.0\r\n"
+      "Content-Length: %zu\r\n"
+      "Content-Type: multipart/form-data; boundary=%s\r\n"
+      "\r\n%s",
+      alloca_tohex_rhizome_filehash_t(slot->manifest->filehash),
+      strbuf_len(content_preamble) + slot->upload_len,
+      boundary, strbuf_str(content_preamble)
+    );
+  if (config.debug.rhizome_rx)
+    DEBUGF("Asking for %s as a delta against %s, with %zu bytes of block signatures",
+	   alloca_tohex_rhizome_filehash_t(slot->manifest->filehash), alloca_tohex_rhizome_filehash_t(base), length);
+  return 1;
+}
+
+static void fetch_delta_free(struct rhizome_fetch_slot *slot)
+{
+  if (slot->upload)
+    free(slot->upload);
+  slot->upload = NULL;
+  slot->upload_len = slot->upload_ofs = 0;
+  if (slot->delta) {
+    rhizome_delta_decode_close(slot->delta);
+    free(slot->delta);
+  }
+  slot->delta = NULL;
+}
+
 /* Returns STARTED (0) if the fetch was started.
  * Returns IMPORTED if the payload is already in the store.
  * Returns -1 on error.
@@ -498,9 +831,9 @@ schedule_fetch(struct rhizome_fetch_slot *slot)
 {
   IN();
   int sock = -1;
-  /* TODO Don't forget to implement resume */
   slot->start_time=gettime_ms();
   slot->alarm.poll.fd = -1;
+  fetch_reset_sources(slot);
   slot->write_state.blob_fd=-1;
   slot->write_state.blob_rowid = 0;
 
@@ -513,7 +846,44 @@ schedule_fetch(struct rhizome_fetch_slot *slot)
     slot->manifest->dataFileName = NULL;
     slot->manifest->dataFileUnlinkOnFree = 0;
     
+    enum rhizome_payload_status status = rhizome_open_write(&slot->write_state,
+							    &slot->manifest->filehash,
+							    slot->manifest->filesize);
+    switch (status) {
+      case RHIZOME_PAYLOAD_STATUS_EMPTY:
+      case RHIZOME_PAYLOAD_STATUS_STORED:
+	RETURN(IMPORTED);
+      case RHIZOME_PAYLOAD_STATUS_TOO_BIG:
+      case RHIZOME_PAYLOAD_STATUS_EVICTED:
+	RETURN(DONOTWANT);
+      case RHIZOME_PAYLOAD_STATUS_NEW:
+	goto status_ok;
+      case RHIZOME_PAYLOAD_STATUS_ERROR:
+	RETURN(WHY("error writing new payload"));
+      case RHIZOME_PAYLOAD_STATUS_WRONG_SIZE:
+	RETURN(WHY("payload size does not match"));
+      case RHIZOME_PAYLOAD_STATUS_WRONG_HASH:
+	RETURN(WHY("payload hash does not match"));
+      case RHIZOME_PAYLOAD_STATUS_CRYPTO_FAIL:
+	RETURN(WHY("payload cannot be encrypted"));
+      // No "default" label, so the compiler will warn if a case is not handled.
+    }
+    FATALF("status = %d", status);
+status_ok:
+    // the hash of each block can be stored, and served to others, along with the payload
+    if (slot->manifest->has_blockhash && !slot->manifest->is_journal)
+      rhizome_write_hash_blocks(&slot->write_state);
+    if (!slot->manifest->is_journal
+	&& rhizome_resume_write(&slot->write_state, &slot->bid, slot->bidVersion)
+	&& config.debug.rhizome_rx)
+      DEBUGF("Resuming fetch of %s at %"PRIu64" of %"PRIu64,
+	     alloca_tohex_rhizome_filehash_t(slot->manifest->filehash),
+	     slot->write_state.file_offset, slot->manifest->filesize);
+
     strbuf r = strbuf_local(slot->request, sizeof slot->request);
+    if (fetch_delta_request(slot, r)) {
+      // the payload comes back as a delta against the version we hold
+    } else {
     strbuf_sprintf(r, "GET /rhizome/file/%s HTTP/1.0\r\n", alloca_tohex_rhizome_filehash_t(slot->manifest->filehash));
     
     if (slot->manifest->is_journal){
@@ -538,38 +908,20 @@ schedule_fetch(struct rhizome_fetch_slot *slot)
 	    slot->manifest->filesize - 1
 	  );
       }
+    }else if (slot->write_state.file_offset){
+      // carry on from where an earlier fetch of the payload stopped
+      strbuf_sprintf(r, "Range: bytes=%"PRIu64"-%"PRIu64"\r\n",
+	  slot->write_state.file_offset,
+	  slot->manifest->filesize - 1
+	);
     }
 
     strbuf_puts(r, "\r\n");
+    }
 
     if (strbuf_overrun(r))
       RETURN(WHY("request overrun"));
     slot->request_len = strbuf_len(r);
-    enum rhizome_payload_status status = rhizome_open_write(&slot->write_state,
-							    &slot->manifest->filehash,
-							    slot->manifest->filesize);
-    switch (status) {
-      case RHIZOME_PAYLOAD_STATUS_EMPTY:
-      case RHIZOME_PAYLOAD_STATUS_STORED:
-	RETURN(IMPORTED);
-      case RHIZOME_PAYLOAD_STATUS_TOO_BIG:
-      case RHIZOME_PAYLOAD_STATUS_EVICTED:
-	RETURN(DONOTWANT);
-      case RHIZOME_PAYLOAD_STATUS_NEW:
-	goto status_ok;
-      case RHIZOME_PAYLOAD_STATUS_ERROR:
-	RETURN(WHY("error writing new payload"));
-      case RHIZOME_PAYLOAD_STATUS_WRONG_SIZE:
-	RETURN(WHY("payload size does not match"));
-      case RHIZOME_PAYLOAD_STATUS_WRONG_HASH:
-	RETURN(WHY("payload hash does not match"));
-      case RHIZOME_PAYLOAD_STATUS_CRYPTO_FAIL:
-	RETURN(WHY("payload cannot be encrypted"));
-      // No "default" label, so the compiler will warn if a case is not handled.
-    }
-    FATALF("status = %d", status);
-status_ok:
-    ;
   } else {
     strbuf r = strbuf_local(slot->request, sizeof slot->request);
     strbuf_sprintf(r, "GET /rhizome/manifestbyprefix/%s HTTP/1.0\r\n\r\n", alloca_tohex(slot->bid.binary, slot->prefix_length));
@@ -734,10 +1086,11 @@ rhizome_fetch(struct rhizome_fetch_slot *slot, rhizome_manifest *m,
     }
   }
   unsigned i;
-  for (i = 0; i < NQUEUES; ++i) {
-    struct rhizome_fetch_slot *as = &rhizome_fetch_queues[i].active;
+  for (i = 0; i < RHIZOME_FETCH_MAX_SLOTS; ++i) {
+    struct rhizome_fetch_slot *as = &rhizome_fetch_slots[i];
     const rhizome_manifest *am = as->manifest;
-    if (as->state != RHIZOME_FETCH_FREE && cmp_rhizome_filehash_t(&m->filehash, &am->filehash) == 0) {
+    // slots fetching a manifest by its prefix have no manifest yet
+    if (as->state != RHIZOME_FETCH_FREE && am && cmp_rhizome_filehash_t(&m->filehash, &am->filehash) == 0) {
       if (config.debug.rhizome_rx)
 	DEBUGF("   fetch already in progress, slot=%d filehash=%s", i, alloca_tohex_rhizome_filehash_t(m->filehash));
       RETURN(SAMEPAYLOAD);
@@ -798,74 +1151,78 @@ rhizome_fetch_request_manifest_by_prefix(const struct socket_address *addr,
   return schedule_fetch(slot);
 }
 
-/* Activate the next fetch for the given slot.  This takes the next job from the head of the slot's
- * own queue.  If there is none, then takes jobs from other queues.
- *
- * @author Andrew Bettison <andrew@servalproject.com>
+/* Start the most worthy queued fetches, until there are no free slots or no more candidates that
+ * may use them.  Candidates for newer versions of bundles that are being fetched stay queued, so
+ * that they are fetched once the older version arrives.
  */
-static void rhizome_start_next_queued_fetch(struct rhizome_fetch_slot *slot)
+static void rhizome_start_next_queued_fetches(struct sched_ent *UNUSED(alarm))
 {
   IN();
-  struct rhizome_fetch_queue *q;
-  for (q = (struct rhizome_fetch_queue *) slot; q >= rhizome_fetch_queues; --q) {
+  if (fetch_closing) {
+    OUT();
+    return;
+  }
+  struct rhizome_fetch_candidate deferred[RHIZOME_FETCH_MAX_SLOTS];
+  unsigned ndeferred = 0;
+  struct rhizome_fetch_slot *slot;
+  while (candidate_count && ndeferred < NELS(deferred) && (slot = rhizome_find_fetch_slot(0))) {
+    // take the best candidate, unless it is too big for the free slots, then the best small one
     unsigned i = 0;
-    struct rhizome_fetch_candidate *c;
-    while (i < q->candidate_queue_size && (c = &q->candidate_queue[i])->manifest) {
-      int result = rhizome_fetch(slot, c->manifest, &c->addr, c->peer);
-      switch (result) {
-      case SLOTBUSY:
-	OUT(); return;
-      case STARTED:
-	c->manifest = NULL;
-	rhizome_fetch_unqueue(q, i);
-	OUT(); return;
-      case IMPORTED:
-      case SAMEBUNDLE:
-      case SAMEPAYLOAD:
-      case SUPERSEDED:
-      case DONOTWANT:
-      case NEWERBUNDLE:
-      default:
-	// Discard the candidate fetch and loop to try the next in queue.
-	rhizome_fetch_unqueue(q, i);
-	break;
-      case OLDERBUNDLE:
-	// Do not un-queue, so that when the fetch of the older bundle finishes, we will start
-	// fetching a newer one.
-	++i;
+    if (!fetch_slot_allowed(candidates[0].manifest->filesize)) {
+      unsigned j;
+      for (i = candidate_count, j = 0; j < candidate_count; ++j)
+	if (candidates[j].manifest->filesize <= RHIZOME_FETCH_SMALL_SIZE
+	  && (i == candidate_count || candidates[j].priority < candidates[i].priority))
+	  i = j;
+      if (i == candidate_count)
 	break;
+    }
+    struct rhizome_fetch_candidate c = candidate_take(i);
+    int result = rhizome_fetch(slot, c.manifest, &c.addr, c.peer);
+    switch (result) {
+    case STARTED: {
+	struct rhizome_fetch_queue_stats *q = &queue_stats[c.size_class];
+	time_ms_t wait = gettime_ms() - c.queued_time;
+	q->started++;
+	q->total_wait += wait;
+	if (wait > q->max_wait)
+	  q->max_wait = wait;
+	if (config.debug.rhizome_rx)
+	  DEBUGF("Started fetch slot=%d after waiting %"PRId64"ms, %u candidates remain", slotno(slot), wait, candidate_count);
       }
+      break;
+    case SLOTBUSY:
+    case OLDERBUNDLE:
+      // Keep the candidate, so that when the fetch of the older bundle finishes, we will start
+      // fetching a newer one.
+      deferred[ndeferred++] = c;
+      break;
+    case IMPORTED:
+    case SAMEBUNDLE:
+    case SAMEPAYLOAD:
+    case SUPERSEDED:
+    case DONOTWANT:
+    case NEWERBUNDLE:
+    default:
+      // Discard the candidate fetch and loop to try the next in queue.
+      rhizome_manifest_free(c.manifest);
+      break;
     }
   }
-  OUT();
-}
-
-/* Called soon after any fetch candidate is queued, to start any queued fetches.
- *
- * @author Andrew Bettison <andrew@servalproject.com>
- */
-static void rhizome_start_next_queued_fetches(struct sched_ent *alarm)
-{
-  IN();
-  assert(alarm == &sched_activate);
-  unsigned i;
-  for (i = 0; i < NQUEUES; ++i)
-    rhizome_start_next_queued_fetch(&rhizome_fetch_queues[i].active);
+  while (ndeferred)
+    if (candidate_push(&deferred[--ndeferred]) == -1) {
+      queue_stats[deferred[ndeferred].size_class].dropped++;
+      rhizome_manifest_free(deferred[ndeferred].manifest);
+    }
   OUT();
 }
 
 /* Do we have space to add a fetch candidate of this size? */
 int rhizome_fetch_has_queue_space(unsigned char log2_size){
-  struct rhizome_fetch_queue *q = rhizome_find_queue(log2_size);
-  if (q){
-    // is there an empty candidate?
-    unsigned j;
-    for (j=0;j < q->candidate_queue_size;j++)
-      if (!q->candidate_queue[j].manifest)
-	return 1;
-    return 0;
-  }
-  return 0;
+  if (candidate_count < config.rhizome.fetch_queue_size)
+    return 1;
+  // a smaller payload may be worth more than the least worthy candidate
+  return candidate_count && log2ll(candidates[candidate_worst()].manifest->filesize) > log2_size;
 }
 
 /* Queue a fetch for the payload of the given manifest.  If 'addr' is not NULL, then it is used as
@@ -922,53 +1279,63 @@ int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, const struct sock
     RETURN(0);
   }
 
-  // Find the proper queue for the payload.  If there is none suitable, it is an error.
-  struct rhizome_fetch_queue *qi = rhizome_find_queue(log2ll(m->filesize));
-  if (!qi) {
-    WHYF("No suitable fetch queue for bundle size=%"PRIu64, m->filesize);
+  // If this version is already being fetched, the peer can supply blocks of it too.
+  struct rhizome_fetch_slot *as = fetch_search_slot(m->cryptoSignPublic.binary, sizeof m->cryptoSignPublic.binary);
+  if (as && as->manifest->version == m->version) {
+    fetch_add_source(as, peer);
     rhizome_manifest_free(m);
-    RETURN(-1);
+    RETURN(0);
   }
 
-  // Search all the queues for the same manifest (it could be in any queue because its payload size
-  // may have changed between versions.) If a newer or the same version is already queued, then
+  // Search the queue for the same bundle.  If a newer or the same version is already queued, then
   // ignore this one.  Otherwise, unqueue all older candidates.
-  int ci = -1;
   unsigned i;
-  for (i = 0; i < NQUEUES; ++i) {
-    struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
-    unsigned j;
-    for (j = 0; j < q->candidate_queue_size; ) {
-      struct rhizome_fetch_candidate *c = &q->candidate_queue[j];
-      if (!c->manifest){
-	if (ci == -1 && q == qi)
-	  ci = j;
-	break;
+  for (i = 0; i < candidate_count; ) {
+    struct rhizome_fetch_candidate *c = &candidates[i];
+    if (cmp_rhizome_bid_t(&m->cryptoSignPublic, &c->manifest->cryptoSignPublic) == 0) {
+      if (c->manifest->version >= m->version) {
+	rhizome_manifest_free(m);
+	RETURN(0);
       }
-      
-      if (cmp_rhizome_bid_t(&m->cryptoSignPublic, &c->manifest->cryptoSignPublic) == 0) {
-	if (c->manifest->version >= m->version) {
-	  rhizome_manifest_free(m);
-	  RETURN(0);
-	}
-	rhizome_fetch_unqueue(q, j);
-      }else
-	j++;
+      // the last candidate takes this position, so look at it next
+      rhizome_fetch_unqueue(i);
+    }else
+      i++;
+  }
+
+  time_ms_t now = gettime_ms();
+  struct rhizome_fetch_candidate c = {
+    .manifest = m,
+    .addr = *addr,
+    .peer = peer,
+    .queued_time = now,
+    .priority = fetch_priority(m, peer, now),
+    .size_class = fetch_size_class(log2ll(m->filesize)),
+  };
+  queue_stats[c.size_class].queued++;
+
+  // If the queue is full, drop the least worthy candidate, which may be this one.
+  if (candidate_count >= config.rhizome.fetch_queue_size) {
+    unsigned worst = candidate_worst();
+    if (candidates[worst].priority <= c.priority) {
+      queue_stats[c.size_class].dropped++;
+      rhizome_manifest_free(m);
+      RETURN(1);
     }
+    queue_stats[candidates[worst].size_class].dropped++;
+    rhizome_fetch_unqueue(worst);
   }
-  // No duplicate was found, so if no free queue place was found either then bail out.
-  if (ci == -1) {
+  if (candidate_push(&c) == -1) {
+    queue_stats[c.size_class].dropped++;
     rhizome_manifest_free(m);
     RETURN(1);
   }
-
-  struct rhizome_fetch_candidate *c = rhizome_fetch_insert(qi, ci);
-  c->manifest = m;
-  c->addr = *addr;
-  c->peer = peer;
+  if (config.debug.rhizome_rx)
+    DEBUGF("queued candidate bid=%s priority=+%"PRId64"ms, %u candidates",
+	alloca_tohex_rhizome_bid_t(m->cryptoSignPublic), c.priority - now, candidate_count);
 
   if (!is_scheduled(&sched_activate)) {
-    sched_activate.alarm = gettime_ms() + rhizome_fetch_delay_ms();
+    sched_activate.alarm = now + rhizome_fetch_delay_ms();
     sched_activate.deadline = sched_activate.alarm + config.rhizome.idle_timeout;
     schedule(&sched_activate);
   }
@@ -992,23 +1359,55 @@ static void rhizome_fetch_close(struct rhizome_fetch_slot *slot)
   slot->alarm.poll.fd = -1;
 
   /* Free ephemeral data */
-  if (slot->manifest)
+  if (slot->manifest) {
+    if (slot->write_state.file_offset < slot->manifest->filesize)
+      fetch_record_failure(slot->manifest);
     rhizome_manifest_free(slot->manifest);
+  }
   slot->manifest = NULL;
 
   if (slot->previous)
     rhizome_manifest_free(slot->previous);
   slot->previous = NULL;
+  fetch_delta_free(slot);
   
-  if (slot->write_state.blob_fd != -1 || slot->write_state.blob_rowid != 0)
-    rhizome_fail_write(&slot->write_state);
+  // keep what has arrived of a payload, so that a later fetch can carry on from there
+  if (slot->write_state.blob_fd != -1 || slot->write_state.blob_rowid != 0 || slot->write_state.block_hashes)
+    rhizome_suspend_write(&slot->write_state, &slot->bid, slot->bidVersion);
+
+  free(slot->block_hashes);
+  slot->block_hashes = NULL;
+  free(slot->chunks);
+  slot->chunks = NULL;
+  slot->chunk_list_wanted = 0;
 
   // Release the fetch slot.
   slot->state = RHIZOME_FETCH_FREE;
 
-  // Activate the next queued fetch that is eligible for this slot.  Try starting candidates from
-  // all queues with the same or smaller size thresholds until the slot is taken.
-  rhizome_start_next_queued_fetch(slot);
+  // Activate the next queued fetch that may use this slot.
+  rhizome_start_next_queued_fetches(&sched_activate);
+}
+
+/* Stop every fetch in progress, keeping whatever has arrived so that the fetches can be resumed
+ * after the server restarts.
+ */
+void rhizome_fetch_close_all()
+{
+  unsigned i;
+  fetch_closing = 1;
+  for (i = 0; i < RHIZOME_FETCH_MAX_SLOTS; ++i)
+    if (rhizome_fetch_slots[i].state != RHIZOME_FETCH_FREE)
+      rhizome_fetch_close(&rhizome_fetch_slots[i]);
+}
+
+// how many sources of the fetch have answered their last request
+static unsigned fetch_answering_sources(const struct rhizome_fetch_slot *slot)
+{
+  unsigned i, count = 0;
+  for (i = 0; i < slot->source_count; ++i)
+    if (!slot->sources[i].stalls)
+      count++;
+  return count;
 }
 
 static void rhizome_fetch_mdp_slot_callback(struct sched_ent *alarm)
@@ -1026,11 +1425,48 @@ static void rhizome_fetch_mdp_slot_callback(struct sched_ent *alarm)
     OUT();
     return;
   }
-  if (config.debug.rhizome_rx)
-    DEBUGF("Timeout: Resending request for slot=0x%p (%"PRIu64" of %"PRIu64" received)",
-	   slot, slot->write_state.file_offset,
-	   slot->write_state.file_length);
-  rhizome_fetch_mdp_requestblocks(slot);
+  if (slot->block_hashes || slot->chunk_list_wanted || slot->source_count == 0) {
+    if (config.debug.rhizome_rx)
+      DEBUGF("Timeout: Resending request for slot=0x%p (%"PRIu64" of %"PRIu64" received)",
+	     slot, slot->write_state.file_offset,
+	     slot->write_state.file_length);
+    rhizome_fetch_mdp_requestblocks(slot);
+    OUT();
+    return;
+  }
+  // ask again of each source that has not answered in time, and stop asking those that never do
+  // while others are still answering, so that their windows are taken over
+  unsigned i = 0;
+  while (i < slot->source_count) {
+    struct rhizome_fetch_source *source = &slot->sources[i];
+    if (source->outstanding && now - source->last_activity < fetch_source_stall_timeout(source)) {
+      i++;
+      continue;
+    }
+    if (source->outstanding) {
+      source->stalls++;
+      // the window was more than the link would carry, so ask for less next time
+      source->blocks /= 2;
+      if (source->blocks < RHIZOME_FETCH_MIN_WINDOW)
+	source->blocks = RHIZOME_FETCH_MIN_WINDOW;
+    }
+    if (source->stalls >= RHIZOME_FETCH_SOURCE_STALL_LIMIT && fetch_answering_sources(slot)) {
+      if (config.debug.rhizome_rx)
+	DEBUGF("Dropping source %s of slot=0x%p, no reply to %d requests",
+	       source->peer ? alloca_tohex_sid_t(source->peer->sid) : "broadcast", slot, source->stalls);
+      slot->source_count--;
+      memmove(source, source + 1, (slot->source_count - i) * sizeof *source);
+      continue;
+    }
+    if (config.debug.rhizome_rx && source->outstanding)
+      DEBUGF("Timeout: Resending request to %s for slot=0x%p (%"PRIu64" of %"PRIu64" received)",
+	     source->peer ? alloca_tohex_sid_t(source->peer->sid) : "broadcast",
+	     slot, slot->write_state.file_offset,
+	     slot->write_state.file_length);
+    rhizome_fetch_mdp_request_window(slot, source);
+    i++;
+  }
+  rhizome_fetch_mdp_touch_timeout(slot);
   OUT();
 }
 
@@ -1043,80 +1479,523 @@ static int rhizome_fetch_mdp_touch_timeout(struct rhizome_fetch_slot *slot)
   // on lossy links.  1K packets seem to get through only very rarely.
   // For now, we will just make the timeout 1 second from the time of the last
   // received block.
+  // With several sources, wake up when the first of them is overdue.
   unschedule(&slot->alarm);
   slot->alarm.alarm=gettime_ms()+config.rhizome.mdp_stall_timeout; 
+  unsigned i;
+  for (i = 0; i < slot->source_count; ++i) {
+    const struct rhizome_fetch_source *source = &slot->sources[i];
+    if (source->outstanding && source->last_activity + fetch_source_stall_timeout(source) < slot->alarm.alarm)
+      slot->alarm.alarm = source->last_activity + fetch_source_stall_timeout(source);
+  }
   slot->alarm.deadline=slot->alarm.alarm+500;
   schedule(&slot->alarm);
   return 0;
 }
 
-static int rhizome_fetch_mdp_requestblocks(struct rhizome_fetch_slot *slot)
+static int rhizome_fetch_mdp_request_block_hashes(struct rhizome_fetch_slot *slot)
+{
+  struct internal_mdp_header header;
+  bzero(&header, sizeof header);
+  
+  header.source = my_subscriber;
+  header.source_port = MDP_PORT_RHIZOME_RESPONSE;
+  header.destination = (struct subscriber *)slot->peer;
+  header.destination_port = MDP_PORT_RHIZOME_BLOCKHASH_REQUEST;
+  header.ttl = 1;
+  header.qos = OQ_ORDINARY;
+  
+  struct overlay_buffer *payload = ob_new();
+  ob_append_bytes(payload, slot->bid.binary, sizeof slot->bid.binary);
+  ob_append_ui64_rv(payload, slot->bidVersion);
+  ob_append_ui32_rv(payload, slot->block_hashes_received);
+  
+  if (config.debug.rhizome_tx)
+    DEBUGF("Requesting block hashes from %"PRIu32" of %"PRIu32" for slot=0x%p",
+	   slot->block_hashes_received, slot->block_hash_count, slot);
+  
+  ob_flip(payload);
+  overlay_send_frame(&header, payload);
+  ob_free(payload);
+  
+  slot->block_hash_requests++;
+  slot->mdp_last_request_time = gettime_ms();
+  return rhizome_fetch_mdp_touch_timeout(slot);
+}
+
+static void rhizome_fetch_drop_block_hashes(struct rhizome_fetch_slot *slot)
+{
+  free(slot->block_hashes);
+  slot->block_hashes = NULL;
+}
+
+/* Receive a packet of block hashes requested by rhizome_fetch_mdp_request_block_hashes().  Once all
+ * of them have arrived and match the manifest's "blockhash", every block fetched from then on is
+ * verified before it is accepted.  If the peer has none, or they don't match, carry on fetching
+ * blocks unverified; the payload will still be checked against its filehash when it is complete.
+ */
+int rhizome_received_block_hashes(const unsigned char *bidprefix, uint64_t version,
+				  uint32_t first, size_t count, const unsigned char *hashes)
 {
   IN();
-  // only issue new requests every 133ms.  
-  // we automatically re-issue once we have received all packets in this
-  // request also, so if there is no packet loss, we can go substantially
-  // faster.  Optimising behaviour when there is no packet loss is an
-  // outstanding task.
+  struct rhizome_fetch_slot *slot = fetch_search_slot(bidprefix, 16);
+  if (!slot || slot->bidVersion != version || slot->state != RHIZOME_FETCH_RXFILEMDP || !slot->block_hashes)
+    RETURN(0);
+  if (first != slot->block_hashes_received)
+    RETURN(0);
   
+  if (count == 0) {
+    if (config.debug.rhizome_rx)
+      DEBUGF("Peer has no block hashes for slot=0x%p", slot);
+    rhizome_fetch_drop_block_hashes(slot);
+  } else {
+    if (count > slot->block_hash_count - first)
+      count = slot->block_hash_count - first;
+    memcpy(&slot->block_hashes[(size_t)first * RHIZOME_BLOCK_HASH_BYTES], hashes, count * RHIZOME_BLOCK_HASH_BYTES);
+    slot->block_hashes_received += count;
+    slot->block_hash_requests = 0;
+    if (slot->block_hashes_received < slot->block_hash_count) {
+      rhizome_fetch_mdp_request_block_hashes(slot);
+      RETURN(0);
+    }
+    unsigned char root[RHIZOME_BLOCKHASH_BYTES];
+    rhizome_block_hash_root(slot->block_hashes, slot->block_hash_count, root);
+    if (memcmp(root, slot->manifest->blockhash, sizeof root) != 0) {
+      WARNF("Block hashes for bid=%s do not match the manifest", alloca_tohex_rhizome_bid_t(slot->bid));
+      rhizome_fetch_drop_block_hashes(slot);
+    } else if (rhizome_write_expect_block_hashes(&slot->write_state, slot->block_hashes, slot->block_hash_count) == -1) {
+      rhizome_fetch_drop_block_hashes(slot);
+    } else {
+      if (config.debug.rhizome_rx)
+	DEBUGF("Received %"PRIu32" block hashes, verifying each block of slot=0x%p", slot->block_hash_count, slot);
+      // now owned by the write state
+      slot->block_hashes = NULL;
+    }
+  }
+  rhizome_fetch_mdp_requestblocks(slot);
+  RETURN(0);
+  OUT();
+}
+
+static int rhizome_fetch_mdp_request_chunk_list(struct rhizome_fetch_slot *slot)
+{
   struct internal_mdp_header header;
   bzero(&header, sizeof header);
   
   header.source = my_subscriber;
   header.source_port = MDP_PORT_RHIZOME_RESPONSE;
   header.destination = (struct subscriber *)slot->peer;
-  header.destination_port = MDP_PORT_RHIZOME_REQUEST;
+  header.destination_port = MDP_PORT_RHIZOME_CHUNK_REQUEST;
   header.ttl = 1;
   header.qos = OQ_ORDINARY;
   
   struct overlay_buffer *payload = ob_new();
   ob_append_bytes(payload, slot->bid.binary, sizeof slot->bid.binary);
+  ob_append_ui64_rv(payload, slot->bidVersion);
+  ob_append_ui32_rv(payload, slot->chunks_received);
+  
+  if (config.debug.rhizome_tx)
+    DEBUGF("Requesting chunk list from %"PRIu32" for slot=0x%p", slot->chunks_received, slot);
+  
+  ob_flip(payload);
+  overlay_send_frame(&header, payload);
+  ob_free(payload);
+  
+  slot->chunk_list_requests++;
+  slot->mdp_last_request_time = gettime_ms();
+  return rhizome_fetch_mdp_touch_timeout(slot);
+}
+
+static void rhizome_fetch_drop_chunk_list(struct rhizome_fetch_slot *slot)
+{
+  free(slot->chunks);
+  slot->chunks = NULL;
+  slot->chunk_count = 0;
+  slot->chunk_list_wanted = 0;
+}
+
+/* Receive a packet of the chunk list requested by rhizome_fetch_mdp_request_chunk_list().  If the
+ * peer doesn't store the payload as chunks, or the list doesn't add up to the payload's size, just
+ * fetch every block.  A bad list can't corrupt the payload, as it is still checked against its
+ * filehash when complete.
+ */
+int rhizome_received_chunk_list(const unsigned char *bidprefix, uint64_t version,
+				uint32_t first, uint32_t total, const struct rhizome_chunk_ref *refs, size_t count)
+{
+  IN();
+  struct rhizome_fetch_slot *slot = fetch_search_slot(bidprefix, 16);
+  if (!slot || slot->bidVersion != version || slot->state != RHIZOME_FETCH_RXFILEMDP || !slot->chunk_list_wanted)
+    RETURN(0);
+  if (first != slot->chunks_received)
+    RETURN(0);
+  
+  if (   total == 0
+      || total > slot->manifest->filesize / RHIZOME_CHUNK_MIN_SIZE + 1
+      || (slot->chunks && total != slot->chunk_count)
+  ) {
+    if (config.debug.rhizome_rx)
+      DEBUGF("Peer has no chunk list for slot=0x%p", slot);
+    rhizome_fetch_drop_chunk_list(slot);
+  } else {
+    if (!slot->chunks) {
+      if ((slot->chunks = emalloc((size_t)total * sizeof *slot->chunks)) == NULL) {
+	rhizome_fetch_drop_chunk_list(slot);
+	rhizome_fetch_mdp_requestblocks(slot);
+	RETURN(0);
+      }
+      slot->chunk_count = total;
+    }
+    if (count > slot->chunk_count - first)
+      count = slot->chunk_count - first;
+    memcpy(&slot->chunks[first], refs, count * sizeof *refs);
+    slot->chunks_received += count;
+    slot->chunk_list_requests = 0;
+    if (count && slot->chunks_received < slot->chunk_count) {
+      rhizome_fetch_mdp_request_chunk_list(slot);
+      RETURN(0);
+    }
+    uint64_t length = 0;
+    uint32_t i;
+    for (i = 0; i < slot->chunks_received; ++i)
+      length += slot->chunks[i].length;
+    if (slot->chunks_received < slot->chunk_count || length != slot->manifest->filesize) {
+      WARNF("Chunk list for bid=%s does not match the manifest", alloca_tohex_rhizome_bid_t(slot->bid));
+      rhizome_fetch_drop_chunk_list(slot);
+    } else {
+      if (config.debug.rhizome_rx)
+	DEBUGF("Received list of %"PRIu32" chunks for slot=0x%p", slot->chunk_count, slot);
+      slot->chunk_list_wanted = 0;
+      slot->chunk_next = 0;
+      slot->chunk_next_offset = 0;
+    }
+  }
+  rhizome_fetch_mdp_requestblocks(slot);
+  RETURN(0);
+  OUT();
+}
+
+/* Copy the chunks of the payload that we already hold, from the current write position up to the
+ * first one that we don't, so that only the chunks we lack are requested from the peer.  Returns 1
+ * if there is more to copy later, -1 if the payload is complete (and the slot has been closed).
+ */
+static int rhizome_fetch_copy_chunks(struct rhizome_fetch_slot *slot)
+{
+  uint64_t offset = slot->write_state.file_offset;
+  while (   slot->chunk_next < slot->chunk_count
+	 && slot->chunk_next_offset + slot->chunks[slot->chunk_next].length <= offset) {
+    slot->chunk_next_offset += slot->chunks[slot->chunk_next].length;
+    slot->chunk_next++;
+  }
+  // anything between the write position and the next chunk is already waiting to be written
+  if (offset < slot->chunk_next_offset)
+    offset = slot->chunk_next_offset;
+  if (slot->chunk_next >= slot->chunk_count)
+    return 0;
+  unsigned char *buffer = emalloc(RHIZOME_CHUNK_MAX_SIZE);
+  if (!buffer)
+    return 0;
+  uint64_t copied = 0;
+  int ret = 0;
+  while (slot->chunk_next < slot->chunk_count) {
+    if (copied >= RHIZOME_CHUNK_COPY_LIMIT) {
+      ret = 1;
+      break;
+    }
+    const struct rhizome_chunk_ref *ref = &slot->chunks[slot->chunk_next];
+    if (ref->length > RHIZOME_CHUNK_MAX_SIZE || rhizome_read_chunk(ref, buffer) != (ssize_t)ref->length)
+      break;
+    size_t skip = (size_t)(offset - slot->chunk_next_offset);
+    if (rhizome_random_write(&slot->write_state, offset, buffer + skip, ref->length - skip) == -1) {
+      free(buffer);
+      rhizome_fetch_close(slot);
+      return -1;
+    }
+    copied += ref->length - skip;
+    slot->chunk_next_offset += ref->length;
+    slot->chunk_next++;
+    offset = slot->chunk_next_offset;
+  }
+  free(buffer);
+  if (copied) {
+    slot->chunk_bytes_copied += copied;
+    slot->last_write_time = gettime_ms();
+    if (config.debug.rhizome_rx)
+      DEBUGF("Copied %"PRIu64" bytes from chunks already held, %"PRIu64" in total, for slot=0x%p",
+	     copied, slot->chunk_bytes_copied, slot);
+    if (rhizome_write_complete(slot))
+      return -1;
+  }
+  return ret;
+}
+
+static int rhizome_fetch_mdp_requestblocks(struct rhizome_fetch_slot *slot)
+{
+  IN();
+  // fetch the block hashes first, if we're waiting for them
+  if (slot->block_hashes) {
+    if (slot->block_hash_requests < RHIZOME_BLOCK_HASH_REQUEST_LIMIT)
+      RETURN(rhizome_fetch_mdp_request_block_hashes(slot));
+    if (config.debug.rhizome_rx)
+      DEBUGF("No block hashes received, fetching unverified blocks for slot=0x%p", slot);
+    rhizome_fetch_drop_block_hashes(slot);
+  }
+  // then the chunk list
+  if (slot->chunk_list_wanted) {
+    if (slot->chunk_list_requests < RHIZOME_CHUNK_LIST_REQUEST_LIMIT)
+      RETURN(rhizome_fetch_mdp_request_chunk_list(slot));
+    if (config.debug.rhizome_rx)
+      DEBUGF("No chunk list received, fetching every block for slot=0x%p", slot);
+    rhizome_fetch_drop_chunk_list(slot);
+  }
+  // copy whatever we already hold from the write position onwards, instead of asking for it
+  if (slot->chunks) {
+    switch (rhizome_fetch_copy_chunks(slot)) {
+      case -1:
+	RETURN(0);
+      case 1:
+	// come straight back for the rest
+	unschedule(&slot->alarm);
+	slot->alarm.alarm = gettime_ms();
+	slot->alarm.deadline = slot->alarm.alarm + 500;
+	schedule(&slot->alarm);
+	RETURN(0);
+    }
+  }
+
+  // Ask every source for its own window of blocks, those that are answering first so that they
+  // take the windows nearest the write position.  We automatically ask a source for its next window
+  // once all of its blocks have arrived, so if there is no packet loss we can go substantially
+  // faster than the stall timeout.
+  unsigned i;
+  for (i = 0; i < slot->source_count; ++i)
+    slot->sources[i].outstanding = 0;
+  for (i = 0; i < slot->source_count; ++i)
+    if (!slot->sources[i].stalls)
+      rhizome_fetch_mdp_request_window(slot, &slot->sources[i]);
+  for (i = 0; i < slot->source_count; ++i)
+    if (slot->sources[i].stalls)
+      rhizome_fetch_mdp_request_window(slot, &slot->sources[i]);
+  
+  rhizome_fetch_mdp_touch_timeout(slot);
   
-  uint32_t bitmap=0;
-  int requests=32;
+  RETURN(0);
+  OUT();
+}
+
+// Which of the given number of blocks from the given offset are already buffered, one bit per block
+// from the most significant bit of the first byte, and how many are still needed.
+static int fetch_window_bitmap(struct rhizome_fetch_slot *slot, uint64_t offset, int blocks, uint16_t block_length, uint8_t *bitmap)
+{
+  int requests=0;
   int i;
   struct rhizome_write_buffer *p = slot->write_state.buffer_list;
-  uint64_t offset = slot->write_state.file_offset;
-  for (i=0;i<32;i++){
+  bzero(bitmap, (blocks + 7) / 8);
+  for (i=0;i<blocks;i++){
+    if (offset >= slot->write_state.file_length){
+      // mark blocks past the end as held, so peers that only read the fixed size bitmap skip them
+      bitmap[i >> 3] |= 0x80 >> (i & 7);
+      continue;
+    }
+    uint64_t end = offset+block_length;
+    if (end > slot->write_state.file_length)
+      end = slot->write_state.file_length;
     while(p && p->offset + p->data_size < offset)
       p=p->_next;
-    if (!p)
-      break;
-    if (p->offset <= offset && p->offset+p->data_size >= offset+slot->mdpRXBlockLength){
-      bitmap |= 1<<(31-i);
-      requests --;
+    if (p && p->offset <= offset && p->offset+p->data_size >= end)
+      bitmap[i >> 3] |= 0x80 >> (i & 7);
+    else
+      requests++;
+    offset+=block_length;
+  }
+  return requests;
+}
+
+// If another source is answering a window that overlaps the one at the given offset, return the end
+// of that window, otherwise 0.  A source that has stopped answering only keeps its window from other
+// sources that have stopped answering too.
+static uint64_t fetch_window_taken(const struct rhizome_fetch_slot *slot, const struct rhizome_fetch_source *source, uint64_t offset, uint64_t window_size)
+{
+  unsigned i;
+  for (i = 0; i < slot->source_count; ++i) {
+    const struct rhizome_fetch_source *s = &slot->sources[i];
+    if (   s != source
+	&& s->outstanding
+	&& (!s->stalls || source->stalls)
+	&& s->window < offset + window_size
+	&& offset < s->window + s->window_bytes)
+      return s->window + s->window_bytes;
+  }
+  return 0;
+}
+
+/* Ask one source for the first window of blocks from the write position that holds blocks we still
+ * lack, and that no other source is answering.  Sources are only asked for windows a little ahead
+ * of the write position, so that the out of order blocks can be held until they are written.
+ * While copying chunks that we already hold, only the window at the write position is fetched, as
+ * the rest of the payload may not need fetching at all.
+ */
+static int rhizome_fetch_mdp_request_window(struct rhizome_fetch_slot *slot, struct rhizome_fetch_source *source)
+{
+  IN();
+  uint16_t block_length = slot->mdpRXBlockLength;
+  int blocks = source->legacy && source->blocks > RHIZOME_MDP_LEGACY_WINDOW ? RHIZOME_MDP_LEGACY_WINDOW : source->blocks;
+  uint64_t window_size = blocks * (uint64_t)block_length;
+  uint64_t offset = slot->write_state.file_offset;
+  uint64_t span = RHIZOME_FETCH_SWARM_SPAN < window_size ? window_size : RHIZOME_FETCH_SWARM_SPAN;
+  uint64_t limit = offset + (slot->chunks ? window_size : span);
+  uint8_t bitmap[RHIZOME_MDP_MAX_WINDOW / 8];
+  int requests = 0;
+  
+  while (offset < slot->write_state.file_length && offset < limit) {
+    uint64_t next = fetch_window_taken(slot, source, offset, window_size);
+    if (next) {
+      offset = next;
+      continue;
     }
-    offset+=slot->mdpRXBlockLength;
+    requests = fetch_window_bitmap(slot, offset, blocks, block_length, bitmap);
+    if (requests)
+      break;
+    offset += window_size;
   }
+  source->outstanding = 0;
+  if (!requests)
+    RETURN(0);
+  
+  struct internal_mdp_header header;
+  bzero(&header, sizeof header);
+  
+  header.source = my_subscriber;
+  header.source_port = MDP_PORT_RHIZOME_RESPONSE;
+  header.destination = (struct subscriber *)source->peer;
+  header.destination_port = MDP_PORT_RHIZOME_REQUEST;
+  header.ttl = 1;
+  header.qos = OQ_ORDINARY;
+  
+  // the first 32 blocks in the original fixed size bitmap, with any blocks past the window marked
+  // as held, then the whole window if it is any other size
+  uint8_t legacy[RHIZOME_MDP_LEGACY_WINDOW / 8];
+  memset(legacy, 0xFF, sizeof legacy);
+  memcpy(legacy, bitmap, (blocks < RHIZOME_MDP_LEGACY_WINDOW ? blocks + 7 : RHIZOME_MDP_LEGACY_WINDOW) / 8);
+  if (blocks < RHIZOME_MDP_LEGACY_WINDOW && blocks % 8)
+    legacy[blocks / 8] |= 0xFF >> (blocks % 8);
   
+  struct overlay_buffer *payload = ob_new();
+  ob_append_bytes(payload, slot->bid.binary, sizeof slot->bid.binary);
   ob_append_ui64_rv(payload, slot->bidVersion);
-  ob_append_ui64_rv(payload, slot->write_state.file_offset);
-  ob_append_ui32_rv(payload, bitmap);
-  ob_append_ui16_rv(payload, slot->mdpRXBlockLength);
+  ob_append_ui64_rv(payload, offset);
+  ob_append_ui32_rv(payload, ((uint32_t)legacy[0] << 24) | ((uint32_t)legacy[1] << 16) | (legacy[2] << 8) | legacy[3]);
+  ob_append_ui16_rv(payload, block_length);
+  // peers that don't know the flags ignore them, and send the blocks uncompressed
+  if (blocks > RHIZOME_MDP_LEGACY_WINDOW || config.rhizome.mdp.compress_blocks) {
+    ob_append_ui16_rv(payload, blocks);
+    ob_append_bytes(payload, bitmap, (blocks + 7) / 8);
+    if (config.rhizome.mdp.compress_blocks)
+      ob_append_byte(payload, RHIZOME_MDP_REQUEST_COMPRESS);
+  }
   
   if (config.debug.rhizome_tx)
-    DEBUGF("src sid=%s, dst sid=%s, mdpRXWindowStart=0x%"PRIx64", slot->bidVersion=0x%"PRIx64,
+    DEBUGF("src sid=%s, dst sid=%s, mdpRXWindowStart=0x%"PRIx64", blocks=%d x %u, slot->bidVersion=0x%"PRIx64,
 	   alloca_tohex_sid_t(header.source->sid),
-	   alloca_tohex_sid_t(header.destination->sid),
-	   slot->write_state.file_offset,
+	   header.destination ? alloca_tohex_sid_t(header.destination->sid) : "broadcast",
+	   offset, blocks, block_length,
 	   slot->bidVersion);
   
   ob_flip(payload);
   overlay_send_frame(&header, payload);
   ob_free(payload);
   
-  // remember when we sent the request so that we can adjust the inter-request
-  // interval based on how fast the packets arrive.
-  slot->mdpResponsesOutstanding=requests;
-  slot->mdp_last_request_offset = slot->write_state.file_offset;
-  slot->mdp_last_request_time = gettime_ms();
-  
-  rhizome_fetch_mdp_touch_timeout(slot);
-  
+  // remember when we sent the request so that we can tell when the source stops answering
+  source->window = offset;
+  source->window_bytes = window_size;
+  source->block_length = block_length;
+  source->requested = source->outstanding = requests;
+  source->highest = -1;
+  source->request_time = source->last_activity = slot->mdp_last_request_time = gettime_ms();
   RETURN(0);
   OUT();
 }
 
+/* Adjust a source's pacing once its last window has arrived, or as much of it as will, and the
+ * block length of the whole fetch, which all sources share.  Loss shrinks the window in proportion,
+ * and on a very lossy link the blocks too, so that each loss wastes less of the link.  A window
+ * that arrives whole grows the next one, unless it delivered much less than a smaller window did
+ * before, which means we are already asking for more than the link can carry and the extra blocks
+ * are only queueing.
+ */
+static void fetch_source_window_done(struct rhizome_fetch_slot *slot, struct rhizome_fetch_source *source, time_ms_t now)
+{
+  int lost = source->outstanding;
+  int received = source->requested - lost;
+  time_ms_t elapsed = now - source->request_time;
+  if (elapsed < 1)
+    elapsed = 1;
+  
+  // a peer that answered the start of a big window but nothing past block 32 does not understand them
+  if (   source->requested > RHIZOME_MDP_LEGACY_WINDOW
+      && received
+      && source->highest >= 0
+      && source->highest < RHIZOME_MDP_LEGACY_WINDOW
+      && !source->legacy) {
+    if (config.debug.rhizome_rx)
+      DEBUGF("Source %s only answers %d block windows", alloca_tohex_sid_t(source->peer->sid), RHIZOME_MDP_LEGACY_WINDOW);
+    source->legacy = 1;
+    source->blocks = RHIZOME_MDP_LEGACY_WINDOW;
+    return;
+  }
+  
+  unsigned window_loss = lost * 1000 / source->requested;
+  source->loss = (source->loss * 3 + window_loss) / 4;
+  uint32_t goodput = received * (uint64_t)source->block_length * 1000 / elapsed;
+  if (received)
+    source->srtt = source->srtt ? (source->srtt * 7 + elapsed) / 8 : elapsed;
+  // forget the best rate slowly, in case the link has become slower since
+  source->best_goodput -= source->best_goodput / 64;
+  
+  int max_blocks = source->legacy ? RHIZOME_MDP_LEGACY_WINDOW : RHIZOME_MDP_MAX_WINDOW;
+  int blocks = source->blocks;
+  if (source->loss > 100) {
+    source->blocks = blocks - blocks * source->loss / 2000;
+    slot->mdpCleanWindows = 0;
+    if (source->loss > 300 && slot->mdpRXBlockLength > RHIZOME_FETCH_MIN_BLOCK_LENGTH) {
+      slot->mdpRXBlockLength /= 2;
+      source->loss = 0;
+    }
+  } else if (source->requested >= source->best_blocks && goodput * 4 < source->best_goodput * 3) {
+    source->blocks = blocks - blocks / 8;
+  } else if (window_loss <= 100) {
+    source->blocks = blocks + (blocks / 4 > 4 ? blocks / 4 : 4);
+    if (++slot->mdpCleanWindows >= 4 && slot->mdpRXBlockLength < RHIZOME_FETCH_MAX_BLOCK_LENGTH) {
+      slot->mdpRXBlockLength *= 2;
+      slot->mdpCleanWindows = 0;
+    }
+  }
+  if (source->blocks < RHIZOME_FETCH_MIN_WINDOW)
+    source->blocks = RHIZOME_FETCH_MIN_WINDOW;
+  if (source->blocks > max_blocks)
+    source->blocks = max_blocks;
+  // rates are only comparable between windows of blocks of the same length
+  if (goodput > source->best_goodput || source->block_length != slot->mdpRXBlockLength) {
+    source->best_goodput = goodput;
+    source->best_blocks = source->requested;
+  }
+  
+  if (config.debug.rhizome_rx)
+    DEBUGF("Window from %s: %d of %d blocks in %"PRId64"ms, %"PRIu32" bytes/s, next window %d x %d",
+	   alloca_tohex_sid_t(source->peer->sid), received, source->requested, elapsed,
+	   goodput, source->blocks, slot->mdpRXBlockLength);
+}
+
+// How long to wait for more of a source's window before asking again.
+static time_ms_t fetch_source_stall_timeout(const struct rhizome_fetch_source *source)
+{
+  time_ms_t timeout = config.rhizome.mdp_stall_timeout;
+  if (source->srtt && source->srtt / 2 + 50 < timeout)
+    timeout = source->srtt / 2 + 50;
+  if (timeout < RHIZOME_FETCH_MIN_STALL_TIMEOUT)
+    timeout = RHIZOME_FETCH_MIN_STALL_TIMEOUT;
+  return timeout;
+}
+
 static int pipe_journal(struct rhizome_fetch_slot *slot){
   if (!slot->previous)
     return 0;
@@ -1192,28 +2071,50 @@ static enum rhizome_start_fetch_result rhizome_fetch_switch_to_mdp(struct rhizom
   slot->last_write_time=gettime_ms();
   
   pipe_journal(slot);
+  // whatever part of a delta arrived has been written in order, so MDP can carry on from there
+  fetch_delta_free(slot);
   
     /* We are requesting a file.  The http request may have already received
        some of the file, so take that into account when setting up ring buffer. 
-       Then send the request for the next block of data, and set our alarm to
-       re-ask in a little while. "In a little while" is 266ms, which is roughly
-       the time it takes to send 32KB via WiFi broadcast at the 1Mbit base rate 
-       (this will need tuning for non-WiFi interfaces). 32KB = 32 x 1024 bytes
-       which is the block size we will use.  200bytes would allow for several
-       blocks to fit into a packet, and probably fit at least one any any,
-       outgoing packet that is not otherwise full. But then the whole thing slows
-       down too much.  Much careful thought is required to optimise this
-       transport.
+       Then send the request for the next window of blocks, and set our alarm to
+       re-ask in a little while.  Each source starts with a window of 32 blocks
+       of the configured block size, and both are then paced to what the link
+       actually delivers (see fetch_source_window_done()).
     */
   slot->mdpIdleTimeout = config.rhizome.idle_timeout; // give up if nothing received for 5 seconds
   
-  unsigned char log_size=log2ll(slot->manifest->filesize);
-  struct rhizome_fetch_queue *q=rhizome_find_queue(log_size);
-  // increase the timeout based on the queue number
-  if (q)
-    slot->mdpIdleTimeout *= 1+(q - rhizome_fetch_queues);
+  // increase the timeout for bigger payloads
+  slot->mdpIdleTimeout *= 1+fetch_size_class(log2ll(slot->manifest->filesize));
   
   slot->mdpRXBlockLength = config.rhizome.rhizome_mdp_block_size; // Rhizome over MDP block size
+  slot->mdpCleanWindows = 0;
+  
+  // if the manifest commits to block hashes, fetch them first so that each block can be verified
+  free(slot->block_hashes);
+  slot->block_hashes = NULL;
+  if (   slot->manifest->has_blockhash
+      && slot->write_state.block_hashing
+      && !slot->write_state.verify_blocks
+      && !slot->write_state.crypt
+      && slot->write_state.file_offset % RHIZOME_BLOCK_HASH_SIZE == 0) {
+    slot->block_hash_count = rhizome_block_hash_count(slot->manifest->filesize);
+    slot->block_hashes_received = 0;
+    slot->block_hash_requests = 0;
+    if ((slot->block_hashes = emalloc((size_t)slot->block_hash_count * RHIZOME_BLOCK_HASH_BYTES)) == NULL)
+      slot->block_hash_count = 0;
+  }
+  // if we keep a chunk store, find out which chunks of the payload we already have
+  free(slot->chunks);
+  slot->chunks = NULL;
+  slot->chunk_count = 0;
+  slot->chunks_received = 0;
+  slot->chunk_list_requests = 0;
+  slot->chunk_bytes_copied = 0;
+  slot->chunk_list_wanted = 
+       rhizome_chunk_payloads()
+    && !slot->manifest->is_journal
+    && slot->manifest->filesize >= RHIZOME_CHUNK_MIN_PAYLOAD
+    && rhizome_have_chunks();
   rhizome_fetch_mdp_requestblocks(slot);
 
   RETURN(STARTED);
@@ -1223,9 +2124,19 @@ static enum rhizome_start_fetch_result rhizome_fetch_switch_to_mdp(struct rhizom
 void rhizome_fetch_write(struct rhizome_fetch_slot *slot)
 {
   IN();
-  if (config.debug.rhizome_rx)
-    DEBUGF("write_nonblock(%d, %s)", slot->alarm.poll.fd, alloca_toprint(-1, &slot->request[slot->request_ofs], slot->request_len-slot->request_ofs));
-  int bytes = write_nonblock(slot->alarm.poll.fd, &slot->request[slot->request_ofs], slot->request_len-slot->request_ofs);
+  int bytes;
+  if (slot->request_ofs < slot->request_len) {
+    if (config.debug.rhizome_rx)
+      DEBUGF("write_nonblock(%d, %s)", slot->alarm.poll.fd, alloca_toprint(-1, &slot->request[slot->request_ofs], slot->request_len-slot->request_ofs));
+    bytes = write_nonblock(slot->alarm.poll.fd, &slot->request[slot->request_ofs], slot->request_len-slot->request_ofs);
+  } else {
+    // the body of the request, once its headers have gone
+    bytes = write_nonblock(slot->alarm.poll.fd, &slot->upload[slot->upload_ofs], slot->upload_len - slot->upload_ofs);
+    if (bytes > 0) {
+      slot->upload_ofs += bytes;
+      bytes = 0;
+    }
+  }
   if (bytes == -1) {
     WHY("Got error while sending HTTP request.");
     rhizome_fetch_switch_to_mdp(slot);
@@ -1238,10 +2149,15 @@ void rhizome_fetch_write(struct rhizome_fetch_slot *slot)
     slot->alarm.deadline = slot->alarm.alarm + config.rhizome.idle_timeout;
     schedule(&slot->alarm);
     slot->request_ofs+=bytes;
-    if (slot->request_ofs>=slot->request_len) {
+    if (slot->request_ofs>=slot->request_len && slot->upload_ofs>=slot->upload_len) {
       /* Sent all of request.  Switch to listening for HTTP response headers.
        */
       slot->request_len=0; slot->request_ofs=0;
+      if (slot->upload) {
+	free(slot->upload);
+	slot->upload = NULL;
+	slot->upload_len = slot->upload_ofs = 0;
+      }
       slot->state=RHIZOME_FETCH_RXHTTPHEADERS;
       slot->alarm.poll.events=POLLIN;
       watch(&slot->alarm);
@@ -1275,7 +2191,12 @@ static int rhizome_write_complete(struct rhizome_fetch_slot *slot)
       RETURN(-1);
     }
 
-    if (slot->state==RHIZOME_FETCH_RXFILE) {
+    if (slot->state==RHIZOME_FETCH_RXFILE && slot->delta) {
+      INFOF("Completed http request from %s for file %s as a delta: %"PRIu64" bytes received, %"PRIu64" copied from the previous version",
+	      alloca_socket_address(&slot->addr), 
+	      alloca_tohex_rhizome_filehash_t(slot->manifest->filehash),
+	      slot->delta->received, slot->delta->copied);
+    } else if (slot->state==RHIZOME_FETCH_RXFILE) {
       INFOF("Completed http request from %s for file %s",
 	      alloca_socket_address(&slot->addr), 
 	      alloca_tohex_rhizome_filehash_t(slot->manifest->filehash));
@@ -1334,6 +2255,17 @@ int rhizome_write_content(struct rhizome_fetch_slot *slot, unsigned char *buffer
   if (bytes<=0)
     RETURN(0);
   
+  if (slot->delta) {
+    /* We are reading a delta.  Copy blocks from the version we hold, and write the literal bytes,
+       in order. */
+    if (rhizome_delta_decode(slot->delta, &slot->write_state, buffer, bytes) == -1) {
+      rhizome_fetch_close(slot);
+      RETURN(-1);
+    }
+    slot->last_write_time=gettime_ms();
+    RETURN(rhizome_write_complete(slot));
+  }
+  
   // Truncate to known length of file (handy for reading from journal bundles that
   // might grow while we are reading from them).
   if (bytes > slot->write_state.file_length - slot->write_state.file_offset) {
@@ -1366,7 +2298,7 @@ int rhizome_write_content(struct rhizome_fetch_slot *slot, unsigned char *buffer
   OUT();
 }
 
-int rhizome_received_content(const unsigned char *bidprefix,
+int rhizome_received_content(const struct subscriber *peer, const unsigned char *bidprefix,
 			     uint64_t version, uint64_t offset,
 			     size_t count, unsigned char *bytes)
 {
@@ -1379,6 +2311,7 @@ int rhizome_received_content(const unsigned char *bidprefix,
   if (slot && slot->bidVersion == version && slot->state == RHIZOME_FETCH_RXFILEMDP){
     if (config.debug.rhizome)
       DEBUGF("Rhizome over MDP receiving %zu bytes.", count);
+    uint64_t file_offset = slot->write_state.file_offset;
     if (rhizome_random_write(&slot->write_state, offset, bytes, count)){
       if (config.debug.rhizome)
 	DEBUGF("Write failed!");
@@ -1391,14 +2324,51 @@ int rhizome_received_content(const unsigned char *bidprefix,
       RETURN(-1);
     }
     
-    slot->last_write_time=gettime_ms();
-    rhizome_fetch_mdp_touch_timeout(slot);
-
-    slot->mdpResponsesOutstanding--;
-    if (slot->mdpResponsesOutstanding==0) {
-      // We have received all responses, so immediately ask for more
-      rhizome_fetch_mdp_requestblocks(slot);
+    time_ms_t now = gettime_ms();
+    slot->last_write_time=now;
+    
+    // a lone source is credited with any block in its window, as it may be answering by broadcast
+    struct rhizome_fetch_source *source = fetch_find_source(slot, peer);
+    if (!source && slot->source_count == 1)
+      source = &slot->sources[0];
+    if (source && source->peer == peer)
+      source->bytes_received += count;
+    if (   source
+	&& source->outstanding
+	&& offset >= source->window
+	&& offset < source->window + source->window_bytes) {
+      // a block broadcast for another fetcher may be longer than ours, and cover several of them
+      int block = (offset - source->window) / source->block_length;
+      int last = (offset + count - 1 - source->window) / source->block_length;
+      int window_blocks = source->window_bytes / source->block_length;
+      if (last >= window_blocks)
+	last = window_blocks - 1;
+      if (last < block)
+	last = block;
+      if (last > source->highest)
+	source->highest = last;
+      source->last_activity = now;
+      source->stalls = 0;
+      source->outstanding -= last - block + 1;
+      if (source->outstanding < 0)
+	source->outstanding = 0;
+      // blocks are sent in order, so once the last of the window arrives the rest have been lost
+      if (   source->outstanding == 0
+	  || offset + count >= source->window + source->window_bytes
+	  || offset + count >= slot->write_state.file_length) {
+	fetch_source_window_done(slot, source, now);
+	// We have received all responses, so immediately ask for more
+	rhizome_fetch_mdp_request_window(slot, source);
+      }
+    }
+    // once the write position moves, sources that had nothing left to fetch may have more to do
+    if (slot->write_state.file_offset != file_offset) {
+      unsigned i;
+      for (i = 0; i < slot->source_count; ++i)
+	if (!slot->sources[i].outstanding)
+	  rhizome_fetch_mdp_request_window(slot, &slot->sources[i]);
     }
+    rhizome_fetch_mdp_touch_timeout(slot);
     RETURN(0);
   }
   
@@ -1521,9 +2491,18 @@ void rhizome_fetch_poll(struct sched_ent *alarm)
 	    rhizome_fetch_switch_to_mdp(slot);
 	    return;
 	  }
+	  if (   slot->manifest
+	      && !slot->previous
+	      && slot->write_state.file_offset
+	      && parts.range_start != slot->write_state.file_offset) {
+	    if (config.debug.rhizome_rx)
+	      DEBUGF("HTTP reply starts @%"PRIu64", not where the fetch resumes", parts.range_start);
+	    rhizome_fetch_switch_to_mdp(slot);
+	    return;
+	  }
 	  if (slot->write_state.file_length == RHIZOME_SIZE_UNSET)
 	    slot->write_state.file_length = parts.content_length;
-	  else if (parts.content_length + parts.range_start != slot->write_state.file_length)
+	  else if (!slot->delta && parts.content_length + parts.range_start != slot->write_state.file_length)
 	    WARNF("Expected content length %"PRIu64", got %"PRIu64" + %"PRIu64, 
 	      slot->write_state.file_length, parts.content_length, parts.range_start);
 	  /* We have all we need.  The file is already open, so just write out any initial bytes of
@@ -1594,6 +2573,7 @@ int unpack_http_response(char *response, struct http_response_parts *parts)
   parts->reason = NULL;
   parts->range_start=0;
   parts->content_length = HTTP_RESPONSE_CONTENT_LENGTH_UNSET;
+  parts->keep_alive = 0;
   parts->content_start = NULL;
   char *p = NULL;
   if (!str_startswith(response, "HTTP/1.0 ", (const char **)&p)) {
@@ -1639,6 +2619,20 @@ int unpack_http_response(char *response, struct http_response_parts *parts)
 	RETURN(-1);
       }
     }
+    if (strcase_startswith(p, "Connection:", (const char **)&p)) {
+      // a comma separated list of tokens, of which only "keep-alive" matters here
+      while (*p && *p != '\r' && *p != '\n') {
+	if (*p == ' ' || *p == ',') {
+	  ++p;
+	  continue;
+	}
+	const char *token = p;
+	while (*p && *p != ' ' && *p != ',' && *p != '\r' && *p != '\n')
+	  ++p;
+	if (p - token == 10 && strncasecmp(token, "keep-alive", 10) == 0)
+	  parts->keep_alive = 1;
+      }
+    }
     while (*p++ != '\n')
       ;
   }
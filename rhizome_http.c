@@ -17,6 +17,7 @@ along with this program; if not, write to the Free Software
 Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
+#include <assert.h>
 #include "serval.h"
 #include "conf.h"
 #include "httpd.h"
@@ -46,6 +47,113 @@ int rhizome_file_page(httpd_request *r, const char *remainder)
   return 1;
 }
 
+/* A fetcher that holds an older version of a payload posts the signatures of its blocks, and gets
+ * the payload back as a delta against them (see rhizome_delta.c).
+ */
+static void finalise_union_delta(httpd_request *r)
+{
+  form_buf_malloc_release(&r->u.delta.signatures);
+  rhizome_delta_free(&r->u.delta.delta);
+  rhizome_read_close(&r->u.delta.read_state);
+}
+
+static char PART_SIGNATURES[] = "signatures";
+
+static int delta_mime_part_start(struct http_request *hr)
+{
+  httpd_request *r = (httpd_request *) hr;
+  assert(r->u.delta.current_part == NULL);
+  return 0;
+}
+
+static int delta_mime_part_end(struct http_request *hr)
+{
+  httpd_request *r = (httpd_request *) hr;
+  if (r->u.delta.current_part == PART_SIGNATURES)
+    r->u.delta.received_signatures = 1;
+  else
+    FATALF("current_part = %s", alloca_str_toprint(r->u.delta.current_part));
+  r->u.delta.current_part = NULL;
+  return 0;
+}
+
+static int delta_mime_part_header(struct http_request *hr, const struct mime_part_headers *h)
+{
+  httpd_request *r = (httpd_request *) hr;
+  if (strcmp(h->content_disposition.type, "form-data") != 0)
+    return http_response_content_disposition(r, "Unsupported", h->content_disposition.type);
+  if (strcmp(h->content_disposition.name, PART_SIGNATURES) != 0)
+    return http_response_form_part(r, "Unsupported", h->content_disposition.name, NULL, 0);
+  if (r->u.delta.received_signatures)
+    return http_response_form_part(r, "Duplicate", PART_SIGNATURES, NULL, 0);
+  r->u.delta.current_part = PART_SIGNATURES;
+  form_buf_malloc_init(&r->u.delta.signatures, 8 + RHIZOME_DELTA_MAX_SIGNATURES * RHIZOME_DELTA_SIGNATURE_BYTES);
+  return 0;
+}
+
+static int delta_mime_part_body(struct http_request *hr, char *buf, size_t len)
+{
+  httpd_request *r = (httpd_request *) hr;
+  if (r->u.delta.current_part == PART_SIGNATURES)
+    form_buf_malloc_accumulate(r, PART_SIGNATURES, &r->u.delta.signatures, buf, len);
+  else
+    FATALF("current_part = %s", alloca_str_toprint(r->u.delta.current_part));
+  return 0;
+}
+
+static int rhizome_delta_content(struct http_request *hr, unsigned char *buf, size_t bufsz, struct http_content_generator_result *result)
+{
+  httpd_request *r = (httpd_request *) hr;
+  ssize_t n = rhizome_delta_generate(&r->u.delta.delta, &r->u.delta.read_state, buf, bufsz);
+  if (n == -1)
+    return -1;
+  result->generated = (size_t) n;
+  uint64_t remain = r->u.delta.delta.length - r->u.delta.delta.generated;
+  const size_t preferred_bufsz = 16 * 1024;
+  result->need = remain < preferred_bufsz ? remain : preferred_bufsz;
+  return remain ? 1 : 0;
+}
+
+static int rhizome_delta_end(struct http_request *hr)
+{
+  httpd_request *r = (httpd_request *) hr;
+  if (!r->u.delta.received_signatures)
+    return http_response_form_part(r, "Missing", PART_SIGNATURES, NULL, 0);
+  r->payload_status = rhizome_open_read(&r->u.delta.read_state, &r->u.delta.filehash);
+  if (r->payload_status != RHIZOME_PAYLOAD_STATUS_STORED)
+    return 404;
+  if (rhizome_delta_encode(&r->u.delta.delta, &r->u.delta.filehash,
+			   (const unsigned char *)r->u.delta.signatures.buffer, r->u.delta.signatures.length) == -1)
+    return 400;
+  if (config.debug.rhizome_tx)
+    DEBUGF("Sending %s as a delta of %zu ops, %"PRIu64" bytes (%"PRIu64" literal)",
+	   alloca_tohex_rhizome_filehash_t(r->u.delta.filehash), r->u.delta.delta.op_count,
+	   r->u.delta.delta.length, r->u.delta.delta.literal_bytes);
+  r->http.response.header.content_range_start = 0;
+  r->http.response.header.content_length = r->http.response.header.resource_length = r->u.delta.delta.length;
+  http_request_response_generated(&r->http, 200, CONTENT_TYPE_BLOB, rhizome_delta_content);
+  return 1;
+}
+
+int rhizome_delta_page(httpd_request *r, const char *remainder)
+{
+  if (!is_rhizome_http_enabled())
+    return 403;
+  if (r->http.verb != HTTP_VERB_POST)
+    return 405;
+  if (str_to_rhizome_filehash_t(&r->u.delta.filehash, remainder) == -1)
+    return 404;
+  assert(r->finalise_union == NULL);
+  r->finalise_union = finalise_union_delta;
+  r->u.delta.read_state.blob_fd = -1;
+  r->http.form_data.handle_mime_part_start = delta_mime_part_start;
+  r->http.form_data.handle_mime_part_end = delta_mime_part_end;
+  r->http.form_data.handle_mime_part_header = delta_mime_part_header;
+  r->http.form_data.handle_mime_body = delta_mime_part_body;
+  r->http.handle_content_end = rhizome_delta_end;
+  return 1;
+}
+
 int manifest_by_prefix_page(httpd_request *r, const char *remainder)
 {
   if (!is_rhizome_http_enabled())
@@ -82,7 +190,10 @@ int rhizome_status_page(httpd_request *r, const char *remainder)
   strbuf b = strbuf_local(buf, sizeof buf);
   strbuf_puts(b, "<html><head><meta http-equiv=\"refresh\" content=\"5\" ></head><body>");
   strbuf_sprintf(b, "%d HTTP requests<br>", httpd_request_count);
-  strbuf_sprintf(b, "%d Bundles transferring via MDP<br>", rhizome_cache_count());
+  struct rhizome_cache_stats cache;
+  rhizome_cache_get_stats(&cache);
+  strbuf_sprintf(b, "%u Bundles transferring via MDP (%"PRIu64" hits, %"PRIu64" misses, %"PRIu64" evicted, %"PRIu64" expired)<br>",
+      cache.open, cache.hits, cache.misses, cache.evicted, cache.expired);
   rhizome_fetch_status_html(b);
   strbuf_puts(b, "</body></html>");
   if (strbuf_overrun(b))
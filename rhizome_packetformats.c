@@ -306,15 +306,17 @@ next:
     if (rhizome_ignore_manifest_check(rhizome_bar_prefix(bar), RHIZOME_BAR_PREFIX_BYTES))
       continue;
 
+    // are we already fetching this bundle [or later]?  If so, the sender can supply some of it.
+    if (rhizome_fetch_bar_queued(bar)){
+      rhizome_fetch_add_source(bar, f->source);
+      continue;
+    }
+
     // do we have free space in a fetch queue?
     unsigned char log2_size = rhizome_bar_log_size(bar);
     if (log2_size!=0xFF && rhizome_fetch_has_queue_space(log2_size)!=1)
       continue;
 
-    // are we already fetching this bundle [or later]?
-    if (rhizome_fetch_bar_queued(bar))
-      continue;
-
     bar_count++;
   }
 
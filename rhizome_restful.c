@@ -21,6 +21,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "conf.h"
 #include "httpd.h"
 #include "strbuf_helpers.h"
+#include "dataformats.h"
 
 static HTTP_RENDERER render_manifest_headers;
 
@@ -32,7 +33,7 @@ static void finalise_union_read_state(httpd_request *r)
 static void finalise_union_rhizome_insert(httpd_request *r)
 {
   form_buf_malloc_release(&r->u.insert.manifest);
-  if (r->u.insert.write.blob_fd != -1)
+  if (r->u.insert.write.blob_fd != -1 || r->u.insert.write.block_hashes)
     rhizome_fail_write(&r->u.insert.write);
 }
 
@@ -180,6 +181,79 @@ static int restful_rhizome_bundlelist_json_content(struct http_request *hr, unsi
   return ret;
 }
 
+/* A bundle list may be narrowed by filters and paged, in either direction, by token:
+ *
+ *   /restful/rhizome/[service/<service>/][sender/<sid>/][recipient/<sid>/][limit/<n>/]
+ *                    [before/<token>/|newsince/<token>/]{bundlelist.json|bundlecount.json}
+ *
+ * A list limited to <n> rows ends with a "before_token" to fetch the next (older) page with.
+ * bundlecount.json just gives the number of bundles that would be listed.
+ */
+static int restful_rhizome_list(httpd_request *r, const char *remainder)
+{
+  r->u.rhlist.phase = LIST_HEADER;
+  r->u.rhlist.rowcount = 0;
+  r->u.rhlist.limit = 0;
+  bzero(&r->u.rhlist.cursor, sizeof r->u.rhlist.cursor);
+  struct rhizome_list_cursor *c = &r->u.rhlist.cursor;
+  const char *end;
+  if (str_startswith(remainder, "service/", &end)) {
+    const char *slash = strchr(end, '/');
+    if (slash == NULL || (size_t)(slash - end) >= sizeof r->u.rhlist.service)
+      return 404;
+    strncpy(r->u.rhlist.service, end, slash - end)[slash - end] = '\0';
+    if (!rhizome_str_is_manifest_service(r->u.rhlist.service))
+      return 404;
+    c->service = r->u.rhlist.service;
+    remainder = slash + 1;
+  }
+  if (str_startswith(remainder, "sender/", &end)) {
+    if (strn_to_sid_t(&c->sender, end, SIZE_MAX, &end) == -1 || *end != '/')
+      return 404;
+    c->is_sender_set = 1;
+    remainder = end + 1;
+  }
+  if (str_startswith(remainder, "recipient/", &end)) {
+    if (strn_to_sid_t(&c->recipient, end, SIZE_MAX, &end) == -1 || *end != '/')
+      return 404;
+    c->is_recipient_set = 1;
+    remainder = end + 1;
+  }
+  if (str_startswith(remainder, "limit/", &end)) {
+    uint64_t limit;
+    if (!str_to_uint64(end, 10, &limit, &end) || limit == 0 || *end != '/')
+      return 404;
+    r->u.rhlist.limit = limit;
+    remainder = end + 1;
+  }
+  if (str_startswith(remainder, "before/", &end)) {
+    if (!strn_to_list_token(end, &c->rowid_before, &end) || *end != '/')
+      return 404;
+    remainder = end + 1;
+  } else if (str_startswith(remainder, "newsince/", &end)) {
+    if (!strn_to_list_token(end, &c->rowid_since, &end) || *end != '/')
+      return 404;
+    r->u.rhlist.end_time = gettime_ms() + config.api.restful.newsince_timeout * 1000;
+    remainder = end + 1;
+  }
+  if (r->http.verb != HTTP_VERB_GET)
+    return 405;
+  if (strcmp(remainder, "bundlelist.json") == 0) {
+    http_request_response_generated(&r->http, 200, CONTENT_TYPE_JSON, restful_rhizome_bundlelist_json_content);
+    return 1;
+  }
+  if (strcmp(remainder, "bundlecount.json") == 0 && !c->rowid_since) {
+    uint64_t count;
+    if (rhizome_list_count(c, &count) == -1)
+      return 500;
+    strbuf b = strbuf_alloca(40);
+    strbuf_sprintf(b, "{\n\"count\":%"PRIu64"\n}\n", count);
+    http_request_response_static(&r->http, 200, CONTENT_TYPE_JSON, strbuf_str(b), strbuf_len(b));
+    return 1;
+  }
+  return 404;
+}
+
 int restful_rhizome_newsince(httpd_request *r, const char *remainder)
 {
   r->http.response.header.content_type = CONTENT_TYPE_JSON;
@@ -203,6 +277,15 @@ int restful_rhizome_newsince(httpd_request *r, const char *remainder)
   return 1;
 }
 
+static void restful_rhizome_newsince_notify(struct rhizome_bundle_listener *l, const rhizome_manifest *m)
+{
+  httpd_request *r = (httpd_request *) l->context;
+  if (m && !rhizome_list_matches(&r->u.rhlist.cursor, m))
+    return;
+  rhizome_bundle_unlisten(l);
+  http_request_resume_response(&r->http);
+}
+
 static int restful_rhizome_bundlelist_json_content_chunk(struct http_request *hr, strbuf b)
 {
   httpd_request *r = (httpd_request *) hr;
@@ -239,6 +322,10 @@ static int restful_rhizome_bundlelist_json_content_chunk(struct http_request *hr
     case LIST_FIRST:
     case LIST_ROWS:
       {
+	if (r->u.rhlist.limit && r->u.rhlist.rowcount >= r->u.rhlist.limit) {
+	  r->u.rhlist.phase = LIST_END;
+	  return 1;
+	}
 	int ret = rhizome_list_next(&r->u.rhlist.cursor);
 	if (ret == -1)
 	  return -1;
@@ -248,9 +335,14 @@ static int restful_rhizome_bundlelist_json_content_chunk(struct http_request *hr
 	    r->u.rhlist.phase = LIST_END;
 	    return 1;
 	  }
-	  time_ms_t wake_at = now + config.api.restful.newsince_poll_ms;
-	  if (wake_at > r->u.rhlist.end_time)
-	    wake_at = r->u.rhlist.end_time;
+	  // Sleep until a new bundle is stored that this list would show, and then resume the list from
+	  // the last row sent.  If that cannot be arranged, fall back to polling.
+	  time_ms_t wake_at = r->u.rhlist.end_time;
+	  r->newsince.rowid = r->u.rhlist.rowid_highest > r->u.rhlist.cursor.rowid_since ? r->u.rhlist.rowid_highest : r->u.rhlist.cursor.rowid_since;
+	  r->newsince.notify = restful_rhizome_newsince_notify;
+	  r->newsince.context = r;
+	  if (rhizome_bundle_listen(&r->newsince) == -1 && wake_at > now + config.api.restful.newsince_poll_ms)
+	    wake_at = now + config.api.restful.newsince_poll_ms;
 	  http_request_pause_response(&r->http, wake_at);
 	  return 0;
 	}
@@ -304,11 +396,18 @@ static int restful_rhizome_bundlelist_json_content_chunk(struct http_request *hr
 	if (!strbuf_overrun(b)) {
 	  rhizome_list_commit(&r->u.rhlist.cursor);
 	  ++r->u.rhlist.rowcount;
+	  if (r->u.rhlist.rowid_lowest == 0 || m->rowid < r->u.rhlist.rowid_lowest)
+	    r->u.rhlist.rowid_lowest = m->rowid;
 	}
       }
       return 1;
     case LIST_END:
-      strbuf_puts(b, "\n]\n}\n");
+      strbuf_puts(b, "\n]");
+      if (r->u.rhlist.limit && r->u.rhlist.rowcount >= r->u.rhlist.limit && !r->u.rhlist.cursor.rowid_since) {
+	strbuf_puts(b, ",\n\"before_token\":");
+	strbuf_json_string(b, alloca_list_token(r->u.rhlist.rowid_lowest));
+      }
+      strbuf_puts(b, "\n}\n");
       if (!strbuf_overrun(b))
 	r->u.rhlist.phase = LIST_DONE;
       // fall through...
@@ -630,9 +729,10 @@ static int restful_rhizome_insert_end(struct http_request *hr)
   }
   // Finalise the manifest and add it to the store.
   if (r->manifest->filesize) {
-    if (!r->manifest->has_filehash)
+    if (!r->manifest->has_filehash) {
       rhizome_manifest_set_filehash(r->manifest, &r->u.insert.write.id);
-    else
+      rhizome_manifest_set_blockhash(r->manifest, r->u.insert.write.has_block_root ? r->u.insert.write.block_root : NULL);
+    } else
       assert(cmp_rhizome_filehash_t(&r->u.insert.write.id, &r->manifest->filehash) == 0);
   }
   const char *invalid_reason = rhizome_manifest_validate_reason(r->manifest);
@@ -719,7 +819,7 @@ int restful_rhizome_(httpd_request *r, const char *remainder)
     }
   }
   if (handler == NULL)
-    return 404;
+    return restful_rhizome_list(r, remainder);
   if (r->http.verb != HTTP_VERB_GET)
     return 405;
   if ((r->manifest = rhizome_new_manifest()) == NULL)
@@ -860,7 +960,11 @@ int rhizome_payload_content(struct http_request *hr, unsigned char *buf, size_t
   httpd_request *r = (httpd_request *) hr;
   assert(r->u.read_state.length != RHIZOME_SIZE_UNSET);
   assert(r->u.read_state.offset < r->u.read_state.length);
-  uint64_t remain = r->u.read_state.length - r->u.read_state.offset;
+  // Stop at the end of the requested range, not the end of the payload.
+  uint64_t end = r->http.response.header.content_range_start + r->http.response.header.content_length;
+  assert(end <= r->u.read_state.length);
+  assert(r->u.read_state.offset < end);
+  uint64_t remain = end - r->u.read_state.offset;
   size_t readlen = bufsz;
   if (remain <= bufsz)
     readlen = remain;
@@ -872,8 +976,8 @@ int rhizome_payload_content(struct http_request *hr, unsigned char *buf, size_t
       return -1;
     result->generated = (size_t) n;
   }
-  assert(r->u.read_state.offset <= r->u.read_state.length);
-  remain = r->u.read_state.length - r->u.read_state.offset;
+  assert(r->u.read_state.offset <= end);
+  remain = end - r->u.read_state.offset;
   result->need = remain < preferred_bufsz ? remain : preferred_bufsz;
   return remain ? 1 : 0;
 }
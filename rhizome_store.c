@@ -28,12 +28,18 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #    define statvfs statfs
 #  endif
 #endif
+#ifdef HAVE_SYS_MMAN_H
+#  include <sys/mman.h>
+#endif
 #include "serval.h"
 #include "rhizome.h"
 #include "conf.h"
 #include "strlcpy.h"
+#include "dataformats.h"
 
 #define RHIZOME_BUFFER_MAXIMUM_SIZE (1024*1024)
+// how far ahead (or behind, when reading backwards) of a mapped read to ask the kernel to page in
+#define RHIZOME_MAP_READAHEAD (64*1024)
 
 uint64_t rhizome_copy_file_to_blob(int fd, uint64_t id, size_t size);
 
@@ -60,7 +66,7 @@ int rhizome_exists(const rhizome_filehash_t *hashp)
   
   struct stat st;
   if (stat(blob_path, &st) == -1)
-    return 0;
+    return rhizome_chunked_exists(hashp) == 1;
   return 1;
 }
 
@@ -85,8 +91,14 @@ static uint64_t rhizome_create_fileblob(sqlite_retry_state *retry, uint64_t id,
   return rowid;
 }
 
+static void rhizome_unmap_unused(const rhizome_filehash_t *hashp);
+
 static int rhizome_delete_external(const char *id)
 {
+  // don't keep a deleted file's pages alive through an idle memory map
+  rhizome_filehash_t hash;
+  if (str_to_rhizome_filehash_t(&hash, id) == 0)
+    rhizome_unmap_unused(&hash);
   // attempt to remove any external blob
   char blob_path[1024];
   if (!FORMF_RHIZOME_STORE_PATH(blob_path, "%s/%s", RHIZOME_BLOB_SUBDIR, id))
@@ -108,6 +120,11 @@ static int rhizome_delete_file_id_retry(sqlite_retry_state *retry, const char *i
   sqlite3_stmt *statement = sqlite_prepare_bind(retry, "DELETE FROM fileblobs WHERE id = ?", STATIC_TEXT, id, END);
   if (!statement || sqlite_exec_retry(retry, statement) == -1)
     ret = -1;
+  statement = sqlite_prepare_bind(retry, "DELETE FROM blockhashes WHERE id = ?", STATIC_TEXT, id, END);
+  if (!statement || sqlite_exec_retry(retry, statement) == -1)
+    ret = -1;
+  if (rhizome_release_chunks(retry, id) == -1)
+    ret = -1;
   statement = sqlite_prepare_bind(retry, "DELETE FROM files WHERE id = ?", STATIC_TEXT, id, END);
   if (!statement || sqlite_exec_retry(retry, statement) == -1)
     ret = -1;
@@ -222,6 +239,10 @@ static enum rhizome_payload_status store_make_space(uint64_t bytes, struct rhizo
 	    "SELECT 1  "
 	    "FROM FILEBLOBS "
 	    "WHERE FILES.ID = FILEBLOBS.ID "
+	  ") AND NOT EXISTS( "
+	    "SELECT 1 "
+	    "FROM FILECHUNKS "
+	    "WHERE FILECHUNKS.fileid = FILES.ID "
 	  ");", END) == -1LL
   )
     return WHY("Cannot measure database used bytes");
@@ -276,6 +297,7 @@ static enum rhizome_payload_status store_make_space(uint64_t bytes, struct rhizo
     sqlite3_stmt *s = sqlite_prepare_bind(&retry, "DELETE FROM fileblobs WHERE id = ?", STATIC_TEXT, id, END);
     if (s)
       sqlite_exec_retry(&retry, s);
+    rhizome_release_chunks(&retry, id);
     s = sqlite_prepare_bind(&retry, "DELETE FROM files WHERE id = ?", STATIC_TEXT, id, END);
     if (s)
       sqlite_exec_retry(&retry, s);
@@ -308,8 +330,174 @@ int rhizome_store_cleanup(struct rhizome_cleanup_report *report)
   return store_make_space(0, report);
 }
 
+// unique name for a payload that is still being written, even among forked processes
+static uint64_t new_temp_id()
+{
+  static unsigned id=0;
+  return ((uint64_t)getpid()<<16) + id++;
+}
+
+/* Block hashes.  Each RHIZOME_BLOCK_HASH_SIZE block of stored content is hashed on its own, and the
+ * first RHIZOME_BLOCK_HASH_BYTES of each block's SHA-512 digest are kept in the BLOCKHASHES table
+ * under the payload's filehash.  The root in the manifest's "blockhash" field is the start of the
+ * SHA-512 digest of all the block hashes in order, so the (signed) manifest is enough to check a list
+ * of block hashes received from anyone, and then every block against that list.  The filehash
+ * remains the identity of the payload and is still checked once the whole payload is present.
+ */
+
+uint32_t rhizome_block_hash_count(uint64_t length)
+{
+  return (uint32_t)((length + RHIZOME_BLOCK_HASH_SIZE - 1) / RHIZOME_BLOCK_HASH_SIZE);
+}
+
+static void block_hash_final(SHA512_CTX *context, unsigned char hash[RHIZOME_BLOCK_HASH_BYTES])
+{
+  unsigned char digest[SHA512_DIGEST_LENGTH];
+  SHA512_Final(digest, context);
+  memcpy(hash, digest, RHIZOME_BLOCK_HASH_BYTES);
+}
+
+static void block_hash(const unsigned char *data, size_t len, unsigned char hash[RHIZOME_BLOCK_HASH_BYTES])
+{
+  SHA512_CTX context;
+  SHA512_Init(&context);
+  SHA512_Update(&context, data, len);
+  block_hash_final(&context, hash);
+}
+
+void rhizome_block_hash_root(const unsigned char *hashes, uint32_t count, unsigned char root[RHIZOME_BLOCKHASH_BYTES])
+{
+  unsigned char digest[SHA512_DIGEST_LENGTH];
+  SHA512_CTX context;
+  SHA512_Init(&context);
+  SHA512_Update(&context, hashes, (size_t)count * RHIZOME_BLOCK_HASH_BYTES);
+  SHA512_Final(digest, &context);
+  memcpy(root, digest, RHIZOME_BLOCKHASH_BYTES);
+}
+
+/* Read up to count block hashes of a stored payload, starting at block number first.  Returns the
+ * number of hashes read, zero if the payload has no block hashes, or -1 on error.
+ */
+int rhizome_read_block_hashes(const rhizome_filehash_t *hashp, uint32_t first, uint32_t count, unsigned char *hashes)
+{
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
+      "SELECT substr(hashes, ?, ?) FROM BLOCKHASHES WHERE id = ?;",
+      INT64, (int64_t)first * RHIZOME_BLOCK_HASH_BYTES + 1,
+      INT64, (int64_t)count * RHIZOME_BLOCK_HASH_BYTES,
+      RHIZOME_FILEHASH_T, hashp,
+      END);
+  if (!statement)
+    return -1;
+  int ret = 0;
+  int stepcode = sqlite_step_retry(&retry, statement);
+  if (stepcode == SQLITE_ROW) {
+    size_t n = (size_t)sqlite3_column_bytes(statement, 0) / RHIZOME_BLOCK_HASH_BYTES;
+    if (n > count)
+      n = count;
+    if (n)
+      memcpy(hashes, sqlite3_column_blob(statement, 0), n * RHIZOME_BLOCK_HASH_BYTES);
+    ret = (int)n;
+  } else if (!sqlite_code_ok(stepcode))
+    ret = -1;
+  sqlite3_finalize(statement);
+  return ret;
+}
+
+/* Hash each block of the content as it is processed, so that the block hashes can be stored with
+ * the payload, and their root put in its manifest, when the write is finished.  Must be called
+ * before any content has been written.
+ */
+void rhizome_write_hash_blocks(struct rhizome_write *write)
+{
+  assert(write->file_offset == 0);
+  write->block_hashing = 1;
+  SHA512_Init(&write->block_context);
+}
+
+/* Supply the expected hash of every block of the content, so that rhizome_random_write() checks
+ * each block before accepting it, and discards any bad block so that it can be fetched again.
+ * Takes ownership of the hashes (which must have been allocated with malloc(3)) if successful.
+ * Fails if the content is being encrypted as it is written, or if the content processed so far
+ * does not match the hashes.
+ */
+int rhizome_write_expect_block_hashes(struct rhizome_write *write, unsigned char *hashes, uint32_t count)
+{
+  if (   write->crypt
+      || write->file_length == RHIZOME_SIZE_UNSET
+      || count != rhizome_block_hash_count(write->file_length)
+      || write->file_offset % RHIZOME_BLOCK_HASH_SIZE != 0)
+    return -1;
+  uint32_t done = (uint32_t)(write->file_offset / RHIZOME_BLOCK_HASH_SIZE);
+  if (done) {
+    if (!write->block_hashing || write->block_hash_count != done)
+      return -1;
+    if (memcmp(write->block_hashes, hashes, (size_t)done * RHIZOME_BLOCK_HASH_BYTES) != 0)
+      return WHY("Content already received does not match its block hashes");
+  }
+  free(write->block_hashes);
+  write->block_hashes = hashes;
+  write->block_hash_count = write->block_hash_alloc = count;
+  write->block_hashing = 1;
+  write->verify_blocks = 1;
+  return 0;
+}
+
+static int write_end_block(struct rhizome_write *write)
+{
+  if (write->block_hash_count >= write->block_hash_alloc) {
+    uint32_t alloc = write->block_hash_alloc ? write->block_hash_alloc * 2 : 16;
+    if (write->file_length != RHIZOME_SIZE_UNSET && alloc < rhizome_block_hash_count(write->file_length))
+      alloc = rhizome_block_hash_count(write->file_length);
+    unsigned char *hashes = erealloc(write->block_hashes, (size_t)alloc * RHIZOME_BLOCK_HASH_BYTES);
+    if (!hashes)
+      return -1;
+    write->block_hashes = hashes;
+    write->block_hash_alloc = alloc;
+  }
+  block_hash_final(&write->block_context, &write->block_hashes[(size_t)write->block_hash_count * RHIZOME_BLOCK_HASH_BYTES]);
+  write->block_hash_count++;
+  SHA512_Init(&write->block_context);
+  return 0;
+}
+
+// hash content that is about to be processed, ending a block hash at each block boundary
+static int write_hash_blocks(struct rhizome_write *write, const uint8_t *buffer, size_t data_size)
+{
+  uint64_t offset = write->file_offset;
+  while (data_size) {
+    size_t len = RHIZOME_BLOCK_HASH_SIZE - (size_t)(offset % RHIZOME_BLOCK_HASH_SIZE);
+    if (len > data_size)
+      len = data_size;
+    SHA512_Update(&write->block_context, buffer, len);
+    offset += len;
+    buffer += len;
+    data_size -= len;
+    if (offset % RHIZOME_BLOCK_HASH_SIZE == 0 && write_end_block(write) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+static int write_finish_block_hashes(struct rhizome_write *write)
+{
+  if (!write->verify_blocks && write->file_offset % RHIZOME_BLOCK_HASH_SIZE != 0 && write_end_block(write) == -1)
+    return -1;
+  if (write->block_hash_count != rhizome_block_hash_count(write->file_length))
+    return WHYF("Expected %"PRIu32" block hashes, got %"PRIu32,
+		rhizome_block_hash_count(write->file_length), write->block_hash_count);
+  rhizome_block_hash_root(write->block_hashes, write->block_hash_count, write->block_root);
+  write->has_block_root = 1;
+  return 0;
+}
+
 enum rhizome_payload_status rhizome_open_write(struct rhizome_write *write, const rhizome_filehash_t *expectedHashp, uint64_t file_length)
 {
+  free(write->block_hashes);
+  write->block_hashes = NULL;
+  write->block_hash_count = write->block_hash_alloc = 0;
+  write->block_hashing = write->verify_blocks = write->has_block_root = 0;
+
   if (file_length == 0)
     return RHIZOME_PAYLOAD_STATUS_EMPTY;
 
@@ -331,8 +519,7 @@ enum rhizome_payload_status rhizome_open_write(struct rhizome_write *write, cons
       return status;
   }
   
-  static unsigned id=0;
-  write->temp_id = (getpid()<<16) + id++;
+  write->temp_id = new_temp_id();
   
   write->file_length = file_length;
   write->file_offset = 0;
@@ -366,6 +553,11 @@ static int prepare_data(struct rhizome_write *write_state, uint8_t *buffer, size
       return -1;
   }
   
+  // expected block hashes have already been checked by write_verify_blocks()
+  if (write_state->block_hashing && !write_state->verify_blocks
+      && write_hash_blocks(write_state, buffer, data_size) == -1)
+    return -1;
+
   SHA512_Update(&write_state->sha512_context, buffer, data_size);
   write_state->file_offset+=data_size;
   
@@ -397,7 +589,7 @@ static int write_get_lock(struct rhizome_write *write_state)
       DEBUGF("Writing to new blob file %s (fd=%d)", blob_path, write_state->blob_fd);
   }else{
     // use an explicit transaction so we can delay I/O failures until COMMIT so they can be retried.
-    if (sqlite_exec_void_retry(&retry, "BEGIN TRANSACTION;", END) == -1)
+    if (rhizome_db_begin(&retry) == -1)
       return -1;
     if (write_state->blob_rowid == 0){
       write_state->blob_rowid = rhizome_create_fileblob(&retry, write_state->temp_id, write_state->file_length);
@@ -410,7 +602,7 @@ static int write_get_lock(struct rhizome_write *write_state)
   return 0;
 
 fail:
-  sqlite_exec_void_retry(&retry, "ROLLBACK;", END);
+  rhizome_db_rollback(&retry);
   return -1;
 }
 
@@ -461,13 +653,115 @@ static int write_release_lock(struct rhizome_write *write_state)
   if (write_state->sql_blob){
     ret = sqlite_blob_close(write_state->sql_blob);
     sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
-    if (sqlite_exec_void_retry(&retry, "COMMIT;", END) == -1)
+    if (rhizome_db_commit(&retry) == -1)
       ret=-1;
     write_state->sql_blob=NULL;
   }
   return ret;
 }
 
+// Cache data without processing it, split so that no cached buffer spans a block boundary.
+static int write_cache_blocks(struct rhizome_write *write_state, uint64_t offset, uint8_t *buffer, size_t data_size)
+{
+  struct rhizome_write_buffer **ptr = &write_state->buffer_list;
+  // anything before file_offset has already been checked and processed
+  if (offset < write_state->file_offset) {
+    uint64_t delta = write_state->file_offset - offset;
+    if (delta >= data_size)
+      return 0;
+    data_size -= delta;
+    offset += delta;
+    buffer += delta;
+  }
+  while (data_size > 0) {
+    while (*ptr && (*ptr)->offset + (*ptr)->data_size <= offset)
+      ptr = &(*ptr)->_next;
+    // skip over data that we've already received
+    if (*ptr && (*ptr)->offset <= offset) {
+      uint64_t delta = (*ptr)->offset + (*ptr)->data_size - offset;
+      if (delta >= data_size)
+	break;
+      data_size -= delta;
+      offset += delta;
+      buffer += delta;
+      continue;
+    }
+    size_t size = data_size;
+    if (*ptr && offset + size > (*ptr)->offset)
+      size = (*ptr)->offset - offset;
+    size_t boundary = RHIZOME_BLOCK_HASH_SIZE - (size_t)(offset % RHIZOME_BLOCK_HASH_SIZE);
+    if (size > boundary)
+      size = boundary;
+    // anything beyond the limit on cached data will have to be sent again
+    if (write_state->buffer_size + size > RHIZOME_BUFFER_MAXIMUM_SIZE)
+      break;
+    if (config.debug.rhizome_store)
+      DEBUGF("Caching unverified block @%"PRId64", %zu", offset, size);
+    struct rhizome_write_buffer *i = emalloc(size + sizeof(struct rhizome_write_buffer));
+    if (!i)
+      return -1;
+    i->offset = offset;
+    i->buffer_size = i->data_size = size;
+    bcopy(buffer, i->data, size);
+    i->_next = *ptr;
+    *ptr = i;
+    ptr = &i->_next;
+    write_state->buffer_size += size;
+    data_size -= size;
+    offset += size;
+    buffer += size;
+  }
+  return 0;
+}
+
+// Process each complete block of cached data that matches its expected hash, in file order.  A
+// block that does not match is discarded, so it will be missing until it is received again.
+static int write_verify_blocks(struct rhizome_write *write_state)
+{
+  while (write_state->file_offset < write_state->file_length) {
+    uint64_t start = write_state->file_offset;
+    uint64_t end = start + RHIZOME_BLOCK_HASH_SIZE;
+    if (end > write_state->file_length)
+      end = write_state->file_length;
+    uint32_t block = (uint32_t)(start / RHIZOME_BLOCK_HASH_SIZE);
+    assert(block < write_state->block_hash_count);
+    
+    struct rhizome_write_buffer **first = &write_state->buffer_list;
+    while (*first && (*first)->offset < start)
+      first = &(*first)->_next;
+    
+    // is the whole block here yet?
+    SHA512_CTX context;
+    SHA512_Init(&context);
+    uint64_t pos = start;
+    struct rhizome_write_buffer *p;
+    for (p = *first; p && p->offset == pos && pos < end; p = p->_next) {
+      SHA512_Update(&context, p->data, p->data_size);
+      pos += p->data_size;
+    }
+    if (pos < end)
+      break;
+    assert(pos == end);
+    
+    unsigned char hash[RHIZOME_BLOCK_HASH_BYTES];
+    block_hash_final(&context, hash);
+    if (memcmp(hash, &write_state->block_hashes[(size_t)block * RHIZOME_BLOCK_HASH_BYTES], sizeof hash) != 0) {
+      WARNF("Block %"PRIu32" @%"PRIu64" does not match its hash, discarding it", block, start);
+      while (*first != p) {
+	struct rhizome_write_buffer *n = *first;
+	*first = n->_next;
+	write_state->buffer_size -= n->data_size;
+	free(n);
+      }
+      break;
+    }
+    for (p = *first; p && p->offset < end; p = p->_next)
+      if (prepare_data(write_state, p->data, p->data_size) == -1)
+	return -1;
+  }
+  return 0;
+}
+
 // Write data buffers in any order, the data will be cached and streamed into the database in file order. 
 // Though there is an upper bound on the amount of cached data
 int rhizome_random_write(struct rhizome_write *write_state, uint64_t offset, uint8_t *buffer, size_t data_size)
@@ -482,6 +776,15 @@ int rhizome_random_write(struct rhizome_write *write_state, uint64_t offset, uin
       && offset + data_size > write_state->file_length)
     data_size = write_state->file_length - offset;
   
+  if (write_state->verify_blocks) {
+    // hold on to incoming data until each whole block can be checked against its expected hash
+    if (buffer && write_cache_blocks(write_state, offset, buffer, data_size) == -1)
+      return -1;
+    if (write_verify_blocks(write_state) == -1)
+      return -1;
+    data_size = 0;
+  }
+  
   struct rhizome_write_buffer **ptr = &write_state->buffer_list;
   int ret=0;
   int should_write = 0;
@@ -512,15 +815,15 @@ int rhizome_random_write(struct rhizome_write *write_state, uint64_t offset, uin
   while(1){
     
     // can we process this existing data block now?
-    if (*ptr && (*ptr)->offset == write_state->file_offset){
+    if (*ptr && (*ptr)->offset == write_state->file_offset && !write_state->verify_blocks){
       if (prepare_data(write_state, (*ptr)->data, (*ptr)->data_size)){
 	ret=-1;
 	break;
       }
     }
     
-    // if existing data should be written, do so now
-    if (should_write && *ptr && (*ptr)->offset == write_state->written_offset){
+    // if existing data should be written, do so now, but only once it has been processed
+    if (should_write && *ptr && (*ptr)->offset == write_state->written_offset && (*ptr)->offset < write_state->file_offset){
       struct rhizome_write_buffer *n=*ptr;
       if (write_get_lock(write_state)){
 	ret=-1;
@@ -677,8 +980,195 @@ void rhizome_fail_write(struct rhizome_write *write)
     write->buffer_list=n->_next;
     free(n);
   }
+  write->buffer_size = 0;
+  free(write->block_hashes);
+  write->block_hashes = NULL;
+  write->block_hashing = write->verify_blocks = 0;
+}
+
+/* Partial payloads.  A fetch that stops before the whole payload has arrived keeps what it has
+ * received in its temporary blob file, and records the file in the PARTIALS table under the bundle
+ * ID, version and filehash, with the byte ranges of the file that hold content.  A later fetch of
+ * the same payload, from any peer and even after a restart, picks the file up again with
+ * rhizome_resume_write() and carries on where the last one left off.  Only payloads written to
+ * external files are kept, as smaller payloads are quick to fetch again.  The cleanup task
+ * discards partial payloads that have not been resumed for rhizome.partial_max_age_ms.
+ */
+
+// append a range to a list of ranges in file order, merging it with the last one if they touch
+static unsigned partial_add_range(unsigned char *ranges, unsigned count, uint64_t start, uint64_t end)
+{
+  if (count && read_uint64(&ranges[(count - 1) * 16 + 8]) >= start) {
+    if (read_uint64(&ranges[(count - 1) * 16 + 8]) < end)
+      write_uint64(&ranges[(count - 1) * 16 + 8], end);
+    return count;
+  }
+  write_uint64(&ranges[count * 16], start);
+  write_uint64(&ranges[count * 16 + 8], end);
+  return count + 1;
+}
+
+/* Stop writing a payload that has not all arrived, keeping what has, so that it can be resumed.
+ * Falls back to rhizome_fail_write() if the payload cannot be kept.
+ */
+void rhizome_suspend_write(struct rhizome_write *write_state, const rhizome_bid_t *bidp, uint64_t version)
+{
+  if (   !config.rhizome.resume_fetches
+      || !write_state->id_known
+      || write_state->crypt
+      || write_state->blob_fd == -1
+      || write_state->file_length == RHIZOME_SIZE_UNSET
+      || write_state->written_offset + write_state->buffer_size == 0) {
+    rhizome_fail_write(write_state);
+    return;
+  }
+  unsigned count = 0;
+  struct rhizome_write_buffer *p;
+  for (p = write_state->buffer_list; p; p = p->_next)
+    count++;
+  unsigned char *ranges = emalloc((count + 1) * 16);
+  if (!ranges) {
+    rhizome_fail_write(write_state);
+    return;
+  }
+  count = 0;
+  if (write_state->written_offset)
+    count = partial_add_range(ranges, count, 0, write_state->written_offset);
+  // the buffered content after the first gap goes into the file too, where it belongs
+  for (p = write_state->buffer_list; p; p = p->_next) {
+    if (   lseek64(write_state->blob_fd, (off64_t) p->offset, SEEK_SET) == -1
+	|| write(write_state->blob_fd, p->data, p->data_size) != (ssize_t) p->data_size) {
+      WHYF_perror("write(%d) @%"PRIu64, write_state->blob_fd, p->offset);
+      break;
+    }
+    count = partial_add_range(ranges, count, p->offset, p->offset + p->data_size);
+  }
+  time_ms_t now = gettime_ms();
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  int ret = count ? sqlite_exec_void_retry(&retry,
+      "INSERT OR REPLACE INTO PARTIALS(bid, version, filehash, temp_id, length, ranges, updated) VALUES(?,?,?,?,?,?,?);",
+      RHIZOME_BID_T, bidp,
+      INT64, (int64_t)version,
+      RHIZOME_FILEHASH_T, &write_state->id,
+      INT64, (int64_t)write_state->temp_id,
+      INT64, (int64_t)write_state->file_length,
+      STATIC_BLOB, ranges, (int)(count * 16),
+      INT64, now,
+      END) : -1;
+  free(ranges);
+  if (ret == -1) {
+    rhizome_fail_write(write_state);
+    return;
+  }
+  if (config.debug.rhizome_store)
+    DEBUGF("Kept %u ranges of partial payload %s in %"PRIu64" to resume later",
+	   count, alloca_tohex_rhizome_filehash_t(write_state->id), write_state->temp_id);
+  close(write_state->blob_fd);
+  write_state->blob_fd = -1;
+  while(write_state->buffer_list){
+    struct rhizome_write_buffer *n=write_state->buffer_list;
+    write_state->buffer_list=n->_next;
+    free(n);
+  }
+  write_state->buffer_size = 0;
+  free(write_state->block_hashes);
+  write_state->block_hashes = NULL;
+  write_state->block_hashing = write_state->verify_blocks = 0;
+}
+
+/* Pick up the content of a partial payload kept by rhizome_suspend_write(), if there is one, for a
+ * write just opened with the payload's hash (and set up for block hashing if it is wanted).  The
+ * content from the start of the payload is processed again, so the write carries on from the end of
+ * it, and the content beyond the first gap is cached as if it had just been received.  Returns the
+ * new write position, which is zero if there was nothing to resume.
+ */
+uint64_t rhizome_resume_write(struct rhizome_write *write, const rhizome_bid_t *bidp, uint64_t version)
+{
+  if (   !config.rhizome.resume_fetches
+      || !write->id_known
+      || write->crypt
+      || write->file_offset != 0
+      || write->file_length == RHIZOME_SIZE_UNSET
+      || write->file_length <= config.rhizome.max_blob_size)
+    return 0;
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
+      "SELECT temp_id, length, ranges FROM PARTIALS WHERE bid = ? AND version = ? AND filehash = ?;",
+      RHIZOME_BID_T, bidp,
+      INT64, (int64_t)version,
+      RHIZOME_FILEHASH_T, &write->id,
+      END);
+  if (!statement)
+    return 0;
+  if (sqlite_step_retry(&retry, statement) != SQLITE_ROW) {
+    sqlite3_finalize(statement);
+    return 0;
+  }
+  uint64_t temp_id = (uint64_t)sqlite3_column_int64(statement, 0);
+  uint64_t length = (uint64_t)sqlite3_column_int64(statement, 1);
+  unsigned count = (unsigned)sqlite3_column_bytes(statement, 2) / 16;
+  unsigned char *ranges = count ? emalloc(count * 16) : NULL;
+  if (ranges)
+    memcpy(ranges, sqlite3_column_blob(statement, 2), count * 16);
+  sqlite3_finalize(statement);
+  // the file is ours now, whether or not it can be used
+  sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "DELETE FROM PARTIALS WHERE temp_id = ?;", INT64, (int64_t)temp_id, END);
+  
+  char old_path[1024];
+  char blob_path[1024];
+  if (   !FORMF_RHIZOME_STORE_PATH(old_path, "%s/%"PRIu64, RHIZOME_BLOB_SUBDIR, temp_id)
+      || !FORMF_RHIZOME_STORE_PATH(blob_path, "%s/%"PRIu64, RHIZOME_BLOB_SUBDIR, write->temp_id)) {
+    free(ranges);
+    return 0;
+  }
+  if (   length != write->file_length
+      || !ranges
+      || read_uint64(&ranges[0]) != 0
+      || rename(old_path, blob_path) == -1
+      || (write->blob_fd = open(blob_path, O_RDWR)) == -1) {
+    if (config.debug.rhizome_store)
+      DEBUGF("Discarding partial payload %s in %s", alloca_tohex_rhizome_filehash_t(write->id), old_path);
+    unlink(old_path);
+    unlink(blob_path);
+    free(ranges);
+    return 0;
+  }
+  
+  unsigned char buffer[RHIZOME_CRYPT_PAGE_SIZE];
+  unsigned i;
+  for (i = 0; i < count; i++) {
+    uint64_t offset = read_uint64(&ranges[i * 16]);
+    uint64_t end = read_uint64(&ranges[i * 16 + 8]);
+    if (end > write->file_length)
+      end = write->file_length;
+    if (lseek64(write->blob_fd, (off64_t) offset, SEEK_SET) == -1)
+      break;
+    while (offset < end) {
+      size_t len = end - offset < sizeof buffer ? (size_t)(end - offset) : sizeof buffer;
+      ssize_t r = read(write->blob_fd, buffer, len);
+      if (r <= 0)
+	break;
+      if (i == 0) {
+	// already in the file, so only needs processing again
+	if (prepare_data(write, buffer, (size_t) r) == -1)
+	  break;
+	write->written_offset = write->file_offset;
+      } else if (rhizome_random_write(write, offset, buffer, (size_t) r) == -1)
+	break;
+      offset += (uint64_t) r;
+    }
+    if (offset < end)
+      break;
+  }
+  free(ranges);
+  if (config.debug.rhizome_store)
+    DEBUGF("Resumed partial payload %s at %"PRIu64" of %"PRIu64", with %zu bytes cached beyond",
+	   alloca_tohex_rhizome_filehash_t(write->id), write->file_offset, write->file_length, write->buffer_size);
+  return write->file_offset;
 }
 
+static enum rhizome_payload_status write_commit(struct rhizome_write *write);
+
 enum rhizome_payload_status rhizome_finish_write(struct rhizome_write *write)
 {
   enum rhizome_payload_status status = RHIZOME_PAYLOAD_STATUS_NEW;
@@ -737,19 +1227,38 @@ enum rhizome_payload_status rhizome_finish_write(struct rhizome_write *write)
   } else
     write->id = hash_out;
 
+  if (write->block_hashing && write_finish_block_hashes(write) == -1) {
+    status = RHIZOME_PAYLOAD_STATUS_ERROR;
+    goto failure;
+  }
+
+  return write_commit(write);
+
+failure:
+  rhizome_fail_write(write);
+  return status;
+}
+
+/* Move a completely written and hashed payload into its final place in the store, under its hash.
+ */
+static enum rhizome_payload_status write_commit(struct rhizome_write *write)
+{
+  enum rhizome_payload_status status = RHIZOME_PAYLOAD_STATUS_NEW;
   char blob_path[1024];
   if (!FORMF_RHIZOME_STORE_PATH(blob_path, "%s/%"PRIu64, RHIZOME_BLOB_SUBDIR, write->temp_id)) {
     WHYF("Failed to generate external blob path");
     status = RHIZOME_PAYLOAD_STATUS_ERROR;
     goto failure;
   }
+  // Large payloads go into the chunk store, if it is enabled, instead of being kept whole.
+  int chunk = rhizome_chunk_payloads() && write->file_length >= RHIZOME_CHUNK_MIN_PAYLOAD;
   // If the payload was written into an external blob (file) but is small enough to fit into a
   // SQLite blob, then copy it into a proper blob (this occurs if rhizome_open_write() was called
   // with file_length == RHIZOME_SIZE_UNSET) and max_blob_size > RHIZOME_BUFFER_MAXIMUM_SIZE.
   int external = 0;
   if (write->blob_fd != -1) {
     external = 1;
-    if (write->file_length <= config.rhizome.max_blob_size) {
+    if (!chunk && write->file_length <= config.rhizome.max_blob_size) {
       if (config.debug.rhizome_store)
 	DEBUGF("Copying %zu bytes from external file %s into blob, id=%"PRIu64, (size_t)write->file_offset, blob_path, write->temp_id);
       int ret = 0;
@@ -765,10 +1274,13 @@ enum rhizome_payload_status rhizome_finish_write(struct rhizome_write *write)
 	  WARNF_perror("unlink(%s)", alloca_str_toprint(blob_path));
       }
     }
-    if (config.debug.rhizome_store)
-      DEBUGF("Closing fd=%d", write->blob_fd);
-    close(write->blob_fd);
-    write->blob_fd = -1;
+    // keep the file open if it is about to be cut into chunks
+    if (!chunk) {
+      if (config.debug.rhizome_store)
+	DEBUGF("Closing fd=%d", write->blob_fd);
+      close(write->blob_fd);
+      write->blob_fd = -1;
+    }
   }
   if (write_release_lock(write)) {
     status = RHIZOME_PAYLOAD_STATUS_ERROR;
@@ -790,7 +1302,7 @@ enum rhizome_payload_status rhizome_finish_write(struct rhizome_write *write)
     if (config.debug.rhizome_store)
       DEBUGF("Payload id=%s already present, removed id='%"PRIu64"'", alloca_tohex_rhizome_filehash_t(write->id), write->temp_id);
   }else{
-    if (sqlite_exec_void_retry(&retry, "BEGIN TRANSACTION;", END) == -1)
+    if (rhizome_db_begin(&retry) == -1)
       goto dbfailure;
 
     time_ms_t now = gettime_ms();
@@ -807,7 +1319,14 @@ enum rhizome_payload_status rhizome_finish_write(struct rhizome_write *write)
       )
       goto dbfailure;
 
-    if (external) {
+    if (chunk) {
+      struct rhizome_chunk_stats stats;
+      if (rhizome_store_chunks(&retry, &write->id, write->file_length, write->blob_fd, write->blob_rowid, &stats) == -1)
+	goto dbfailure;
+      if (write->blob_rowid && sqlite_exec_void_retry(&retry, "DELETE FROM FILEBLOBS WHERE rowid = ?;",
+	    INT64, write->blob_rowid, END) == -1)
+	goto dbfailure;
+    }else if (external) {
       char dest_path[1024];
       if (!FORMF_RHIZOME_STORE_PATH(dest_path, "%s/%s", RHIZOME_BLOB_SUBDIR, alloca_tohex_rhizome_filehash_t(write->id)))
 	goto dbfailure;
@@ -828,16 +1347,32 @@ enum rhizome_payload_status rhizome_finish_write(struct rhizome_write *write)
 	)
 	  goto dbfailure;
     }
-    if (sqlite_exec_void_retry(&retry, "COMMIT;", END) == -1)
+    if (rhizome_db_commit(&retry) == -1)
       goto dbfailure;
+    if (chunk && external && unlink(blob_path) == -1)
+      WARNF_perror("unlink(%s)", alloca_str_toprint(blob_path));
     if (config.debug.rhizome_store)
       DEBUGF("Stored file %s", alloca_tohex_rhizome_filehash_t(write->id));
   }
+  if (write->blob_fd != -1) {
+    close(write->blob_fd);
+    write->blob_fd = -1;
+  }
   write->blob_rowid = 0;
+  if (write->has_block_root) {
+    // not fatal; the payload can still be verified as a whole
+    sqlite_exec_void_retry_loglevel(LOG_LEVEL_WARN, &retry,
+	"INSERT OR REPLACE INTO BLOCKHASHES(id,hashes) VALUES(?,?);",
+	RHIZOME_FILEHASH_T, &write->id,
+	STATIC_BLOB, write->block_hashes, (int)(write->block_hash_count * RHIZOME_BLOCK_HASH_BYTES),
+	END);
+  }
+  free(write->block_hashes);
+  write->block_hashes = NULL;
   return status;
 
 dbfailure:
-  sqlite_exec_void_retry(&retry, "ROLLBACK;", END);
+  rhizome_db_rollback(&retry);
   status = RHIZOME_PAYLOAD_STATUS_ERROR;
 failure:
   rhizome_fail_write(write);
@@ -863,6 +1398,8 @@ enum rhizome_payload_status rhizome_import_payload_from_file(rhizome_manifest *m
   enum rhizome_payload_status status = rhizome_open_write(&write, &m->filehash, m->filesize);
   if (status != RHIZOME_PAYLOAD_STATUS_NEW)
     return status;
+  if (m->has_blockhash && !m->is_journal)
+    rhizome_write_hash_blocks(&write);
   
   // file payload is not in the store yet
   if (rhizome_write_file(&write, filepath)){
@@ -892,6 +1429,8 @@ enum rhizome_payload_status rhizome_import_buffer(rhizome_manifest *m, uint8_t *
   enum rhizome_payload_status status = rhizome_open_write(&write, &m->filehash, m->filesize);
   if (status != RHIZOME_PAYLOAD_STATUS_NEW)
     return status;
+  if (m->has_blockhash && !m->is_journal)
+    rhizome_write_hash_blocks(&write);
   
   // file payload is not in the store yet
   if (rhizome_write_buffer(&write, buffer, length)){
@@ -963,6 +1502,8 @@ enum rhizome_payload_status rhizome_write_open_manifest(struct rhizome_write *wr
 	);
   if (status == RHIZOME_PAYLOAD_STATUS_NEW)
     status = rhizome_write_derive_key(m, write);
+  if (status == RHIZOME_PAYLOAD_STATUS_NEW && !m->is_journal && (m->has_blockhash || config.rhizome.block_hashes))
+    rhizome_write_hash_blocks(write);
   return status;
 }
 
@@ -1005,8 +1546,10 @@ enum rhizome_payload_status rhizome_store_payload_file(rhizome_manifest *m, cons
       assert(m->filesize == write.file_length);
       if (m->has_filehash)
 	assert(cmp_rhizome_filehash_t(&m->filehash, &write.id) == 0);
-      else
+      else {
 	rhizome_manifest_set_filehash(m, &write.id);
+	rhizome_manifest_set_blockhash(m, write.has_block_root ? write.block_root : NULL);
+      }
       return status;
     case RHIZOME_PAYLOAD_STATUS_ERROR:
     case RHIZOME_PAYLOAD_STATUS_STORED:
@@ -1020,6 +1563,247 @@ enum rhizome_payload_status rhizome_store_payload_file(rhizome_manifest *m, cons
   FATALF("rhizome_finish_write() returned status = %d", status);
 }
 
+/* Encrypt, hash and write a payload file into a new temporary external blob file, without touching
+ * the database, so that this may be done by a forked worker process.  The manifest's filesize must
+ * already be set and its payload key already derived.  Returns RHIZOME_PAYLOAD_STATUS_NEW and the
+ * temporary file's id and payload hash if successful; the parent process must then hand both to
+ * rhizome_store_prepared_payload().
+ */
+enum rhizome_payload_status rhizome_prepare_payload_file(rhizome_manifest *m, const char *filepath, uint64_t *temp_idp, rhizome_filehash_t *hashp)
+{
+  assert(m->filesize != RHIZOME_SIZE_UNSET);
+  if (m->filesize == 0)
+    return RHIZOME_PAYLOAD_STATUS_EMPTY;
+  struct rhizome_write write;
+  bzero(&write, sizeof write);
+  write.blob_fd = -1;
+  write.temp_id = new_temp_id();
+  write.file_length = m->filesize;
+  SHA512_Init(&write.sha512_context);
+  enum rhizome_payload_status status = rhizome_write_derive_key(m, &write);
+  if (status != RHIZOME_PAYLOAD_STATUS_NEW)
+    return status;
+  char blob_path[1024];
+  if (!FORMF_RHIZOME_STORE_PATH(blob_path, "%s/%"PRIu64, RHIZOME_BLOB_SUBDIR, write.temp_id))
+    return RHIZOME_PAYLOAD_STATUS_ERROR;
+  if ((write.blob_fd = open(blob_path, O_CREAT | O_TRUNC | O_RDWR, 0664)) == -1) {
+    WHYF_perror("open(%s,O_CREAT|O_TRUNC|O_RDWR)", alloca_str_toprint(blob_path));
+    return RHIZOME_PAYLOAD_STATUS_ERROR;
+  }
+  // with an external blob file open, writing never needs a database lock
+  if (rhizome_write_file(&write, filepath) == -1 || write.buffer_list || write.file_offset != write.file_length)
+    status = RHIZOME_PAYLOAD_STATUS_ERROR;
+  SHA512_Final(hashp->binary, &write.sha512_context);
+  SHA512_End(&write.sha512_context, NULL);
+  if (status != RHIZOME_PAYLOAD_STATUS_NEW) {
+    rhizome_fail_write(&write);
+    return status;
+  }
+  close(write.blob_fd);
+  *temp_idp = write.temp_id;
+  return status;
+}
+
+/* Store a payload that was prepared by rhizome_prepare_payload_file(), possibly in another process,
+ * under its hash.  The temporary file is removed whether or not this succeeds.
+ */
+enum rhizome_payload_status rhizome_store_prepared_payload(rhizome_manifest *m, uint64_t temp_id, const rhizome_filehash_t *hashp)
+{
+  struct rhizome_write write;
+  bzero(&write, sizeof write);
+  write.temp_id = temp_id;
+  write.file_length = write.file_offset = write.written_offset = m->filesize;
+  write.id = *hashp;
+  write.id_known = 1;
+  char blob_path[1024];
+  if (!FORMF_RHIZOME_STORE_PATH(blob_path, "%s/%"PRIu64, RHIZOME_BLOB_SUBDIR, temp_id))
+    return RHIZOME_PAYLOAD_STATUS_ERROR;
+  if ((write.blob_fd = open(blob_path, O_RDWR)) == -1) {
+    WHYF_perror("open(%s,O_RDWR)", alloca_str_toprint(blob_path));
+    return RHIZOME_PAYLOAD_STATUS_ERROR;
+  }
+  enum rhizome_payload_status status = store_make_space(m->filesize, NULL);
+  if (status != RHIZOME_PAYLOAD_STATUS_NEW) {
+    rhizome_fail_write(&write);
+    return status;
+  }
+  return write_commit(&write);
+}
+
+/* External payload files never change once they have been stored under their hash, so a single
+ * read-only memory map of each file can be shared by every reader of that payload.  Maps that are no
+ * longer referenced are kept in most-recently-used order so that re-opening a payload (eg, scanning a
+ * MeshMS ply again) costs nothing, and are unmapped, least recently used first, whenever the total
+ * mapped size would exceed config.rhizome.max_mapped_bytes.  If a map cannot be made within that
+ * bound, the reader falls back to lseek(2) and read(2).
+ */
+struct rhizome_mapping {
+  struct rhizome_mapping *_next;
+  struct rhizome_mapping *_prev;
+  rhizome_filehash_t id;
+  unsigned char *addr;
+  size_t length;
+  unsigned refcount;
+};
+
+static struct rhizome_mapping *mappings_head = NULL; // most recently used
+static struct rhizome_mapping *mappings_tail = NULL; // least recently used
+static uint64_t mapped_bytes = 0;
+
+static void mapping_unlink(struct rhizome_mapping *map)
+{
+  if (map->_prev)
+    map->_prev->_next = map->_next;
+  else
+    mappings_head = map->_next;
+  if (map->_next)
+    map->_next->_prev = map->_prev;
+  else
+    mappings_tail = map->_prev;
+  map->_next = map->_prev = NULL;
+}
+
+static void mapping_push_head(struct rhizome_mapping *map)
+{
+  map->_prev = NULL;
+  map->_next = mappings_head;
+  if (mappings_head)
+    mappings_head->_prev = map;
+  else
+    mappings_tail = map;
+  mappings_head = map;
+}
+
+static void mapping_free(struct rhizome_mapping *map)
+{
+  assert(map->refcount == 0);
+  mapping_unlink(map);
+#ifdef HAVE_SYS_MMAN_H
+  if (munmap(map->addr, map->length) == -1)
+    WARNF_perror("munmap(%p,%zu)", map->addr, map->length);
+#endif
+  assert(mapped_bytes >= map->length);
+  mapped_bytes -= map->length;
+  if (config.debug.rhizome_store)
+    DEBUGF("Unmapped payload %s, %"PRIu64" bytes remain mapped", alloca_tohex_rhizome_filehash_t(map->id), mapped_bytes);
+  free(map);
+}
+
+// unmap unreferenced maps, least recently used first, until there is room for another 'length' bytes
+static void mapping_make_room(uint64_t length)
+{
+  struct rhizome_mapping *map = mappings_tail;
+  while (map && mapped_bytes + length > config.rhizome.max_mapped_bytes) {
+    struct rhizome_mapping *prev = map->_prev;
+    if (map->refcount == 0)
+      mapping_free(map);
+    map = prev;
+  }
+}
+
+static void rhizome_unmap_unused(const rhizome_filehash_t *hashp)
+{
+  struct rhizome_mapping *map;
+  for (map = mappings_head; map; map = map->_next) {
+    if (cmp_rhizome_filehash_t(&map->id, hashp) == 0) {
+      if (map->refcount == 0)
+	mapping_free(map);
+      return;
+    }
+  }
+}
+
+/* Return a shared map of the whole of the given external payload file, or NULL if it cannot or should
+ * not be mapped.
+ */
+static struct rhizome_mapping *rhizome_map(const rhizome_filehash_t *hashp, int fd, uint64_t length)
+{
+#ifdef HAVE_SYS_MMAN_H
+  struct rhizome_mapping *map;
+  for (map = mappings_head; map; map = map->_next) {
+    if (cmp_rhizome_filehash_t(&map->id, hashp) == 0 && map->length == length) {
+      map->refcount++;
+      mapping_unlink(map);
+      mapping_push_head(map);
+      return map;
+    }
+  }
+  if (length == 0 || length > SIZE_MAX || length > config.rhizome.max_mapped_bytes)
+    return NULL;
+  mapping_make_room(length);
+  if (mapped_bytes + length > config.rhizome.max_mapped_bytes) {
+    if (config.debug.rhizome_store)
+      DEBUGF("Not mapping payload %s, %"PRIu64" bytes already mapped", alloca_tohex_rhizome_filehash_t(*hashp), mapped_bytes);
+    return NULL;
+  }
+  void *addr = mmap(NULL, (size_t)length, PROT_READ, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) {
+    WARNF_perror("mmap(NULL,%"PRIu64",PROT_READ,MAP_SHARED,%d,0)", length, fd);
+    return NULL;
+  }
+  // we issue our own read-ahead hints in the direction each reader is going, so stop the kernel
+  // guessing (MeshMS plies are read from the end backwards)
+  if (madvise(addr, (size_t)length, MADV_RANDOM) == -1)
+    WARNF_perror("madvise(%p,%"PRIu64",MADV_RANDOM)", addr, length);
+  if ((map = emalloc_zero(sizeof(struct rhizome_mapping))) == NULL) {
+    munmap(addr, (size_t)length);
+    return NULL;
+  }
+  map->id = *hashp;
+  map->addr = addr;
+  map->length = (size_t)length;
+  map->refcount = 1;
+  mapping_push_head(map);
+  mapped_bytes += length;
+  if (config.debug.rhizome_store)
+    DEBUGF("Mapped payload %s, %"PRIu64" bytes at %p, %"PRIu64" bytes mapped", alloca_tohex_rhizome_filehash_t(*hashp), length, addr, mapped_bytes);
+  return map;
+#else
+  return NULL;
+#endif
+}
+
+static void rhizome_unmap(struct rhizome_mapping *map)
+{
+  assert(map->refcount > 0);
+  if (--map->refcount == 0)
+    mapping_make_room(0);
+}
+
+// unmap everything not currently being read
+static void rhizome_unmap_all_unused()
+{
+  struct rhizome_mapping *map = mappings_head;
+  while (map) {
+    struct rhizome_mapping *next = map->_next;
+    if (map->refcount == 0)
+      mapping_free(map);
+    map = next;
+  }
+}
+
+/* Before copying [offset, offset+len) out of a map, ask the kernel to page in the next window
+ * of the file in the direction that this reader is moving, unless we already have.
+ */
+static void read_advise(struct rhizome_read *read_state, size_t len)
+{
+#ifdef HAVE_SYS_MMAN_H
+  uint64_t start = read_state->offset;
+  uint64_t end = read_state->offset + len;
+  if (start >= read_state->advise_start && end <= read_state->advise_end)
+    return;
+  if (end <= read_state->advise_start)
+    start = end > RHIZOME_MAP_READAHEAD ? end - RHIZOME_MAP_READAHEAD : 0;
+  else if ((end = start + RHIZOME_MAP_READAHEAD) > read_state->length)
+    end = read_state->length;
+  start &= ~((uint64_t)sysconf(_SC_PAGESIZE) - 1);
+  if (madvise(read_state->mapping->addr + start, (size_t)(end - start), MADV_WILLNEED) == -1)
+    WARNF_perror("madvise(%p,%"PRIu64",MADV_WILLNEED)", read_state->mapping->addr + start, end - start);
+  read_state->advise_start = start;
+  read_state->advise_end = end;
+#endif
+}
+
 /* Return RHIZOME_PAYLOAD_STATUS_STORED if file blob found, RHIZOME_PAYLOAD_STATUS_NEW if not found.
  */
 enum rhizome_payload_status rhizome_open_read(struct rhizome_read *read, const rhizome_filehash_t *hashp)
@@ -1027,9 +1811,21 @@ enum rhizome_payload_status rhizome_open_read(struct rhizome_read *read, const r
   read->id = *hashp;
   read->blob_rowid = 0;
   read->blob_fd = -1;
+  read->mapping = NULL;
+  read->advise_start = 0;
+  read->advise_end = 0;
   read->verified = 0;
   read->offset = 0;
   read->hash_offset = 0;
+  read->block_hashes_loaded = 0;
+  read->block_hashes = NULL;
+  read->block_hash_count = 0;
+  read->blocks_verified = NULL;
+  read->chunked = 0;
+  read->chunk_offset = 0;
+  read->chunk_length = 0;
+  read->chunk_rowid = 0;
+  read->chunk_data = NULL;
   
   if (sqlite_exec_uint64(&read->length,"SELECT length FROM FILES WHERE id = ?", 
     RHIZOME_FILEHASH_T, &read->id, END) == -1)
@@ -1049,6 +1845,17 @@ enum rhizome_payload_status rhizome_open_read(struct rhizome_read *read, const r
     read->blob_fd = open(blob_path, O_RDONLY);
     if (read->blob_fd == -1) {
       if (errno == ENOENT) {
+	// nor an external file, so it may be in the chunk store
+	int chunked = rhizome_chunked_exists(&read->id);
+	if (chunked == -1)
+	  return RHIZOME_PAYLOAD_STATUS_ERROR;
+	if (chunked) {
+	  if (config.debug.rhizome_store)
+	    DEBUGF("Opened chunked file %s, len %"PRIx64, alloca_tohex_rhizome_filehash_t(read->id), read->length);
+	  read->chunked = 1;
+	  SHA512_Init(&read->sha512_context);
+	  return RHIZOME_PAYLOAD_STATUS_STORED;
+	}
 	if (config.debug.rhizome_store)
 	  DEBUGF("Stored file does not exist: %s", blob_path);
 	// make sure we remove an orphan file row
@@ -1069,6 +1876,13 @@ enum rhizome_payload_status rhizome_open_read(struct rhizome_read *read, const r
     }
     if (config.debug.rhizome_store)
       DEBUGF("Opened stored file %s as fd %d, len %"PRIx64, blob_path, read->blob_fd, read->length);
+    // If we can map the whole file, we no longer need the file descriptor.
+    if ((read->mapping = rhizome_map(&read->id, read->blob_fd, read->length)) != NULL) {
+      if (config.debug.rhizome_store)
+	DEBUGF("Closing fd %d, reading %s through memory map", read->blob_fd, blob_path);
+      close(read->blob_fd);
+      read->blob_fd = -1;
+    }
   }
   SHA512_Init(&read->sha512_context);
   return RHIZOME_PAYLOAD_STATUS_STORED;
@@ -1077,6 +1891,18 @@ enum rhizome_payload_status rhizome_open_read(struct rhizome_read *read, const r
 static ssize_t rhizome_read_retry(sqlite_retry_state *retry, struct rhizome_read *read_state, unsigned char *buffer, size_t bufsz)
 {
   IN();
+  if (read_state->mapping) {
+    if (buffer == NULL || bufsz == 0 || read_state->offset >= read_state->length)
+      RETURN(0);
+    size_t bytes_read = (size_t)(read_state->length - read_state->offset);
+    if (bytes_read > bufsz)
+      bytes_read = bufsz;
+    read_advise(read_state, bytes_read);
+    bcopy(read_state->mapping->addr + read_state->offset, buffer, bytes_read);
+    if (config.debug.rhizome_store)
+      DEBUGF("Read %zu bytes from map %p @%"PRIx64, bytes_read, read_state->mapping->addr, read_state->offset);
+    RETURN(bytes_read);
+  }
   if (read_state->blob_fd != -1) {
     if (lseek64(read_state->blob_fd, (off64_t) read_state->offset, SEEK_SET) == -1)
       RETURN(WHYF_perror("lseek64(%d,%"PRIu64",SEEK_SET)", read_state->blob_fd, read_state->offset));
@@ -1089,6 +1915,8 @@ static ssize_t rhizome_read_retry(sqlite_retry_state *retry, struct rhizome_read
       DEBUGF("Read %zu bytes from fd=%d @%"PRIx64, (size_t) rd, read_state->blob_fd, read_state->offset);
     RETURN(rd);
   }
+  if (read_state->chunked)
+    RETURN(rhizome_read_chunks(retry, read_state, buffer, bufsz));
   if (read_state->blob_rowid == 0)
     RETURN(WHY("blob not created"));
   sqlite3_blob *blob = NULL;
@@ -1119,8 +1947,64 @@ static ssize_t rhizome_read_retry(sqlite_retry_state *retry, struct rhizome_read
   OUT();
 }
 
+/* Check each block touched by an out of order read against the payload's block hashes, if it has
+ * any.  Blocks only partly covered by the read are read again in full.  Each block is only checked
+ * once per reader.
+ */
+static int read_verify_blocks(sqlite_retry_state *retry, struct rhizome_read *read_state, const unsigned char *buffer, size_t len)
+{
+  if (!read_state->block_hashes_loaded) {
+    read_state->block_hashes_loaded = 1;
+    uint32_t count = rhizome_block_hash_count(read_state->length);
+    unsigned char *hashes = emalloc((size_t)count * RHIZOME_BLOCK_HASH_BYTES);
+    unsigned char *verified = emalloc_zero((count + 7) / 8);
+    if (hashes && verified && rhizome_read_block_hashes(&read_state->id, 0, count, hashes) == (int)count) {
+      read_state->block_hashes = hashes;
+      read_state->block_hash_count = count;
+      read_state->blocks_verified = verified;
+    } else {
+      free(hashes);
+      free(verified);
+    }
+  }
+  if (!read_state->block_hashes)
+    return 0;
+  uint64_t offset = read_state->offset;
+  uint32_t block;
+  for (block = (uint32_t)(offset / RHIZOME_BLOCK_HASH_SIZE); (uint64_t)block * RHIZOME_BLOCK_HASH_SIZE < offset + len; ++block) {
+    if (read_state->blocks_verified[block >> 3] & (1 << (block & 7)))
+      continue;
+    uint64_t start = (uint64_t)block * RHIZOME_BLOCK_HASH_SIZE;
+    size_t size = RHIZOME_BLOCK_HASH_SIZE;
+    if (start + size > read_state->length)
+      size = (size_t)(read_state->length - start);
+    unsigned char page[RHIZOME_BLOCK_HASH_SIZE];
+    const unsigned char *data = page;
+    if (start >= offset && start + size <= offset + len)
+      data = buffer + (start - offset);
+    else {
+      read_state->offset = start;
+      ssize_t r = rhizome_read_retry(retry, read_state, page, size);
+      read_state->offset = offset;
+      if (r == -1)
+	return -1;
+      if ((size_t) r != size)
+	return WHYF("Short read of block %"PRIu32", expected %zu bytes, got %zu", block, size, (size_t) r);
+    }
+    unsigned char hash[RHIZOME_BLOCK_HASH_BYTES];
+    block_hash(data, size, hash);
+    if (memcmp(hash, &read_state->block_hashes[(size_t)block * RHIZOME_BLOCK_HASH_BYTES], sizeof hash) != 0) {
+      read_state->verified = -1;
+      return WHYF("Block %"PRIu32" of payload %s does not match its hash", block, alloca_tohex_rhizome_filehash_t(read_state->id));
+    }
+    read_state->blocks_verified[block >> 3] |= 1 << (block & 7);
+  }
+  return 0;
+}
+
 /* Read content from the store, hashing and decrypting as we go. 
- Random access is supported, but hashing requires all payload contents to be read sequentially. */
+ Random access is supported, but hashing requires all payload contents to be read sequentially.
+ Out of order reads are checked against the payload's block hashes instead, if it has any. */
 // returns the number of bytes read
 ssize_t rhizome_read(struct rhizome_read *read_state, unsigned char *buffer, size_t buffer_length)
 {
@@ -1135,6 +2019,12 @@ ssize_t rhizome_read(struct rhizome_read *read_state, unsigned char *buffer, siz
     RETURN(-1);
   size_t bytes_read = (size_t) n;
 
+  if (   read_state->hash_offset != read_state->offset
+      && read_state->verified != 1
+      && buffer && bytes_read > 0
+      && read_verify_blocks(&retry, read_state, buffer, bytes_read) == -1)
+    RETURN(-1);
+
   // hash the payload as we go, but only if we happen to read the payload data in order
   if (read_state->hash_offset == read_state->offset && buffer && bytes_read>0){
     SHA512_Update(&read_state->sha512_context, buffer, bytes_read);
@@ -1235,12 +2125,23 @@ ssize_t rhizome_read_buffered(struct rhizome_read *read, struct rhizome_read_buf
 
 void rhizome_read_close(struct rhizome_read *read)
 {
+  if (read->mapping) {
+    rhizome_unmap(read->mapping);
+    read->mapping = NULL;
+  }
   if (read->blob_fd != -1) {
     if (config.debug.rhizome_store)
       DEBUGF("Closing store fd %d", read->blob_fd);
     close(read->blob_fd);
     read->blob_fd = -1;
   }
+  free(read->block_hashes);
+  read->block_hashes = NULL;
+  free(read->blocks_verified);
+  read->blocks_verified = NULL;
+  free(read->chunk_data);
+  read->chunk_data = NULL;
+  read->chunk_rowid = 0;
   
   if (read->verified==-1) {
     // delete payload!
@@ -1256,72 +2157,109 @@ void rhizome_read_close(struct rhizome_read *read)
   }
 }
 
+/* Payloads being served to MDP block requests are held open in a cache keyed by bundle id and
+ * version, so that consecutive block requests don't have to look up and re-open the payload.
+ *
+ * Entries are found through a small hash table, and are also kept on a single list in order of
+ * expiry time (latest first).  Because every request pushes an entry's expiry further into the
+ * future, that list is also the least-recently-used order, so the alarm only ever has to look at
+ * the tail to close expired entries, and the tail is what gets closed when the number of open
+ * entries reaches config.rhizome.mdp.max_open_reads.
+ */
+#define RHIZOME_CACHE_BUCKETS 64
+
 struct cache_entry{
-  struct cache_entry *_left;
-  struct cache_entry *_right;
+  struct cache_entry *_next_hash;
+  struct cache_entry *_prev; // expires later
+  struct cache_entry *_next; // expires earlier
   rhizome_bid_t bundle_id;
   uint64_t version;
   struct rhizome_read read_state;
   time_ms_t expires;
 };
-struct cache_entry *root;
 
-static struct cache_entry ** find_entry_location(struct cache_entry **ptr, const rhizome_bid_t *bundle_id, uint64_t version)
+static struct cache_entry *cache_buckets[RHIZOME_CACHE_BUCKETS];
+static struct cache_entry *cache_head = NULL; // latest expiry, most recently used
+static struct cache_entry *cache_tail = NULL; // earliest expiry, least recently used
+static struct rhizome_cache_stats cache_stats;
+
+static unsigned cache_bucket(const rhizome_bid_t *bundle_id, uint64_t version)
 {
-  while(*ptr){
-    struct cache_entry *entry = *ptr;
-    int cmp = cmp_rhizome_bid_t(bundle_id, &entry->bundle_id);
-    if (cmp==0){
-      if (entry->version==version)
-	break;
-      if (version < entry->version)
-	ptr = &entry->_left;
-      else
-	ptr = &entry->_right;
-      continue;
-    }
-    if (cmp<0)
-      ptr = &entry->_left;
-    else
-      ptr = &entry->_right;
-  }
+  // bundle ids are public keys, so their leading bytes are already well distributed
+  uint32_t h = read_uint32(bundle_id->binary) ^ (uint32_t)version ^ (uint32_t)(version >> 32);
+  return h & (RHIZOME_CACHE_BUCKETS - 1);
+}
+
+static struct cache_entry ** find_entry_location(const rhizome_bid_t *bundle_id, uint64_t version)
+{
+  struct cache_entry **ptr = &cache_buckets[cache_bucket(bundle_id, version)];
+  while (*ptr && ((*ptr)->version != version || cmp_rhizome_bid_t(bundle_id, &(*ptr)->bundle_id) != 0))
+    ptr = &(*ptr)->_next_hash;
   return ptr;
 }
 
-static time_ms_t close_entries(struct cache_entry **entry, time_ms_t timeout)
+static void cache_list_remove(struct cache_entry *entry)
 {
-  if (!*entry)
-    return 0;
-    
-  time_ms_t ret = close_entries(&(*entry)->_left, timeout);
-  time_ms_t t_right = close_entries(&(*entry)->_right, timeout);
-  if (t_right!=0 && (t_right < ret || ret==0))
-    ret=t_right;
-    
-  if ((*entry)->expires < timeout || timeout==0){
-    rhizome_read_close(&(*entry)->read_state);
-    // remember the two children
-    struct cache_entry *left=(*entry)->_left;
-    struct cache_entry *right=(*entry)->_right;
-    // free this entry
-    free(*entry);
-    // re-add both children to the tree
-    *entry=left;
-    if (right){
-      entry = find_entry_location(entry, &right->bundle_id, right->version);
-      *entry=right;
-    }
-  }else{
-    if ((*entry)->expires < ret || ret==0)
-      ret=(*entry)->expires;
+  if (entry->_prev)
+    entry->_prev->_next = entry->_next;
+  else
+    cache_head = entry->_next;
+  if (entry->_next)
+    entry->_next->_prev = entry->_prev;
+  else
+    cache_tail = entry->_prev;
+  entry->_next = entry->_prev = NULL;
+}
+
+// insert in expiry order, searching from the head where new expiry times almost always belong
+static void cache_list_insert(struct cache_entry *entry)
+{
+  struct cache_entry *prev = NULL;
+  struct cache_entry *next = cache_head;
+  while (next && next->expires > entry->expires) {
+    prev = next;
+    next = next->_next;
   }
-  return ret;
+  entry->_prev = prev;
+  entry->_next = next;
+  if (prev)
+    prev->_next = entry;
+  else
+    cache_head = entry;
+  if (next)
+    next->_prev = entry;
+  else
+    cache_tail = entry;
+}
+
+static void close_entry(struct cache_entry *entry)
+{
+  struct cache_entry **ptr = find_entry_location(&entry->bundle_id, entry->version);
+  assert(*ptr == entry);
+  *ptr = entry->_next_hash;
+  cache_list_remove(entry);
+  rhizome_read_close(&entry->read_state);
+  free(entry);
+  assert(cache_stats.open > 0);
+  cache_stats.open--;
+}
+
+// close every entry that expires before the timeout (or all entries if timeout is zero) and return
+// the earliest remaining expiry time
+static time_ms_t close_entries(time_ms_t timeout)
+{
+  while (cache_tail && (timeout == 0 || cache_tail->expires < timeout)) {
+    if (timeout)
+      cache_stats.expired++;
+    close_entry(cache_tail);
+  }
+  return cache_tail ? cache_tail->expires : 0;
 }
 
 // close any expired cache entries
 static void rhizome_cache_alarm(struct sched_ent *alarm)
 {
-  alarm->alarm = close_entries(&root, gettime_ms());
+  alarm->alarm = close_entries(gettime_ms());
   if (alarm->alarm){
     alarm->deadline = alarm->alarm + 1000;
     schedule(alarm);
@@ -1339,32 +2277,37 @@ static struct sched_ent cache_alarm={
 // close all cache entries
 int rhizome_cache_close()
 {
-  close_entries(&root, 0);
+  if (cache_head && config.debug.rhizome_store)
+    DEBUGF("Closing read cache, hits=%"PRIu64" misses=%"PRIu64" evicted=%"PRIu64" expired=%"PRIu64,
+	cache_stats.hits, cache_stats.misses, cache_stats.evicted, cache_stats.expired);
+  close_entries(0);
   unschedule(&cache_alarm);
+  rhizome_unmap_all_unused();
   return 0;
 }
 
-static int _rhizome_cache_count(struct cache_entry *entry)
+int rhizome_cache_count()
 {
-  if (!entry)
-    return 0;
-  return 1+_rhizome_cache_count(entry->_left)+_rhizome_cache_count(entry->_right);
+  return cache_stats.open;
 }
 
-int rhizome_cache_count()
+void rhizome_cache_get_stats(struct rhizome_cache_stats *stats)
 {
-  return _rhizome_cache_count(root);
+  *stats = cache_stats;
 }
 
 // read a block of data, caching meta data for reuse
 ssize_t rhizome_read_cached(const rhizome_bid_t *bidp, uint64_t version, time_ms_t timeout, uint64_t fileOffset, unsigned char *buffer, size_t length)
 {
   // look for a cached entry
-  struct cache_entry **ptr = find_entry_location(&root, bidp, version);
+  struct cache_entry **ptr = find_entry_location(bidp, version);
   struct cache_entry *entry = *ptr;
   
   // if we don't have one yet, create one and open it
-  if (!entry){
+  if (entry)
+    cache_stats.hits++;
+  else {
+    cache_stats.misses++;
     rhizome_filehash_t filehash;
     if (rhizome_database_filehash_from_id(bidp, version, &filehash) != 0){
       if (config.debug.rhizome_store)
@@ -1372,6 +2315,14 @@ ssize_t rhizome_read_cached(const rhizome_bid_t *bidp, uint64_t version, time_ms
 	  alloca_tohex_rhizome_bid_t(*bidp), version);
       return -1;
     }
+    // make room by closing the least recently used entry
+    while (cache_tail && cache_stats.open >= config.rhizome.mdp.max_open_reads) {
+      if (config.debug.rhizome_store)
+	DEBUGF("Closing least recently used payload bid=%s version=%"PRIu64,
+	    alloca_tohex_rhizome_bid_t(cache_tail->bundle_id), cache_tail->version);
+      cache_stats.evicted++;
+      close_entry(cache_tail);
+    }
     entry = emalloc_zero(sizeof(struct cache_entry));
     if (entry == NULL)
       return -1;
@@ -1394,15 +2345,17 @@ ssize_t rhizome_read_cached(const rhizome_bid_t *bidp, uint64_t version, time_ms
     }
     entry->bundle_id = *bidp;
     entry->version = version;
+    // the location may have moved if we closed an entry in the same bucket
+    ptr = find_entry_location(bidp, version);
     *ptr = entry;
+    cache_list_insert(entry);
+    cache_stats.open++;
   }
   
-  entry->read_state.offset = fileOffset;
-  if (entry->read_state.length != RHIZOME_SIZE_UNSET && fileOffset >= entry->read_state.length)
-    return 0;
-  
   if (entry->expires < timeout){
     entry->expires = timeout;
+    cache_list_remove(entry);
+    cache_list_insert(entry);
     
     if (!cache_alarm.alarm){
       cache_alarm.alarm = timeout;
@@ -1411,6 +2364,10 @@ ssize_t rhizome_read_cached(const rhizome_bid_t *bidp, uint64_t version, time_ms
     }
   }
   
+  entry->read_state.offset = fileOffset;
+  if (entry->read_state.length != RHIZOME_SIZE_UNSET && fileOffset >= entry->read_state.length)
+    return 0;
+  
   return rhizome_read(&entry->read_state, buffer, length);
 }
 
@@ -1470,6 +2427,9 @@ static enum rhizome_payload_status read_derive_key(rhizome_manifest *m, struct r
 enum rhizome_payload_status rhizome_open_decrypt_read(rhizome_manifest *m, struct rhizome_read *read_state)
 {
   enum rhizome_payload_status status = rhizome_open_read(read_state, &m->filehash);
+  // don't look for block hashes that the manifest says the payload doesn't have
+  if (!m->has_blockhash)
+    read_state->block_hashes_loaded = 1;
   if (status == RHIZOME_PAYLOAD_STATUS_STORED)
     status = read_derive_key(m, read_state);
   return status;
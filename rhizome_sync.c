@@ -27,6 +27,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #define MSG_TYPE_BARS 0
 #define MSG_TYPE_REQ 1
+#define MSG_TYPE_SKETCH_REQ 2
+#define MSG_TYPE_SKETCH 3
 
 #define MAX_TRIES 10
 #define CACHE_BARS 60
@@ -35,6 +37,39 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #define HEAD_FLAG INT64_MAX
 
+/* Set reconciliation.  Each node keeps an invertible Bloom lookup table of every BAR in its store,
+ * with SKETCH_MAX_CELLS cells.  A peer asks for it folded down to 2^n cells (cell i of the folded
+ * table is the sum of every cell j with j%2^n==i), subtracts its own table folded the same way, and
+ * peels out the BARs that only one side holds.  So the bytes exchanged grow with the number of
+ * differences, not the size of the stores.  If the table is too small to decode, the peer asks for
+ * one twice the size, and after SKETCH_MAX_LOG2 (or when the other node doesn't reply) falls back
+ * to walking the rowid window.
+ */
+#define SKETCH_HASHES 3
+#define SKETCH_MIN_LOG2 5
+#define SKETCH_MAX_LOG2 11
+#define SKETCH_MAX_CELLS (1<<SKETCH_MAX_LOG2)
+#define SKETCH_CELL_BYTES (2+4+RHIZOME_BAR_BYTES)
+// keep packets about the size of an MDP payload block, headers and encryption must fit in the mtu
+#define SKETCH_CELLS_PER_PACKET 16
+#define SKETCH_CELLS_PER_REQUEST (SKETCH_CELLS_PER_PACKET * 4)
+#define SKETCH_TIMEOUT 2000
+#define SKETCH_MAX_TRIES 3
+
+#define SKETCH_IDLE 0
+#define SKETCH_RECEIVING 1
+#define SKETCH_DECODING 2
+#define SKETCH_DONE 3
+#define SKETCH_FAILED 4
+
+struct sketch_cell
+{
+  // counts wrap, only the difference between two tables matters
+  uint16_t count;
+  uint32_t hash_sum;
+  rhizome_bar_t key_sum;
+};
+
 struct bar_entry
 {
   rhizome_bar_t bar;
@@ -61,6 +96,22 @@ struct rhizome_sync
   struct bar_entry *bars;
   // how many bars are we interested in?
   int bar_count;
+  // set reconciliation with this peer
+  unsigned char sketch_state;
+  unsigned char sketch_log2;
+  unsigned sketch_tries;
+  unsigned sketch_received;
+  unsigned sketch_requested;
+  uint64_t sketch_token;
+  uint64_t sketch_count;
+  time_ms_t sketch_timeout;
+  struct sketch_cell *sketch;
+  // BARs that only this peer holds, waiting for room in the list above
+  rhizome_bar_t *recon_bars;
+  int recon_count;
+  // bytes of unicast sync messages exchanged with this peer
+  uint32_t bytes_sent;
+  uint32_t bytes_received;
 };
 
 void rhizome_sync_status_html(struct strbuf *b, struct subscriber *subscriber)
@@ -68,13 +119,15 @@ void rhizome_sync_status_html(struct strbuf *b, struct subscriber *subscriber)
   if (!subscriber->sync_state)
     return;
   struct rhizome_sync *state=subscriber->sync_state;
-  strbuf_sprintf(b, "Seen %u BARs [%"PRId64" to %"PRId64" of %"PRId64"], %d interesting, %d skipped<br>",
+  strbuf_sprintf(b, "Seen %u BARs [%"PRId64" to %"PRId64" of %"PRId64"], %d interesting, %d skipped, %u bytes sent, %u received<br>",
     state->bars_seen,
     state->sync_start,
     state->sync_end,
     state->highest_seen,
-    state->bar_count,
-    state->bars_skipped);
+    state->bar_count + state->recon_count,
+    state->bars_skipped,
+    state->bytes_sent,
+    state->bytes_received);
 }
 
 static int sync_status(struct subscriber *subscriber, void *UNUSED(context))
@@ -82,14 +135,16 @@ static int sync_status(struct subscriber *subscriber, void *UNUSED(context))
   if (!subscriber->sync_state)
     return 0;
   struct rhizome_sync *state=subscriber->sync_state;
-  DEBUGF("%s seen %u BARs [%"PRId64" to %"PRId64" of %"PRId64"], %d interesting, %d skipped",
+  DEBUGF("%s seen %u BARs [%"PRId64" to %"PRId64" of %"PRId64"], %d interesting, %d skipped, %u bytes sent, %u received",
     alloca_tohex_sid_t(subscriber->sid),
     state->bars_seen,
     state->sync_start,
     state->sync_end,
     state->highest_seen,
-    state->bar_count,
-    state->bars_skipped);
+    state->bar_count + state->recon_count,
+    state->bars_skipped,
+    state->bytes_sent,
+    state->bytes_received);
   return 0;
 }
 
@@ -98,6 +153,14 @@ void rhizome_sync_status()
   enum_subscribers(NULL, sync_status, NULL);
 }
 
+static void sync_send_frame(struct internal_mdp_header *header, struct overlay_buffer *b)
+{
+  ob_flip(b);
+  if (header->destination && header->destination->sync_state)
+    header->destination->sync_state->bytes_sent += ob_remaining(b);
+  overlay_send_frame(header, b);
+}
+
 static void rhizome_sync_request(struct subscriber *subscriber, uint64_t token, unsigned char forwards)
 {
   struct internal_mdp_header header;
@@ -117,16 +180,434 @@ static void rhizome_sync_request(struct subscriber *subscriber, uint64_t token,
   if (config.debug.rhizome_sync)
     DEBUGF("Sending request to %s for BARs from %"PRIu64" %s", alloca_tohex_sid_t(subscriber->sid), token, forwards?"forwards":"backwards");
     
-  ob_flip(b);
-  overlay_send_frame(&header, b);
+  sync_send_frame(&header, b);
+  ob_free(b);
+}
+
+static uint64_t sketch_mix(uint64_t h)
+{
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+  return h;
+}
+
+static uint64_t sketch_hash(const rhizome_bar_t *bar)
+{
+  // FNV-1a, mixed so that every bit of every cell index depends on the whole BAR
+  uint64_t h = 0xcbf29ce484222325ULL;
+  unsigned i;
+  for (i = 0; i < RHIZOME_BAR_BYTES; ++i) {
+    h ^= bar->binary[i];
+    h *= 0x100000001b3ULL;
+  }
+  return sketch_mix(h);
+}
+
+static uint32_t sketch_check(uint64_t h)
+{
+  return (uint32_t)sketch_mix(h ^ 0x9e3779b97f4a7c15ULL);
+}
+
+// cell indexes are taken modulo SKETCH_MAX_CELLS, so that folding a table preserves them
+static unsigned sketch_index(uint64_t h, unsigned j)
+{
+  return (h >> (j * 16)) & (SKETCH_MAX_CELLS - 1);
+}
+
+static void sketch_toggle(struct sketch_cell *cells, unsigned mask, const rhizome_bar_t *bar, int sign)
+{
+  uint64_t h = sketch_hash(bar);
+  uint32_t check = sketch_check(h);
+  unsigned j, i;
+  for (j = 0; j < SKETCH_HASHES; ++j) {
+    struct sketch_cell *cell = &cells[sketch_index(h, j) & mask];
+    cell->count += sign;
+    cell->hash_sum ^= check;
+    for (i = 0; i < RHIZOME_BAR_BYTES; ++i)
+      cell->key_sum.binary[i] ^= bar->binary[i];
+  }
+}
+
+static void sketch_subtract(struct sketch_cell *a, const struct sketch_cell *b)
+{
+  unsigned i;
+  a->count -= b->count;
+  a->hash_sum ^= b->hash_sum;
+  for (i = 0; i < RHIZOME_BAR_BYTES; ++i)
+    a->key_sum.binary[i] ^= b->key_sum.binary[i];
+}
+
+static int sketch_cell_is_empty(const struct sketch_cell *cell)
+{
+  return cell->count == 0 && cell->hash_sum == 0 && rhizome_is_bar_none(&cell->key_sum);
+}
+
+// our own table, rebuilt whenever the store has changed
+static struct {
+  uint64_t token;
+  uint64_t count;
+  struct sketch_cell *cells;
+} own_sketch;
+
+/* Make sure our own table matches the store.  Returns 0 if it does, 1 if the database was busy,
+ * -1 on error.
+ */
+static int sketch_refresh()
+{
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_ASYNC;
+  sqlite3_stmt *statement = sqlite_prepare_read(&retry, "SELECT max(rowid), count(*) FROM manifests");
+  if (!statement)
+    return sqlite_retry_yielded(&retry) ? 1 : -1;
+  uint64_t token = 0, count = 0;
+  int r = sqlite_step_retry(&retry, statement);
+  if (r == SQLITE_ROW) {
+    token = sqlite3_column_int64(statement, 0);
+    count = sqlite3_column_int64(statement, 1);
+  }
+  sqlite3_finalize(statement);
+  if (r != SQLITE_ROW)
+    return sqlite_retry_yielded(&retry) ? 1 : -1;
+  if (own_sketch.cells && own_sketch.token == token && own_sketch.count == count)
+    return 0;
+
+  if (!own_sketch.cells && (own_sketch.cells = emalloc(sizeof(struct sketch_cell) * SKETCH_MAX_CELLS)) == NULL)
+    return -1;
+  bzero(own_sketch.cells, sizeof(struct sketch_cell) * SKETCH_MAX_CELLS);
+  // don't use a half built table
+  own_sketch.token = own_sketch.count = UINT64_MAX;
+
+  statement = sqlite_prepare_read(&retry, "SELECT bar FROM manifests");
+  if (!statement)
+    return sqlite_retry_yielded(&retry) ? 1 : -1;
+  while ((r = sqlite_step_retry(&retry, statement)) == SQLITE_ROW) {
+    const rhizome_bar_t *bar = sqlite3_column_blob(statement, 0);
+    if (sqlite3_column_bytes(statement, 0) == RHIZOME_BAR_BYTES)
+      sketch_toggle(own_sketch.cells, SKETCH_MAX_CELLS - 1, bar, 1);
+  }
+  sqlite3_finalize(statement);
+  if (r != SQLITE_DONE)
+    return sqlite_retry_yielded(&retry) ? 1 : -1;
+  own_sketch.token = token;
+  own_sketch.count = count;
+  if (config.debug.rhizome_sync)
+    DEBUGF("Built BAR sketch of %"PRIu64" bundles up to %"PRIu64, count, token);
+  return 0;
+}
+
+// cell i of our own table folded down to 2^log2 cells
+static void sketch_fold(struct sketch_cell *cell, unsigned log2, unsigned i)
+{
+  bzero(cell, sizeof *cell);
+  unsigned j;
+  for (j = i; j < SKETCH_MAX_CELLS; j += 1u << log2) {
+    const struct sketch_cell *src = &own_sketch.cells[j];
+    cell->count += src->count;
+    cell->hash_sum ^= src->hash_sum;
+    unsigned k;
+    for (k = 0; k < RHIZOME_BAR_BYTES; ++k)
+      cell->key_sum.binary[k] ^= src->key_sum.binary[k];
+  }
+}
+
+static void sync_send_sketch(struct subscriber *dest, unsigned log2, unsigned offset)
+{
+  unsigned cells = 1u << log2;
+  unsigned end = offset + SKETCH_CELLS_PER_REQUEST;
+  if (end > cells)
+    end = cells;
+
+  struct internal_mdp_header header;
+  bzero(&header, sizeof header);
+  header.source = my_subscriber;
+  header.source_port = MDP_PORT_RHIZOME_SYNC;
+  header.destination = dest;
+  header.destination_port = MDP_PORT_RHIZOME_SYNC;
+  header.qos = OQ_OPPORTUNISTIC;
+
+  if (config.debug.rhizome_sync)
+    DEBUGF("Sending sketch cells %u to %u of %u to %s", offset, end, cells, alloca_tohex_sid_t(dest->sid));
+
+  while (offset < end) {
+    struct overlay_buffer *b = ob_new();
+    ob_limitsize(b, MDP_MTU);
+    ob_append_byte(b, MSG_TYPE_SKETCH);
+    ob_append_byte(b, log2);
+    ob_append_packed_ui64(b, own_sketch.token);
+    ob_append_packed_ui64(b, own_sketch.count);
+    ob_append_packed_ui32(b, offset);
+    unsigned n;
+    for (n = 0; n < SKETCH_CELLS_PER_PACKET && offset < end; ++n, ++offset) {
+      struct sketch_cell cell;
+      sketch_fold(&cell, log2, offset);
+      ob_append_ui16(b, cell.count);
+      ob_append_ui32(b, cell.hash_sum);
+      ob_append_bytes(b, cell.key_sum.binary, RHIZOME_BAR_BYTES);
+    }
+    if (ob_overrun(b)) {
+      WHY("Sketch packet overrun");
+      ob_free(b);
+      return;
+    }
+    sync_send_frame(&header, b);
+    ob_free(b);
+  }
+}
+
+static void sync_request_sketch(struct subscriber *subscriber, struct rhizome_sync *state)
+{
+  struct internal_mdp_header header;
+  bzero(&header, sizeof header);
+  header.source = my_subscriber;
+  header.source_port = MDP_PORT_RHIZOME_SYNC;
+  header.destination = subscriber;
+  header.destination_port = MDP_PORT_RHIZOME_SYNC;
+  header.qos = OQ_OPPORTUNISTIC;
+
+  struct overlay_buffer *b = ob_new();
+  ob_append_byte(b, MSG_TYPE_SKETCH_REQ);
+  ob_append_byte(b, state->sketch_log2);
+  ob_append_packed_ui32(b, state->sketch_received);
+
+  state->sketch_requested = state->sketch_received + SKETCH_CELLS_PER_REQUEST;
+  if (state->sketch_requested > 1u << state->sketch_log2)
+    state->sketch_requested = 1u << state->sketch_log2;
+  state->sketch_timeout = gettime_ms() + SKETCH_TIMEOUT;
+
+  if (config.debug.rhizome_sync)
+    DEBUGF("Requesting sketch cells %u to %u of %u from %s",
+      state->sketch_received, state->sketch_requested, 1u << state->sketch_log2, alloca_tohex_sid_t(subscriber->sid));
+
+  sync_send_frame(&header, b);
   ob_free(b);
 }
 
+static void sync_sketch_free(struct rhizome_sync *state)
+{
+  if (state->sketch) {
+    free(state->sketch);
+    state->sketch = NULL;
+  }
+}
+
+static void sync_sketch_failed(struct subscriber *subscriber, struct rhizome_sync *state, const char *reason)
+{
+  if (config.debug.rhizome_sync)
+    DEBUGF("Set reconciliation with %s failed (%s), walking BARs instead", alloca_tohex_sid_t(subscriber->sid), reason);
+  state->sketch_state = SKETCH_FAILED;
+  sync_sketch_free(state);
+}
+
+static void sync_process_sketch(struct subscriber *subscriber, struct rhizome_sync *state, struct overlay_buffer *b)
+{
+  unsigned log2 = ob_get(b);
+  uint64_t token = ob_get_packed_ui64(b);
+  uint64_t count = ob_get_packed_ui64(b);
+  uint32_t offset = ob_get_packed_ui32(b);
+  if (ob_overrun(b) || state->sketch_state != SKETCH_RECEIVING || log2 != state->sketch_log2)
+    return;
+  // cells must arrive in order, anything else is picked up again after a timeout
+  if (offset != state->sketch_received)
+    return;
+  if (offset == 0) {
+    state->sketch_token = token;
+    state->sketch_count = count;
+  } else if (token != state->sketch_token || count != state->sketch_count) {
+    // their store changed part way through, start again
+    state->sketch_received = 0;
+    sync_request_sketch(subscriber, state);
+    return;
+  }
+  unsigned cells = 1u << log2;
+  if (!state->sketch && (state->sketch = emalloc(sizeof(struct sketch_cell) * SKETCH_MAX_CELLS)) == NULL)
+    return;
+  while (ob_remaining(b) >= SKETCH_CELL_BYTES && state->sketch_received < cells) {
+    struct sketch_cell *cell = &state->sketch[state->sketch_received++];
+    cell->count = ob_get_ui16(b);
+    cell->hash_sum = ob_get_ui32(b);
+    ob_get_bytes(b, cell->key_sum.binary, RHIZOME_BAR_BYTES);
+  }
+  state->sketch_tries = 0;
+  if (state->sketch_received == cells)
+    state->sketch_state = SKETCH_DECODING;
+  else if (state->sketch_received >= state->sketch_requested)
+    sync_request_sketch(subscriber, state);
+  else
+    state->sketch_timeout = gettime_ms() + SKETCH_TIMEOUT;
+}
+
+/* Subtract our own table from the peer's and peel out the differences.  Returns 0 if it decoded
+ * completely, 1 if it needs a bigger table, -1 on error.
+ */
+static int sync_decode_sketch(struct subscriber *subscriber, struct rhizome_sync *state)
+{
+  unsigned cells = 1u << state->sketch_log2;
+  unsigned mask = cells - 1;
+  struct sketch_cell *diff = state->sketch;
+  unsigned i;
+  for (i = 0; i < SKETCH_MAX_CELLS; ++i)
+    sketch_subtract(&diff[i & mask], &own_sketch.cells[i]);
+
+  rhizome_bar_t *theirs = emalloc(sizeof(rhizome_bar_t) * cells);
+  if (!theirs)
+    return -1;
+  int their_count = 0, our_count = 0, decoded = 0;
+  int progress = 1;
+  while (progress) {
+    progress = 0;
+    for (i = 0; i < cells; ++i) {
+      struct sketch_cell *cell = &diff[i];
+      if (cell->count != 1 && cell->count != 0xFFFF)
+        continue;
+      uint64_t h = sketch_hash(&cell->key_sum);
+      if (cell->hash_sum != sketch_check(h))
+        continue;
+      unsigned j;
+      for (j = 0; j < SKETCH_HASHES && (sketch_index(h, j) & mask) != i; ++j)
+        ;
+      if (j == SKETCH_HASHES)
+        continue;
+      // can't take more out than there are cells, unless something is badly wrong
+      if (decoded == (int)cells) {
+        progress = 0;
+        break;
+      }
+      decoded++;
+      rhizome_bar_t bar = cell->key_sum;
+      if (cell->count == 1)
+        theirs[their_count++] = bar;
+      else
+        our_count++;
+      sketch_toggle(diff, mask, &bar, cell->count == 1 ? -1 : 1);
+      progress = 1;
+    }
+  }
+  for (i = 0; i < cells && sketch_cell_is_empty(&diff[i]); ++i)
+    ;
+  if (i < cells) {
+    free(theirs);
+    return 1;
+  }
+
+  if (config.debug.rhizome_sync)
+    DEBUGF("Reconciled %"PRIu64" BARs with %s using %u cells, %d to fetch, %d they lack",
+      state->sketch_count, alloca_tohex_sid_t(subscriber->sid), cells, their_count, our_count);
+  if (their_count) {
+    free(state->recon_bars);
+    state->recon_bars = theirs;
+    state->recon_count = their_count;
+  } else
+    free(theirs);
+
+  // everything they held up to sketch_token is now accounted for
+  uint64_t token = state->sketch_token;
+  if (state->sync_end == 0 || state->sync_start <= token) {
+    if (state->sync_end < token)
+      state->sync_end = token;
+  } else
+    state->sync_end = token;
+  state->sync_start = 0;
+  if (state->highest_seen < token)
+    state->highest_seen = token;
+  state->bars_seen += state->sketch_count;
+  state->last_extended = gettime_ms();
+  return 0;
+}
+
+/* Drive set reconciliation with this peer.  Returns 1 while it is still in progress, so the rowid
+ * window walk should wait.
+ */
+static int sync_reconcile(struct subscriber *subscriber, struct rhizome_sync *state, time_ms_t now)
+{
+  switch (state->sketch_state) {
+    case SKETCH_IDLE:
+      if (!config.rhizome.sync_reconcile) {
+        state->sketch_state = SKETCH_FAILED;
+        return 0;
+      }
+      state->sketch_state = SKETCH_RECEIVING;
+      state->sketch_log2 = SKETCH_MIN_LOG2;
+      state->sketch_received = 0;
+      state->sketch_tries = 0;
+      sync_request_sketch(subscriber, state);
+      return 1;
+    case SKETCH_RECEIVING:
+      if (state->sketch_timeout > now)
+        return 1;
+      if (++state->sketch_tries >= SKETCH_MAX_TRIES) {
+        sync_sketch_failed(subscriber, state, "no reply");
+        return 0;
+      }
+      sync_request_sketch(subscriber, state);
+      return 1;
+    case SKETCH_DECODING:
+      switch (sketch_refresh()) {
+        case 1:
+          return 1;
+        case -1:
+          sync_sketch_failed(subscriber, state, "error");
+          return 0;
+      }
+      switch (sync_decode_sketch(subscriber, state)) {
+        case 0:
+          state->sketch_state = SKETCH_DONE;
+          sync_sketch_free(state);
+          return 0;
+        case 1:
+          if (state->sketch_log2 < SKETCH_MAX_LOG2) {
+            state->sketch_log2++;
+            state->sketch_state = SKETCH_RECEIVING;
+            state->sketch_received = 0;
+            state->sketch_tries = 0;
+            sync_request_sketch(subscriber, state);
+            return 1;
+          }
+          sync_sketch_failed(subscriber, state, "too many differences");
+          return 0;
+      }
+      sync_sketch_failed(subscriber, state, "error");
+      return 0;
+  }
+  return 0;
+}
+
+static int sync_queue_bar(struct rhizome_sync *state, const rhizome_bar_t *bar)
+{
+  if (rhizome_is_bar_interesting(bar)==0)
+    return 0;
+  if (!state->bars){
+    state->bars = emalloc(sizeof(struct bar_entry) * CACHE_BARS);
+    if (!state->bars)
+      return -1;
+  }
+
+  if (config.debug.rhizome_sync)
+    DEBUGF("Remembering BAR %s", alloca_tohex_rhizome_bar_t(bar));
+
+  state->bars[state->bar_count].bar = *bar;
+  state->bars[state->bar_count].next_request = gettime_ms();
+  state->bars[state->bar_count].tries = MAX_TRIES;
+  state->bar_count++;
+  return 1;
+}
+
 static void rhizome_sync_send_requests(struct subscriber *subscriber, struct rhizome_sync *state)
 {
   int i, requests=0;
   time_ms_t now = gettime_ms();
 
+  // move BARs found by set reconciliation into the list as it drains
+  while (state->recon_count && state->bar_count < CACHE_BARS){
+    if (sync_queue_bar(state, &state->recon_bars[--state->recon_count])==-1)
+      break;
+  }
+  if (state->recon_bars && state->recon_count==0){
+    free(state->recon_bars);
+    state->recon_bars=NULL;
+  }
+
   // send requests for manifests that we have room to fetch
   struct internal_mdp_header header;
   bzero(&header, sizeof header);
@@ -141,16 +622,18 @@ static void rhizome_sync_send_requests(struct subscriber *subscriber, struct rhi
     if (rhizome_ignore_manifest_check(prefix, RHIZOME_BAR_PREFIX_BYTES))
       continue;
 
-    // do we have free space now in the appropriate fetch queue?
-    unsigned char log2_size = rhizome_bar_log_size(&state->bars[i].bar);
-    if (log2_size!=0xFF && rhizome_fetch_has_queue_space(log2_size)!=1)
-      continue;
-    
+    // if we're already fetching it, this peer can supply some of the payload
     if (rhizome_fetch_bar_queued(&state->bars[i].bar)){
+      rhizome_fetch_add_source(&state->bars[i].bar, subscriber);
       state->bars[i].next_request = now+2000;
       continue;
     }
 
+    // do we have free space now in the appropriate fetch queue?
+    unsigned char log2_size = rhizome_bar_log_size(&state->bars[i].bar);
+    if (log2_size!=0xFF && rhizome_fetch_has_queue_space(log2_size)!=1)
+      continue;
+
     if (!payload){
       header.source = my_subscriber;
       header.source_port = MDP_PORT_RHIZOME_RESPONSE;
@@ -197,8 +680,11 @@ static void rhizome_sync_send_requests(struct subscriber *subscriber, struct rhi
     ob_free(payload);
   }
 
+  if (sync_reconcile(subscriber, state, now))
+    return;
+
   // send request for more bars if we have room to cache them
-  if (state->bar_count >= CACHE_BARS)
+  if (state->bar_count >= CACHE_BARS || state->recon_count)
     return;
 
   if (state->next_request<=now){
@@ -211,7 +697,8 @@ static void rhizome_sync_send_requests(struct subscriber *subscriber, struct rhi
       state->sync_complete = 1;
       state->completed = gettime_ms();
       if (config.debug.rhizome_sync)
-        DEBUGF("BAR sync with %s complete", alloca_tohex_sid_t(subscriber->sid));
+        DEBUGF("BAR sync with %s complete, %u bytes sent, %u received",
+          alloca_tohex_sid_t(subscriber->sid), state->bytes_sent, state->bytes_received);
     }
     state->next_request = now+5000;
   }
@@ -261,21 +748,10 @@ static int sync_cache_bar(struct rhizome_sync *state, const rhizome_bar_t *bar,
   if (state->bar_count>=CACHE_BARS)
     return 0;
   // check the database before adding the BAR to the list
-  if (token!=0 && rhizome_is_bar_interesting(bar)!=0){
-    if (!state->bars){
-      state->bars = emalloc(sizeof(struct bar_entry) * CACHE_BARS);
-      if (!state->bars)
-	return -1;
-    }
-    
-    if (config.debug.rhizome_sync)
-      DEBUGF("Remembering BAR %s", alloca_tohex_rhizome_bar_t(bar));
-    
-    state->bars[state->bar_count].bar = *bar;
-    state->bars[state->bar_count].next_request = gettime_ms();
-    state->bars[state->bar_count].tries = MAX_TRIES;
-    state->bar_count++;
-    ret=1;
+  if (token!=0){
+    ret = sync_queue_bar(state, bar);
+    if (ret==-1)
+      return -1;
   }
   if (state->sync_end < token){
     state->sync_end = token;
@@ -307,6 +783,9 @@ static void sync_process_bar_list(struct subscriber *subscriber, struct rhizome_
   
   if (now - state->start_time > (60*60*1000)){
     // restart rhizome sync every hour, no matter what state it is in
+    free(state->bars);
+    free(state->recon_bars);
+    sync_sketch_free(state);
     bzero(state, sizeof(struct rhizome_sync));
     state->start_time = now;
   }
@@ -401,7 +880,14 @@ static void append_response(struct overlay_buffer *b, uint64_t token, const unsi
 }
 
 static uint64_t max_token=0;
-static void sync_send_response(struct subscriber *dest, int forwards, uint64_t token, int max_count)
+
+// how soon to try announcing again after finding the database locked
+#define SYNC_BUSY_RETRY_MS 50
+
+/* Send BARs from our store, starting at token.  Returns 1 if the database was locked, so the
+ * caller should try again soon, otherwise 0.
+ */
+static int sync_send_response(struct subscriber *dest, int forwards, uint64_t token, int max_count)
 {
   IN();
   if (max_count == 0 || max_count > BARS_PER_RESPONSE)
@@ -421,16 +907,16 @@ static void sync_send_response(struct subscriber *dest, int forwards, uint64_t t
     header.ttl = 1;
   }
 
-  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_ASYNC;
   sqlite3_stmt *statement;
   if (forwards){
-    statement = sqlite_prepare(&retry, "SELECT rowid, bar FROM manifests WHERE rowid >= ? ORDER BY rowid ASC");
+    statement = sqlite_prepare_read(&retry, "SELECT rowid, bar FROM manifests WHERE rowid >= ? ORDER BY rowid ASC");
   }else{
-    statement = sqlite_prepare(&retry, "SELECT rowid, bar FROM manifests WHERE rowid <= ? ORDER BY rowid DESC");
+    statement = sqlite_prepare_read(&retry, "SELECT rowid, bar FROM manifests WHERE rowid <= ? ORDER BY rowid DESC");
   }
 
   if (!statement)
-    return;
+    RETURN(sqlite_retry_yielded(&retry));
 
   sqlite3_bind_int64(statement, 1, token);
   int count=0;
@@ -502,10 +988,10 @@ static void sync_send_response(struct subscriber *dest, int forwards, uint64_t t
   if (count){
     if (config.debug.rhizome_sync)
       DEBUGF("Sending %d BARs from %"PRIu64" to %"PRIu64, count, token, last);
-    ob_flip(b);
-    overlay_send_frame(&header, b);
+    sync_send_frame(&header, b);
   }
   ob_free(b);
+  RETURN(sqlite_retry_yielded(&retry));
   OUT();
 }
 
@@ -515,9 +1001,10 @@ void rhizome_sync_announce(struct sched_ent *alarm)
   if (!is_rhizome_advertise_enabled())
     return;
   int (*oldfunc)() = sqlite_set_tracefunc(is_debug_rhizome_ads);
-  sync_send_response(NULL, 0, HEAD_FLAG, 5);
+  int busy = sync_send_response(NULL, 0, HEAD_FLAG, 5);
   sqlite_set_tracefunc(oldfunc);
-  alarm->alarm = gettime_ms()+config.rhizome.advertise.interval;
+  // don't wait a whole interval to announce bundles that a locked database kept us from sending
+  alarm->alarm = gettime_ms() + (busy ? SYNC_BUSY_RETRY_MS : config.rhizome.advertise.interval);
   alarm->deadline = alarm->alarm+10000;
   schedule(alarm);
 }
@@ -526,11 +1013,16 @@ int overlay_mdp_service_rhizome_sync(struct internal_mdp_header *header, struct
 {
   if (!config.rhizome.enable || !rhizome_db)
     return 0;
+  // we hear our own announcements, walking our own store would only stall the server
+  if (header->source == my_subscriber)
+    return 0;
   struct rhizome_sync *state = header->source->sync_state;
   if (!state){
     state = header->source->sync_state = emalloc_zero(sizeof(struct rhizome_sync));
     state->start_time=gettime_ms();
   }
+  if (header->destination)
+    state->bytes_received += ob_remaining(payload);
   int type = ob_get(payload);
   switch (type){
     case MSG_TYPE_BARS:
@@ -544,6 +1036,24 @@ int overlay_mdp_service_rhizome_sync(struct internal_mdp_header *header, struct
         sync_send_response(header->source, forwards, token, 0);
       }
       break;
+    case MSG_TYPE_SKETCH_REQ:
+      {
+        // behave like a node that doesn't know this message, so the peer falls back
+        if (!config.rhizome.sync_reconcile)
+          break;
+        unsigned log2 = ob_get(payload);
+        uint32_t offset = ob_get_packed_ui32(payload);
+        if (ob_overrun(payload) || log2 < SKETCH_MIN_LOG2 || log2 > SKETCH_MAX_LOG2 || offset >= 1u << log2)
+          break;
+        // if the database is busy, the peer will ask again
+        if (sketch_refresh()==0)
+          sync_send_sketch(header->source, log2, offset);
+      }
+      break;
+    case MSG_TYPE_SKETCH:
+      if (config.rhizome.fetch)
+        sync_process_sketch(header->source, state, payload);
+      break;
   }
   if (config.rhizome.fetch)
     rhizome_sync_send_requests(header->source, state);
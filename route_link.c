@@ -1148,6 +1148,13 @@ int link_state_ack_soon(struct subscriber *subscriber)
 }
 
 // our neighbour is sending a duplicate frame, did we see the original?
+// how many packets in every hundred are lost on our best path to this subscriber, or -1 if unknown
+int link_path_drop_rate(const struct subscriber *subscriber)
+{
+  struct link *link = find_best_link((struct subscriber *)subscriber);
+  return link ? link->path_drop_rate : -1;
+}
+
 int link_received_duplicate(struct subscriber *subscriber, int payload_seq)
 {
   struct neighbour *neighbour = get_neighbour(subscriber, 0);
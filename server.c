@@ -370,11 +370,38 @@ void rhizome_clean_db(struct sched_ent *alarm)
     return;
     
   time_ms_t now = gettime_ms();
-  rhizome_cleanup(NULL);
+  if (rhizome_cleanup_step(config.rhizome.cleanup_slice_ms) == 1) {
+    // carry on when we're next idle, leaving at least as long again for other work
+    now = gettime_ms();
+    RESCHEDULE(alarm, now + config.rhizome.cleanup_slice_ms, TIME_MS_NEVER_WILL, TIME_MS_NEVER_WILL);
+    return;
+  }
   // clean up every 30 minutes or so
   RESCHEDULE(alarm, now + 30*60*1000, TIME_MS_NEVER_WILL, TIME_MS_NEVER_WILL);
 }
 
+DEFINE_ALARM(rhizome_verify);
+void rhizome_verify(struct sched_ent *alarm)
+{
+  if (!config.rhizome.enable || !rhizome_db)
+    return;
+  if (rhizome_verify_step(config.rhizome.cleanup_slice_ms) == 1) {
+    // carry on after leaving at least as long again for other work
+    time_ms_t now = gettime_ms();
+    RESCHEDULE(alarm, now + config.rhizome.cleanup_slice_ms, now + config.rhizome.cleanup_slice_ms, TIME_MS_NEVER_WILL);
+  }
+}
+
+DEFINE_ALARM(rhizome_checkpoint);
+void rhizome_checkpoint(struct sched_ent *alarm)
+{
+  if (!config.rhizome.enable || !rhizome_db)
+    return;
+  rhizome_checkpoint_db();
+  time_ms_t now = gettime_ms();
+  RESCHEDULE(alarm, now + config.rhizome.checkpoint_interval_ms, now + config.rhizome.checkpoint_interval_ms, TIME_MS_NEVER_WILL);
+}
+
 void cf_on_config_change()
 {
   if (!serverMode)
@@ -408,6 +435,12 @@ void cf_on_config_change()
   if (config.rhizome.enable){
     rhizome_opendb();
     RESCHEDULE(&ALARM_STRUCT(rhizome_clean_db), now + 30*60*1000, TIME_MS_NEVER_WILL, TIME_MS_NEVER_WILL);
+    // check any manifests left unverified by a database upgrade or an earlier run
+    RESCHEDULE(&ALARM_STRUCT(rhizome_verify), now, now, TIME_MS_NEVER_WILL);
+    RESCHEDULE(&ALARM_STRUCT(rhizome_checkpoint),
+      now + config.rhizome.checkpoint_interval_ms,
+      now + config.rhizome.checkpoint_interval_ms,
+      TIME_MS_NEVER_WILL);
     if (config.debug.rhizome)
       RESCHEDULE(&ALARM_STRUCT(rhizome_fetch_status), now + 3000, TIME_MS_NEVER_WILL, TIME_MS_NEVER_WILL);
   }else if(rhizome_db){
@@ -464,6 +497,7 @@ static void clean_proc()
 static void serverCleanUp()
 {
   assert(serverMode);
+  rhizome_fetch_close_all();
   rhizome_close_db();
   dna_helper_shutdown();
   overlay_interface_close_all();
@@ -13,6 +13,7 @@ SERVAL_CLIENT_SOURCES = \
 	limit.c \
 	logMessage.c \
 	log_util.c \
+	lz4.c \
 	mem.c \
 	net.c \
 	os.c \
@@ -84,10 +85,14 @@ SERVAL_DAEMON_SOURCES = \
 	route_link.c \
 	rhizome.c \
 	rhizome_bundle.c \
+	rhizome_bulk.c \
+	rhizome_chunk.c \
 	rhizome_crypto.c \
 	rhizome_database.c \
+	rhizome_delta.c \
 	rhizome_direct.c \
 	rhizome_direct_http.c \
+	rhizome_direct_range.c \
 	rhizome_fetch.c \
 	rhizome_http.c \
 	rhizome_restful.c \